@@ -5,6 +5,8 @@
 #include <orbit/mangling/mangle.h>
 #include <orbit/stdlib/stdlib.h>
 #include <orbit/orbit.h>
+#include <orbit/runtime/image.h>
+#include <orbit/runtime/objfile.h>
 
 static void demangle(const char* name) {
     OCStringID id = orbit_demangle(name, strlen(name));
@@ -16,6 +18,28 @@ static void demangle(const char* name) {
     }
 }
 
+static int optimize(const char* inPath, const char* outPath) {
+    FILE* in = fopen(inPath, "rb");
+    if(!in) {
+        fprintf(stderr, "error: unable to open `%s`\n", inPath);
+        return -1;
+    }
+    OrbitModuleImage* image = orbit_readImage(in);
+    fclose(in);
+    if(!image) { return -1; }
+    
+    orbit_imageOptimize(image);
+    FILE* out = fopen(outPath, "wb");
+    bool written = out && orbit_packImage(out, image);
+    if(out) { fclose(out); }
+    orbit_imageRelease(image);
+    if(!written) {
+        fprintf(stderr, "error: unable to write `%s`\n", outPath);
+        return -1;
+    }
+    return 0;
+}
+
 static bool console_getLine(char *buffer, size_t size) {
     int ch, extra;
     if (fgets(buffer, size, stdin) == NULL) { return false; }
@@ -53,16 +77,25 @@ int main(int argc, const char** argv) {
         fprintf(stderr, "error: no input module file.\n");
         return -1;
     }
-    orbit_stringPoolInit(512);
-    
     const char* command = argv[1];
     
     if(strcmp(command, "demangle") == 0) {
+        OCStringPool strings;
+        orbit_stringPoolInit(&strings, 512);
+        orbit_stringPoolSetCurrent(&strings);
         if(argc >= 3) {
             demangle(argv[2]);
         } else {
             demangleLoop();
         }
+        orbit_stringPoolDeinit(&strings);
+    }
+    else if(strcmp(command, "optimize") == 0) {
+        if(argc < 4) {
+            fprintf(stderr, "error: usage: orbit optimize <in.omf> <out.omf>\n");
+            return -1;
+        }
+        return optimize(argv[2], argv[3]);
     }
     else {
         OrbitVM* vm = orbit_vmNew();
@@ -72,5 +105,4 @@ int main(int argc, const char** argv) {
         }
         orbit_vmDealloc(vm);
     }
-    orbit_stringPoolDeinit();
 }
\ No newline at end of file
@@ -29,8 +29,6 @@ int main(int argc, const char** args) {
         return -1;
     }
     
-    orbit_stringPoolInit(1024);
-    
     OrbitASTContext cont;
     orbit_astContextInit(&cont);
     
@@ -55,6 +53,5 @@ int main(int argc, const char** args) {
     }
     
     orbit_astContextDeinit(&cont);
-    orbit_stringPoolDeinit();
     return result;
 }
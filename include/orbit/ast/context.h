@@ -12,13 +12,18 @@
 #include <orbit/ast/ast.h>
 #include <orbit/ast/diag.h>
 #include <orbit/csupport/source.h>
+#include <orbit/csupport/string.h>
 
 typedef struct _OrbitASTContext OrbitASTContext;
 
+/// Each context owns the pool its identifiers and literals are interned in. Compiler entry points
+/// that take a context (orbit_parse(), sema_runTypeAnalysis(), ...) make it the current pool until
+/// they return, so contexts can be torn down in any order and used from any thread.
 struct _OrbitASTContext {
     OrbitSource         source;
     OrbitDiagManager    diagnostics;
     OrbitAST*           root;
+    OCStringPool        strings;
 };
 
 void orbit_astContextInit(OrbitASTContext* context);
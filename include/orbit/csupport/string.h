@@ -10,6 +10,7 @@
 #ifndef orbit_utils_string_h
 #define orbit_utils_string_h
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <orbit/utils/utf8.h>
 #include <orbit/utils/platforms.h>
@@ -18,24 +19,49 @@
 typedef struct _OCString OCString;
 typedef uint64_t OCStringID;
 typedef struct _OCStringBuffer OCStringBuffer;
+typedef struct _OCStringPool OCStringPool;
+typedef struct _OCStringShard OCStringShard;
 
 extern const OCStringID orbit_invalidStringID;
 
 struct _OCString {
     uint64_t        length;
-    uint64_t        next;
     uint32_t        hash;
     char            data[0];
 };
 
+/// Interned strings are stored once per pool, and never move or get freed before the pool is
+/// deinitialised: a string's ID is its address, so orbit_stringPoolGet() doesn't need to know
+/// which pool it comes from.
+///
+/// Pools are owned by whatever needs one (an OrbitASTContext, an OrbitVM). Code that interns
+/// strings without being given a pool uses the calling thread's current pool, which its owner sets
+/// with orbit_stringPoolSetCurrent().
+///
+/// A concurrent pool can be shared by several threads: lookups don't take any lock, and strings
+/// are inserted in one of several shards picked by hash, each with its own lock.
+struct _OCStringPool {
+    bool            concurrent;
+    uint32_t        shardCount;
+    OCStringShard*  shards;
+};
+
 struct _OCStringBuffer {
     uint64_t        length;
     uint64_t        capacity;
     char*           data;
 };
 
-void orbit_stringPoolInit(uint64_t capacity);
-void orbit_stringPoolDeinit();
+void orbit_stringPoolInit(OCStringPool* pool, uint64_t capacity);
+void orbit_stringPoolInitConcurrent(OCStringPool* pool, uint64_t capacity);
+void orbit_stringPoolDeinit(OCStringPool* pool);
+
+/// Makes [pool] the calling thread's current pool, and returns the previous one.
+OCStringPool* orbit_stringPoolSetCurrent(OCStringPool* pool);
+OCStringPool* orbit_stringPoolCurrent();
+
+OCStringID orbit_stringPoolIntern(OCStringPool* pool, const char* data, uint64_t length);
+OCString* orbit_stringPoolLookup(OCStringPool* pool, const char* data, uint64_t length);
 
 bool orbit_stringEquals(OCString* a, const char* b, uint64_t length);
 OCStringID orbit_stringIntern(const char* data, uint64_t length);
@@ -14,10 +14,134 @@
 #include <orbit/runtime/value.h>
 #include <orbit/runtime/vm.h>
 
+// The collector is generational. New objects are young until they survive a
+// collection, and are then old: they are never moved, and minor collections
+// leave them alone. A minor collection finds the live
+// young objects from the VM's roots and from the remembered set, which holds
+// every old object that could point to a young one.
+//
+// Full collections are incremental when the VM has a pause budget: marking
+// and sweeping are split in slices run by allocations, and objects allocated
+// meanwhile are marked already. Objects are marked grey, then traced from a
+// worklist, and the write barrier marks whatever is stored while marking, so
+// that a traced object never points to an unmarked one. Without a budget,
+// collections started by the allocator are marked in one go, and the mutator
+// resumes right after: each allocation then sweeps a page until the
+// collection is done.
+//
+// That is why any reference stored in an object (instance fields, maps,
+// arrays, classes, functions) must go through orbit_gcWriteBarrier(). Tasks
+// and modules are remembered for as long as they live instead, and traced
+// again when marking finishes, so their stacks, globals and constants can be
+// written directly.
+
+// Runs a full collection, which marks and sweeps every object and promotes
+// the ones that survive, and is done when this returns. A collection in
+// progress is finished first.
 void orbit_gcRun(OrbitVM* vm);
 
+// Runs a minor collection, which only sweeps the objects allocated since the
+// last collection and promotes the ones that survive. Does nothing while a
+// full collection is in progress.
+void orbit_gcRunMinor(OrbitVM* vm);
+
+// Starts a full collection. If [vm] has no pause budget, it is marked in one go
+// and swept lazily by orbit_gcStep().
+void orbit_gcStart(OrbitVM* vm);
+
+// Runs the next slice of the collection in progress once enough was allocated
+// since the last one, or sweeps a few more objects if it is swept lazily.
+void orbit_gcStep(OrbitVM* vm);
+
+// Sets the longest pause, in microseconds, of each slice of a full collection
+// in [vm]. Slices are stopped at the first object boundary after the budget
+// runs out, and the last one also traces tasks and modules again. 0 (the
+// default) makes full collections run in one go.
+void orbit_gcSetPauseBudget(OrbitVM* vm, uint32_t microseconds);
+
+// Sets the number of threads, the VM's own included, that mark the heap in a
+// full collection of [vm]. They share grey objects through work-stealing
+// deques. Only marking that isn't split in slices is done in parallel, and
+// never on Windows. The default is 1.
+void orbit_gcSetMarkThreads(OrbitVM* vm, uint32_t count);
+
+// What a VM's heap holds in one size class: [pages] of [bytes] in total,
+// split in [slots] of [objectSize] bytes, [used] of which hold an object.
+// Objects larger than ORBIT_GC_LARGE_SIZE each get a page of their own, and
+// are counted as size class ORBIT_GC_SIZE_CLASSES, whose [objectSize] is 0.
+typedef struct {
+    uint32_t    objectSize;
+    uint64_t    pages;
+    uint64_t    bytes;
+    uint64_t    slots;
+    uint64_t    used;
+} OrbitGCSizeClassStats;
+
+// Fills [stats] with what [vm]'s heap holds in [sizeClass], which is at most
+// ORBIT_GC_SIZE_CLASSES. Free slots are what pages of the class can't give
+// back to the system, because they still hold some objects.
+void orbit_gcSizeClassStats(OrbitVM* vm, uint32_t sizeClass, OrbitGCSizeClassStats* stats);
+
+// Copies what the collector did in [vm] so far to [stats]: the collections it
+// ran, a histogram of the pauses they made, and the bytes allocated, freed,
+// and promoted. Sweeping a few pages per allocation after a collection isn't
+// counted as a pause. [peakHeap] is the most the VM's heap held when a
+// collection started, or now.
+void orbit_gcStats(OrbitVM* vm, OrbitGCStats* stats);
+
+#define ORBIT_OBJK_COUNT (ORBIT_OBJK_TASK + 1)
+
+// The objects of one kind or one class in a census, and their size in bytes.
+typedef struct {
+    const char* name;
+    uint64_t    objects;
+    uint64_t    bytes;
+} OrbitGCCensusEntry;
+
+// The objects in a VM's heap by kind (indexed by OrbitObjKind), and the ones
+// that have a class by class, in no particular order.
+typedef struct {
+    OrbitGCCensusEntry  kinds[ORBIT_OBJK_COUNT];
+    OrbitGCCensusEntry* classes;
+    uint32_t            classCount;
+} OrbitGCCensus;
+
+// Counts the objects in [vm]'s heap in [census], after finishing the collection
+// in progress if there is one. Objects that died since are counted until they
+// are swept, so this only counts live ones right after orbit_gcRun(). [census]
+// must be freed with orbit_gcCensusDeinit().
+void orbit_gcCensus(OrbitVM* vm, OrbitGCCensus* census);
+
+void orbit_gcCensusDeinit(OrbitGCCensus* census);
+
+// Adds [object] to [vm]'s remembered set.
+void orbit_gcRemember(OrbitVM* vm, OrbitGCObject* object);
+
 void orbit_gcMarkObject(OrbitVM* vm, OrbitGCObject* obj);
 
+// Returns whether [object] was marked by the collection in progress. Mark bits
+// are kept in the pages' descriptors rather than in objects, and are all clear
+// between collections.
+bool orbit_gcIsMarked(const OrbitGCObject* object);
+
+// Records that [value] was stored in [owner]. Objects still marked while
+// sweeping survived the collection, and are about to be promoted.
+static inline void orbit_gcWriteBarrier(OrbitVM* vm, OrbitGCObject* owner, OrbitValue value) {
+    if(!IS_OBJECT(value)) { return; }
+    OrbitGCObject* object = AS_OBJECT(value);
+    if(vm->gcPhase == ORBIT_GC_MARK) {
+        orbit_gcMarkObject(vm, object);
+        return;
+    }
+    if(owner->remembered || object->old) { return; }
+    if(vm->gcPhase == ORBIT_GC_SWEEP) {
+        if(!(owner->old || orbit_gcIsMarked(owner)) || orbit_gcIsMarked(object)) { return; }
+    } else if(!owner->old) {
+        return;
+    }
+    orbit_gcRemember(vm, owner);
+}
+
 void orbit_gcMark(OrbitVM* vm, OrbitValue value);
 
 #endif /* orbit_runtime_gc_h */
@@ -0,0 +1,96 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/image.h - Immutable, shareable images of loaded modules
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-14 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#ifndef orbit_runtime_image_h
+#define orbit_runtime_image_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <orbit/orbit.h>
+#include <orbit/runtime/objfile.h>
+#include <orbit/runtime/value.h>
+
+// A module image is the contents of a module file, decoded once and never
+// modified afterwards: constants, global and class names, and each function's
+// metadata and code. Images don't belong to a VM and can be shared by any
+// number of them, on any thread, through orbit_vmLoadImage().
+//
+// Each VM that loads an image gets its own OrbitVMModule for the state that
+// changes as code runs: constants (which call sites resolve to functions and
+// classes in place), globals, and function objects with their quickening,
+// threaded code, register code and JIT data. Those functions run the image's
+// bytecode without copying or writing to it: quickened opcodes are kept in a
+// per-function side table, and operands are always read from the image.
+//
+// Images are reference counted, atomically. Modules keep a reference to their
+// image, so the host can release its own as soon as the image is loaded.
+
+typedef struct {
+    uint16_t        length;
+    char*           data;
+} OrbitImageString;
+
+typedef struct {
+    OMFTag              kind;
+    double              number;
+    OrbitImageString    string;
+} OrbitImageConstant;
+
+typedef struct {
+    OrbitImageString    name;
+    uint16_t            fieldCount;
+} OrbitImageClass;
+
+typedef struct {
+    OrbitImageString    signature;
+    uint8_t             arity;
+    uint8_t             localCount;
+    uint16_t            stackEffect;
+    uint16_t            byteCodeLength;
+    uint8_t*            byteCode;
+    bool                verified;
+} OrbitImageFunction;
+
+struct _OrbitModuleImage {
+    uint32_t            refCount;
+    
+    uint16_t            constantCount;
+    OrbitImageConstant* constants;
+    
+    uint16_t            globalCount;
+    OrbitImageString*   globals;
+    
+    uint16_t            classCount;
+    OrbitImageClass*    classes;
+    
+    uint16_t            functionCount;
+    OrbitImageFunction* functions;
+};
+
+// Reads the module file at [path]. Returns an image with a reference count of
+// one, or NULL if the file can't be read or isn't a valid module.
+OrbitModuleImage* orbit_imageLoad(const char* path);
+
+OrbitModuleImage* orbit_imageRetain(OrbitModuleImage* image);
+
+// Runs the bytecode optimiser (see vm_optimize.c) on every function of
+// [image]. Images are only modified before any VM loads them:
+// orbit_unpackImage() already optimises the images it returns. Functions are
+// only changed if their optimised code passes verification again.
+void orbit_imageOptimize(OrbitModuleImage* image);
+
+// Drops a reference to [image], and frees it when there are none left.
+void orbit_imageRelease(OrbitModuleImage* image);
+
+// Creates [vm]'s module for [image]: its constants, globals, classes and
+// functions. Classes and functions are added to the VM's dispatch tables.
+OrbitVMModule* orbit_imageInstantiate(OrbitVM* vm, OrbitModuleImage* image);
+
+#endif /* orbit_runtime_image_h */
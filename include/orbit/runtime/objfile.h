@@ -23,7 +23,7 @@
 //
 // object_file {
 //      c4              fingerprint     'OMFF'
-//      u8              version_number  (0x0001)
+//      u8              version_number  (0x0001, or 0x0002 when reading)
 //
 //      u16             constant_count
 //      const_struct[]  constants;
@@ -64,8 +64,17 @@
 //
 //      u16             code_length
 //      b8[]            bytecode
+//
+//      u8              register_count  (version 2 only)
+//      u16             regcode_length  (version 2 only, in words)
+//      u32[]           regcode         (version 2 only, see regcodes.h)
 // }
 //
+// Version 2 files carry register code, which isn't verified: it is skipped
+// when a module is loaded, and the register VM translates a function's bytecode
+// when it first calls it instead. orbit_packImage() writes version 1 files, so
+// that runtimes which only read version 1 can still load them.
+//
 //
 // const_struct = (num_struct || string_struct)
 //
@@ -82,6 +91,9 @@
 //
 //
 
+#define OMF_VERSION     0x01
+#define OMF_VERSION_MAX 0x02
+
 typedef enum {
     OMF_VARIABLE    = 0x01,
     OMF_CLASS       = 0x02,
@@ -93,5 +105,18 @@ typedef enum {
 // Unpacks a module from [file] and adds it to [vm].
 OrbitVMModule* orbit_unpackModule(OrbitVM* vm, FILE* file);
 
+// Unpacks a module image (see image.h) from [file], and prepares its code to
+// run. Returns NULL if [file] isn't a valid module.
+OrbitModuleImage* orbit_unpackImage(FILE* file);
+
+// Unpacks a module image from [file] without changing its code, for tools that
+// work on module files. Returns NULL if [file] isn't a valid module.
+OrbitModuleImage* orbit_readImage(FILE* file);
+
+// Writes [image] to [file] as a version 1 module file. Images returned by
+// orbit_unpackImage() can hold superinstructions, which aren't part of the
+// format, so only those from orbit_readImage() should be written back.
+bool orbit_packImage(FILE* file, const OrbitModuleImage* image);
+
 
 #endif /* orbit_runtime_objfile_h */
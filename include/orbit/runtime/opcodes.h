@@ -70,4 +70,46 @@ OPCODE(init_sym, 2, 1)      /// [...] -> [..., new(classes[constants[idx16]])]
 OPCODE(init, 2, 1)          /// [...] -> [..., new(constants[idx16])]
 OPCODE(debug_prt, 0, 0)     /// [...] -> [...]
 
+/*
+ * Task codes - tasks are green threads, scheduled cooperatively by the VM (see
+ * vm_tasks.c). `spawn_sym` resolves its symbol like `invoke_sym` does, and
+ * rewrites itself into `spawn`.
+ */
+
+OPCODE(spawn_sym, 2, 1)     /// [..., args] -> [..., task(dispatch[ref], args)]
+OPCODE(spawn, 2, 1)         /// [..., args] -> [..., task(func, args)]
+OPCODE(yield, 0, 0)         /// [...] -> [...], run other tasks
+OPCODE(join, 0, 0)          /// [..., task] -> [..., task's return value]
+
+/*
+ * Quickened opcodes - never emitted by the compiler. The generic arithmetic
+ * and comparison codes rewrite themselves into one of these once they have
+ * seen the kinds of their operands, and the specialised code rewrites itself
+ * back into the generic one if it ever sees other kinds.
+ */
+
+OPCODE(add_nn, 0, -1)       /// [..., num, num] -> [..., a+b]
+OPCODE(sub_nn, 0, -1)       /// [..., num, num] -> [..., a-b]
+OPCODE(mul_nn, 0, -1)       /// [..., num, num] -> [..., a*b]
+OPCODE(div_nn, 0, -1)       /// [..., num, num] -> [..., a/b]
+OPCODE(test_lt_nn, 0, -1)   /// [..., num, num] -> [..., (a<b)]
+OPCODE(test_gt_nn, 0, -1)   /// [..., num, num] -> [..., (a>b)]
+OPCODE(test_eq_nn, 0, -1)   /// [..., num, num] -> [..., (a==b)]
+OPCODE(test_eq_ss, 0, -1)   /// [..., str, str] -> [..., (a==b)]
+
+/*
+ * Superinstructions - never emitted by the compiler either. When a module is
+ * loaded, orbit_vmFuseFunction() replaces the sequences that dominated opcode
+ * pair profiles with one of these, saving the dispatches in between. Their
+ * operands are those of the fused codes, in order.
+ */
+
+OPCODE(load_local2, 2, 2)       /// [...] -> [..., locals[a8], locals[b8]]
+OPCODE(load_local_const, 3, 2)  /// [...] -> [..., locals[a8], constants[idx16]]
+OPCODE(load_local_field, 3, 1)  /// [...] -> [..., locals[a8][idx16]]
+OPCODE(store_load_local, 2, 0)  /// [..., val] -> [..., locals[b8]], locals[a8] = val
+OPCODE(add_ll, 2, 1)            /// [...] -> [..., locals[a8]+locals[b8]]
+OPCODE(jump_if_lt, 2, -2)       /// [..., b, a] -> [...], if(a<b) ip += idx16
+OPCODE(rjump_if_lt, 2, -2)      /// [..., b, a] -> [...], if(a<b) ip -= idx16
+
 #undef OPCODE
@@ -0,0 +1,48 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/profiler.h - Sampling profiler for Orbit code
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-18 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#ifndef orbit_runtime_profiler_h
+#define orbit_runtime_profiler_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <orbit/orbit.h>
+
+// The profiler interrupts the thread running a VM [frequency] times per second
+// of CPU time, and records the functions on the current task's call stack.
+// Nothing in the interpreter changes while it runs, and it costs nothing when
+// it doesn't. Samples are kept in a ring buffer of [capacity] entries until
+// they are drained: samples taken while it is full are counted as dropped.
+//
+// SIGPROF and its handler are shared by the whole process, so only one VM in
+// the process can be profiled at a time, from the thread that runs it, and
+// only where call frames never move in memory (ORBIT_GUARDED_STACKS).
+// orbit_profilerStart() returns false everywhere else, or if another VM is
+// already being profiled.
+bool orbit_profilerStart(OrbitVM* vm, uint32_t frequency, uint32_t capacity);
+
+// Stops sampling [vm], and drains the samples left in the ring buffer. The
+// profile is kept until it is written, or profiling starts again.
+void orbit_profilerStop(OrbitVM* vm);
+
+// Moves the samples in the ring buffer into [vm]'s profile, which can be done
+// from any thread while the VM runs. Returns the number of samples moved.
+uint32_t orbit_profilerDrain(OrbitVM* vm);
+
+// Writes [vm]'s profile to [out] as folded stacks, one line per distinct call
+// stack followed by the number of samples it was seen in, which tools like
+// flamegraph.pl can read. Functions are named by their demangled signature,
+// followed by the offset of the instruction they were at if [offsets] is set.
+//
+// This must be done from the thread that runs [vm], while it isn't running.
+// Returns the number of samples written.
+uint64_t orbit_profilerWrite(OrbitVM* vm, FILE* out, bool offsets);
+
+#endif /* orbit_runtime_profiler_h */
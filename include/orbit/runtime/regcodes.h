@@ -0,0 +1,80 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/regcodes.h
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-10 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  Instructions of the register-based VM, as an X-macro like opcodes.h.
+//
+//  Register code is a stream of 32-bit words. The low byte of the first word is
+//  the opcode, and the other three hold operands in one of these formats:
+//
+//      ABC     three 8-bit operands
+//      ABx     one 8-bit operand and one unsigned 16-bit operand
+//      sJ      one signed 24-bit operand
+//
+//  Registers are slots of the function's frame, indexed from its base: the
+//  parameters first, then locals, then the temporaries that replace the
+//  stack machine's operand stack. Some instructions are followed by a second,
+//  raw word (field index or signed jump offset). Jump offsets are counted in
+//  words, from the end of the jump instruction.
+//
+//  The first parameter is the instruction's mnemonic, the second its length in
+//  words.
+//
+#ifndef REGCODE
+#define REGCODE(_, _)
+#endif
+
+REGCODE(halt, 1)        /// Stops VM
+REGCODE(move, 1)        /// R[A] = R[B]
+REGCODE(loadnil, 1)     /// R[A] = nil
+REGCODE(loadtrue, 1)    /// R[A] = true
+REGCODE(loadfalse, 1)   /// R[A] = false
+REGCODE(loadk, 1)       /// R[A] = constants[Bx]
+REGCODE(getg, 1)        /// R[A] = globals[Bx]
+REGCODE(setg, 1)        /// globals[Bx] = R[A]
+REGCODE(getfield, 2)    /// R[A] = R[B].fields[ext]
+REGCODE(setfield, 2)    /// R[A].fields[ext] = R[B]
+
+REGCODE(add, 1)         /// R[A] = R[B] + R[C]
+REGCODE(sub, 1)         /// R[A] = R[B] - R[C]
+REGCODE(mul, 1)         /// R[A] = R[B] * R[C]
+REGCODE(div, 1)         /// R[A] = R[B] / R[C]
+REGCODE(lt, 1)          /// R[A] = R[B] < R[C]
+REGCODE(gt, 1)          /// R[A] = R[B] > R[C]
+REGCODE(eq, 1)          /// R[A] = R[B] == R[C]
+
+REGCODE(jmp, 1)         /// ip += sJ
+REGCODE(jt, 2)          /// if(R[A]) ip += ext
+REGCODE(jlt, 2)         /// if(R[A] < R[B]) ip += ext
+REGCODE(jgt, 2)         /// if(R[A] > R[B]) ip += ext
+REGCODE(jeq, 2)         /// if(R[A] == R[B]) ip += ext
+
+// Arguments are in the registers just below R[A], and the result (if any) is
+// stored in the first one. Like `invoke_sym`, `callsym` rewrites itself into
+// `call` once the symbol in the constant pool is resolved.
+REGCODE(callsym, 1)     /// R[A-arity] = dispatch[constants[Bx]](R[A-arity] ... R[A-1])
+REGCODE(call, 1)        /// R[A-arity] = constants[Bx](R[A-arity] ... R[A-1])
+// Stands for a call or spawn whose callee wasn't loaded, or was a foreign
+// function that never ran, when the function was translated. Bx is the offset
+// of the call in the function's bytecode.
+REGCODE(resolve, 1)     /// translate the function again, then carry on from the call
+REGCODE(ret, 1)         /// return
+REGCODE(retv, 1)        /// return R[A]
+REGCODE(newsym, 1)      /// R[A] = new(classes[constants[Bx]])
+REGCODE(new, 1)         /// R[A] = new(constants[Bx])
+REGCODE(debug, 1)       /// print R[A]
+
+// Task codes. Like calls, `spawnsym` and `spawn` take their arguments in the
+// registers just below R[A]. For `yield` and `join`, A is the first register
+// that isn't live, and R[A-1] holds the task to join.
+REGCODE(spawnsym, 1)    /// R[A-arity] = task(dispatch[constants[Bx]], R[A-arity] ... R[A-1])
+REGCODE(spawn, 1)       /// R[A-arity] = task(constants[Bx], R[A-arity] ... R[A-1])
+REGCODE(yield, 1)       /// run other tasks
+REGCODE(join, 1)        /// R[A-1] = result of task R[A-1]
+
+#undef REGCODE
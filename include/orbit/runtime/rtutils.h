@@ -30,4 +30,13 @@
 // Single function used for memory allocation and deallocation in orbit.
 void* orbit_allocator(OrbitVM* vm, void* ptr, size_t newSize);
 
+#define ALLOC_OBJECT(vm, type) \
+    orbit_objectAllocator(vm, sizeof(type))
+#define ALLOC_OBJECT_FLEX(vm, type, arrayType, count) \
+    orbit_objectAllocator(vm, sizeof(type) + (sizeof(arrayType) * (count)))
+
+// Allocates a garbage-collected object of [size] bytes in [vm]'s heap. Objects
+// are only freed by the collector.
+void* orbit_objectAllocator(OrbitVM* vm, size_t size);
+
 #endif /* orbit_utils_h */
@@ -0,0 +1,53 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/stats.h - Interpreter execution counts and disassembly
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-19 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#ifndef orbit_runtime_stats_h
+#define orbit_runtime_stats_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <orbit/orbit.h>
+#include <orbit/runtime/vm.h>
+
+// When built with ORBIT_VM_STATS, the stack interpreters count every opcode
+// they dispatch, every pair of opcodes dispatched one after the other (across
+// calls and returns too), and how many times each instruction of each function
+// ran. Quickened and fused instructions are counted as what they became. The
+// register engine only counts dispatches, and code run by the JIT isn't
+// counted at all.
+//
+// Setting the ORBIT_VM_STATS environment variable to a path (or `-` for the
+// standard error) also makes orbit_vmDealloc() append the report written by
+// orbit_vmStatsWrite() to it.
+
+// Returns the number of times [code] was dispatched in [vm], or 0 without
+// ORBIT_VM_STATS.
+uint64_t orbit_vmStatsOpcode(const OrbitVM* vm, VMCode code);
+
+// Returns the number of times [second] was dispatched right after [first] in
+// [vm], or 0 without ORBIT_VM_STATS.
+uint64_t orbit_vmStatsPair(const OrbitVM* vm, VMCode first, VMCode second);
+
+// Clears every count collected in [vm] so far.
+void orbit_vmStatsReset(OrbitVM* vm);
+
+// Writes a report of [vm]'s counts to [out]: opcodes and the [pairLimit] most
+// frequent pairs by count, and the number of instructions run by each function.
+// If [disassemble] is set, each function that ran is then disassembled. Returns
+// false, and writes nothing, without ORBIT_VM_STATS.
+bool orbit_vmStatsWrite(OrbitVM* vm, FILE* out, uint32_t pairLimit, bool disassemble);
+
+// Writes the bytecode of the function registered as [signature] in [vm] to
+// [out], one instruction per line, preceded by the number of times it ran when
+// built with ORBIT_VM_STATS. Returns false if there is no such function, or it
+// isn't an Orbit function.
+bool orbit_vmDisassemble(OrbitVM* vm, const char* signature, FILE* out);
+
+#endif /* orbit_runtime_stats_h */
@@ -0,0 +1,40 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/tracer.h - Call and collection tracing in trace-event format
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-20 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#ifndef orbit_runtime_tracer_h
+#define orbit_runtime_tracer_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <orbit/orbit.h>
+
+// The tracer records when the interpreter enters and leaves each function,
+// Orbit or foreign, and when the garbage collector starts and finishes, with
+// the time it was at. Events go in a buffer of [capacity] entries allocated
+// by orbit_tracerStart(): once it is full, events are counted as dropped
+// instead. Functions run by the JIT don't record the calls they make.
+//
+// Starting again discards the events recorded so far.
+void orbit_tracerStart(OrbitVM* vm, uint32_t capacity);
+
+// Stops recording events in [vm]. They are kept until tracing starts again,
+// or the VM is destroyed.
+void orbit_tracerStop(OrbitVM* vm);
+
+// Writes the events recorded in [vm] to [out] as trace-event JSON, which
+// chrome://tracing and Perfetto can open. Each task gets a track of its own,
+// and collections one shared by all. Functions are named by their demangled
+// signature.
+//
+// This must be done while the VM isn't running. Returns the number of events
+// written.
+uint64_t orbit_tracerWrite(OrbitVM* vm, FILE* out);
+
+#endif /* orbit_runtime_tracer_h */
@@ -19,7 +19,12 @@
 typedef enum _OrbitValueKind    OrbitValueKind;
 typedef enum _OrbitFnKind       OrbitFnKind;
 typedef enum _OrbitObjKind      OrbitObjKind;
+typedef enum _OrbitTaskState    OrbitTaskState;
+#ifdef ORBIT_NAN_TAGGING
+typedef uint64_t                OrbitValue;
+#else
 typedef struct _OrbitValue      OrbitValue;
+#endif
 typedef struct _OrbitGCClass    OrbitGCClass;
 typedef struct _OrbitGCObject   OrbitGCObject;
 typedef struct _OrbitGCInstance OrbitGCInstance;
@@ -31,6 +36,8 @@ typedef struct _OrbitVMFrame    OrbitVMFrame;
 typedef struct _OrbitVMGlobal   OrbitVMGlobal;
 typedef struct _OrbitVMModule   OrbitVMModule;
 typedef struct _OrbitVMTask     OrbitVMTask;
+typedef struct _OrbitJITCode    OrbitJITCode;
+typedef struct _OrbitModuleImage OrbitModuleImage;
 typedef bool (*GCForeignFn)(OrbitVM* vm, OrbitValue*);
 
 
@@ -52,6 +59,38 @@ enum _OrbitValueKind {
 };
 
 
+#ifdef ORBIT_NAN_TAGGING
+
+// With NaN tagging, values are packed in 64 bits. Any double that is not a
+// quiet NaN with all of [ORBIT_QNAN]'s bits set is a number. Object pointers
+// are stored in the low 48 bits of a quiet NaN with the sign bit set, and the
+// singletons are quiet NaNs with a small tag in the low bits. Every NaN made
+// into a value becomes [ORBIT_CANONICAL_NAN], which doesn't have bit 50 set,
+// so NaNs coming from the host can't pass for another kind of value.
+#define ORBIT_QNAN          ((uint64_t)0x7ffc000000000000)
+#define ORBIT_CANONICAL_NAN ((uint64_t)0x7ff8000000000000)
+#define ORBIT_SIGN_BIT      ((uint64_t)0x8000000000000000)
+#define ORBIT_TAG_NIL       1
+#define ORBIT_TAG_FALSE     2
+#define ORBIT_TAG_TRUE      3
+
+typedef union {
+    double      number;
+    uint64_t    bits;
+} OrbitValueBits;
+
+static inline OrbitValue orbit_valueFromNum(double number) {
+    OrbitValueBits value = {.number = number};
+    return number == number ? value.bits : ORBIT_CANONICAL_NAN;
+}
+
+static inline double orbit_valueToNum(OrbitValue bits) {
+    OrbitValueBits value = {.bits = bits};
+    return value.number;
+}
+
+#else
+
 // Orbit's value type, used for the GC's stack and the language's variables.
 struct _OrbitValue {
     OrbitValueKind  kind;
@@ -61,6 +100,8 @@ struct _OrbitValue {
     };
 };
 
+#endif
+
 // The type of a garbage-collected object. This is used to decide how to collect
 // the object, and wether it has fields pointing to other objects in the graph.
 enum _OrbitObjKind {
@@ -80,8 +121,10 @@ enum _OrbitObjKind {
 struct _OrbitGCObject {
     OrbitGCClass*   class;
     OrbitObjKind    kind;
-    bool            mark;
-    OrbitGCObject*  next;
+    // Whether the object survived a collection, and is in the VM's remembered
+    // set. Mark bits are kept on the side, in the page the object is in.
+    bool            old;
+    bool            remembered;
 };
 
 
@@ -156,9 +199,53 @@ enum _OrbitFnKind {
 };
 
 // Orbit's native function type, used for bytecode-compiled functions.
+//
+// When the VM is built with direct-threaded dispatch, [threadedCode] holds one
+// word per bytecode byte: the handler address at each instruction's offset,
+// followed by its pre-decoded operand. Keeping the same offsets as [byteCode]
+// means jumps don't need to be relocated.
+//
+// When the JIT is enabled, [callCount] counts invocations until the function
+// is hot enough to be compiled to machine code, which is then kept in [jit].
+// [loopCounts] counts how many times each backward jump was taken, indexed by
+// the jump's offset, so that functions that never return (like a program's
+// main loop) get compiled as well.
+//
+// With the register VM, [regCode] holds the function's register instructions
+// (see regcodes.h), translated from [byteCode] once it was verified, and
+// [regCount] the number of registers its frame needs. Translating again once a
+// call is resolved leaves older code in [retiredRegCode], for the frames that
+// still run it.
+//
+// Functions loaded from a module image (see image.h) borrow the image's code
+// instead of owning it, as recorded in [shared]. Shared code is never
+// rewritten: engines that quicken bytecode write the quickened opcodes to
+// [quickened], a side table indexed like [byteCode] that the function only
+// gets once one of its instructions is quickened.
+#define ORBIT_SHARED_BYTECODE   (1 << 0)
+
+//
+// [verified] is set for functions that passed every check of the load-time
+// verifier (see vm_verify.c), which the interpreter then doesn't repeat.
 typedef struct _GCNativeFn {
+    uint8_t         shared;
+    bool            verified;
     uint16_t        byteCodeLength;
     uint8_t*        byteCode;
+    void**          threadedCode;
+    uint8_t*        quickened;
+    uint16_t        regCodeLength;
+    uint8_t         regCount;
+    uint32_t*       regCode;
+    uint16_t        retiredCount;
+    uint32_t**      retiredRegCode;
+    uint32_t        callCount;
+    uint16_t*       loopCounts;
+    OrbitJITCode*   jit;
+#ifdef ORBIT_VM_STATS
+    // Times the instruction at each bytecode offset was run, once it has run.
+    uint64_t*       executionCounts;
+#endif
 } GCNativeFn;
 
 // Orbit's Function type.
@@ -166,13 +253,18 @@ typedef struct _GCNativeFn {
 // Function objects can hold either bytecode for functions compiled from an
 // Orbit script file, or a pointer to their native implementation for functions
 // declared through the C API.
+//
+// Foreign functions only say whether they produce a value when they run. The
+// register VM records what the first call returned in [foreignResults], which
+// is -1 until then.
 struct _OrbitVMFunction {
     OrbitGCObject   base;
     OrbitFnKind     kind;
     OrbitVMModule*  module;
     uint8_t         arity;
     uint8_t         localCount;
-    uint8_t         stackEffect;
+    uint16_t        stackEffect;
+    int8_t          foreignResults;
     union {
         GCForeignFn foreign;
         GCNativeFn  native;
@@ -187,9 +279,20 @@ struct _OrbitVMFrame {
     OrbitValue*         stackBase;
 };
 
+enum _OrbitTaskState {
+    ORBIT_TASK_READY,
+    ORBIT_TASK_WAITING,
+    ORBIT_TASK_DONE,
+};
+
 // Tasks hold the data required to execute bytecode: an operand stack for
 // temporary results, as well as a call stack for function invocation and
 // return.
+//
+// Tasks are also Orbit's green threads, scheduled cooperatively by the VM (see
+// vm_tasks.c). A task that isn't running is either in the VM's run queue,
+// waiting for another task to finish (in that task's [waiters] list), or done,
+// in which case [result] holds the value its entry point returned.
 struct _OrbitVMTask {
     OrbitGCObject   base;
     
@@ -200,6 +303,11 @@ struct _OrbitVMTask {
     uint64_t        frameCount;
     uint64_t        frameCapacity;
     OrbitVMFrame*   frames;
+    
+    OrbitTaskState  state;
+    OrbitValue      result;
+    OrbitVMTask*    next;
+    OrbitVMTask*    waiters;
 };
 
 struct _OrbitVMGlobal {
@@ -209,9 +317,11 @@ struct _OrbitVMGlobal {
 
 // OrbitVMModule holds all that is needed for a bytecode file to be executed.
 // A module is created when a bytecode file is loaded into the VM, and can be
-// used to hold state in between C API function calls.
+// used to hold state in between C API function calls. Modules loaded from a
+// file keep a reference to the [image] their functions' code lives in.
 struct _OrbitVMModule {
     OrbitGCObject   base;
+    OrbitModuleImage* image;
     
     uint16_t        constantCount;
     OrbitValue*     constants;
@@ -222,6 +332,28 @@ struct _OrbitVMModule {
 
 // Macros used to check the type of an orbit OrbitValue tagged union.
 
+#ifdef ORBIT_NAN_TAGGING
+
+#define MAKE_NUM(num)   orbit_valueFromNum(num)
+#define MAKE_BOOL(val)  ((val)? VAL_TRUE : VAL_FALSE)
+#define MAKE_OBJECT(obj)((OrbitValue)(ORBIT_SIGN_BIT | ORBIT_QNAN | (uint64_t)(uintptr_t)(obj)))
+
+#define VAL_NIL         ((OrbitValue)(ORBIT_QNAN | ORBIT_TAG_NIL))
+#define VAL_TRUE        ((OrbitValue)(ORBIT_QNAN | ORBIT_TAG_TRUE))
+#define VAL_FALSE       ((OrbitValue)(ORBIT_QNAN | ORBIT_TAG_FALSE))
+
+#define IS_BOOL(val)    (((val) | 1) == VAL_TRUE)
+#define IS_TRUE(val)    ((val) == VAL_TRUE || (IS_NUM(val) && AS_NUM(val) != 0.0))
+#define IS_NIL(val)     ((val) == VAL_NIL)
+#define IS_NUM(val)     (((val) & ORBIT_QNAN) != ORBIT_QNAN)
+#define IS_OBJECT(val)  (((val) & (ORBIT_QNAN | ORBIT_SIGN_BIT)) == (ORBIT_QNAN | ORBIT_SIGN_BIT))
+
+#define AS_BOOL(val)    ((val) == VAL_TRUE)
+#define AS_NUM(val)     orbit_valueToNum(val)
+#define AS_OBJECT(val)  ((OrbitGCObject*)(uintptr_t)((val) & ~(ORBIT_SIGN_BIT | ORBIT_QNAN)))
+
+#else
+
 #define MAKE_NUM(num)   ((OrbitValue){ORBIT_VK_NUM, {.numValue=(num)}})
 #define MAKE_BOOL(val)  ((OrbitValue){(val)? ORBIT_VK_TRUE : ORBIT_VK_FALSE, {.numValue=0}})
 #define MAKE_OBJECT(obj)((OrbitValue){ORBIT_VK_OBJECT, {.objectValue=(obj)}})
@@ -232,25 +364,31 @@ struct _OrbitVMModule {
 
 #define IS_BOOL(val)    ((val).kind == ORBIT_VK_TRUE || (val).kind == ORBIT_VK_FALSE)
 #define IS_TRUE(val)    ((val).kind == ORBIT_VK_TRUE || (IS_NUM(val) && AS_NUM(val) != 0.0))
-#define IS_FALSE(val)   (!IS_TRUE(val))
 #define IS_NIL(val)     ((val).kind == ORBIT_VK_NIL)
 #define IS_NUM(val)     ((val).kind == ORBIT_VK_NUM)
 #define IS_OBJECT(val)  ((val).kind == ORBIT_VK_OBJECT)
+
+#define AS_BOOL(val)    ((val).kind == ORBIT_VK_TRUE)
+#define AS_NUM(val)     ((double)(val).numValue)
+#define AS_OBJECT(val)  ((OrbitGCObject*)(val).objectValue)
+
+#endif
+
+#define IS_FALSE(val)   (!IS_TRUE(val))
 #define IS_INSTANCE(val)(IS_OBJECT(val) && AS_OBJECT(val)->kind == ORBIT_OBJK_INSTANCE)
 #define IS_STRING(val)  (IS_OBJECT(val) && AS_OBJECT(val)->kind == ORBIT_OBJK_STRING)
 #define IS_CLASS(val)   (IS_OBJECT(val) && AS_OBJECT(val)->kind == ORBIT_OBJK_CLASS)
 #define IS_FUNCTION(val)(IS_OBJECT(val) && AS_OBJECT(val)->kind == ORBIT_OBJK_FUNCTION)
 #define IS_MODULE(val)  (IS_OBJECT(val) && AS_OBJECT(val)->kind == ORBIT_OBJK_MODULE)
+#define IS_TASK(val)    (IS_OBJECT(val) && AS_OBJECT(val)->kind == ORBIT_OBJK_TASK)
 
 // Macros used to cast [val] to a given GC type.
 
-#define AS_BOOL(val)    ((val).type == ORBIT_VK_TRUE)
-#define AS_NUM(val)     ((double)(val).numValue)
-#define AS_OBJECT(val)  ((OrbitGCObject*)(val).objectValue)
 #define AS_CLASS(val)   ((OrbitGCClass*)AS_OBJECT(val))
 #define AS_INST(val)    ((OrbitGCInstance*)AS_OBJECT(val))
 #define AS_STRING(val)  ((OrbitGCString*)AS_OBJECT(val))
 #define AS_FUNCTION(val)((OrbitVMFunction*)AS_OBJECT(val))
+#define AS_TASK(val)    ((OrbitVMTask*)AS_OBJECT(val))
 
 // Creates a garbage collected string in [vm] from the bytes in [string].
 OrbitGCString* orbit_gcStringNew(OrbitVM* vm, const char* string);
@@ -261,6 +399,13 @@ OrbitGCString* orbit_gcStringReserve(OrbitVM* vm, size_t size);
 // Recomputes the hash of [string] and stores it.
 void orbit_gcStringComputeHash(OrbitGCString* string);
 
+// Returns whether [a] and [b] hold the same characters.
+bool orbit_gcStringEquals(OrbitGCString* a, OrbitGCString* b);
+
+// Returns whether [a] and [b] are equal: numbers and strings are compared by
+// value, other objects by identity. Values of different kinds are never equal.
+bool orbit_valueEquals(OrbitValue a, OrbitValue b);
+
 // Creates a garbage collected instance of [class] in [vm].
 OrbitGCInstance* orbit_gcInstanceNew(OrbitVM* vm, OrbitGCClass* class);
 
@@ -297,6 +442,10 @@ bool orbit_gcArrayRemove(OrbitVM* vm, OrbitGCArray* array, uint32_t index);
 // Creates a native bytecode function.
 OrbitVMFunction* orbit_gcFunctionNew(OrbitVM* vm, uint16_t byteCodeLength);
 
+// Creates a new bytecode function that runs [byteCode], owned by someone else
+// (a module image) and never modified.
+OrbitVMFunction* orbit_gcFunctionSharedNew(OrbitVM* vm, uint8_t* byteCode, uint16_t byteCodeLength);
+
 // Creates a new foreign function
 OrbitVMFunction* orbit_gcFunctionForeignNew(OrbitVM* vm, GCForeignFn ffi, uint8_t arity);
 
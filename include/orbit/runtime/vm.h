@@ -13,6 +13,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <orbit/orbit.h>
+#include <orbit/csupport/string.h>
 #include <orbit/runtime/rtutils.h>
 #include <orbit/runtime/value.h>
 
@@ -23,21 +24,200 @@ typedef enum {
 } VMCode;
 #undef OPCODE
 
+#define OPCODE(code, idx, stack) + 1
+enum { ORBIT_OPCODE_COUNT = 0
+#include <orbit/runtime/opcodes.h>
+};
+#undef OPCODE
+
+// Instructions of the register VM (see regcodes.h)
+#define REGCODE(code, length) REG_##code,
+typedef enum {
+#include <orbit/runtime/regcodes.h>
+} VMRegCode;
+#undef REGCODE
+
 #define ORBIT_FIRST_GC (32 * 1024)
 
+// Bytes allocated since the last collection after which a minor one is run
+// (see orbit_gcRunMinor()).
+#ifndef ORBIT_NURSERY_SIZE
+#define ORBIT_NURSERY_SIZE (256 * 1024)
+#endif
+
+// Bytes allocated between two slices of an incremental collection (see
+// orbit_gcSetPauseBudget()).
+#ifndef ORBIT_GC_STEP_SIZE
+#define ORBIT_GC_STEP_SIZE (64 * 1024)
+#endif
+
+// What the collection in progress is doing, if any (see gc.c).
+typedef enum {
+    ORBIT_GC_IDLE,
+    ORBIT_GC_MARK,
+    ORBIT_GC_SWEEP,
+} OrbitGCPhase;
+
+// Objects marked but not traced yet.
+typedef struct {
+    OrbitGCObject** objects;
+    uint64_t        count;
+    uint64_t        capacity;
+} OrbitGCWorklist;
+
+// Size in bytes of the pages objects are allocated in, which must be a power of
+// two. Objects up to ORBIT_GC_LARGE_SIZE bytes share pages with objects of the
+// same size class, and larger ones get a page of their own (see heap.c).
+#ifndef ORBIT_GC_PAGE_SIZE
+#define ORBIT_GC_PAGE_SIZE (32 * 1024)
+#endif
+#define ORBIT_GC_LARGE_SIZE 2048
+#define ORBIT_GC_SIZE_CLASSES 24
+
+typedef struct _OrbitGCPage OrbitGCPage;
+
+// The pages holding objects of one size class. Objects are allocated from the
+// [free] slots of the [current] page, and then from the first page after
+// [scan] that has some.
+typedef struct {
+    OrbitGCPage*    pages;
+    OrbitGCPage*    scan;
+    OrbitGCPage*    current;
+    void*           free;
+    uint32_t        size;
+} OrbitGCSizeClass;
+
+// The objects of a VM. Every page is in [pages], in the order they are swept,
+// and the ones allocated from since the last collection are also in [young].
+// [sweep] is the next page the collection in progress sweeps, and pages are
+// swept once [epoch] is theirs.
+typedef struct {
+    OrbitGCSizeClass    classes[ORBIT_GC_SIZE_CLASSES];
+    uint8_t             classOf[ORBIT_GC_LARGE_SIZE / 16 + 1];
+    OrbitGCPage*        pages;
+    OrbitGCPage*        young;
+    OrbitGCPage*        sweep;
+    uint32_t            epoch;
+} OrbitGCHeap;
+
+// Number of buckets in the pause histogram of OrbitGCStats. Bucket 0 counts
+// pauses under 1µs, bucket i the ones under 2^i µs, and the last one all the
+// ones that are longer.
+#define ORBIT_GC_PAUSE_BUCKETS 16
+
+// What the collector did in a VM since it was created (see orbit_gcStats()).
+// Bytes are counted like the VM's [allocated] bytes: what objects and the
+// buffers they own asked for. Pause times are in nanoseconds.
+typedef struct {
+    uint64_t    collections;
+    uint64_t    minorCollections;
+    uint64_t    pauses[ORBIT_GC_PAUSE_BUCKETS];
+    uint64_t    pauseTotal;
+    uint64_t    pauseMax;
+    uint64_t    allocatedBytes;
+    uint64_t    freedBytes;
+    uint64_t    promotedBytes;
+    uint64_t    peakHeap;
+} OrbitGCStats;
+
+// Maximum number of values and call frames a task can hold, and the size in
+// bytes of the guard pages after each, when stacks are guarded. Only the pages
+// that get used are ever committed.
+#ifndef ORBIT_STACK_RESERVE
+#define ORBIT_STACK_RESERVE (1 << 20)
+#endif
+#ifndef ORBIT_FRAMES_RESERVE
+#define ORBIT_FRAMES_RESERVE (1 << 16)
+#endif
+#ifndef ORBIT_STACK_GUARD
+#define ORBIT_STACK_GUARD (64 * 1024)
+#endif
+
+// A call to an Orbit function, resolved once by orbit_vmPrepareCall() and run
+// any number of times with orbit_vmCall(). Each prepared call keeps its own
+// task, which is reset after every run instead of being allocated again.
+typedef struct _OrbitVMCall OrbitVMCall;
+struct _OrbitVMCall {
+    OrbitVMCall*        next;
+    OrbitVMFunction*    function;
+    OrbitVMTask*        task;
+    uint8_t             argCount;
+    bool                running;
+    OrbitValue          result;
+    
+    // The batch being run (see orbit_vmCallBatch()), if any.
+    const OrbitValue*   batchArgs;
+    OrbitValue*         batchResults;
+    uint32_t            batchCount;
+    uint32_t            batchDone;
+};
+
+// State of the sampling profiler (see profiler.h).
+typedef struct _OrbitProfiler OrbitProfiler;
+
+// Events recorded by the tracer (see tracer.h).
+typedef struct _OrbitTracer OrbitTracer;
+
 #define ORBIT_GCSTACK_SIZE 16
 struct _OrbitVM {
     OrbitVMTask*    task;
-    OrbitGCObject*  gcHead;
+    // Tasks ready to run, in order (linked through their [next] field).
+    OrbitVMTask*    runQueue;
+    OrbitVMTask*    runQueueTail;
+    OrbitGCHeap     heap;
+    // Old objects that can point to young ones (see orbit_gcWriteBarrier()).
+    OrbitGCObject** gcRemembered;
+    uint64_t        gcRememberedCount;
+    uint64_t        gcRememberedCapacity;
+    bool            gcMinor;
+    
+    // Full collections run in slices of at most [gcBudget] microseconds, or in
+    // one go if it is 0, when they are marked by [gcMarkThreads] threads.
+    OrbitGCPhase    gcPhase;
+    uint32_t        gcBudget;
+    uint32_t        gcMarkThreads;
+    OrbitGCWorklist gcGrey;
+    // Bytes traced so far, allocated when the collection started, and after
+    // which the next slice runs.
+    uint64_t        gcMarked;
+    uint64_t        gcStartAllocated;
+    uint64_t        gcNextStep;
+    
     uint64_t        allocated;
+    uint64_t        nurseryAllocated;
     uint64_t        nextGC;
+    OrbitGCStats    gcStats;
     
     OrbitGCMap*     dispatchTable;
     OrbitGCMap*     classes;
     OrbitGCMap*     modules;
+    // Prepared calls, which keep their function, task and result alive.
+    OrbitVMCall*    calls;
+    // The prepared call running a batch, whose task restarts with the next
+    // arguments whenever it finishes.
+    OrbitVMCall*    batch;
     
     OrbitGCObject*  gcStack[ORBIT_GCSTACK_SIZE];
     uint64_t        gcStackSize;
+    
+    // Interned strings used by the VM's host side (demangled names, messages),
+    // current on the thread running the VM during orbit_vmInvoke().
+    OCStringPool    strings;
+    
+    // The profile collected by orbit_profilerStart(), if any.
+    OrbitProfiler*  profiler;
+    // The trace recorded since orbit_tracerStart(), if any.
+    OrbitTracer*    tracer;
+    
+#ifdef ORBIT_VM_STATS
+    // Number of instructions dispatched by the interpreter.
+    uint64_t        dispatchCount;
+    // Executions of each opcode, and of each opcode right after another one
+    // (see stats.h). [lastOpcode] is ORBIT_OPCODE_COUNT until the first one.
+    uint64_t        opcodeCounts[ORBIT_OPCODE_COUNT];
+    uint64_t        pairCounts[ORBIT_OPCODE_COUNT][ORBIT_OPCODE_COUNT];
+    uint8_t         lastOpcode;
+#endif
 };
 
 static inline void orbit_gcRetain(OrbitVM* vm, OrbitGCObject* object) {
@@ -52,4 +232,70 @@ static inline void orbit_gcRelease(OrbitVM* vm) {
 
 void orbit_vmLoadModule(OrbitVM* vm, const char* module);
 
+// Loads [image] (see image.h) into [vm] as [moduleName]. Returns false if a
+// module with that name is already loaded. [image] is retained by the module.
+bool orbit_vmLoadImage(OrbitVM* vm, const char* moduleName, OrbitModuleImage* image);
+
+// Resolves [entry] in [module] (loading it if needed) and returns a call that
+// can be run repeatedly, or NULL if there is no such function. Calls belong to
+// [vm] until released.
+OrbitVMCall* orbit_vmPrepareCall(OrbitVM* vm, const char* module, const char* entry);
+
+void orbit_vmReleaseCall(OrbitVM* vm, OrbitVMCall* call);
+
+// Runs [call] with the arguments pushed since it was last run. Returns false if
+// a runtime error occurs. Arguments must be pushed again before the next run.
+bool orbit_vmCall(OrbitVM* vm, OrbitVMCall* call);
+
+// Runs [call] once for each of the [count] argument tuples at [args], which
+// holds the function's arity values for each tuple, one tuple after the other.
+// The value returned by each run is stored in [results]. Everything runs in a
+// single interpreter entry. Tasks spawned by one run may still be running when
+// the next one starts, and all of them are done when this returns. Stops at the
+// first runtime error, leaving nil in the remaining results, and returns false.
+// Objects in [results] aren't rooted once this returns: they must be retained
+// (see orbit_gcRetain()) before anything else allocates in [vm].
+bool orbit_vmCallBatch(OrbitVM* vm, OrbitVMCall* call,
+                       const OrbitValue* args, OrbitValue* results, uint32_t count);
+
+// Splits a batch between [workerCount] VMs, each running its slice with its own
+// entry in [calls] on its own thread. Every VM must have loaded the same
+// module, typically from one shared image. This is only done if the function
+// is isolated in every VM (see orbit_vmFunctionIsIsolated()): otherwise the
+// whole batch is run by the first VM. Arguments can't be objects, and objects
+// returned belong to the VM that created them, unrooted like those returned by
+// orbit_vmCallBatch().
+bool orbit_vmCallBatchParallel(OrbitVM** vms, OrbitVMCall** calls, uint32_t workerCount,
+                               const OrbitValue* args, OrbitValue* results, uint32_t count);
+
+// Returns whether [function] and every function it calls only use their own
+// parameters and locals: no module globals, and no foreign functions. Running
+// such a function in another VM gives the same result.
+bool orbit_vmFunctionIsIsolated(OrbitVM* vm, OrbitVMFunction* function);
+
+// Sets the next parameter of [call]'s function.
+static inline void orbit_vmCallPush(OrbitVMCall* call, OrbitValue value) {
+    assert(!call->running && "prepared call is already running");
+    assert(call->argCount < call->function->arity && "too many arguments");
+    call->task->stack[call->argCount++] = value;
+}
+
+static inline void orbit_vmCallPushNum(OrbitVMCall* call, double number) {
+    orbit_vmCallPush(call, MAKE_NUM(number));
+}
+
+static inline void orbit_vmCallPushBool(OrbitVMCall* call, bool value) {
+    orbit_vmCallPush(call, MAKE_BOOL(value));
+}
+
+// Returns the value returned by the last run of [call], or nil.
+static inline OrbitValue orbit_vmCallResult(const OrbitVMCall* call) {
+    return call->result;
+}
+
+// Rewrites common instruction sequences in [function]'s bytecode into
+// superinstructions. Modules are fused when loaded; this must be called before
+// the function first runs, and does nothing with the register-based engine.
+void orbit_vmFuseFunction(OrbitVM* vm, OrbitVMFunction* function);
+
 #endif /* orbit_vm_h */
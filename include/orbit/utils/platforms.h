@@ -29,8 +29,48 @@
 #define ORBIT_PLATFORM "Unknown Platform"
 #endif
 
-#ifndef _MSC_VER
-#define ORBIT_FORBIT_AST_INTERPRET
+// Interpreter dispatch engines. The build system picks one through the
+// ORBIT_DISPATCH CMake option; when nothing is specified we fall back on
+// token-threaded dispatch wherever computed gotos are available.
+//
+// - SWITCH:    portable `switch` loop.
+// - TOKEN:     computed-goto loop indexing a label table with each opcode byte.
+// - DIRECT:    bytecode is translated at load time into handler addresses with
+//              pre-decoded operands, so dispatch is a single indirect jump.
+// - TAILCALL:  every opcode is its own function, and handlers tail-call each
+//              other through a function pointer table.
+// - REGISTERS: functions are translated to register code (see regcodes.h) and
+//              run by a register-based interpreter loop.
+#define ORBIT_DISPATCH_SWITCH       0
+#define ORBIT_DISPATCH_TOKEN        1
+#define ORBIT_DISPATCH_DIRECT       2
+#define ORBIT_DISPATCH_TAILCALL     3
+#define ORBIT_DISPATCH_REGISTERS    4
+
+#ifndef ORBIT_DISPATCH
+#ifdef _MSC_VER
+#define ORBIT_DISPATCH ORBIT_DISPATCH_SWITCH
+#else
+#define ORBIT_DISPATCH ORBIT_DISPATCH_TOKEN
+#endif
+#endif
+
+#if defined(_MSC_VER) && (ORBIT_DISPATCH == ORBIT_DISPATCH_TOKEN || ORBIT_DISPATCH == ORBIT_DISPATCH_DIRECT)
+#error "threaded dispatch requires computed goto support"
+#endif
+
+// Task stacks are reserved as large regions of virtual memory ending in guard
+// pages, wherever we have mmap() and signal handlers to catch overflows.
+#if defined(__unix__) || defined(__APPLE__)
+#define ORBIT_GUARDED_STACKS
+#endif
+
+// Thread-local storage, for state that must not be shared between threads
+// running separate compilers or VMs.
+#ifdef _MSC_VER
+#define ORBIT_THREAD_LOCAL __declspec(thread)
+#else
+#define ORBIT_THREAD_LOCAL __thread
 #endif
 
 #if __STDC_VERSION__ >= 199901L
@@ -19,6 +19,7 @@ void orbit_astContextInit(OrbitASTContext* context) {
     context->source.lineMap = NULL;
     context->source.length = 0;
     orbit_diagManagerInit(&context->diagnostics, &context->source);
+    orbit_stringPoolInit(&context->strings, 1024);
 }
 
 void orbit_astContextDeinit(OrbitASTContext* context) {
@@ -26,4 +27,5 @@ void orbit_astContextDeinit(OrbitASTContext* context) {
     ORCRELEASE(context->root);
     orbit_sourceDeinit(&context->source);
     orbit_diagManagerDeinit(&context->diagnostics);
+    orbit_stringPoolDeinit(&context->strings);
 }
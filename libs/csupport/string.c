@@ -12,24 +12,132 @@
 #include <orbit/csupport/string.h>
 #include <orbit/utils/hashing.h>
 
+// Pools in concurrent mode need a lock per shard, and atomic accesses to the
+// tables that are read without one.
+#ifdef _WIN32
+#include <windows.h>
+typedef SRWLOCK OCMutex;
+#define orbit_mutexInit(m) InitializeSRWLock(m)
+#define orbit_mutexDeinit(m) ((void)(m))
+#define orbit_mutexLock(m) AcquireSRWLockExclusive(m)
+#define orbit_mutexUnlock(m) ReleaseSRWLockExclusive(m)
+#else
+#include <pthread.h>
+typedef pthread_mutex_t OCMutex;
+#define orbit_mutexInit(m) pthread_mutex_init((m), NULL)
+#define orbit_mutexDeinit(m) pthread_mutex_destroy(m)
+#define orbit_mutexLock(m) pthread_mutex_lock(m)
+#define orbit_mutexUnlock(m) pthread_mutex_unlock(m)
+#endif
+
+#ifdef _MSC_VER
+// Aligned pointer loads and stores are atomic on the platforms MSVC targets,
+// the barriers keep the compiler from reordering them.
+#define ORBIT_ATOMIC_LOAD(ptr) (_ReadWriteBarrier(), *(ptr))
+#define ORBIT_ATOMIC_STORE(ptr, val) do { _ReadWriteBarrier(); *(ptr) = (val); } while(0)
+#else
+#define ORBIT_ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define ORBIT_ATOMIC_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+#endif
+
 const OCStringID orbit_invalidStringID = UINT64_MAX;
 
-static struct OCStringPool {
-    uint64_t size;
-    uint64_t capacity;
-    void* data;
-} StringPool;
+// Strings are allocated in chunks that are only freed with the pool, so that
+// IDs (addresses) stay valid and readers never see a string move.
+typedef struct _OCStringChunk {
+    struct _OCStringChunk*  next;
+    uint64_t                capacity;
+    uint64_t                size;
+    uint8_t                 data[ORBIT_FLEXIBLE_ARRAY_MEMB];
+} OCStringChunk;
+
+// Open-addressing hash table of the strings in a shard. Tables are replaced,
+// not resized, so that concurrent readers always see a consistent one. Old
+// tables are kept until the pool is deinitialised, since a reader might still
+// be probing one.
+typedef struct _OCStringTable {
+    struct _OCStringTable*  retired;
+    uint64_t                capacity;
+    OCString*               slots[ORBIT_FLEXIBLE_ARRAY_MEMB];
+} OCStringTable;
+
+struct _OCStringShard {
+    OCStringTable*  table;
+    uint64_t        count;
+    OCStringChunk*  chunks;
+    uint64_t        chunkSize;
+    OCMutex         lock;
+};
+
+#define ORBIT_STRINGPOOL_SHARDS 16
+#define ORBIT_STRINGTABLE_MIN 64
+
+static ORBIT_THREAD_LOCAL OCStringPool* orbit_currentPool = NULL;
+
+static OCStringTable* _tableNew(uint64_t capacity) {
+    OCStringTable* table = ORBIT_ALLOC_FLEX(OCStringTable, OCString*, capacity);
+    table->retired = NULL;
+    table->capacity = capacity;
+    memset(table->slots, 0, capacity * sizeof(OCString*));
+    return table;
+}
+
+static void _poolInit(OCStringPool* pool, uint64_t capacity, uint32_t shardCount, bool concurrent) {
+    assert(pool != NULL && "Null instance error");
+    pool->concurrent = concurrent;
+    pool->shardCount = shardCount;
+    pool->shards = ORBIT_ALLOC_ARRAY(OCStringShard, shardCount);
+    
+    uint64_t chunkSize = capacity / shardCount;
+    if(chunkSize < 256) { chunkSize = 256; }
+    for(uint32_t i = 0; i < shardCount; ++i) {
+        OCStringShard* shard = &pool->shards[i];
+        shard->table = _tableNew(ORBIT_STRINGTABLE_MIN);
+        shard->count = 0;
+        shard->chunks = NULL;
+        shard->chunkSize = chunkSize;
+        if(concurrent) { orbit_mutexInit(&shard->lock); }
+    }
+}
+
+void orbit_stringPoolInit(OCStringPool* pool, uint64_t capacity) {
+    _poolInit(pool, capacity, 1, false);
+}
+
+void orbit_stringPoolInitConcurrent(OCStringPool* pool, uint64_t capacity) {
+    _poolInit(pool, capacity, ORBIT_STRINGPOOL_SHARDS, true);
+}
+
+void orbit_stringPoolDeinit(OCStringPool* pool) {
+    assert(pool != NULL && "Null instance error");
+    for(uint32_t i = 0; i < pool->shardCount; ++i) {
+        OCStringShard* shard = &pool->shards[i];
+        while(shard->table) {
+            OCStringTable* retired = shard->table->retired;
+            orbit_dealloc(shard->table);
+            shard->table = retired;
+        }
+        while(shard->chunks) {
+            OCStringChunk* next = shard->chunks->next;
+            orbit_dealloc(shard->chunks);
+            shard->chunks = next;
+        }
+        if(pool->concurrent) { orbit_mutexDeinit(&shard->lock); }
+    }
+    orbit_dealloc(pool->shards);
+    pool->shards = NULL;
+    pool->shardCount = 0;
+    if(orbit_currentPool == pool) { orbit_currentPool = NULL; }
+}
 
-void orbit_stringPoolInit(uint64_t capacity) {
-    StringPool.capacity = capacity;
-    StringPool.size = 0;
-    StringPool.data = orbit_alloc(StringPool.capacity);
+OCStringPool* orbit_stringPoolSetCurrent(OCStringPool* pool) {
+    OCStringPool* previous = orbit_currentPool;
+    orbit_currentPool = pool;
+    return previous;
 }
 
-void orbit_stringPoolDeinit() {
-    StringPool.capacity = 0;
-    StringPool.size = 0;
-    orbit_dealloc(StringPool.data);
+OCStringPool* orbit_stringPoolCurrent() {
+    return orbit_currentPool;
 }
 
 bool orbit_stringEquals(OCString* a, const char* b, uint64_t length) {
@@ -37,53 +145,128 @@ bool orbit_stringEquals(OCString* a, const char* b, uint64_t length) {
     return hash == a->hash && length == a->length && strncmp(b, a->data, length) == 0;
 }
 
-OCString* orbit_stringPoolSearch(const char* data, uint64_t length) {
-    uint32_t hash = orbit_hashString(data, length);
-    uint64_t offset = 0;
-    
-    while(offset < StringPool.size) {
-        OCString* str = (OCString*)(StringPool.data + offset);
-        if(hash == str->hash && length == str->length && strncmp(data, str->data, length) == 0) {
+static inline OCStringShard* _poolShard(OCStringPool* pool, uint32_t hash) {
+    // The table index uses the low bits of the hash, so pick shards with the
+    // high ones.
+    return &pool->shards[(hash >> 24) & (pool->shardCount - 1)];
+}
+
+// Looks [data] up in [table]. Returns the string, or NULL and the index of the
+// empty slot it would go in. Safe to run while another thread inserts.
+static OCString* _tableFind(OCStringTable* table, const char* data, uint64_t length,
+                            uint32_t hash, uint64_t* slot) {
+    uint64_t mask = table->capacity - 1;
+    for(uint64_t i = hash & mask;; i = (i + 1) & mask) {
+        OCString* str = ORBIT_ATOMIC_LOAD(&table->slots[i]);
+        if(!str) {
+            *slot = i;
+            return NULL;
+        }
+        if(hash == str->hash && length == str->length && memcmp(data, str->data, length) == 0) {
             return str;
         }
-        offset = str->next;
     }
-    return NULL;
 }
 
-OCStringID orbit_stringIntern(const char* data, uint64_t length) {
-    OCString* str = orbit_stringPoolSearch(data, length);
-    if(str) { return (OCStringID)((void*)str - StringPool.data); }
-    
-    while(StringPool.size + length > StringPool.capacity) {
-        StringPool.capacity *= 2;
-        StringPool.data = orbit_realloc(StringPool.data, StringPool.capacity);
+static OCString* _shardAllocate(OCStringShard* shard, uint64_t length) {
+    // Keep strings aligned for their header.
+    uint64_t size = (sizeof(OCString) + length + 1 + 7) & ~7ULL;
+    OCStringChunk* chunk = shard->chunks;
+    if(!chunk || chunk->size + size > chunk->capacity) {
+        uint64_t capacity = size > shard->chunkSize ? size : shard->chunkSize;
+        chunk = ORBIT_ALLOC_FLEX(OCStringChunk, uint8_t, capacity);
+        chunk->next = shard->chunks;
+        chunk->capacity = capacity;
+        chunk->size = 0;
+        shard->chunks = chunk;
     }
+    OCString* str = (OCString*)(chunk->data + chunk->size);
+    chunk->size += size;
+    return str;
+}
+
+// Swaps [shard]'s table for one twice as large. Only one thread can be
+// inserting in the shard.
+static void _shardGrow(OCStringShard* shard) {
+    OCStringTable* old = shard->table;
+    OCStringTable* table = _tableNew(old->capacity * 2);
+    uint64_t mask = table->capacity - 1;
+    for(uint64_t i = 0; i < old->capacity; ++i) {
+        OCString* str = old->slots[i];
+        if(!str) { continue; }
+        uint64_t j = str->hash & mask;
+        while(table->slots[j]) { j = (j + 1) & mask; }
+        table->slots[j] = str;
+    }
+    table->retired = old;
+    ORBIT_ATOMIC_STORE(&shard->table, table);
+}
+
+OCString* orbit_stringPoolLookup(OCStringPool* pool, const char* data, uint64_t length) {
+    assert(pool != NULL && "Null instance error");
+    uint32_t hash = orbit_hashString(data, length);
+    OCStringShard* shard = _poolShard(pool, hash);
+    uint64_t slot = 0;
+    return _tableFind(ORBIT_ATOMIC_LOAD(&shard->table), data, length, hash, &slot);
+}
+
+OCStringID orbit_stringPoolIntern(OCStringPool* pool, const char* data, uint64_t length) {
+    assert(pool != NULL && "Null instance error");
+    uint32_t hash = orbit_hashString(data, length);
+    OCStringShard* shard = _poolShard(pool, hash);
+    uint64_t slot = 0;
     
-    uint64_t id = StringPool.size;
-    str = (OCString*)(StringPool.data + StringPool.size);
-    StringPool.size += sizeof(OCString) + (length + 1) * sizeof(uint8_t);
-    
-    memcpy(str->data, data, length+1);
-    str->data[length] = '\0';
-    str->length = length;
-    str->next = StringPool.size;
-    str->hash = orbit_hashString(data, length);
+    // Most strings are already interned, which doesn't need the lock.
+    OCString* str = _tableFind(ORBIT_ATOMIC_LOAD(&shard->table), data, length, hash, &slot);
+    if(str) { return (OCStringID)(uintptr_t)str; }
     
-    return id;
+    // Another thread might have inserted the string (or replaced the table)
+    // since, so look again once we hold the lock.
+    if(pool->concurrent) { orbit_mutexLock(&shard->lock); }
+    str = _tableFind(shard->table, data, length, hash, &slot);
+    if(!str) {
+        if((shard->count + 1) * 2 > shard->table->capacity) {
+            _shardGrow(shard);
+            _tableFind(shard->table, data, length, hash, &slot);
+        }
+        str = _shardAllocate(shard, length);
+        memcpy(str->data, data, length);
+        str->data[length] = '\0';
+        str->length = length;
+        str->hash = hash;
+        // Publishing the string last means readers only see it complete.
+        ORBIT_ATOMIC_STORE(&shard->table->slots[slot], str);
+        shard->count += 1;
+    }
+    if(pool->concurrent) { orbit_mutexUnlock(&shard->lock); }
+    return (OCStringID)(uintptr_t)str;
+}
+
+OCString* orbit_stringPoolSearch(const char* data, uint64_t length) {
+    assert(orbit_currentPool != NULL && "no current string pool");
+    return orbit_stringPoolLookup(orbit_currentPool, data, length);
+}
+
+OCStringID orbit_stringIntern(const char* data, uint64_t length) {
+    assert(orbit_currentPool != NULL && "no current string pool");
+    return orbit_stringPoolIntern(orbit_currentPool, data, length);
 }
 
 OCString* orbit_stringPoolGet(OCStringID id) {
     if(id == orbit_invalidStringID) { return NULL; }
-    return (OCString*)(StringPool.data + id);
+    return (OCString*)(uintptr_t)id;
 }
 
 void orbit_stringPoolDebug() {
-    uint64_t offset = 0;
-    while(offset < StringPool.size) {
-        OCString* str = (OCString*)(StringPool.data + offset);
-        fprintf(stderr, "[strpool: 0x%08lx]: \"%.*s\"\n", ((void*)str - StringPool.data), (int)str->length, str->data);
-        offset = str->next;
+    OCStringPool* pool = orbit_currentPool;
+    if(!pool) { return; }
+    for(uint32_t i = 0; i < pool->shardCount; ++i) {
+        OCStringTable* table = ORBIT_ATOMIC_LOAD(&pool->shards[i].table);
+        for(uint64_t j = 0; j < table->capacity; ++j) {
+            OCString* str = ORBIT_ATOMIC_LOAD(&table->slots[j]);
+            if(!str) { continue; }
+            fprintf(stderr, "[strpool: %p]: \"%.*s\"\n", (void*)str, (int)str->length, str->data);
+        }
     }
 }
 
@@ -450,6 +450,7 @@ static OrbitAST* recMapType(OCParser* parser) {
 }
 
 void orbit_dumpTokens(OrbitASTContext* context) {
+    OCStringPool* strings = orbit_stringPoolSetCurrent(&context->strings);
     OCParser parser;
     orbit_parserInit(&parser, context);
     
@@ -466,10 +467,11 @@ void orbit_dumpTokens(OrbitASTContext* context) {
         putchar('\n');
         orbit_parserNextToken(&parser);
     }
+    orbit_stringPoolSetCurrent(strings);
 }
 
 bool orbit_parse(OrbitASTContext* context) {
-    
+    OCStringPool* strings = orbit_stringPoolSetCurrent(&context->strings);
     OCParser parser;
     orbit_parserInit(&parser, context);
     
@@ -477,5 +479,6 @@ bool orbit_parse(OrbitASTContext* context) {
     context->root = ORCRETAIN(recProgram(&parser));
     
     orbit_parserDeinit(&parser);
+    orbit_stringPoolSetCurrent(strings);
     return context->root != NULL;
 }
@@ -8,8 +8,17 @@
 // =^•.•^=
 //===--------------------------------------------------------------------------------------------===
 #include <assert.h>
+#include <string.h>
 #include <orbit/runtime/gc.h>
 #include <orbit/runtime/vm.h>
+#include <orbit/utils/memory.h>
+#include "vm_private.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#define ORBIT_GC_PARALLEL
+#endif
 
 #ifdef DEBUG_GC
 #define GCDBG(fmt, ...) DBG(fmt, ##__VA_ARGS__)
@@ -17,159 +26,838 @@
 #define GCDBG(fmt, ...)
 #endif
 
-void orbit_gcRun(OrbitVM* vm) {
-    // Reset allocation size so we can count as we go
-    GCDBG("gc run: kick (%llu)", vm->allocated);
-    GCDBG("gc run: marking objects");
+// Time checks aren't free, so slices only look at the clock after tracing
+// this many objects, or sweeping a page.
+#define ORBIT_GC_CHECK_INTERVAL 64
+
+// Number of pages each allocation sweeps while a collection without a pause
+// budget is sweeping.
+#define ORBIT_GC_SWEEP_CHUNK 1
+
+// Number of grey objects each marking thread can share with the others. The
+// rest wait in its own worklist until it has room again.
+#define ORBIT_GC_DEQUE_SIZE 4096
+
+// A Chase-Lev deque with a fixed size ("Correct and Efficient Work-Stealing
+// for Weak Memory Models", Le et al. 2013). The thread that owns it pushes and
+// takes at the bottom, the others steal from the top.
+typedef struct {
+    int64_t         top;
+    int64_t         bottom;
+    OrbitGCObject*  slots[ORBIT_GC_DEQUE_SIZE];
+} OrbitGCDeque;
+
+typedef struct _OrbitGCMarking OrbitGCMarking;
+
+// What one thread marks with. Without a deque, marking is done by the VM's
+// thread alone and grey objects all go in [grey].
+typedef struct {
+    OrbitVM*            vm;
+    OrbitGCWorklist*    grey;
+    OrbitGCDeque*       deque;
+    uint64_t            marked;
+    uint64_t            promoted;
+    OrbitGCMarking*     marking;
+    uint32_t            index;
+} OrbitGCMarker;
+
+static inline OrbitGCMarker orbit_gcMarker(OrbitVM* vm) {
+    OrbitGCMarker marker = {vm, &vm->gcGrey, NULL, 0, 0, NULL, 0};
+    return marker;
+}
+
+static uint64_t orbit_gcTrace(OrbitGCMarker* marker, OrbitGCObject* obj);
+
+// Traces [obj], and counts its size as marked, and as promoted if it is young.
+static inline void orbit_gcTraceGrey(OrbitGCMarker* marker, OrbitGCObject* obj) {
+    uint64_t size = orbit_gcTrace(marker, obj);
+    marker->marked += size;
+    if(!obj->old) { marker->promoted += size; }
+}
+
+static void orbit_gcPushGrey(OrbitGCWorklist* grey, OrbitGCObject* obj) {
+    if(grey->count == grey->capacity) {
+        grey->capacity = grey->capacity ? grey->capacity * 2 : 256;
+        grey->objects = ORBIT_REALLOC_ARRAY(grey->objects, OrbitGCObject*, grey->capacity);
+    }
+    grey->objects[grey->count++] = obj;
+}
+
+#ifdef ORBIT_GC_PARALLEL
+static bool orbit_gcDequePush(OrbitGCDeque* deque, OrbitGCObject* obj) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+    if(bottom - top >= ORBIT_GC_DEQUE_SIZE) { return false; }
+    __atomic_store_n(&deque->slots[bottom % ORBIT_GC_DEQUE_SIZE], obj, __ATOMIC_RELAXED);
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static OrbitGCObject* orbit_gcDequeTake(OrbitGCDeque* deque) {
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&deque->bottom, bottom, __ATOMIC_SEQ_CST);
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+    if(top > bottom) {
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
     
-    vm->allocated = 0;
+    // The last object can be stolen while we take it, and only one of us
+    // gets it.
+    OrbitGCObject* obj = __atomic_load_n(&deque->slots[bottom % ORBIT_GC_DEQUE_SIZE], __ATOMIC_RELAXED);
+    if(top == bottom) {
+        if(!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            obj = NULL;
+        }
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+    return obj;
+}
+
+static OrbitGCObject* orbit_gcDequeSteal(OrbitGCDeque* deque) {
+    int64_t top = __atomic_load_n(&deque->top, __ATOMIC_SEQ_CST);
+    int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_SEQ_CST);
+    if(top >= bottom) { return NULL; }
     
-    // mark everything used by the current execution context
+    OrbitGCObject* obj = __atomic_load_n(&deque->slots[top % ORBIT_GC_DEQUE_SIZE], __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return obj;
+}
+
+static inline bool orbit_gcDequeEmpty(OrbitGCDeque* deque) {
+    return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE)
+           >= __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+#endif
+
+// Marks [obj] grey if it wasn't marked yet.
+static inline void orbit_gcShade(OrbitGCMarker* marker, OrbitGCObject* obj) {
+    if(obj == NULL) return;
+    // Minor collections stop at old objects, which are all considered live.
+    if(marker->vm->gcMinor && obj->old) return;
+    
+#ifdef ORBIT_GC_PARALLEL
+    // When threads mark in parallel, only the one that sets the mark bit
+    // traces the object.
+    if(marker->deque) {
+        if(!orbit_heapMarkAtomic(obj)) return;
+        if(!orbit_gcDequePush(marker->deque, obj)) {
+            orbit_gcPushGrey(marker->grey, obj);
+        }
+        return;
+    }
+#endif
+    if(!orbit_heapMark(obj)) return;
+    orbit_gcPushGrey(marker->grey, obj);
+}
+
+static inline void orbit_gcShadeValue(OrbitGCMarker* marker, OrbitValue value) {
+    if(!IS_OBJECT(value)) return;
+    orbit_gcShade(marker, AS_OBJECT(value));
+}
+
+#ifdef ORBIT_GC_PARALLEL
+// State shared by the threads marking in parallel. [active] counts the ones
+// that were started, and marking is done once they are all [idle].
+struct _OrbitGCMarking {
+    OrbitGCMarker*  markers;
+    uint32_t        count;
+    uint32_t        active;
+    uint32_t        idle;
+};
+
+// Moves what fits of [marker]'s worklist to its deque, where other threads
+// can steal it.
+static void orbit_gcShare(OrbitGCMarker* marker) {
+    OrbitGCWorklist* grey = marker->grey;
+    while(grey->count && orbit_gcDequePush(marker->deque, grey->objects[grey->count-1])) {
+        grey->count -= 1;
+    }
+}
+
+static OrbitGCObject* orbit_gcNextGrey(OrbitGCMarker* marker) {
+    OrbitGCObject* obj = orbit_gcDequeTake(marker->deque);
+    if(obj) { return obj; }
+    
+    OrbitGCWorklist* grey = marker->grey;
+    if(grey->count) {
+        obj = grey->objects[--grey->count];
+        orbit_gcShare(marker);
+        return obj;
+    }
+    
+    OrbitGCMarking* marking = marker->marking;
+    for(uint32_t i = 1; i < marking->count; ++i) {
+        OrbitGCMarker* victim = &marking->markers[(marker->index + i) % marking->count];
+        obj = orbit_gcDequeSteal(victim->deque);
+        if(obj) { return obj; }
+    }
+    return NULL;
+}
+
+static bool orbit_gcWorkLeft(OrbitGCMarking* marking) {
+    for(uint32_t i = 0; i < marking->count; ++i) {
+        if(!orbit_gcDequeEmpty(marking->markers[i].deque)) { return true; }
+    }
+    return false;
+}
+
+// Traces grey objects until there are none left in any thread. Only the thread
+// that owns a worklist pushes to it, so a thread with nothing to take or steal
+// can only get more work from another that isn't idle yet.
+static void orbit_gcMarkParallel(OrbitGCMarker* marker) {
+    OrbitGCMarking* marking = marker->marking;
+    for(;;) {
+        OrbitGCObject* obj;
+        while((obj = orbit_gcNextGrey(marker))) {
+            orbit_gcTraceGrey(marker, obj);
+        }
+        
+        __atomic_add_fetch(&marking->idle, 1, __ATOMIC_SEQ_CST);
+        for(;;) {
+            uint32_t idle = __atomic_load_n(&marking->idle, __ATOMIC_SEQ_CST);
+            if(idle == __atomic_load_n(&marking->active, __ATOMIC_SEQ_CST)) { return; }
+            if(orbit_gcWorkLeft(marking)) { break; }
+            sched_yield();
+        }
+        __atomic_sub_fetch(&marking->idle, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void* orbit_gcMarkWorker(void* data) {
+    orbit_gcMarkParallel(data);
+    return NULL;
+}
+
+// Traces the VM's grey objects with [gcMarkThreads] threads, the calling one
+// included. The roots are grey when this starts, so tasks, modules and retained
+// objects are shared between threads like everything else.
+static void orbit_gcDrainParallel(OrbitVM* vm) {
+    uint32_t count = vm->gcMarkThreads;
+    OrbitGCMarking marking = {NULL, count, 1, 0};
+    marking.markers = ORBIT_ALLOC_ARRAY(OrbitGCMarker, count);
+    OrbitGCWorklist* worklists = ORBIT_ALLOC_ARRAY(OrbitGCWorklist, count);
+    pthread_t* threads = ORBIT_ALLOC_ARRAY(pthread_t, count);
+    bool* started = ORBIT_ALLOC_ARRAY(bool, count);
+    
+    for(uint32_t i = 0; i < count; ++i) {
+        OrbitGCMarker* marker = &marking.markers[i];
+        worklists[i].objects = NULL;
+        worklists[i].count = worklists[i].capacity = 0;
+        marker->vm = vm;
+        marker->grey = i ? &worklists[i] : &vm->gcGrey;
+        marker->deque = ORBIT_ALLOC(OrbitGCDeque);
+        marker->deque->top = marker->deque->bottom = 0;
+        marker->marked = marker->promoted = 0;
+        marker->marking = &marking;
+        marker->index = i;
+    }
+    orbit_gcShare(&marking.markers[0]);
+    
+    // A thread that can't be started doesn't count, and its deque stays empty.
+    for(uint32_t i = 1; i < count; ++i) {
+        __atomic_add_fetch(&marking.active, 1, __ATOMIC_SEQ_CST);
+        started[i] = pthread_create(&threads[i], NULL, orbit_gcMarkWorker, &marking.markers[i]) == 0;
+        if(!started[i]) {
+            __atomic_sub_fetch(&marking.active, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+    orbit_gcMarkParallel(&marking.markers[0]);
+    
+    for(uint32_t i = 1; i < count; ++i) {
+        if(started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    for(uint32_t i = 0; i < count; ++i) {
+        vm->gcMarked += marking.markers[i].marked;
+        vm->gcStats.promotedBytes += marking.markers[i].promoted;
+        orbit_dealloc(marking.markers[i].deque);
+        orbit_dealloc(worklists[i].objects);
+    }
+    orbit_dealloc(marking.markers);
+    orbit_dealloc(worklists);
+    orbit_dealloc(threads);
+    orbit_dealloc(started);
+}
+#endif
+
+// Marks everything used by the current execution context.
+static void orbit_gcMarkRoots(OrbitVM* vm) {
     orbit_gcMarkObject(vm, (OrbitGCObject*)vm->task);
     orbit_gcMarkObject(vm, (OrbitGCObject*)vm->dispatchTable);
     orbit_gcMarkObject(vm, (OrbitGCObject*)vm->classes);
     orbit_gcMarkObject(vm, (OrbitGCObject*)vm->modules);
     
+    // mark the tasks waiting to run. Suspended tasks that aren't in the queue
+    // are waiting for another task, and are marked with it.
+    for(OrbitVMTask* task = vm->runQueue; task; task = task->next) {
+        orbit_gcMarkObject(vm, (OrbitGCObject*)task);
+    }
+    
+    // mark what prepared calls need to run again
+    for(OrbitVMCall* call = vm->calls; call; call = call->next) {
+        orbit_gcMarkObject(vm, (OrbitGCObject*)call->function);
+        orbit_gcMarkObject(vm, (OrbitGCObject*)call->task);
+        orbit_gcMark(vm, call->result);
+        
+        // A batch's results are only seen by the host, and its arguments
+        // haven't been copied into the task yet.
+        if(!call->batchResults) { continue; }
+        uint32_t arity = call->function->arity;
+        for(uint32_t i = 0; i < call->batchDone; ++i) {
+            orbit_gcMark(vm, call->batchResults[i]);
+        }
+        for(uint32_t i = call->batchDone * arity; i < call->batchCount * arity; ++i) {
+            orbit_gcMark(vm, call->batchArgs[i]);
+        }
+    }
+    
     // mark the retained objects
     for(uint8_t i = 0; i < vm->gcStackSize; ++i) {
         orbit_gcMarkObject(vm, vm->gcStack[i]);
     }
+}
+
+// Traces grey objects until there are none left, and returns true, or until
+// [deadline] passes if it isn't 0.
+static bool orbit_gcDrain(OrbitVM* vm, uint64_t deadline) {
+#ifdef ORBIT_GC_PARALLEL
+    // Starting threads costs more than a slice is allowed to take, and minor
+    // collections don't have enough to trace to make up for it.
+    if(!deadline && !vm->gcMinor && vm->gcMarkThreads > 1 && vm->gcGrey.count) {
+        orbit_gcDrainParallel(vm);
+        return true;
+    }
+#endif
+    OrbitGCMarker marker = orbit_gcMarker(vm);
+    uint32_t work = 0;
+    bool done = true;
+    while(vm->gcGrey.count) {
+        if(deadline && ++work % ORBIT_GC_CHECK_INTERVAL == 0 && orbit_vmClock() > deadline) {
+            done = false;
+            break;
+        }
+        orbit_gcTraceGrey(&marker, vm->gcGrey.objects[--vm->gcGrey.count]);
+    }
+    vm->gcMarked += marker.marked;
+    vm->gcStats.promotedBytes += marker.promoted;
+    return done;
+}
+
+static inline bool orbit_gcAlwaysRemembered(const OrbitGCObject* object) {
+    return object->kind == ORBIT_OBJK_TASK || object->kind == ORBIT_OBJK_MODULE;
+}
+
+void orbit_gcRemember(OrbitVM* vm, OrbitGCObject* object) {
+    assert(vm != NULL && "Null instance error");
+    assert(object != NULL && "Null instance error");
+    if(object->remembered) { return; }
     
+    // The set isn't allocated through the VM, so growing it can't start a
+    // collection in the middle of a store.
+    if(vm->gcRememberedCount == vm->gcRememberedCapacity) {
+        vm->gcRememberedCapacity = vm->gcRememberedCapacity ? vm->gcRememberedCapacity * 2 : 64;
+        vm->gcRemembered = ORBIT_REALLOC_ARRAY(vm->gcRemembered, OrbitGCObject*,
+                                               vm->gcRememberedCapacity);
+    }
+    object->remembered = true;
+    vm->gcRemembered[vm->gcRememberedCount++] = object;
+}
+
+// Only keeps the tasks and modules that survive the collection in the
+// remembered set, which are marked, or old if it is a minor one. Every other
+// object in it ends up old and pointing to old objects.
+static void orbit_gcForget(OrbitVM* vm, bool minor) {
+    uint64_t kept = 0;
+    for(uint64_t i = 0; i < vm->gcRememberedCount; ++i) {
+        OrbitGCObject* object = vm->gcRemembered[i];
+        if(orbit_gcAlwaysRemembered(object) && (orbit_heapMarked(object) || (minor && object->old))) {
+            vm->gcRemembered[kept++] = object;
+        } else {
+            object->remembered = false;
+        }
+    }
+    vm->gcRememberedCount = kept;
+}
+
+// The heap only grows between collections, so its peak is checked when one
+// starts rather than by the allocator.
+static inline void orbit_gcPeak(OrbitVM* vm) {
+    if(vm->allocated > vm->gcStats.peakHeap) { vm->gcStats.peakHeap = vm->allocated; }
+}
+
+static void orbit_gcBeginMark(OrbitVM* vm) {
+    GCDBG("gc run: kick (%llu)", vm->allocated);
+    orbit_gcPeak(vm);
+    vm->gcStats.collections += 1;
+    vm->gcPhase = ORBIT_GC_MARK;
+    vm->gcMarked = 0;
+    vm->gcStartAllocated = vm->allocated;
+    orbit_gcMarkRoots(vm);
+}
+
+// Marking is done once there is nothing grey left after the roots, tasks and
+// modules, which are written without a barrier, have been traced again. This
+// part can't be split.
+static void orbit_gcFinishMark(OrbitVM* vm) {
     GCDBG("gc run: sweeping");
+    OrbitGCMarker marker = orbit_gcMarker(vm);
+    orbit_gcMarkRoots(vm);
+    for(uint64_t i = 0; i < vm->gcRememberedCount; ++i) {
+        OrbitGCObject* object = vm->gcRemembered[i];
+        if(orbit_gcAlwaysRemembered(object) && orbit_heapMarked(object)) {
+            orbit_gcTrace(&marker, object);
+        }
+    }
+    orbit_gcDrain(vm, 0);
+    
+    // Every survivor ends up old, so nothing old points to a young object any
+    // more.
+    orbit_gcForget(vm, false);
+    
+    // What was allocated while marking is all live.
+    uint64_t before = vm->allocated;
+    vm->allocated = vm->gcMarked + (vm->allocated - vm->gcStartAllocated);
+    for(OrbitVMCall* call = vm->calls; call; call = call->next) {
+        vm->allocated += sizeof(OrbitVMCall);
+    }
+    if(before > vm->allocated) { vm->gcStats.freedBytes += before - vm->allocated; }
     
+    orbit_heapBeginSweep(&vm->heap);
+    vm->nurseryAllocated = 0;
+    vm->gcPhase = ORBIT_GC_SWEEP;
+}
+
+// Sweeps the heap until [deadline] passes if it isn't 0, or [limit] pages
+// were swept, and ends the collection once every page was. Surviving objects
+// are promoted without being copied: the host and the interpreter hold raw
+// object pointers across allocations, so objects never move.
+static void orbit_gcSweepPages(OrbitVM* vm, uint64_t deadline, uint64_t limit) {
 // basic Mark-sweep algorithm from 
 // http://journal.stuffwithstuff.com/2013/12/08/babys-first-garbage-collector/
-    OrbitGCObject** obj = &vm->gcHead;
-    while(*obj) {
-        if(!(*obj)->mark) {
-            OrbitGCObject* garbage = *obj;
-            *obj = garbage->next;
-            orbit_gcDeallocate(vm, garbage);
-        } else {
-            (*obj)->mark = false;
-            obj = &(*obj)->next;
-        }
-    }
+    if(!orbit_heapSweep(vm, deadline, limit)) { return; }
     
     GCDBG("gc run: done (%llu)", vm->allocated);
+    vm->gcPhase = ORBIT_GC_IDLE;
     vm->nextGC = vm->allocated * 2;
 }
 
-static inline void orbit_markClass(OrbitVM* vm, OrbitGCClass* class) {
-    vm->allocated += sizeof(OrbitGCClass);
-    orbit_gcMarkObject(vm, (OrbitGCObject*)class->name);
-    orbit_gcMarkObject(vm, (OrbitGCObject*)class->methods);
+// Runs the collection in progress until [deadline] passes if it isn't 0, or
+// until it is done.
+static void orbit_gcAdvance(OrbitVM* vm, uint64_t deadline) {
+    if(vm->gcPhase == ORBIT_GC_MARK) {
+        if(!orbit_gcDrain(vm, deadline)) { return; }
+        orbit_gcFinishMark(vm);
+    }
+    orbit_gcSweepPages(vm, deadline, UINT64_MAX);
+}
+
+static inline uint64_t orbit_gcDeadline(OrbitVM* vm) {
+    return vm->gcBudget ? orbit_vmClock() + vm->gcBudget * 1000ull : 0;
+}
+
+// Counts a pause of the mutator that started at [start] in [vm]'s histogram.
+static void orbit_gcPause(OrbitVM* vm, uint64_t start) {
+    uint64_t pause = orbit_vmClock() - start;
+    uint32_t bucket = 0;
+    for(uint64_t us = pause / 1000; us && bucket < ORBIT_GC_PAUSE_BUCKETS - 1; us >>= 1) {
+        bucket += 1;
+    }
+    vm->gcStats.pauses[bucket] += 1;
+    vm->gcStats.pauseTotal += pause;
+    if(pause > vm->gcStats.pauseMax) { vm->gcStats.pauseMax = pause; }
+}
+
+void orbit_gcRun(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    ORBIT_TRACE(vm, ORBIT_TRACE_GC_START, NULL, vm->task, vm->allocated);
+    uint64_t start = orbit_vmClock();
+    
+    // Objects allocated since a collection started are kept by it, so it is
+    // finished before one that can free them.
+    if(vm->gcPhase != ORBIT_GC_IDLE) {
+        orbit_gcAdvance(vm, 0);
+    }
+    orbit_gcBeginMark(vm);
+    orbit_gcAdvance(vm, 0);
+    
+    orbit_gcPause(vm, start);
+    ORBIT_TRACE(vm, ORBIT_TRACE_GC_END, NULL, vm->task, vm->allocated);
+}
+
+void orbit_gcStart(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    if(vm->gcPhase != ORBIT_GC_IDLE) { return; }
+    ORBIT_TRACE(vm, ORBIT_TRACE_GC_START, NULL, vm->task, vm->allocated);
+    uint64_t start = orbit_vmClock();
+    
+    // Without a budget, the heap is marked in one go, and swept a little by
+    // each allocation that follows instead of before the mutator resumes.
+    uint64_t deadline = orbit_gcDeadline(vm);
+    orbit_gcBeginMark(vm);
+    if(deadline) {
+        orbit_gcAdvance(vm, deadline);
+    } else {
+        orbit_gcDrain(vm, 0);
+        orbit_gcFinishMark(vm);
+    }
+    vm->gcNextStep = vm->allocated + ORBIT_GC_STEP_SIZE;
+    
+    orbit_gcPause(vm, start);
+    ORBIT_TRACE(vm, ORBIT_TRACE_GC_END, NULL, vm->task, vm->allocated);
+}
+
+void orbit_gcStep(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    if(vm->gcPhase == ORBIT_GC_IDLE) { return; }
+    if(vm->gcPhase == ORBIT_GC_SWEEP && !vm->gcBudget) {
+        orbit_gcSweepPages(vm, 0, ORBIT_GC_SWEEP_CHUNK);
+        return;
+    }
+    if(vm->allocated < vm->gcNextStep) { return; }
+    ORBIT_TRACE(vm, ORBIT_TRACE_GC_START, NULL, vm->task, vm->allocated);
+    uint64_t start = orbit_vmClock();
+    
+    orbit_gcAdvance(vm, orbit_gcDeadline(vm));
+    vm->gcNextStep = vm->allocated + ORBIT_GC_STEP_SIZE;
+    
+    orbit_gcPause(vm, start);
+    ORBIT_TRACE(vm, ORBIT_TRACE_GC_END, NULL, vm->task, vm->allocated);
+}
+
+void orbit_gcSetPauseBudget(OrbitVM* vm, uint32_t microseconds) {
+    assert(vm != NULL && "Null instance error");
+    vm->gcBudget = microseconds;
+}
+
+void orbit_gcSetMarkThreads(OrbitVM* vm, uint32_t count) {
+    assert(vm != NULL && "Null instance error");
+    assert(count > 0 && "marking needs at least one thread");
+    vm->gcMarkThreads = count;
+}
+
+void orbit_gcRunMinor(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    if(vm->gcPhase != ORBIT_GC_IDLE) { return; }
+    GCDBG("gc minor: kick (%llu)", vm->nurseryAllocated);
+    ORBIT_TRACE(vm, ORBIT_TRACE_GC_START, NULL, vm->task, vm->allocated);
+    uint64_t start = orbit_vmClock();
+    orbit_gcPeak(vm);
+    vm->gcStats.minorCollections += 1;
+    
+    // Old objects aren't marked, so only the young survivors are counted. What
+    // was allocated since the last collection is replaced by their size.
+    uint64_t oldSize = vm->allocated - vm->nurseryAllocated;
+    vm->gcMarked = 0;
+    vm->gcMinor = true;
+    OrbitGCMarker marker = orbit_gcMarker(vm);
+    orbit_gcMarkRoots(vm);
+    for(uint64_t i = 0; i < vm->gcRememberedCount; ++i) {
+        OrbitGCObject* object = vm->gcRemembered[i];
+        if(object->old) {
+            orbit_gcTrace(&marker, object);
+        }
+    }
+    orbit_gcDrain(vm, 0);
+    vm->gcMinor = false;
+    
+    orbit_gcForget(vm, true);
+    orbit_heapSweepYoung(vm);
+    
+    uint64_t before = vm->allocated;
+    vm->allocated = oldSize + vm->gcMarked;
+    vm->nurseryAllocated = 0;
+    if(before > vm->allocated) { vm->gcStats.freedBytes += before - vm->allocated; }
+    GCDBG("gc minor: done (%llu)", vm->allocated);
+    orbit_gcPause(vm, start);
+    ORBIT_TRACE(vm, ORBIT_TRACE_GC_END, NULL, vm->task, vm->allocated);
+}
+
+// Sizes of objects, as counted in the VM's [allocated] bytes.
+static inline uint64_t orbit_sizeString(const OrbitGCString* string) {
+    return sizeof(OrbitGCString) + string->length + 1;
+}
+
+static inline uint64_t orbit_sizeInstance(const OrbitGCInstance* instance) {
+    return sizeof(OrbitGCInstance)
+           + instance->base.class->fieldCount * sizeof(OrbitValue);
+}
+
+static inline uint64_t orbit_sizeMap(const OrbitGCMap* map) {
+    return sizeof(OrbitGCMap) + sizeof(OrbitGCMapEntry) * map->capacity;
+}
+
+static inline uint64_t orbit_sizeArray(const OrbitGCArray* array) {
+    return sizeof(OrbitGCArray) + sizeof(OrbitValue) * array->capacity;
+}
+
+static inline uint64_t orbit_sizeFunction(const OrbitVMFunction* function) {
+    uint64_t size = sizeof(OrbitVMFunction);
+    if(function->kind == ORBIT_FK_NATIVE) {
+        // Code shared with other VMs doesn't belong to this one's heap.
+        if(!(function->native.shared & ORBIT_SHARED_BYTECODE)) {
+            size += function->native.byteCodeLength;
+        }
+        if(function->native.threadedCode) {
+            size += sizeof(void*) * (function->native.byteCodeLength + 1);
+        }
+        if(function->native.quickened) {
+            size += function->native.byteCodeLength;
+        }
+        size += sizeof(uint32_t) * function->native.regCodeLength;
+    }
+    return size;
+}
+
+static inline uint64_t orbit_sizeModule(const OrbitVMModule* module) {
+    return sizeof(OrbitVMModule) + (module->globalCount * sizeof(OrbitVMGlobal));
+}
+
+static inline uint64_t orbit_sizeTask(const OrbitVMTask* task) {
+    // Guarded stacks are mostly reserved address space, so we only count what
+    // is in use.
+    return sizeof(OrbitVMTask)
+           + sizeof(OrbitVMFrame) * task->frameCount
+           + sizeof(OrbitValue) * (task->sp - task->stack);
+}
+
+static uint64_t orbit_gcSizeOf(const OrbitGCObject* obj) {
+    switch(obj->kind) {
+    case ORBIT_OBJK_CLASS:
+        return sizeof(OrbitGCClass);
+    case ORBIT_OBJK_INSTANCE:
+        return orbit_sizeInstance((const OrbitGCInstance*)obj);
+    case ORBIT_OBJK_STRING:
+        return orbit_sizeString((const OrbitGCString*)obj);
+    case ORBIT_OBJK_MAP:
+        return orbit_sizeMap((const OrbitGCMap*)obj);
+    case ORBIT_OBJK_ARRAY:
+        return orbit_sizeArray((const OrbitGCArray*)obj);
+    case ORBIT_OBJK_FUNCTION:
+        return orbit_sizeFunction((const OrbitVMFunction*)obj);
+    case ORBIT_OBJK_MODULE:
+        return orbit_sizeModule((const OrbitVMModule*)obj);
+    case ORBIT_OBJK_TASK:
+        return orbit_sizeTask((const OrbitVMTask*)obj);
+    }
+    return 0;
 }
 
-static inline void orbit_markString(OrbitVM* vm, OrbitGCString* string) {
-    vm->allocated += sizeof(OrbitGCString) + string->length + 1;
+static inline uint64_t orbit_markClass(OrbitGCMarker* marker, OrbitGCClass* class) {
+    orbit_gcShade(marker, (OrbitGCObject*)class->name);
+    orbit_gcShade(marker, (OrbitGCObject*)class->methods);
+    return sizeof(OrbitGCClass);
 }
 
-static inline void orbit_markInstance(OrbitVM* vm, OrbitGCInstance* instance) {
+static inline uint64_t orbit_markString(OrbitGCMarker* marker, OrbitGCString* string) {
+    return orbit_sizeString(string);
+}
+
+static inline uint64_t orbit_markInstance(OrbitGCMarker* marker, OrbitGCInstance* instance) {
     // mark objects pointed to by the fields of the instance.
     for(uint16_t i = 0; i < instance->base.class->fieldCount; ++i) {
-        orbit_gcMark(vm, instance->fields[i]);
+        orbit_gcShadeValue(marker, instance->fields[i]);
     }
     // mark the class .
-    orbit_gcMarkObject(vm, (OrbitGCObject*)instance->base.class);
+    orbit_gcShade(marker, (OrbitGCObject*)instance->base.class);
     
-    vm->allocated += sizeof(OrbitGCInstance)
-                    + instance->base.class->fieldCount * sizeof(OrbitValue);
+    return orbit_sizeInstance(instance);
 }
 
-static inline void orbit_markMap(OrbitVM* vm, OrbitGCMap* map) {
-    vm->allocated += sizeof(OrbitGCMap);
-    vm->allocated += sizeof(OrbitGCMapEntry) * map->capacity;
-    
+static inline uint64_t orbit_markMap(OrbitGCMarker* marker, OrbitGCMap* map) {
     for(uint32_t i = 0; i < map->capacity; ++i) {
         if(IS_NIL(map->data[i].key)) continue;
-        orbit_gcMark(vm, map->data[i].key);
-        orbit_gcMark(vm, map->data[i].value);
+        orbit_gcShadeValue(marker, map->data[i].key);
+        orbit_gcShadeValue(marker, map->data[i].value);
     }
+    return orbit_sizeMap(map);
 }
 
-static inline void orbit_markArray(OrbitVM* vm, OrbitGCArray* array) {
-    vm->allocated += sizeof(OrbitGCArray);
-    vm->allocated += sizeof(OrbitValue) * array->capacity;
-    
+static inline uint64_t orbit_markArray(OrbitGCMarker* marker, OrbitGCArray* array) {
     for(uint32_t i = 0; i < array->size; ++i) {
-        orbit_gcMark(vm, array->data[i]);
+        orbit_gcShadeValue(marker, array->data[i]);
     }
+    return orbit_sizeArray(array);
 }
 
-static inline void orbit_markFunction(OrbitVM* vm, OrbitVMFunction* function) {
-    vm->allocated += sizeof(OrbitVMFunction);
-    orbit_gcMarkObject(vm, (OrbitGCObject*)function->module);
-    if(function->kind == ORBIT_FK_NATIVE) {
-        vm->allocated += function->native.byteCodeLength;
-    }
+static inline uint64_t orbit_markFunction(OrbitGCMarker* marker, OrbitVMFunction* function) {
+    orbit_gcShade(marker, (OrbitGCObject*)function->module);
+    return orbit_sizeFunction(function);
 }
 
-static inline void orbit_markModule(OrbitVM* vm, OrbitVMModule* module) {
-    vm->allocated += sizeof(OrbitVMModule)
-                   + (module->globalCount * sizeof(OrbitVMGlobal));
-    
+static inline uint64_t orbit_markModule(OrbitGCMarker* marker, OrbitVMModule* module) {
     for(uint16_t i = 0; i < module->globalCount; ++i) {
-        orbit_gcMark(vm, module->globals[i].name);
-        orbit_gcMark(vm, module->globals[i].global);
+        orbit_gcShadeValue(marker, module->globals[i].name);
+        orbit_gcShadeValue(marker, module->globals[i].global);
     }
     
     for(uint16_t i = 0; i < module->constantCount; ++i) {
-        orbit_gcMark(vm, module->constants[i]);
+        orbit_gcShadeValue(marker, module->constants[i]);
     }
+    return orbit_sizeModule(module);
 }
 
-static inline void orbit_markTask(OrbitVM* vm, OrbitVMTask* task) {
-    vm->allocated += sizeof(OrbitVMTask);
-    vm->allocated += sizeof(OrbitVMFrame) * task->frameCapacity;
-    vm->allocated += sizeof(OrbitValue) * task->stackCapacity;
-    
+static inline uint64_t orbit_markTask(OrbitGCMarker* marker, OrbitVMTask* task) {
     // mark the stack
     for(OrbitValue* val = task->stack; val < task->sp; val++) {
-        orbit_gcMark(vm, *val);
+        orbit_gcShadeValue(marker, *val);
     }
     
     // mark the call frames
     for(uint32_t i = 0; i < task->frameCount; ++i) {
-        orbit_gcMarkObject(vm, (OrbitGCObject*)task->frames[i].function);
+        orbit_gcShade(marker, (OrbitGCObject*)task->frames[i].function);
     }
+    
+    // mark the result, and the tasks waiting for this one to finish
+    orbit_gcShadeValue(marker, task->result);
+    for(OrbitVMTask* waiter = task->waiters; waiter; waiter = waiter->next) {
+        orbit_gcShade(marker, (OrbitGCObject*)waiter);
+    }
+    return orbit_sizeTask(task);
 }
 
-void orbit_gcMarkObject(OrbitVM* vm, OrbitGCObject* obj) {
-    if(obj == NULL) return;
-    if(obj->mark) return;
-    
-    obj->mark = true;
-    
+// Marks the objects [obj] points to, and returns its size.
+static uint64_t orbit_gcTrace(OrbitGCMarker* marker, OrbitGCObject* obj) {
     switch(obj->kind) {
     case ORBIT_OBJK_CLASS:
-        orbit_markClass(vm, (OrbitGCClass*)obj);
-        break;
+        return orbit_markClass(marker, (OrbitGCClass*)obj);
     case ORBIT_OBJK_INSTANCE:
-        orbit_markInstance(vm, (OrbitGCInstance*)obj);
-        break;
+        return orbit_markInstance(marker, (OrbitGCInstance*)obj);
     case ORBIT_OBJK_STRING:
-        orbit_markString(vm, (OrbitGCString*)obj);
-        break;
+        return orbit_markString(marker, (OrbitGCString*)obj);
     case ORBIT_OBJK_MAP:
-        orbit_markMap(vm, (OrbitGCMap*)obj);
-        break;
+        return orbit_markMap(marker, (OrbitGCMap*)obj);
     case ORBIT_OBJK_ARRAY:
-        orbit_markArray(vm, (OrbitGCArray*)obj);
-        break;
+        return orbit_markArray(marker, (OrbitGCArray*)obj);
     case ORBIT_OBJK_FUNCTION:
-        orbit_markFunction(vm, (OrbitVMFunction*)obj);
-        break;
+        return orbit_markFunction(marker, (OrbitVMFunction*)obj);
     case ORBIT_OBJK_MODULE:
-        orbit_markModule(vm, (OrbitVMModule*)obj);
-        break;
+        return orbit_markModule(marker, (OrbitVMModule*)obj);
     case ORBIT_OBJK_TASK:
-        orbit_markTask(vm, (OrbitVMTask*)obj);
-        break;
+        return orbit_markTask(marker, (OrbitVMTask*)obj);
     }
+    return 0;
+}
+
+void orbit_gcMarkObject(OrbitVM* vm, OrbitGCObject* obj) {
+    OrbitGCMarker marker = orbit_gcMarker(vm);
+    orbit_gcShade(&marker, obj);
 }
 
 void orbit_gcMark(OrbitVM* vm, OrbitValue value) {
     if(!IS_OBJECT(value)) return;
     orbit_gcMarkObject(vm, AS_OBJECT(value));
 }
+
+void orbit_gcStats(OrbitVM* vm, OrbitGCStats* stats) {
+    assert(vm != NULL && "Null instance error");
+    assert(stats != NULL && "Null instance error");
+    orbit_gcPeak(vm);
+    *stats = vm->gcStats;
+}
+
+static const char* orbit_gcKindNames[ORBIT_OBJK_COUNT] = {
+    "class", "instance", "string", "map", "array", "function", "module", "task",
+};
+
+// Classes found so far are hashed by address to their entry in the census. The
+// table has twice as many slots as the census has room for entries.
+typedef struct {
+    const OrbitGCClass* class;
+    uint32_t            entry;
+} OrbitGCCensusSlot;
+
+typedef struct {
+    OrbitGCCensus*      census;
+    OrbitGCCensusSlot*  slots;
+    uint32_t            capacity;
+} OrbitGCCensusState;
+
+static OrbitGCCensusSlot* orbit_gcCensusSlot(OrbitGCCensusSlot* slots, uint32_t capacity,
+                                             const OrbitGCClass* class) {
+    uint32_t mask = capacity * 2 - 1;
+    uint32_t i = (uint32_t)(((uintptr_t)class >> 4) * 2654435761u) & mask;
+    while(slots[i].class && slots[i].class != class) { i = (i + 1) & mask; }
+    return &slots[i];
+}
+
+static void orbit_gcCensusGrow(OrbitGCCensusState* state) {
+    uint32_t capacity = state->capacity ? state->capacity * 2 : 16;
+    OrbitGCCensusSlot* slots = ORBIT_ALLOC_ARRAY(OrbitGCCensusSlot, capacity * 2);
+    memset(slots, 0, capacity * 2 * sizeof(OrbitGCCensusSlot));
+    for(uint32_t i = 0; i < state->capacity * 2; ++i) {
+        if(!state->slots[i].class) { continue; }
+        *orbit_gcCensusSlot(slots, capacity, state->slots[i].class) = state->slots[i];
+    }
+    orbit_dealloc(state->slots);
+    state->slots = slots;
+    state->capacity = capacity;
+    state->census->classes = ORBIT_REALLOC_ARRAY(state->census->classes, OrbitGCCensusEntry, capacity);
+}
+
+static void orbit_gcCensusVisit(OrbitGCObject* object, void* data) {
+    OrbitGCCensusState* state = data;
+    OrbitGCCensus* census = state->census;
+    uint64_t size = orbit_gcSizeOf(object);
+    census->kinds[object->kind].objects += 1;
+    census->kinds[object->kind].bytes += size;
+    if(!object->class) { return; }
+    
+    if(census->classCount == state->capacity) { orbit_gcCensusGrow(state); }
+    OrbitGCCensusSlot* slot = orbit_gcCensusSlot(state->slots, state->capacity, object->class);
+    if(!slot->class) {
+        // Names are copied, so that the census outlives the classes.
+        OrbitGCCensusEntry* entry = &census->classes[census->classCount];
+        const OrbitGCString* name = object->class->name;
+        char* copy = NULL;
+        if(name) {
+            copy = ORBIT_ALLOC_ARRAY(char, name->length + 1);
+            memcpy(copy, name->data, name->length);
+            copy[name->length] = '\0';
+        }
+        entry->name = copy;
+        entry->objects = entry->bytes = 0;
+        slot->class = object->class;
+        slot->entry = census->classCount++;
+    }
+    census->classes[slot->entry].objects += 1;
+    census->classes[slot->entry].bytes += size;
+}
+
+void orbit_gcCensus(OrbitVM* vm, OrbitGCCensus* census) {
+    assert(vm != NULL && "Null instance error");
+    assert(census != NULL && "Null instance error");
+    for(uint32_t i = 0; i < ORBIT_OBJK_COUNT; ++i) {
+        census->kinds[i].name = orbit_gcKindNames[i];
+        census->kinds[i].objects = census->kinds[i].bytes = 0;
+    }
+    census->classes = NULL;
+    census->classCount = 0;
+    
+    // Dead objects on pages that weren't swept yet can point to classes that
+    // were already freed, so the collection in progress is finished first.
+    if(vm->gcPhase != ORBIT_GC_IDLE) {
+        uint64_t start = orbit_vmClock();
+        orbit_gcAdvance(vm, 0);
+        orbit_gcPause(vm, start);
+    }
+    
+    OrbitGCCensusState state = {census, NULL, 0};
+    orbit_heapVisit(&vm->heap, orbit_gcCensusVisit, &state);
+    orbit_dealloc(state.slots);
+}
+
+void orbit_gcCensusDeinit(OrbitGCCensus* census) {
+    assert(census != NULL && "Null instance error");
+    for(uint32_t i = 0; i < census->classCount; ++i) {
+        orbit_dealloc((char*)census->classes[i].name);
+    }
+    orbit_dealloc(census->classes);
+    census->classes = NULL;
+    census->classCount = 0;
+}
@@ -0,0 +1,401 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/heap.c - Size-segregated pages for garbage-collected objects
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-22 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  Objects live in pages of ORBIT_GC_PAGE_SIZE bytes aligned on their size,
+//  each holding slots of a single size class. What a page holds is kept on the
+//  side, in a bitmap with a bit per slot, so the collector finds objects by
+//  walking pages and the allocator never has to read a free slot.
+//
+//  The first word of a page points to its descriptor, which is how an object
+//  finds the page it is in. Objects too large for any class get a page of
+//  their own, which can be bigger than ORBIT_GC_PAGE_SIZE.
+//
+//  A class allocates from one page at a time, whose free slots are linked
+//  together when it is picked: allocating pops the first one and sets its
+//  bit. While a collection is sweeping, a page is swept before it is picked,
+//  so objects allocated meanwhile are never swept by it.
+//
+//  Mark bits are kept on the side too, next to the live ones. Sweeping a page
+//  works a word of each at a time, and only writes to the young objects that
+//  survived, to promote them: pages that only hold old objects, like the ones
+//  a forked process still shares with its parent, are never written to.
+//
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <orbit/runtime/gc.h>
+#include <orbit/runtime/vm.h>
+#include <orbit/utils/memory.h>
+#include "vm_private.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+// Free slots are poisoned in sanitized builds, so using an object after it
+// was collected is still reported.
+#if defined(__SANITIZE_ADDRESS__)
+#define ORBIT_HEAP_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define ORBIT_HEAP_ASAN
+#endif
+#endif
+
+#ifdef ORBIT_HEAP_ASAN
+#include <sanitizer/asan_interface.h>
+#define ORBIT_HEAP_POISON(ptr, size) ASAN_POISON_MEMORY_REGION((ptr), (size))
+#define ORBIT_HEAP_UNPOISON(ptr, size) ASAN_UNPOISON_MEMORY_REGION((ptr), (size))
+#else
+#define ORBIT_HEAP_POISON(ptr, size) ((void)0)
+#define ORBIT_HEAP_UNPOISON(ptr, size) ((void)0)
+#endif
+
+// Bytes at the start of each page, before the first slot.
+#define ORBIT_GC_PAGE_HEADER 16
+
+#if ORBIT_GC_PAGE_SIZE > (1 << 20)
+#error "ORBIT_GC_PAGE_SIZE must be at most 1MB"
+#endif
+
+// Size class of the pages that hold a single large object.
+#define ORBIT_GC_LARGE ORBIT_GC_SIZE_CLASSES
+
+static const uint16_t orbit_heapSizes[ORBIT_GC_SIZE_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+};
+
+void orbit_heapInit(OrbitGCHeap* heap) {
+    assert(heap != NULL && "Null instance error");
+    for(uint32_t i = 0; i < ORBIT_GC_SIZE_CLASSES; ++i) {
+        OrbitGCSizeClass* class = &heap->classes[i];
+        class->pages = class->scan = class->current = NULL;
+        class->free = NULL;
+        class->size = orbit_heapSizes[i];
+    }
+
+    uint8_t sizeClass = 0;
+    for(uint32_t i = 0; i <= ORBIT_GC_LARGE_SIZE / 16; ++i) {
+        while(orbit_heapSizes[sizeClass] < i * 16) { sizeClass += 1; }
+        heap->classOf[i] = sizeClass;
+    }
+    heap->pages = heap->young = heap->sweep = NULL;
+    heap->epoch = 0;
+}
+
+static inline uint32_t orbit_heapCountLive(const OrbitGCPage* page) {
+    uint32_t count = 0;
+    for(uint32_t i = 0; i < (page->slotCount + 63) / 64; ++i) {
+        count += __builtin_popcountll(page->live[i]);
+    }
+    return count;
+}
+
+static OrbitGCPage* orbit_heapNewPage(OrbitGCHeap* heap, uint8_t sizeClass, uint32_t slotSize) {
+    uint32_t slotCount = 1;
+    size_t blockSize = ORBIT_GC_PAGE_HEADER + slotSize;
+    if(sizeClass != ORBIT_GC_LARGE) {
+        slotCount = (ORBIT_GC_PAGE_SIZE - ORBIT_GC_PAGE_HEADER) / slotSize;
+        blockSize = ORBIT_GC_PAGE_SIZE;
+    }
+
+    uint8_t* block = NULL;
+#ifdef _WIN32
+    block = _aligned_malloc(blockSize, ORBIT_GC_PAGE_SIZE);
+#else
+    if(posix_memalign((void**)&block, ORBIT_GC_PAGE_SIZE, blockSize) != 0) { block = NULL; }
+#endif
+    if(!block) { orbit_die("error: cannot allocate heap page"); }
+
+    uint32_t words = (slotCount + 63) / 64;
+    OrbitGCPage* page = ORBIT_ALLOC_FLEX(OrbitGCPage, uint64_t, 2 * words);
+    memset(page->live, 0, 2 * words * sizeof(uint64_t));
+    page->marks = page->live + words;
+    *(OrbitGCPage**)block = page;
+    page->block = block;
+    page->slots = block + ORBIT_GC_PAGE_HEADER;
+    page->slotSize = slotSize;
+    page->slotCount = slotCount;
+    page->freeCount = slotCount;
+    page->reciprocal = (uint32_t)((1ull << 32) / slotSize + 1);
+    page->epoch = heap->epoch;
+    page->sizeClass = sizeClass;
+    page->young = false;
+    page->nextYoung = NULL;
+    ORBIT_HEAP_POISON(page->slots, (size_t)slotCount * slotSize);
+
+    page->previous = NULL;
+    page->next = heap->pages;
+    if(heap->pages) { heap->pages->previous = page; }
+    heap->pages = page;
+
+    page->previousInClass = page->nextInClass = NULL;
+    if(sizeClass != ORBIT_GC_LARGE) {
+        OrbitGCSizeClass* class = &heap->classes[sizeClass];
+        page->nextInClass = class->pages;
+        if(class->pages) { class->pages->previousInClass = page; }
+        class->pages = page;
+    }
+    return page;
+}
+
+static void orbit_heapReleasePage(OrbitGCHeap* heap, OrbitGCPage* page) {
+    if(page->previous) { page->previous->next = page->next; } else { heap->pages = page->next; }
+    if(page->next) { page->next->previous = page->previous; }
+    if(page->sizeClass != ORBIT_GC_LARGE) {
+        OrbitGCSizeClass* class = &heap->classes[page->sizeClass];
+        if(page->previousInClass) {
+            page->previousInClass->nextInClass = page->nextInClass;
+        } else {
+            class->pages = page->nextInClass;
+        }
+        if(page->nextInClass) { page->nextInClass->previousInClass = page->previousInClass; }
+    }
+
+    ORBIT_HEAP_UNPOISON(page->slots, (size_t)page->slotCount * page->slotSize);
+#ifdef _WIN32
+    _aligned_free(page->block);
+#else
+    free(page->block);
+#endif
+    orbit_dealloc(page);
+}
+
+static inline void orbit_heapMakeYoung(OrbitGCHeap* heap, OrbitGCPage* page) {
+    if(page->young) { return; }
+    page->young = true;
+    page->nextYoung = heap->young;
+    heap->young = page;
+}
+
+// Frees the objects in [page] that weren't marked, and promotes the others.
+// Old objects are left alone by minor collections.
+static void orbit_heapSweepPage(OrbitVM* vm, OrbitGCPage* page, bool minor) {
+    for(uint32_t i = 0; i < (page->slotCount + 63) / 64; ++i) {
+        uint64_t marked = page->live[i] & page->marks[i];
+        uint64_t dead = page->live[i] & ~page->marks[i];
+        page->marks[i] = 0;
+        while(marked) {
+            uint32_t index = i * 64 + __builtin_ctzll(marked);
+            marked &= marked - 1;
+            OrbitGCObject* object = (OrbitGCObject*)(page->slots + (size_t)index * page->slotSize);
+            if(!object->old) { object->old = true; }
+        }
+        while(dead) {
+            uint32_t index = i * 64 + __builtin_ctzll(dead);
+            dead &= dead - 1;
+            OrbitGCObject* object = (OrbitGCObject*)(page->slots + (size_t)index * page->slotSize);
+            if(minor && object->old) { continue; }
+            orbit_gcDeallocate(vm, object);
+        }
+    }
+    page->freeCount = page->slotCount - orbit_heapCountLive(page);
+    page->epoch = vm->heap.epoch;
+}
+
+// Picks the next page [class] allocates from, and links its free slots.
+static void* orbit_heapRefill(OrbitVM* vm, OrbitGCSizeClass* class, uint8_t sizeClass) {
+    OrbitGCHeap* heap = &vm->heap;
+    OrbitGCPage* page = class->scan;
+    while(page) {
+        if(page->epoch != heap->epoch) {
+            orbit_heapSweepPage(vm, page, false);
+        }
+        if(page->freeCount) { break; }
+        page = page->nextInClass;
+    }
+    if(page) {
+        class->scan = page->nextInClass;
+    } else {
+        page = orbit_heapNewPage(heap, sizeClass, class->size);
+        class->scan = NULL;
+    }
+
+    void* free = NULL;
+    for(uint32_t index = page->slotCount; index > 0; --index) {
+        if(page->live[(index-1) / 64] & (1ull << ((index-1) % 64))) { continue; }
+        void** slot = (void**)(page->slots + (size_t)(index-1) * page->slotSize);
+        ORBIT_HEAP_UNPOISON(slot, sizeof(void*));
+        *slot = free;
+        free = slot;
+    }
+    page->freeCount = 0;
+    class->current = page;
+    class->free = free;
+    orbit_heapMakeYoung(heap, page);
+    return free;
+}
+
+void* orbit_heapAllocate(OrbitVM* vm, size_t size) {
+    assert(vm != NULL && "Null instance error");
+    OrbitGCHeap* heap = &vm->heap;
+
+    if(size > ORBIT_GC_LARGE_SIZE) {
+        OrbitGCPage* page = orbit_heapNewPage(heap, ORBIT_GC_LARGE, (size + 15) & ~(size_t)15);
+        page->live[0] = 1;
+        page->freeCount = 0;
+        orbit_heapMakeYoung(heap, page);
+        ORBIT_HEAP_UNPOISON(page->slots, size);
+        return page->slots;
+    }
+
+    uint8_t sizeClass = heap->classOf[(size + 15) / 16];
+    OrbitGCSizeClass* class = &heap->classes[sizeClass];
+    uint8_t* slot = class->free;
+    if(!slot) {
+        slot = orbit_heapRefill(vm, class, sizeClass);
+    }
+    ORBIT_HEAP_UNPOISON(slot, class->size);
+    class->free = *(void**)slot;
+
+    OrbitGCPage* page = class->current;
+    uint32_t index = orbit_heapIndexOf(page, slot);
+    page->live[index / 64] |= 1ull << (index % 64);
+    return slot;
+}
+
+void orbit_heapFree(OrbitGCHeap* heap, OrbitGCObject* object) {
+    assert(heap != NULL && "Null instance error");
+    assert(object != NULL && "Null instance error");
+    OrbitGCPage* page = orbit_heapPageOf(object);
+    uint32_t index = orbit_heapIndexOf(page, object);
+    page->live[index / 64] &= ~(1ull << (index % 64));
+    ORBIT_HEAP_POISON(object, page->slotSize);
+}
+
+// Stops allocating from the pages picked so far, whose free slots are found
+// again when they are swept, and looks for free slots from the first page of
+// each class again.
+static void orbit_heapRetire(OrbitGCHeap* heap) {
+    for(uint32_t i = 0; i < ORBIT_GC_SIZE_CLASSES; ++i) {
+        OrbitGCSizeClass* class = &heap->classes[i];
+        class->current = NULL;
+        class->free = NULL;
+        class->scan = class->pages;
+    }
+}
+
+void orbit_heapBeginSweep(OrbitGCHeap* heap) {
+    assert(heap != NULL && "Null instance error");
+    orbit_heapRetire(heap);
+    for(OrbitGCPage* page = heap->young; page; page = page->nextYoung) {
+        page->young = false;
+    }
+    heap->young = NULL;
+    heap->epoch += 1;
+    heap->sweep = heap->pages;
+}
+
+bool orbit_heapSweep(OrbitVM* vm, uint64_t deadline, uint64_t limit) {
+    assert(vm != NULL && "Null instance error");
+    OrbitGCHeap* heap = &vm->heap;
+    uint64_t swept = 0;
+
+    while(heap->sweep) {
+        if(swept == limit || (deadline && swept && orbit_vmClock() > deadline)) { return false; }
+        OrbitGCPage* page = heap->sweep;
+        heap->sweep = page->next;
+        if(page->epoch == heap->epoch) { continue; }
+
+        orbit_heapSweepPage(vm, page, false);
+        swept += 1;
+        if(page->sizeClass == ORBIT_GC_LARGE && page->freeCount) {
+            orbit_heapReleasePage(heap, page);
+        }
+    }
+
+    // Empty pages go back to the system once everything was swept.
+    OrbitGCPage* next = NULL;
+    for(OrbitGCPage* page = heap->pages; page; page = next) {
+        next = page->next;
+        if(page->young || page->freeCount < page->slotCount) { continue; }
+        orbit_heapReleasePage(heap, page);
+    }
+    for(uint32_t i = 0; i < ORBIT_GC_SIZE_CLASSES; ++i) {
+        heap->classes[i].scan = heap->classes[i].pages;
+    }
+    return true;
+}
+
+void orbit_heapSweepYoung(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    OrbitGCHeap* heap = &vm->heap;
+
+    OrbitGCPage* next = NULL;
+    for(OrbitGCPage* page = heap->young; page; page = next) {
+        next = page->nextYoung;
+        page->young = false;
+        orbit_heapSweepPage(vm, page, true);
+        if(page->sizeClass == ORBIT_GC_LARGE && page->freeCount) {
+            orbit_heapReleasePage(heap, page);
+        }
+    }
+    heap->young = NULL;
+    orbit_heapRetire(heap);
+}
+
+void orbit_heapVisit(OrbitGCHeap* heap, OrbitGCVisitor visitor, void* data) {
+    assert(heap != NULL && "Null instance error");
+    assert(visitor != NULL && "Null function error");
+    for(OrbitGCPage* page = heap->pages; page; page = page->next) {
+        for(uint32_t i = 0; i < (page->slotCount + 63) / 64; ++i) {
+            uint64_t bits = page->live[i];
+            while(bits) {
+                uint32_t index = i * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                visitor((OrbitGCObject*)(page->slots + (size_t)index * page->slotSize), data);
+            }
+        }
+    }
+}
+
+void orbit_heapDeinit(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    OrbitGCHeap* heap = &vm->heap;
+    while(heap->pages) {
+        OrbitGCPage* page = heap->pages;
+        for(uint32_t i = 0; i < (page->slotCount + 63) / 64; ++i) {
+            uint64_t bits = page->live[i];
+            while(bits) {
+                uint32_t index = i * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                orbit_gcDeallocate(vm, (OrbitGCObject*)(page->slots + (size_t)index * page->slotSize));
+            }
+        }
+        orbit_heapReleasePage(heap, page);
+    }
+    heap->young = heap->sweep = NULL;
+    orbit_heapRetire(heap);
+}
+
+bool orbit_gcIsMarked(const OrbitGCObject* object) {
+    assert(object != NULL && "Null instance error");
+    return orbit_heapMarked(object);
+}
+
+void orbit_gcSizeClassStats(OrbitVM* vm, uint32_t sizeClass, OrbitGCSizeClassStats* stats) {
+    assert(vm != NULL && "Null instance error");
+    assert(stats != NULL && "Null instance error");
+    assert(sizeClass <= ORBIT_GC_SIZE_CLASSES && "invalid size class");
+
+    stats->objectSize = sizeClass < ORBIT_GC_SIZE_CLASSES ? orbit_heapSizes[sizeClass] : 0;
+    stats->pages = stats->slots = stats->used = 0;
+    stats->bytes = 0;
+    for(OrbitGCPage* page = vm->heap.pages; page; page = page->next) {
+        if(page->sizeClass != sizeClass) { continue; }
+        stats->pages += 1;
+        stats->slots += page->slotCount;
+        stats->used += orbit_heapCountLive(page);
+        stats->bytes += sizeClass < ORBIT_GC_SIZE_CLASSES
+                        ? ORBIT_GC_PAGE_SIZE
+                        : ORBIT_GC_PAGE_HEADER + page->slotSize;
+    }
+}
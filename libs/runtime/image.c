@@ -0,0 +1,163 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/image.c - Immutable, shareable images of loaded modules
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-14 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include <assert.h>
+#include <string.h>
+#include <orbit/runtime/image.h>
+#include <orbit/runtime/gc.h>
+#include <orbit/runtime/rtutils.h>
+#include <orbit/runtime/vm.h>
+#include <orbit/utils/memory.h>
+#include "vm_private.h"
+
+OrbitModuleImage* orbit_imageLoad(const char* path) {
+    assert(path != NULL && "Null string error");
+    FILE* in = fopen(path, "rb");
+    if(!in) { return NULL; }
+    OrbitModuleImage* image = orbit_unpackImage(in);
+    fclose(in);
+    return image;
+}
+
+OrbitModuleImage* orbit_imageRetain(OrbitModuleImage* image) {
+    assert(image != NULL && "Null instance error");
+#ifdef _MSC_VER
+    _InterlockedIncrement((volatile long*)&image->refCount);
+#else
+    __atomic_add_fetch(&image->refCount, 1, __ATOMIC_RELAXED);
+#endif
+    return image;
+}
+
+void orbit_imageRelease(OrbitModuleImage* image) {
+    assert(image != NULL && "Null instance error");
+#ifdef _MSC_VER
+    if(_InterlockedDecrement((volatile long*)&image->refCount) != 0) { return; }
+#else
+    if(__atomic_sub_fetch(&image->refCount, 1, __ATOMIC_ACQ_REL) != 0) { return; }
+#endif
+
+    for(uint16_t i = 0; i < image->constantCount; ++i) {
+        orbit_dealloc(image->constants[i].string.data);
+    }
+    for(uint16_t i = 0; i < image->globalCount; ++i) {
+        orbit_dealloc(image->globals[i].data);
+    }
+    for(uint16_t i = 0; i < image->classCount; ++i) {
+        orbit_dealloc(image->classes[i].name.data);
+    }
+    for(uint16_t i = 0; i < image->functionCount; ++i) {
+        orbit_dealloc(image->functions[i].signature.data);
+        orbit_dealloc(image->functions[i].byteCode);
+    }
+    orbit_dealloc(image->constants);
+    orbit_dealloc(image->globals);
+    orbit_dealloc(image->classes);
+    orbit_dealloc(image->functions);
+    orbit_dealloc(image);
+}
+
+void orbit_imageOptimize(OrbitModuleImage* image) {
+    assert(image != NULL && "Null instance error");
+    assert(image->refCount == 1 && "shared images can't be modified");
+    
+    // Optimised code never needs more stack than it did before, but checking
+    // it again finds the exact amount. Should the optimiser ever produce code
+    // that doesn't verify, the function keeps its original code.
+    for(uint16_t i = 0; i < image->functionCount; ++i) {
+        OrbitImageFunction* function = &image->functions[i];
+        OrbitImageFunction original = *function;
+        original.byteCode = ORBIT_ALLOC_ARRAY(uint8_t, function->byteCodeLength);
+        memcpy(original.byteCode, function->byteCode, function->byteCodeLength);
+        
+        if(orbit_vmOptimizeFunction(image, function)
+           && !orbit_vmVerifyFunction(image, function)) {
+            memcpy(function->byteCode, original.byteCode, original.byteCodeLength);
+            function->byteCodeLength = original.byteCodeLength;
+            function->stackEffect = original.stackEffect;
+            function->verified = original.verified;
+        }
+        orbit_dealloc(original.byteCode);
+    }
+}
+
+static OrbitValue orbit_imageString(OrbitVM* vm, const OrbitImageString* string) {
+    OrbitGCString* object = orbit_gcStringReserve(vm, string->length);
+    memcpy(object->data, string->data, string->length);
+    orbit_gcStringComputeHash(object);
+    return MAKE_OBJECT(object);
+}
+
+OrbitVMModule* orbit_imageInstantiate(OrbitVM* vm, OrbitModuleImage* image) {
+    assert(vm != NULL && "Null instance error");
+    assert(image != NULL && "Null instance error");
+
+    // We don't want the module to get destroyed collected if the GC kicks
+    // in while we're creating it.
+    OrbitVMModule* module = orbit_gcModuleNew(vm);
+    orbit_gcRetain(vm, (OrbitGCObject*)module);
+    module->image = orbit_imageRetain(image);
+
+    // Arrays are cleared before their counts are set, so the collector never
+    // sees garbage in them.
+    module->constants = ALLOC_ARRAY(vm, OrbitValue, image->constantCount);
+    for(uint16_t i = 0; i < image->constantCount; ++i) {
+        module->constants[i] = VAL_NIL;
+    }
+    module->constantCount = image->constantCount;
+    for(uint16_t i = 0; i < image->constantCount; ++i) {
+        const OrbitImageConstant* constant = &image->constants[i];
+        module->constants[i] = constant->kind == OMF_STRING
+            ? orbit_imageString(vm, &constant->string)
+            : MAKE_NUM(constant->number);
+    }
+
+    module->globals = ALLOC_ARRAY(vm, OrbitVMGlobal, image->globalCount);
+    for(uint16_t i = 0; i < image->globalCount; ++i) {
+        module->globals[i].name = VAL_NIL;
+        module->globals[i].global = VAL_NIL;
+    }
+    module->globalCount = image->globalCount;
+    for(uint16_t i = 0; i < image->globalCount; ++i) {
+        module->globals[i].name = orbit_imageString(vm, &image->globals[i]);
+    }
+
+    for(uint16_t i = 0; i < image->classCount; ++i) {
+        OrbitValue name = orbit_imageString(vm, &image->classes[i].name);
+        orbit_gcRetain(vm, AS_OBJECT(name));
+        OrbitGCClass* class = orbit_gcClassNew(vm, AS_STRING(name), image->classes[i].fieldCount);
+        orbit_gcRetain(vm, (OrbitGCObject*)class);
+        orbit_gcMapAdd(vm, vm->classes, name, MAKE_OBJECT(class));
+        orbit_gcRelease(vm);
+        orbit_gcRelease(vm);
+    }
+
+    for(uint16_t i = 0; i < image->functionCount; ++i) {
+        const OrbitImageFunction* source = &image->functions[i];
+        OrbitValue signature = orbit_imageString(vm, &source->signature);
+        orbit_gcRetain(vm, AS_OBJECT(signature));
+
+        OrbitVMFunction* function = orbit_gcFunctionSharedNew(vm, source->byteCode,
+                                                              source->byteCodeLength);
+        function->arity = source->arity;
+        function->localCount = source->localCount;
+        function->stackEffect = source->stackEffect;
+        function->native.verified = source->verified;
+        function->module = module;
+        orbit_gcWriteBarrier(vm, (OrbitGCObject*)function, MAKE_OBJECT(module));
+        orbit_gcRetain(vm, (OrbitGCObject*)function);
+        orbit_vmPrepareFunction(vm, function);
+        orbit_gcMapAdd(vm, vm->dispatchTable, signature, MAKE_OBJECT(function));
+        orbit_gcRelease(vm);
+        orbit_gcRelease(vm);
+    }
+
+    orbit_gcRelease(vm);
+    return module;
+}
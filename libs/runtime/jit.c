@@ -0,0 +1,858 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/jit.c - Baseline template JIT for x86-64
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-09 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  The JIT translates each bytecode instruction into a fixed template of
+//  machine code. The operand stack and locals stay in the task's stack, so at
+//  every instruction boundary the state is exactly what the interpreter would
+//  have. This means compiled code can hand control back to the interpreter
+//  anywhere, which is how unsupported instructions and failed type guards are
+//  dealt with, and why the GC never has to know about compiled frames.
+//
+//  Register allocation in compiled code:
+//      rbx     operand stack pointer (task->sp)
+//      r12     locals (frame->stackBase)
+//      r13     the module's constant pool
+//      r14     the module's globals
+//      r15     the OrbitJITState compiled code was entered with
+//
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include <orbit/runtime/rtutils.h>
+#include <orbit/runtime/vm.h>
+#include <orbit/utils/memory.h>
+#include "jit_private.h"
+#include "vm_private.h"
+
+#ifdef ORBIT_JIT_ENABLED
+
+#include <sys/mman.h>
+
+// State passed to compiled code, and read back when it exits.
+typedef struct {
+    OrbitValue*     sp;
+    OrbitValue*     locals;
+    OrbitValue*     constants;
+    OrbitVMGlobal*  globals;
+} OrbitJITState;
+
+typedef uint32_t (*OrbitJITEntry)(OrbitJITState* state, void* target);
+
+#define ORBIT_JIT_NOENTRY UINT32_MAX
+
+// Entering and leaving compiled code costs about as much as interpreting a few
+// instructions, so the interpreter only resumes compiled code at instructions
+// followed by at least this many compiled ones, or by a loop.
+#define ORBIT_JIT_MINRUN 8
+
+struct _OrbitJITCode {
+    uint8_t*        code;
+    size_t          size;
+    // Native offset of the code for each bytecode offset, or ORBIT_JIT_NOENTRY
+    // if the interpreter shouldn't enter compiled code there.
+    uint32_t*       entries;
+};
+
+// MARK: - Code buffer
+
+typedef struct {
+    uint8_t*        data;
+    size_t          length;
+    size_t          capacity;
+} OrbitJITBuffer;
+
+// Jump to patch once every instruction has been emitted, either to another
+// instruction ([target] is a bytecode offset) or to an exit stub.
+typedef struct {
+    size_t          position;
+    uint32_t        target;
+} OrbitJITFixup;
+
+typedef struct {
+    OrbitJITBuffer  buffer;
+    OrbitJITFixup*  jumps;
+    size_t          jumpCount;
+    size_t          jumpCapacity;
+    OrbitJITFixup*  exits;
+    size_t          exitCount;
+    size_t          exitCapacity;
+    size_t          epilogue;
+    // Set when the last instruction emitted always exits to the interpreter.
+    bool            exited;
+} OrbitJITCompiler;
+
+static void emit8(OrbitJITBuffer* b, uint8_t byte) {
+    if(b->length + 1 > b->capacity) {
+        b->capacity = b->capacity ? b->capacity * 2 : 1024;
+        b->data = orbit_realloc(b->data, b->capacity);
+    }
+    b->data[b->length++] = byte;
+}
+
+static void emit32(OrbitJITBuffer* b, uint32_t word) {
+    for(int i = 0; i < 4; ++i) { emit8(b, (word >> (i * 8)) & 0xff); }
+}
+
+#ifdef ORBIT_NAN_TAGGING
+static void emit64(OrbitJITBuffer* b, uint64_t word) {
+    for(int i = 0; i < 8; ++i) { emit8(b, (word >> (i * 8)) & 0xff); }
+}
+#endif
+
+static void patch32(OrbitJITBuffer* b, size_t position, uint32_t word) {
+    for(int i = 0; i < 4; ++i) { b->data[position + i] = (word >> (i * 8)) & 0xff; }
+}
+
+static void addFixup(OrbitJITFixup** list, size_t* count, size_t* capacity,
+                     size_t position, uint32_t target) {
+    if(*count + 1 > *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 32;
+        *list = orbit_realloc(*list, *capacity * sizeof(OrbitJITFixup));
+    }
+    (*list)[(*count)++] = (OrbitJITFixup){position, target};
+}
+
+// MARK: - x86-64 encoding
+
+enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+
+enum { XMM0 = 0, XMM1 = 1 };
+
+enum {
+    CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_P = 0xA, CC_NP = 0xB,
+};
+
+static void x64_rex(OrbitJITBuffer* b, int w, int reg, int base) {
+    uint8_t rex = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | ((base >> 3) & 1);
+    if(rex != 0x40) { emit8(b, rex); }
+}
+
+// [base + disp32] memory operand. rsp and r12 need a SIB byte.
+static void x64_mem(OrbitJITBuffer* b, int reg, int base, int32_t disp) {
+    emit8(b, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if((base & 7) == RSP) { emit8(b, 0x24); }
+    emit32(b, (uint32_t)disp);
+}
+
+static void x64_modrr(OrbitJITBuffer* b, int reg, int rm) {
+    emit8(b, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// mov r64, [base + disp]
+static void x64_load(OrbitJITBuffer* b, int reg, int base, int32_t disp) {
+    x64_rex(b, 1, reg, base);
+    emit8(b, 0x8B);
+    x64_mem(b, reg, base, disp);
+}
+
+// mov [base + disp], r64
+static void x64_store(OrbitJITBuffer* b, int base, int32_t disp, int reg) {
+    x64_rex(b, 1, reg, base);
+    emit8(b, 0x89);
+    x64_mem(b, reg, base, disp);
+}
+
+// 32-bit moves are only needed to read and write the kind of struct values.
+#ifndef ORBIT_NAN_TAGGING
+// mov r32, [base + disp]
+static void x64_load32(OrbitJITBuffer* b, int reg, int base, int32_t disp) {
+    x64_rex(b, 0, reg, base);
+    emit8(b, 0x8B);
+    x64_mem(b, reg, base, disp);
+}
+
+// mov [base + disp], r32
+static void x64_store32(OrbitJITBuffer* b, int base, int32_t disp, int reg) {
+    x64_rex(b, 0, reg, base);
+    emit8(b, 0x89);
+    x64_mem(b, reg, base, disp);
+}
+
+// mov dword [base + disp], imm32
+static void x64_storeImm32(OrbitJITBuffer* b, int base, int32_t disp, uint32_t imm) {
+    x64_rex(b, 0, 0, base);
+    emit8(b, 0xC7);
+    x64_mem(b, 0, base, disp);
+    emit32(b, imm);
+}
+#endif
+
+#ifdef ORBIT_NAN_TAGGING
+// mov r64, imm64
+static void x64_movImm64(OrbitJITBuffer* b, int reg, uint64_t imm) {
+    x64_rex(b, 1, 0, reg);
+    emit8(b, 0xB8 + (reg & 7));
+    emit64(b, imm);
+}
+#endif
+
+// mov r32, imm32
+static void x64_movImm32(OrbitJITBuffer* b, int reg, uint32_t imm) {
+    x64_rex(b, 0, 0, reg);
+    emit8(b, 0xB8 + (reg & 7));
+    emit32(b, imm);
+}
+
+// <op> r/m64, r64 (add = 0x01, sub = 0x29, and = 0x21, cmp = 0x39, mov = 0x89)
+static void x64_alu(OrbitJITBuffer* b, uint8_t op, int dst, int src) {
+    x64_rex(b, 1, src, dst);
+    emit8(b, op);
+    x64_modrr(b, src, dst);
+}
+
+// <op> r64, imm32 (add = 0, sub = 5, cmp = 7)
+static void x64_aluImm(OrbitJITBuffer* b, int ext, int reg, int32_t imm) {
+    x64_rex(b, 1, 0, reg);
+    emit8(b, 0x81);
+    x64_modrr(b, ext, reg);
+    emit32(b, (uint32_t)imm);
+}
+
+#ifndef ORBIT_NAN_TAGGING
+// cmp r32, imm32
+static void x64_cmpImm32(OrbitJITBuffer* b, int reg, uint32_t imm) {
+    x64_rex(b, 0, 0, reg);
+    emit8(b, 0x81);
+    x64_modrr(b, 7, reg);
+    emit32(b, imm);
+}
+#endif
+
+// SSE load/store with an optional mandatory prefix (0 for none).
+static void x64_sseMem(OrbitJITBuffer* b, uint8_t prefix, uint8_t op, int xmm, int base, int32_t disp) {
+    if(prefix) { emit8(b, prefix); }
+    x64_rex(b, 0, xmm, base);
+    emit8(b, 0x0F);
+    emit8(b, op);
+    x64_mem(b, xmm, base, disp);
+}
+
+static void x64_sseRR(OrbitJITBuffer* b, uint8_t prefix, uint8_t op, int dst, int src) {
+    if(prefix) { emit8(b, prefix); }
+    x64_rex(b, 0, dst, src);
+    emit8(b, 0x0F);
+    emit8(b, op);
+    x64_modrr(b, dst, src);
+}
+
+#define x64_movsdLoad(b, xmm, base, disp)   x64_sseMem(b, 0xF2, 0x10, xmm, base, disp)
+#define x64_movsdStore(b, base, disp, xmm)  x64_sseMem(b, 0xF2, 0x11, xmm, base, disp)
+#define x64_movupsLoad(b, xmm, base, disp)  x64_sseMem(b, 0, 0x10, xmm, base, disp)
+#define x64_movupsStore(b, base, disp, xmm) x64_sseMem(b, 0, 0x11, xmm, base, disp)
+#define x64_addsd(b, dst, src)              x64_sseRR(b, 0xF2, 0x58, dst, src)
+#define x64_subsd(b, dst, src)              x64_sseRR(b, 0xF2, 0x5C, dst, src)
+#define x64_mulsd(b, dst, src)              x64_sseRR(b, 0xF2, 0x59, dst, src)
+#define x64_divsd(b, dst, src)              x64_sseRR(b, 0xF2, 0x5E, dst, src)
+#define x64_ucomisd(b, dst, src)            x64_sseRR(b, 0x66, 0x2E, dst, src)
+#define x64_xorpd(b, dst, src)              x64_sseRR(b, 0x66, 0x57, dst, src)
+
+#ifdef ORBIT_NAN_TAGGING
+// movq xmm, r64
+static void x64_movqToXmm(OrbitJITBuffer* b, int xmm, int reg) {
+    emit8(b, 0x66);
+    x64_rex(b, 1, xmm, reg);
+    emit8(b, 0x0F);
+    emit8(b, 0x6E);
+    x64_modrr(b, xmm, reg);
+}
+#endif
+
+// setcc r8 (al, cl, dl, bl only)
+static void x64_setcc(OrbitJITBuffer* b, uint8_t cc, int reg) {
+    emit8(b, 0x0F);
+    emit8(b, 0x90 + cc);
+    x64_modrr(b, 0, reg);
+}
+
+// movzx r32, r8 (al, cl, dl, bl only)
+static void x64_movzxb(OrbitJITBuffer* b, int dst, int src) {
+    emit8(b, 0x0F);
+    emit8(b, 0xB6);
+    x64_modrr(b, dst, src);
+}
+
+// jcc rel32, returns the position of the displacement to patch.
+static size_t x64_jcc(OrbitJITBuffer* b, uint8_t cc) {
+    emit8(b, 0x0F);
+    emit8(b, 0x80 + cc);
+    emit32(b, 0);
+    return b->length - 4;
+}
+
+// jmp rel32, returns the position of the displacement to patch.
+static size_t x64_jmp(OrbitJITBuffer* b) {
+    emit8(b, 0xE9);
+    emit32(b, 0);
+    return b->length - 4;
+}
+
+static void x64_bind(OrbitJITBuffer* b, size_t position, size_t target) {
+    patch32(b, position, (uint32_t)(int32_t)(target - (position + 4)));
+}
+
+static void x64_push(OrbitJITBuffer* b, int reg) {
+    x64_rex(b, 0, 0, reg);
+    emit8(b, 0x50 + (reg & 7));
+}
+
+static void x64_pop(OrbitJITBuffer* b, int reg) {
+    x64_rex(b, 0, 0, reg);
+    emit8(b, 0x58 + (reg & 7));
+}
+
+// MARK: - Value layout helpers
+
+#define VS ((int32_t)sizeof(OrbitValue))
+
+#ifdef ORBIT_NAN_TAGGING
+#define NUM_OFFSET 0
+#else
+#define NUM_OFFSET ((int32_t)offsetof(OrbitValue, numValue))
+#define KIND_OFFSET 0
+#define OBJ_OFFSET ((int32_t)offsetof(OrbitValue, objectValue))
+// jit_storeBool() computes a bool's kind from the comparison result, which
+// only works if the two kinds are consecutive (fails to compile otherwise).
+typedef char orbit_jitBoolKindsConsecutive[ORBIT_VK_FALSE == ORBIT_VK_TRUE + 1 ? 1 : -1];
+#endif
+
+// Loads the whole value at [base + disp] into [xmm].
+static void jit_loadValue(OrbitJITBuffer* b, int xmm, int base, int32_t disp) {
+#ifdef ORBIT_NAN_TAGGING
+    x64_movsdLoad(b, xmm, base, disp);
+#else
+    x64_movupsLoad(b, xmm, base, disp);
+#endif
+}
+
+// Stores the whole value held in [xmm] at [base + disp].
+static void jit_storeValue(OrbitJITBuffer* b, int base, int32_t disp, int xmm) {
+#ifdef ORBIT_NAN_TAGGING
+    x64_movsdStore(b, base, disp, xmm);
+#else
+    x64_movupsStore(b, base, disp, xmm);
+#endif
+}
+
+// Copies the value at [srcBase + srcDisp] to [dstBase + dstDisp], using xmm0.
+static void jit_copyValue(OrbitJITBuffer* b, int dstBase, int32_t dstDisp, int srcBase, int32_t srcDisp) {
+    jit_loadValue(b, XMM0, srcBase, srcDisp);
+    jit_storeValue(b, dstBase, dstDisp, XMM0);
+}
+
+// Stores a constant value (nil, true or false) at [base + disp].
+static void jit_storeConstant(OrbitJITBuffer* b, int base, int32_t disp, OrbitValue value) {
+#ifdef ORBIT_NAN_TAGGING
+    x64_movImm64(b, RAX, value);
+    x64_store(b, base, disp, RAX);
+#else
+    x64_storeImm32(b, base, disp + KIND_OFFSET, value.kind);
+#endif
+}
+
+// Jumps to the exit stub for [offset] if the value at [base + disp] is not a
+// number. Clobbers rax and rcx.
+static void jit_guardNum(OrbitJITCompiler* c, int base, int32_t disp, uint32_t offset) {
+    OrbitJITBuffer* b = &c->buffer;
+#ifdef ORBIT_NAN_TAGGING
+    x64_load(b, RAX, base, disp);
+    x64_movImm64(b, RCX, ORBIT_QNAN);
+    x64_alu(b, 0x21, RAX, RCX);
+    x64_alu(b, 0x39, RAX, RCX);
+    size_t exit = x64_jcc(b, CC_E);
+#else
+    x64_load32(b, RAX, base, disp + KIND_OFFSET);
+    x64_cmpImm32(b, RAX, ORBIT_VK_NUM);
+    size_t exit = x64_jcc(b, CC_NE);
+#endif
+    addFixup(&c->exits, &c->exitCount, &c->exitCapacity, exit, offset);
+}
+
+// Stores xmm0 as a number at [base + disp].
+static void jit_storeNum(OrbitJITBuffer* b, int base, int32_t disp) {
+#ifndef ORBIT_NAN_TAGGING
+    x64_storeImm32(b, base, disp + KIND_OFFSET, ORBIT_VK_NUM);
+#endif
+    x64_movsdStore(b, base, disp + NUM_OFFSET, XMM0);
+}
+
+// Stores al (0 or 1) as a boolean at [base + disp]. Clobbers rcx.
+static void jit_storeBool(OrbitJITBuffer* b, int base, int32_t disp) {
+    x64_movzxb(b, RAX, RAX);
+#ifdef ORBIT_NAN_TAGGING
+    x64_movImm64(b, RCX, VAL_FALSE);
+    x64_alu(b, 0x01, RCX, RAX);  // VAL_TRUE == VAL_FALSE + 1
+    x64_store(b, base, disp, RCX);
+#else
+    x64_movImm32(b, RCX, ORBIT_VK_FALSE);
+    emit8(b, 0x29); x64_modrr(b, RAX, RCX); // sub ecx, eax
+    x64_store32(b, base, disp + KIND_OFFSET, RCX);
+#endif
+}
+
+// Loads the object pointer held by the value at [base + disp] into [reg].
+static void jit_loadObject(OrbitJITBuffer* b, int reg, int base, int32_t disp) {
+#ifdef ORBIT_NAN_TAGGING
+    x64_load(b, reg, base, disp);
+    x64_movImm64(b, RCX, ~(ORBIT_SIGN_BIT | ORBIT_QNAN));
+    x64_alu(b, 0x21, reg, RCX);
+#else
+    x64_load(b, reg, base, disp + OBJ_OFFSET);
+#endif
+}
+
+// Pops the top of the stack and jumps to bytecode offset [target] if it is
+// truthy, following IS_TRUE(). Clobbers rax, rcx, rdx, xmm0 and xmm1.
+static void jit_branchIfTrue(OrbitJITCompiler* c, uint32_t target) {
+    OrbitJITBuffer* b = &c->buffer;
+    x64_aluImm(b, 5, RBX, VS);
+#ifdef ORBIT_NAN_TAGGING
+    x64_load(b, RAX, RBX, 0);
+    x64_movImm64(b, RCX, VAL_TRUE);
+    x64_alu(b, 0x39, RAX, RCX);
+    addFixup(&c->jumps, &c->jumpCount, &c->jumpCapacity, x64_jcc(b, CC_E), target);
+    x64_movImm64(b, RCX, ORBIT_QNAN);
+    x64_alu(b, 0x89, RDX, RAX);
+    x64_alu(b, 0x21, RDX, RCX);
+    x64_alu(b, 0x39, RDX, RCX);
+    size_t notNum = x64_jcc(b, CC_E);
+    x64_movqToXmm(b, XMM0, RAX);
+#else
+    x64_load32(b, RAX, RBX, KIND_OFFSET);
+    x64_cmpImm32(b, RAX, ORBIT_VK_TRUE);
+    addFixup(&c->jumps, &c->jumpCount, &c->jumpCapacity, x64_jcc(b, CC_E), target);
+    x64_cmpImm32(b, RAX, ORBIT_VK_NUM);
+    size_t notNum = x64_jcc(b, CC_NE);
+    x64_movsdLoad(b, XMM0, RBX, NUM_OFFSET);
+#endif
+    x64_xorpd(b, XMM1, XMM1);
+    x64_ucomisd(b, XMM0, XMM1);
+    addFixup(&c->jumps, &c->jumpCount, &c->jumpCapacity, x64_jcc(b, CC_NE), target);
+    addFixup(&c->jumps, &c->jumpCount, &c->jumpCapacity, x64_jcc(b, CC_P), target);
+    x64_bind(b, notNum, b->length);
+}
+
+// MARK: - Templates
+
+static void jit_exitAt(OrbitJITCompiler* c, uint32_t offset) {
+    c->exited = true;
+    size_t exit = x64_jmp(&c->buffer);
+    addFixup(&c->exits, &c->exitCount, &c->exitCapacity, exit, offset);
+}
+
+static void jit_arithmetic(OrbitJITCompiler* c, uint8_t code, uint32_t offset) {
+    OrbitJITBuffer* b = &c->buffer;
+    jit_guardNum(c, RBX, -2 * VS, offset);
+    jit_guardNum(c, RBX, -VS, offset);
+    x64_movsdLoad(b, XMM0, RBX, -2 * VS + NUM_OFFSET);
+    x64_movsdLoad(b, XMM1, RBX, -VS + NUM_OFFSET);
+    switch(code) {
+    case CODE_add: case CODE_add_nn: x64_addsd(b, XMM0, XMM1); break;
+    case CODE_sub: case CODE_sub_nn: x64_subsd(b, XMM0, XMM1); break;
+    case CODE_mul: case CODE_mul_nn: x64_mulsd(b, XMM0, XMM1); break;
+    case CODE_div: case CODE_div_nn: x64_divsd(b, XMM0, XMM1); break;
+    }
+    x64_aluImm(b, 5, RBX, VS);
+    jit_storeNum(b, RBX, -VS);
+}
+
+static void jit_compare(OrbitJITCompiler* c, uint8_t code, uint32_t offset) {
+    OrbitJITBuffer* b = &c->buffer;
+    jit_guardNum(c, RBX, -2 * VS, offset);
+    jit_guardNum(c, RBX, -VS, offset);
+    x64_movsdLoad(b, XMM0, RBX, -2 * VS + NUM_OFFSET);
+    x64_movsdLoad(b, XMM1, RBX, -VS + NUM_OFFSET);
+    switch(code) {
+    case CODE_test_lt: case CODE_test_lt_nn:
+        // a < b  <=>  b > a, which is false when either is NaN.
+        x64_ucomisd(b, XMM1, XMM0);
+        x64_setcc(b, CC_A, RAX);
+        break;
+    case CODE_test_gt: case CODE_test_gt_nn:
+        x64_ucomisd(b, XMM0, XMM1);
+        x64_setcc(b, CC_A, RAX);
+        break;
+    case CODE_test_eq: case CODE_test_eq_nn:
+        x64_ucomisd(b, XMM0, XMM1);
+        x64_setcc(b, CC_E, RAX);
+        x64_setcc(b, CC_NP, RCX);
+        emit8(b, 0x20); x64_modrr(b, RCX, RAX); // and al, cl
+        break;
+    }
+    x64_aluImm(b, 5, RBX, VS);
+    jit_storeBool(b, RBX, -VS);
+}
+
+// Emits the template for the instruction at [offset]. Returns false if the
+// bytecode is malformed.
+static bool jit_instruction(OrbitJITCompiler* c, OrbitVMFunction* fn, uint32_t offset) {
+    OrbitJITBuffer* b = &c->buffer;
+    uint8_t* code = fn->native.byteCode;
+    uint8_t op = code[offset];
+    uint32_t next = offset + 1 + orbit_vmOperandBytes[op];
+    if(next > fn->native.byteCodeLength) { return false; }
+
+    uint16_t operand = 0;
+    if(orbit_vmOperandBytes[op] == 1) {
+        operand = code[offset+1];
+    } else if(orbit_vmOperandBytes[op] == 2) {
+        operand = (code[offset+1] << 8) | code[offset+2];
+    }
+
+    switch(op) {
+    case CODE_load_nil:
+    case CODE_load_true:
+    case CODE_load_false:
+        jit_storeConstant(b, RBX, 0, op == CODE_load_nil ? VAL_NIL
+                                   : op == CODE_load_true ? VAL_TRUE : VAL_FALSE);
+        x64_aluImm(b, 0, RBX, VS);
+        break;
+
+    case CODE_load_const:
+        jit_copyValue(b, RBX, 0, R13, operand * VS);
+        x64_aluImm(b, 0, RBX, VS);
+        break;
+
+    case CODE_load_local:
+        jit_copyValue(b, RBX, 0, R12, operand * VS);
+        x64_aluImm(b, 0, RBX, VS);
+        break;
+
+    case CODE_store_local:
+        x64_aluImm(b, 5, RBX, VS);
+        jit_copyValue(b, R12, operand * VS, RBX, 0);
+        break;
+
+    case CODE_load_global:
+        if(operand >= fn->module->globalCount) { return false; }
+        jit_copyValue(b, RBX, 0, R14, operand * sizeof(OrbitVMGlobal) + offsetof(OrbitVMGlobal, global));
+        x64_aluImm(b, 0, RBX, VS);
+        break;
+
+    case CODE_store_global:
+        if(operand >= fn->module->globalCount) { return false; }
+        x64_aluImm(b, 5, RBX, VS);
+        jit_copyValue(b, R14, operand * sizeof(OrbitVMGlobal) + offsetof(OrbitVMGlobal, global), RBX, 0);
+        break;
+
+    case CODE_load_field:
+        jit_loadObject(b, RDX, RBX, -VS);
+        jit_copyValue(b, RBX, -VS, RDX, offsetof(OrbitGCInstance, fields) + operand * VS);
+        break;
+
+    case CODE_add: case CODE_add_nn:
+    case CODE_sub: case CODE_sub_nn:
+    case CODE_mul: case CODE_mul_nn:
+    case CODE_div: case CODE_div_nn:
+        jit_arithmetic(c, op, offset);
+        break;
+
+    case CODE_test_lt: case CODE_test_lt_nn:
+    case CODE_test_gt: case CODE_test_gt_nn:
+    case CODE_test_eq: case CODE_test_eq_nn:
+        jit_compare(c, op, offset);
+        break;
+
+    // Superinstructions are compiled as the sequence they replace. Their guards
+    // come before anything is pushed, so a failed guard can exit at the start
+    // of the instruction.
+    case CODE_load_local2:
+        jit_copyValue(b, RBX, 0, R12, code[offset+1] * VS);
+        jit_copyValue(b, RBX, VS, R12, code[offset+2] * VS);
+        x64_aluImm(b, 0, RBX, 2 * VS);
+        break;
+
+    case CODE_load_local_const:
+        jit_copyValue(b, RBX, 0, R12, code[offset+1] * VS);
+        jit_copyValue(b, RBX, VS, R13, ((code[offset+2] << 8) | code[offset+3]) * VS);
+        x64_aluImm(b, 0, RBX, 2 * VS);
+        break;
+
+    case CODE_load_local_field:
+        jit_loadObject(b, RDX, R12, code[offset+1] * VS);
+        jit_copyValue(b, RBX, 0, RDX, offsetof(OrbitGCInstance, fields)
+                                      + ((code[offset+2] << 8) | code[offset+3]) * VS);
+        x64_aluImm(b, 0, RBX, VS);
+        break;
+
+    case CODE_store_load_local:
+        jit_copyValue(b, R12, code[offset+1] * VS, RBX, -VS);
+        jit_copyValue(b, RBX, -VS, R12, code[offset+2] * VS);
+        break;
+
+    case CODE_add_ll:
+        jit_guardNum(c, R12, code[offset+1] * VS, offset);
+        jit_guardNum(c, R12, code[offset+2] * VS, offset);
+        jit_copyValue(b, RBX, 0, R12, code[offset+1] * VS);
+        jit_copyValue(b, RBX, VS, R12, code[offset+2] * VS);
+        x64_aluImm(b, 0, RBX, 2 * VS);
+        jit_arithmetic(c, CODE_add, offset);
+        break;
+
+    case CODE_jump_if_lt:
+        jit_compare(c, CODE_test_lt, offset);
+        jit_branchIfTrue(c, next + operand);
+        break;
+
+    case CODE_rjump_if_lt:
+        if(operand > next) { return false; }
+        jit_compare(c, CODE_test_lt, offset);
+        jit_branchIfTrue(c, next - operand);
+        break;
+
+    case CODE_and:
+    case CODE_or:
+        // Not implemented by the interpreter either.
+        break;
+
+    case CODE_jump_if:
+        jit_branchIfTrue(c, next + operand);
+        break;
+
+    case CODE_jump:
+        addFixup(&c->jumps, &c->jumpCount, &c->jumpCapacity, x64_jmp(b), next + operand);
+        break;
+
+    case CODE_rjump_if:
+        if(operand > next) { return false; }
+        jit_branchIfTrue(c, next - operand);
+        break;
+
+    case CODE_rjump:
+        if(operand > next) { return false; }
+        addFixup(&c->jumps, &c->jumpCount, &c->jumpCapacity, x64_jmp(b), next - operand);
+        break;
+
+    case CODE_pop:
+        x64_aluImm(b, 5, RBX, VS);
+        break;
+
+    case CODE_swap:
+        jit_loadValue(b, XMM0, RBX, -2 * VS);
+        jit_loadValue(b, XMM1, RBX, -VS);
+        jit_storeValue(b, RBX, -2 * VS, XMM1);
+        jit_storeValue(b, RBX, -VS, XMM0);
+        break;
+
+    default:
+        // Calls, returns, allocation, field stores (which need the GC's write
+        // barrier) and everything else are left to the interpreter, which
+        // will re-enter compiled code when it can.
+        jit_exitAt(c, offset);
+        break;
+    }
+    return true;
+}
+
+// Entry trampoline, at the start of every compiled function. Saves the
+// callee-saved registers we use, loads the interpreter state and jumps to the
+// requested instruction. Exit stubs jump to the epilogue with the bytecode
+// offset to resume at in eax.
+static void jit_prologue(OrbitJITCompiler* c) {
+    OrbitJITBuffer* b = &c->buffer;
+    x64_push(b, RBX);
+    x64_push(b, R12);
+    x64_push(b, R13);
+    x64_push(b, R14);
+    x64_push(b, R15);
+    x64_alu(b, 0x89, R15, RDI);
+    x64_load(b, RBX, RDI, offsetof(OrbitJITState, sp));
+    x64_load(b, R12, RDI, offsetof(OrbitJITState, locals));
+    x64_load(b, R13, RDI, offsetof(OrbitJITState, constants));
+    x64_load(b, R14, RDI, offsetof(OrbitJITState, globals));
+    emit8(b, 0xFF); x64_modrr(b, 4, RSI); // jmp rsi
+
+    c->epilogue = b->length;
+    x64_store(b, R15, offsetof(OrbitJITState, sp), RBX);
+    x64_pop(b, R15);
+    x64_pop(b, R14);
+    x64_pop(b, R13);
+    x64_pop(b, R12);
+    x64_pop(b, RBX);
+    emit8(b, 0xC3);
+}
+
+static void jit_compilerDeinit(OrbitJITCompiler* c) {
+    orbit_dealloc(c->buffer.data);
+    orbit_dealloc(c->jumps);
+    orbit_dealloc(c->exits);
+}
+
+bool orbit_jitCompile(OrbitVM* vm, OrbitVMFunction* function) {
+    assert(vm != NULL && "Null instance error");
+    assert(function != NULL && "Null instance error");
+    if(function->kind != ORBIT_FK_NATIVE || function->native.jit) { return false; }
+    if(!function->module) { return false; }
+
+    uint16_t length = function->native.byteCodeLength;
+    OrbitJITCompiler c;
+    memset(&c, 0, sizeof(c));
+
+    uint32_t* entries = orbit_allocMulti(sizeof(uint32_t), length + 1);
+    for(uint32_t i = 0; i <= length; ++i) { entries[i] = ORBIT_JIT_NOENTRY; }
+
+    jit_prologue(&c);
+
+    // Start offsets of instructions, in order, used to find runs below.
+    uint16_t* starts = orbit_allocMulti(sizeof(uint16_t), length + 1);
+    uint16_t* runs = orbit_allocMulti(sizeof(uint16_t), length + 1);
+    uint32_t count = 0;
+    bool ok = true;
+
+    uint32_t offset = 0;
+    while(ok && offset < length) {
+        uint8_t op = function->native.byteCode[offset];
+        entries[offset] = (uint32_t)c.buffer.length;
+        starts[count++] = offset;
+        c.exited = false;
+        ok = jit_instruction(&c, function, offset);
+        runs[offset] = c.exited ? 0 : 1;
+        if(op == CODE_rjump || op == CODE_rjump_if || op == CODE_rjump_if_lt) {
+            runs[offset] = ORBIT_JIT_MINRUN;
+        }
+        offset += 1 + orbit_vmOperandBytes[op];
+    }
+    // Running off the end of the bytecode hands control back as well.
+    entries[length] = (uint32_t)c.buffer.length;
+    runs[length] = 0;
+    jit_exitAt(&c, length);
+
+    for(size_t i = 0; ok && i < c.jumpCount; ++i) {
+        uint32_t target = c.jumps[i].target;
+        ok = target <= length && entries[target] != ORBIT_JIT_NOENTRY;
+        if(ok) { x64_bind(&c.buffer, c.jumps[i].position, entries[target]); }
+    }
+
+    // Count how many compiled instructions follow each one in a straight line
+    // (loops count as enough), and stop the interpreter from entering the code
+    // at instructions where that isn't worth it.
+    for(uint32_t i = count; ok && i > 0; --i) {
+        uint16_t at = starts[i-1];
+        uint16_t next = (i < count) ? starts[i] : length;
+        if(runs[at] == 1) {
+            runs[at] = runs[next] + 1 < ORBIT_JIT_MINRUN ? runs[next] + 1 : ORBIT_JIT_MINRUN;
+        }
+        if(runs[at] < ORBIT_JIT_MINRUN) { entries[at] = ORBIT_JIT_NOENTRY; }
+    }
+    entries[length] = ORBIT_JIT_NOENTRY;
+    orbit_dealloc(starts);
+    orbit_dealloc(runs);
+
+    if(!ok) {
+        jit_compilerDeinit(&c);
+        orbit_dealloc(entries);
+        return false;
+    }
+
+    for(size_t i = 0; i < c.exitCount; ++i) {
+        x64_bind(&c.buffer, c.exits[i].position, c.buffer.length);
+        x64_movImm32(&c.buffer, RAX, c.exits[i].target);
+        x64_bind(&c.buffer, x64_jmp(&c.buffer), c.epilogue);
+    }
+
+    // Copy the code to its own executable mapping, which is never writable
+    // and executable at the same time.
+    size_t size = c.buffer.length;
+    void* code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED) {
+        jit_compilerDeinit(&c);
+        orbit_dealloc(entries);
+        return false;
+    }
+    memcpy(code, c.buffer.data, size);
+    jit_compilerDeinit(&c);
+    if(mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        orbit_dealloc(entries);
+        return false;
+    }
+
+    OrbitJITCode* jit = ALLOC(vm, OrbitJITCode);
+    jit->code = code;
+    jit->size = size;
+    jit->entries = entries;
+    function->native.jit = jit;
+    return true;
+}
+
+bool orbit_jitLoop(OrbitVM* vm, OrbitVMFunction* function, uint16_t offset) {
+    assert(function->kind == ORBIT_FK_NATIVE && "only bytecode functions have loops");
+    assert(offset < function->native.byteCodeLength && "back-edge offset out of range");
+    if(function->native.jit) { return true; }
+
+    uint16_t* counts = function->native.loopCounts;
+    if(!counts) {
+        counts = ALLOC_ARRAY(vm, uint16_t, function->native.byteCodeLength);
+        memset(counts, 0, function->native.byteCodeLength * sizeof(uint16_t));
+        function->native.loopCounts = counts;
+    }
+    if(++counts[offset] < ORBIT_JIT_LOOP_THRESHOLD) { return false; }
+
+    // Start counting again if the function can't be compiled, so that we
+    // don't try again on every iteration.
+    counts[offset] = 0;
+    if(!orbit_jitCompile(vm, function)) { return false; }
+    DEALLOC(vm, counts);
+    function->native.loopCounts = NULL;
+    return true;
+}
+
+uint8_t* orbit_jitRun(OrbitVMTask* task, OrbitVMFrame* frame) {
+    OrbitVMFunction* fn = frame->function;
+    OrbitJITCode* jit = fn->native.jit;
+    uint32_t offset = frame->ip - fn->native.byteCode;
+    if(offset > fn->native.byteCodeLength || jit->entries[offset] == ORBIT_JIT_NOENTRY) {
+        return frame->ip;
+    }
+
+    OrbitJITState state = {
+        task->sp,
+        frame->stackBase,
+        fn->module->constants,
+        fn->module->globals
+    };
+    OrbitJITEntry entry = (OrbitJITEntry)(void*)jit->code;
+    offset = entry(&state, jit->code + jit->entries[offset]);
+    task->sp = state.sp;
+    return fn->native.byteCode + offset;
+}
+
+void orbit_jitRelease(OrbitVM* vm, OrbitVMFunction* function) {
+    if(function->kind != ORBIT_FK_NATIVE) { return; }
+    if(function->native.loopCounts) {
+        DEALLOC(vm, function->native.loopCounts);
+        function->native.loopCounts = NULL;
+    }
+    if(!function->native.jit) { return; }
+    OrbitJITCode* jit = function->native.jit;
+    munmap(jit->code, jit->size);
+    orbit_dealloc(jit->entries);
+    DEALLOC(vm, jit);
+    function->native.jit = NULL;
+}
+
+#else
+
+bool orbit_jitCompile(OrbitVM* vm, OrbitVMFunction* function) {
+    return false;
+}
+
+bool orbit_jitLoop(OrbitVM* vm, OrbitVMFunction* function, uint16_t offset) {
+    return false;
+}
+
+uint8_t* orbit_jitRun(OrbitVMTask* task, OrbitVMFrame* frame) {
+    return frame->ip;
+}
+
+void orbit_jitRelease(OrbitVM* vm, OrbitVMFunction* function) {}
+
+#endif /* ORBIT_JIT_ENABLED */
@@ -0,0 +1,55 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/jit_private.h - Baseline JIT compiler interface
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-09 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#ifndef orbit_runtime_jit_private_h
+#define orbit_runtime_jit_private_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <orbit/runtime/value.h>
+
+// The JIT only knows how to generate x86-64 code, and relies on mmap() to get
+// executable memory. On every other platform, the stubs below never compile
+// anything and the interpreter runs everything.
+#if defined(ORBIT_JIT) && defined(__x86_64__) && defined(__linux__)
+#define ORBIT_JIT_ENABLED
+#endif
+
+// Number of invocations after which a function gets compiled.
+#ifndef ORBIT_JIT_THRESHOLD
+#define ORBIT_JIT_THRESHOLD 256
+#endif
+
+// Compiles [function] to machine code. The compiled code covers the whole
+// function: opcodes the JIT can't handle (calls, returns, allocation) and
+// failed operand kind guards exit back to the interpreter at that instruction.
+// Returns false if the function couldn't be compiled.
+bool orbit_jitCompile(OrbitVM* vm, OrbitVMFunction* function);
+
+// Number of times a backward jump must be taken before its function gets
+// compiled, and the running frame moved to the compiled code.
+#ifndef ORBIT_JIT_LOOP_THRESHOLD
+#define ORBIT_JIT_LOOP_THRESHOLD 1000
+#endif
+
+// Counts one more iteration of the loop closed by the backward jump at
+// [offset] in [function]. Returns true once the loop is hot and the function
+// has been compiled, at which point the caller can transfer its frame to the
+// compiled code with orbit_jitRun().
+bool orbit_jitLoop(OrbitVM* vm, OrbitVMFunction* function, uint16_t offset);
+
+// Runs the compiled code of [frame]'s function from the frame's instruction
+// pointer, until it reaches an instruction the interpreter must execute.
+// Returns the bytecode address of that instruction.
+uint8_t* orbit_jitRun(OrbitVMTask* task, OrbitVMFrame* frame);
+
+// Frees the machine code and loop counters of [function], if there are any.
+void orbit_jitRelease(OrbitVM* vm, OrbitVMFunction* function);
+
+#endif /* orbit_runtime_jit_private_h */
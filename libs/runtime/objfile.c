@@ -10,11 +10,14 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <orbit/runtime/image.h>
 #include <orbit/runtime/rtutils.h>
 #include <orbit/runtime/objfile.h>
 #include <orbit/runtime/vm.h>
 #include <orbit/utils/debug.h>
+#include <orbit/utils/memory.h>
 #include <orbit/utils/pack.h>
+#include "vm_private.h"
 
 static bool _expect(FILE* in, OMFTag expected, OrbitPackError* error) {
     uint8_t tag = orbit_unpack8(in, error);
@@ -32,46 +35,44 @@ static bool _checkSignature(FILE* in, OrbitPackError* error) {
     return memcmp(signature, extracted, 4) == 0;
 }
 
-static bool _checkVersion(FILE* in, uint16_t version, OrbitPackError* error) {
-    uint16_t fileVersion = orbit_unpack16(in, error);
+static bool _checkVersion(FILE* in, uint16_t* version, OrbitPackError* error) {
+    *version = orbit_unpack16(in, error);
     if(*error != PACK_NOERROR) { return false; }
-    return fileVersion == version;
+    return *version >= OMF_VERSION && *version <= OMF_VERSION_MAX;
 }
 
-static inline bool _loadNumber(FILE* in, OrbitValue* value, OrbitPackError* error) {
+static inline bool _loadNumber(FILE* in, OrbitImageConstant* constant, OrbitPackError* error) {
     double number = orbit_unpackIEEE754(in, error);
     if(*error != PACK_NOERROR) { return false; }
-    *value = MAKE_NUM(number);
+    constant->kind = OMF_NUM;
+    constant->number = number;
     return true;
 }
 
-static inline bool _loadString(OrbitVM* vm, FILE* in, OrbitValue* value, OrbitPackError* error) {
+static inline bool _loadString(FILE* in, OrbitImageString* string, OrbitPackError* error) {
     uint16_t length = orbit_unpack16(in, error);
     if(*error != PACK_NOERROR) { return false; }
     
     // TODO: Check that the string is valid UTF-8
-    OrbitGCString* string = orbit_gcStringReserve(vm, length);
-    
+    string->length = length;
+    string->data = orbit_alloc(length + 1);
     *error = orbit_unpackBytes(in, (uint8_t*)string->data, length);
-    if(*error != PACK_NOERROR) { return false; }
-    
-    orbit_gcStringComputeHash(string);
-    *value = MAKE_OBJECT(string);
-    
-    return true;
+    string->data[length] = '\0';
+    return *error == PACK_NOERROR;
 }
 
-static bool _loadConstant(OrbitVM* vm, FILE* in, OrbitValue* value, OrbitPackError* error) {
+static bool _loadConstant(FILE* in, OrbitImageConstant* constant, OrbitPackError* error) {
     uint8_t tag = orbit_unpack8(in, error);
     if(*error != PACK_NOERROR) { return false; }
     
     switch(tag) {
     case OMF_STRING:
-        return _loadString(vm, in, value, error);
+        constant->kind = OMF_STRING;
+        return _loadString(in, &constant->string, error);
         break;
         
     case OMF_NUM:
-        return _loadNumber(in, value, error);
+        return _loadNumber(in, constant, error);
         break;
         
     default:
@@ -80,106 +81,101 @@ static bool _loadConstant(OrbitVM* vm, FILE* in, OrbitValue* value, OrbitPackErr
     return false;
 }
 
-static bool _loadClass(OrbitVM* vm,
-                       FILE* in,
-                       OrbitValue* className,
-                       OrbitValue* class,
-                       OrbitPackError* error)
-{
+static bool _loadClass(FILE* in, OrbitImageClass* class, OrbitPackError* error) {
     if(!_expect(in, OMF_CLASS, error)) { return false; }
     if(!_expect(in, OMF_STRING, error)) { return false; }
-    if(!_loadString(vm, in, className, error)) { return false; }
+    if(!_loadString(in, &class->name, error)) { return false; }
     
-    uint16_t fieldCount = orbit_unpack16(in, error);
+    class->fieldCount = orbit_unpack16(in, error);
+    return *error == PACK_NOERROR;
+}
+
+// Version 2 modules can carry register code for the function. The verifier
+// only checks bytecode, so it is skipped: the register VM always translates
+// the verified bytecode instead.
+static bool _skipRegisterCode(FILE* in, OrbitPackError* error) {
+    orbit_unpack8(in, error);
     if(*error != PACK_NOERROR) { return false; }
     
-    ORBIT_DLOG("CREATE NEW CLASS");
-    OrbitGCClass* impl = orbit_gcClassNew(vm, AS_STRING(*className), fieldCount);
-    *class = MAKE_OBJECT(impl);
-    return true;
+    uint16_t regCodeLength = orbit_unpack16(in, error);
+    for(uint16_t i = 0; *error == PACK_NOERROR && i < regCodeLength; ++i) {
+        orbit_unpack32(in, error);
+    }
+    return *error == PACK_NOERROR;
 }
 
-static bool _loadFunction(OrbitVM* vm,
-                          FILE* in,
-                          OrbitValue* signature,
-                          OrbitValue* function,
-                          OrbitPackError* error)
-{
+static bool _loadFunction(FILE* in, uint16_t version, OrbitImageFunction* function, OrbitPackError* error) {
     if(!_expect(in, OMF_FUNCTION, error)) { return false; }
     if(!_expect(in, OMF_STRING, error)) { return false; }
-    if(!_loadString(vm, in, signature, error)) { return false; }
+    if(!_loadString(in, &function->signature, error)) { return false; }
     
-    uint8_t arity = orbit_unpack8(in, error);
+    function->arity = orbit_unpack8(in, error);
     if(*error != PACK_NOERROR) { return false; }
     
-    uint8_t localCount = orbit_unpack8(in, error);
+    function->localCount = orbit_unpack8(in, error);
     if(*error != PACK_NOERROR) { return false; }
     
-    uint8_t stackEffect = orbit_unpack8(in, error);
+    function->stackEffect = orbit_unpack8(in, error);
     if(*error != PACK_NOERROR) { return false; }
     
-    uint16_t byteCodeLength = orbit_unpack16(in, error);
+    function->byteCodeLength = orbit_unpack16(in, error);
     if(*error != PACK_NOERROR) { return false; }
     
-    OrbitVMFunction* impl = orbit_gcFunctionNew(vm, byteCodeLength);
-    
-    impl->arity = arity;
-    impl->localCount = localCount;
-    impl->stackEffect = stackEffect;
-    impl->native.byteCodeLength = byteCodeLength;
-    *error = orbit_unpackBytes(in, impl->native.byteCode, byteCodeLength);
+    function->byteCode = ORBIT_ALLOC_ARRAY(uint8_t, function->byteCodeLength);
+    *error = orbit_unpackBytes(in, function->byteCode, function->byteCodeLength);
     if(*error != PACK_NOERROR) { return false; }
     
-    *function = MAKE_OBJECT(impl);
+    if(version >= 0x02 && !_skipRegisterCode(in, error)) { return false; }
     return true;
 }
 
-OrbitVMModule* orbit_unpackModule(OrbitVM* vm, FILE* in) {
-    // TODO: implementation
-    assert(vm != NULL && "Null instance error");
+OrbitModuleImage* orbit_readImage(FILE* in) {
     assert(in != NULL && "Null file passed");
     
     OrbitPackError error = PACK_NOERROR;
     OrbitPackError* errorp = &error;
-    OrbitVMModule* module = orbit_gcModuleNew(vm);
     
-    // We don't want the module to get destroyed collected if the GC kicks
-    // in while we're creating it.
-    orbit_gcRetain(vm, (OrbitGCObject*)module);
+    // Counts are only set once the arrays are allocated and cleared, so that a
+    // partially loaded image can be released.
+    OrbitModuleImage* image = ORBIT_ALLOC_ARRAY(OrbitModuleImage, 1);
+    image->refCount = 1;
     
     if(!_checkSignature(in, errorp)) {
         fprintf(stderr, "error: invalid module file signature\n");
         goto fail;
     }
-    if(!_checkVersion(in, 0x01, errorp)) {
+    uint16_t version = 0;
+    if(!_checkVersion(in, &version, errorp)) {
         fprintf(stderr, "error: invalid module file version\n");
         goto fail;
     }
     
     // Read the constants in
-    module->constantCount = orbit_unpack16(in, errorp);
+    uint16_t constantCount = orbit_unpack16(in, errorp);
     if(error != PACK_NOERROR) {
         fprintf(stderr, "error: invalid module constant count\n");
         goto fail;
     }
-    module->constants = ALLOC_ARRAY(vm, OrbitValue, module->constantCount);
+    image->constants = ORBIT_ALLOC_ARRAY(OrbitImageConstant, constantCount);
+    image->constantCount = constantCount;
     
-    for(uint16_t i = 0; i < module->constantCount; ++i) {
-        if(!_loadConstant(vm, in, &module->constants[i], errorp)) {
+    for(uint16_t i = 0; i < image->constantCount; ++i) {
+        if(!_loadConstant(in, &image->constants[i], errorp)) {
             fprintf(stderr, "error: invalid module constant\n");
             goto fail;
         }
     }
     
     // Read the globals in
-    module->globalCount = orbit_unpack16(in, errorp);
+    uint16_t globalCount = orbit_unpack16(in, errorp);
     if(error != PACK_NOERROR) {
         fprintf(stderr, "error: invalid module global count\n");
         goto fail;
     }
-    module->globals = ALLOC_ARRAY(vm, OrbitVMGlobal, module->globalCount);
+    image->globals = ORBIT_ALLOC_ARRAY(OrbitImageString, globalCount);
+    image->globalCount = globalCount;
 
-    for(uint16_t i = 0; i < module->globalCount; ++i) {
+    for(uint16_t i = 0; i < image->globalCount; ++i) {
         if(!_expect(in, OMF_VARIABLE, errorp)) {
             fprintf(stderr, "error: invalid module variable tag\n");
             goto fail;
@@ -188,11 +184,10 @@ OrbitVMModule* orbit_unpackModule(OrbitVM* vm, FILE* in) {
             fprintf(stderr, "error: invalid module string tag\n");
             goto fail;
         }
-        if(!_loadString(vm, in, &module->globals[i].name, errorp)) {
+        if(!_loadString(in, &image->globals[i], errorp)) {
             fprintf(stderr, "error: invalid module global\n");
             goto fail;
         }
-        module->globals[i].global = VAL_NIL;
     }
     
     // Read user types in
@@ -201,13 +196,14 @@ OrbitVMModule* orbit_unpackModule(OrbitVM* vm, FILE* in) {
         fprintf(stderr, "error: invalid module class count\n");
         goto fail;
     }
-    for(uint8_t i = 0; i < classCount; ++i) {
-        OrbitValue name, class;
-        if(!_loadClass(vm, in, &name, &class, errorp)) {
-            goto fail;
+    image->classes = ORBIT_ALLOC_ARRAY(OrbitImageClass, classCount);
+    image->classCount = classCount;
+    
+    for(uint16_t i = 0; i < image->classCount; ++i) {
+        if(!_loadClass(in, &image->classes[i], errorp)) {
             fprintf(stderr, "error: invalid module class\n");
+            goto fail;
         }
-        orbit_gcMapAdd(vm, vm->classes, name, class);
     }
     
     // Read bytecode functions in
@@ -216,22 +212,112 @@ OrbitVMModule* orbit_unpackModule(OrbitVM* vm, FILE* in) {
         fprintf(stderr, "error: invalid module function count\n");
         goto fail;
     }
+    image->functions = ORBIT_ALLOC_ARRAY(OrbitImageFunction, functionCount);
+    image->functionCount = functionCount;
     
-    for(uint16_t i = 0; i < functionCount; ++i) {
-        OrbitValue signature, function;
-        if(!_loadFunction(vm, in, &signature, &function, errorp)) {
+    for(uint16_t i = 0; i < image->functionCount; ++i) {
+        if(!_loadFunction(in, version, &image->functions[i], errorp)) {
             fprintf(stderr, "error: invalid module function\n");
             goto fail;
         }
-        AS_FUNCTION(function)->module = module;
-        orbit_gcMapAdd(vm, vm->dispatchTable, signature, function);
     }
     
-    orbit_gcRelease(vm);
-    return module;
+    // Functions can only be verified once they can all be looked up.
+    for(uint16_t i = 0; i < image->functionCount; ++i) {
+        OrbitImageFunction* function = &image->functions[i];
+        if(!orbit_vmVerifyFunction(image, function)) {
+            fprintf(stderr, "error: invalid bytecode in `%s`\n", function->signature.data);
+            goto fail;
+        }
+    }
+    return image;
     
 fail:
     // TODO: design error model for VM
     fprintf(stderr, "error parsing module\n");
+    orbit_imageRelease(image);
     return NULL;
 }
+
+OrbitModuleImage* orbit_unpackImage(FILE* in) {
+    assert(in != NULL && "Null file passed");
+    
+    OrbitModuleImage* image = orbit_readImage(in);
+    if(!image) { return NULL; }
+    
+    // Optimising and fusing only depend on the code, so they are done once for
+    // every VM the image is loaded in.
+    orbit_imageOptimize(image);
+    for(uint16_t i = 0; i < image->functionCount; ++i) {
+        OrbitImageFunction* function = &image->functions[i];
+        function->byteCodeLength = orbit_vmFuseCode(function->byteCode, function->byteCodeLength);
+    }
+    return image;
+}
+
+OrbitVMModule* orbit_unpackModule(OrbitVM* vm, FILE* in) {
+    assert(vm != NULL && "Null instance error");
+    assert(in != NULL && "Null file passed");
+    
+    OrbitModuleImage* image = orbit_unpackImage(in);
+    if(!image) { return NULL; }
+    OrbitVMModule* module = orbit_imageInstantiate(vm, image);
+    orbit_imageRelease(image);
+    return module;
+}
+
+static void _packString(FILE* out, const OrbitImageString* string, OrbitPackError* error) {
+    if(*error == PACK_NOERROR) { *error = orbit_pack8(out, OMF_STRING); }
+    if(*error == PACK_NOERROR) { *error = orbit_pack16(out, string->length); }
+    if(*error == PACK_NOERROR) { *error = orbit_packBytes(out, (uint8_t*)string->data, string->length); }
+}
+
+static void _packFunction(FILE* out, const OrbitImageFunction* function, OrbitPackError* error) {
+    if(*error == PACK_NOERROR) { *error = orbit_pack8(out, OMF_FUNCTION); }
+    _packString(out, &function->signature, error);
+    if(*error == PACK_NOERROR) { *error = orbit_pack8(out, function->arity); }
+    if(*error == PACK_NOERROR) { *error = orbit_pack8(out, function->localCount); }
+    // Verification works out larger stack effects again when the file is loaded.
+    uint8_t stackEffect = function->stackEffect > UINT8_MAX ? UINT8_MAX : function->stackEffect;
+    if(*error == PACK_NOERROR) { *error = orbit_pack8(out, stackEffect); }
+    if(*error == PACK_NOERROR) { *error = orbit_pack16(out, function->byteCodeLength); }
+    if(*error == PACK_NOERROR) { *error = orbit_packBytes(out, function->byteCode, function->byteCodeLength); }
+}
+
+bool orbit_packImage(FILE* out, const OrbitModuleImage* image) {
+    assert(out != NULL && "Null file passed");
+    assert(image != NULL && "Null instance error");
+    
+    OrbitPackError error = orbit_packBytes(out, (uint8_t*)"OMFF", 4);
+    if(error == PACK_NOERROR) { error = orbit_pack16(out, OMF_VERSION); }
+    
+    if(error == PACK_NOERROR) { error = orbit_pack16(out, image->constantCount); }
+    for(uint16_t i = 0; error == PACK_NOERROR && i < image->constantCount; ++i) {
+        const OrbitImageConstant* constant = &image->constants[i];
+        if(constant->kind == OMF_STRING) {
+            _packString(out, &constant->string, &error);
+        } else {
+            error = orbit_pack8(out, OMF_NUM);
+            if(error == PACK_NOERROR) { error = orbit_packIEEE754(out, constant->number); }
+        }
+    }
+    
+    if(error == PACK_NOERROR) { error = orbit_pack16(out, image->globalCount); }
+    for(uint16_t i = 0; error == PACK_NOERROR && i < image->globalCount; ++i) {
+        error = orbit_pack8(out, OMF_VARIABLE);
+        _packString(out, &image->globals[i], &error);
+    }
+    
+    if(error == PACK_NOERROR) { error = orbit_pack16(out, image->classCount); }
+    for(uint16_t i = 0; error == PACK_NOERROR && i < image->classCount; ++i) {
+        error = orbit_pack8(out, OMF_CLASS);
+        _packString(out, &image->classes[i].name, &error);
+        if(error == PACK_NOERROR) { error = orbit_pack16(out, image->classes[i].fieldCount); }
+    }
+    
+    if(error == PACK_NOERROR) { error = orbit_pack16(out, image->functionCount); }
+    for(uint16_t i = 0; error == PACK_NOERROR && i < image->functionCount; ++i) {
+        _packFunction(out, &image->functions[i], &error);
+    }
+    return error == PACK_NOERROR;
+}
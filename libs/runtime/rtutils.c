@@ -11,19 +11,41 @@
 #include <orbit/runtime/rtutils.h>
 #include <orbit/runtime/vm.h>
 #include <orbit/runtime/gc.h>
+#include "vm_private.h"
+
+// Counts [size] bytes as allocated in [vm], and runs the collector if it is
+// time to.
+static inline void orbit_allocatorCount(OrbitVM* vm, size_t size) {
+    vm->allocated += size;
+    vm->nurseryAllocated += size;
+    vm->gcStats.allocatedBytes += size;
+    if(vm->gcPhase != ORBIT_GC_IDLE) {
+        orbit_gcStep(vm);
+    } else if(vm->allocated > vm->nextGC) {
+        orbit_gcStart(vm);
+    } else if(vm->nurseryAllocated > ORBIT_NURSERY_SIZE) {
+        orbit_gcRunMinor(vm);
+    }
+}
 
 void* orbit_allocator(OrbitVM* vm, void* ptr, size_t newSize) {
     assert(vm != NULL && "Null instance error");
-    vm->allocated += newSize;
-    if(vm->allocated > vm->nextGC) {
-        orbit_gcRun(vm);
-    }
-    
     if(newSize == 0) {
         free(ptr);
         return NULL;
     }
+    
+    orbit_allocatorCount(vm, newSize);
     void* mem = realloc(ptr, newSize);
     assert(mem != NULL && "Error reallocating memory");
     return mem;
 }
+
+void* orbit_objectAllocator(OrbitVM* vm, size_t size) {
+    assert(vm != NULL && "Null instance error");
+    
+    // The collector runs first, so it never sees a slot that was taken but
+    // isn't an object yet.
+    orbit_allocatorCount(vm, size);
+    return orbit_heapAllocate(vm, size);
+}
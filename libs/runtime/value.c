@@ -10,20 +10,29 @@
 #include <assert.h>
 #include <string.h>
 #include <orbit/utils/hashing.h>
+#include <orbit/runtime/gc.h>
+#include <orbit/runtime/image.h>
 #include <orbit/runtime/value.h>
 #include <orbit/runtime/rtutils.h>
 #include <orbit/runtime/vm.h>
+#include <orbit/utils/memory.h>
+#include "jit_private.h"
+#include "vm_private.h"
 
 // Initialises [object] as an instance of [class]. [class] can be NULL if the
-// object being initialized is a class itself.
+// object being initialized is a class itself. Objects allocated while a
+// collection is marking are marked already (see gc.h).
 static void orbit_objectInit(OrbitVM* vm, OrbitGCObject* object, OrbitGCClass* class) {
     assert(vm != NULL && "Null instance error");
     assert(object != NULL && "Null instance error");
     
     object->class = class;
-    object->mark = false;
-    object->next = vm->gcHead;
-    vm->gcHead = object;
+    object->old = false;
+    object->remembered = false;
+    if(vm->gcPhase == ORBIT_GC_MARK) {
+        orbit_heapMark(object);
+        orbit_gcMarkObject(vm, (OrbitGCObject*)class);
+    }
 }
 
 OrbitGCString* orbit_gcStringNew(OrbitVM* vm, const char* string) {
@@ -41,7 +50,7 @@ OrbitGCString* orbit_gcStringNew(OrbitVM* vm, const char* string) {
 OrbitGCString* orbit_gcStringReserve(OrbitVM* vm, size_t length) {
     assert(vm != NULL && "Null instance error");
     
-    OrbitGCString* object = ALLOC_FLEX(vm, OrbitGCString, char, length+1);
+    OrbitGCString* object = ALLOC_OBJECT_FLEX(vm, OrbitGCString, char, length+1);
     orbit_objectInit(vm, (OrbitGCObject*)object, NULL);
     
     object->base.kind = ORBIT_OBJK_STRING;
@@ -56,13 +65,33 @@ void orbit_gcStringComputeHash(OrbitGCString* string) {
     string->hash = orbit_hashString(string->data, string->length);
 }
 
+bool orbit_gcStringEquals(OrbitGCString* a, OrbitGCString* b) {
+    // Check for pointer equality first, then the hash, which rules out most
+    // different strings without touching their characters.
+    return (a == b)
+        || (a->hash == b->hash
+            && a->length == b->length
+            && memcmp(a->data, b->data, a->length) == 0);
+}
+
+bool orbit_valueEquals(OrbitValue a, OrbitValue b) {
+    if(IS_NUM(a) && IS_NUM(b)) { return AS_NUM(a) == AS_NUM(b); }
+    if(IS_STRING(a) && IS_STRING(b)) { return orbit_gcStringEquals(AS_STRING(a), AS_STRING(b)); }
+    if(IS_OBJECT(a) && IS_OBJECT(b)) { return AS_OBJECT(a) == AS_OBJECT(b); }
+    return (IS_NIL(a) && IS_NIL(b))
+        || (IS_BOOL(a) && IS_BOOL(b) && IS_TRUE(a) == IS_TRUE(b));
+}
+
 OrbitGCInstance* orbit_gcInstanceNew(OrbitVM* vm, OrbitGCClass* class) {
     assert(vm != NULL && "Null instance error");
     assert(class != NULL && "Null class error");
     
-    OrbitGCInstance* object = ALLOC_FLEX(vm, OrbitGCInstance, OrbitValue, class->fieldCount);
+    OrbitGCInstance* object = ALLOC_OBJECT_FLEX(vm, OrbitGCInstance, OrbitValue, class->fieldCount);
     orbit_objectInit(vm, (OrbitGCObject*)object, class);
     object->base.kind = ORBIT_OBJK_INSTANCE;
+    for(uint16_t i = 0; i < class->fieldCount; ++i) {
+        object->fields[i] = VAL_NIL;
+    }
     return object;
 }
 
@@ -70,13 +99,21 @@ OrbitGCClass* orbit_gcClassNew(OrbitVM* vm, OrbitGCString* name, uint16_t fieldC
     assert(vm != NULL && "Null instance error");
     assert(name != NULL && "Null instance error");
     
-    OrbitGCClass* class = ALLOC(vm, OrbitGCClass);
+    OrbitGCClass* class = ALLOC_OBJECT(vm, OrbitGCClass);
     orbit_objectInit(vm, (OrbitGCObject*)class, NULL);
     class->base.kind = ORBIT_OBJK_CLASS;
     class->name = name;
+    orbit_gcWriteBarrier(vm, (OrbitGCObject*)class, MAKE_OBJECT(name));
     class->super = NULL;
     class->fieldCount = fieldCount;
+    class->methods = NULL;
+    
+    // The class could be collected, or promoted, while its method map is
+    // allocated.
+    orbit_gcRetain(vm, (OrbitGCObject*)class);
     class->methods = orbit_gcMapNew(vm);
+    orbit_gcRelease(vm);
+    orbit_gcWriteBarrier(vm, (OrbitGCObject*)class, MAKE_OBJECT(class->methods));
     
     return class;
 }
@@ -84,28 +121,57 @@ OrbitGCClass* orbit_gcClassNew(OrbitVM* vm, OrbitGCString* name, uint16_t fieldC
 OrbitVMFunction* orbit_gcFunctionNew(OrbitVM* vm, uint16_t byteCodeLength) {
     assert(vm != NULL && "Null instance error");
     
-    OrbitVMFunction* function = ALLOC(vm, OrbitVMFunction);
+    OrbitVMFunction* function = ALLOC_OBJECT(vm, OrbitVMFunction);
     orbit_objectInit(vm, (OrbitGCObject*)function, NULL);
     function->base.kind = ORBIT_OBJK_FUNCTION;
     function->kind = ORBIT_FK_NATIVE;
     
     // By default the function lives in the wild
     function->module = NULL;
+    function->native.shared = 0;
+    function->native.verified = false;
     function->native.byteCode = ALLOC_ARRAY(vm, uint8_t, byteCodeLength);
     function->native.byteCodeLength = byteCodeLength;
+    function->native.threadedCode = NULL;
+    function->native.quickened = NULL;
+    function->native.regCodeLength = 0;
+    function->native.regCount = 0;
+    function->native.regCode = NULL;
+    function->native.retiredCount = 0;
+    function->native.retiredRegCode = NULL;
+    function->native.callCount = 0;
+    function->native.loopCounts = NULL;
+    function->native.jit = NULL;
+#ifdef ORBIT_VM_STATS
+    function->native.executionCounts = NULL;
+#endif
     
     function->arity = 0;
     function->localCount = 0;
     function->stackEffect = 0;
+    function->foreignResults = -1;
     
     return function;
 }
 
+OrbitVMFunction* orbit_gcFunctionSharedNew(OrbitVM* vm, uint8_t* byteCode, uint16_t byteCodeLength) {
+    assert(vm != NULL && "Null instance error");
+    
+    // Allocating the function could trigger a collection, so it needs to be
+    // created empty and pointed at the shared code after.
+    OrbitVMFunction* function = orbit_gcFunctionNew(vm, 0);
+    DEALLOC(vm, function->native.byteCode);
+    function->native.shared = ORBIT_SHARED_BYTECODE;
+    function->native.byteCode = byteCode;
+    function->native.byteCodeLength = byteCodeLength;
+    return function;
+}
+
 // Creates a new foreign function
 OrbitVMFunction* orbit_gcFunctionForeignNew(OrbitVM* vm, GCForeignFn ffi, uint8_t arity) {
     assert(vm != NULL && "Null instance error");
     
-    OrbitVMFunction* function = ALLOC(vm, OrbitVMFunction);
+    OrbitVMFunction* function = ALLOC_OBJECT(vm, OrbitVMFunction);
     orbit_objectInit(vm, (OrbitGCObject*)function, NULL);
     function->base.kind = ORBIT_OBJK_FUNCTION;
     function->kind = ORBIT_FK_FOREIGN;
@@ -116,6 +182,7 @@ OrbitVMFunction* orbit_gcFunctionForeignNew(OrbitVM* vm, GCForeignFn ffi, uint8_
     function->arity = arity;
     function->localCount = 0;
     function->stackEffect = 0;
+    function->foreignResults = -1;
     
     return function;
 }
@@ -123,10 +190,12 @@ OrbitVMFunction* orbit_gcFunctionForeignNew(OrbitVM* vm, GCForeignFn ffi, uint8_
 OrbitVMModule* orbit_gcModuleNew(OrbitVM* vm) {
     assert(vm != NULL && "Null instance error");
     
-    OrbitVMModule* module = ALLOC(vm, OrbitVMModule);
+    OrbitVMModule* module = ALLOC_OBJECT(vm, OrbitVMModule);
     orbit_objectInit(vm, (OrbitGCObject*)module, NULL);
     module->base.kind = ORBIT_OBJK_MODULE;
+    orbit_gcRemember(vm, (OrbitGCObject*)module);
     
+    module->image = NULL;
     module->constantCount = 0;
     module->constants = NULL;
     module->globalCount = 0;
@@ -137,29 +206,26 @@ OrbitVMModule* orbit_gcModuleNew(OrbitVM* vm) {
 
 OrbitVMTask* orbit_gcTaskNew(OrbitVM* vm, OrbitVMFunction* function) {
     
-    OrbitVMTask* task = ALLOC(vm, OrbitVMTask);
+    OrbitVMTask* task = ALLOC_OBJECT(vm, OrbitVMTask);
     orbit_objectInit(vm, (OrbitGCObject*)task, NULL);
     task->base.kind = ORBIT_OBJK_TASK;
-    
-    task->stack = ALLOC_ARRAY(vm, OrbitValue, 512);
-    task->stackCapacity = 512;
-    
-    task->frames = ALLOC_ARRAY(vm, OrbitVMTask, 32);
-    task->frameCapacity = 32;
-    
-    // Create the first frame
-    task->frameCount = 1;
-    OrbitVMFrame* frame = &task->frames[0];
-    
-    frame->task = task; // FIXME: not required? prob. not accesed
-    frame->function = function;
-    frame->ip = function->native.byteCode;
-    frame->stackBase = task->stack;
-    
-    // Put the stack pointer where it should be, after the entry point's
-    // locals table.
-    task->sp = frame->stackBase + function->localCount;
-    
+    orbit_gcRemember(vm, (OrbitGCObject*)task);
+    
+    // The stack is allocated after the task is linked into the GC's list, so
+    // the task must be valid (and retained) in case that triggers a collection.
+    task->stack = task->sp = NULL;
+    task->frames = NULL;
+    task->frameCount = 0;
+    task->waiters = task->next = NULL;
+    task->result = VAL_NIL;
+    
+    orbit_gcRetain(vm, (OrbitGCObject*)task);
+    if(!orbit_vmStackInit(vm, task)) {
+        fprintf(stderr, "error: cannot allocate task stack\n");
+        abort();
+    }
+    orbit_vmTaskReset(vm, task, function);
+    orbit_gcRelease(vm);
     return task;
 }
 
@@ -187,21 +253,35 @@ void orbit_gcDeallocate(OrbitVM* vm, OrbitGCObject* object) {
         
     case ORBIT_OBJK_FUNCTION:
         if(((OrbitVMFunction*)object)->kind == ORBIT_FK_NATIVE) {
-            DEALLOC(vm, ((OrbitVMFunction*)object)->native.byteCode);
+            GCNativeFn* native = &((OrbitVMFunction*)object)->native;
+            if(!(native->shared & ORBIT_SHARED_BYTECODE)) { DEALLOC(vm, native->byteCode); }
+            DEALLOC(vm, native->regCode);
+            for(uint16_t i = 0; i < native->retiredCount; ++i) {
+                DEALLOC(vm, native->retiredRegCode[i]);
+            }
+            DEALLOC(vm, native->retiredRegCode);
+            DEALLOC(vm, native->threadedCode);
+            DEALLOC(vm, native->quickened);
+#ifdef ORBIT_VM_STATS
+            orbit_dealloc(native->executionCounts);
+#endif
+            orbit_jitRelease(vm, (OrbitVMFunction*)object);
         }
         break;
         
     case ORBIT_OBJK_MODULE:
         DEALLOC(vm, ((OrbitVMModule*)object)->constants);
         DEALLOC(vm, ((OrbitVMModule*)object)->globals);
+        if(((OrbitVMModule*)object)->image) {
+            orbit_imageRelease(((OrbitVMModule*)object)->image);
+        }
         break;
         
     case ORBIT_OBJK_TASK:
-        DEALLOC(vm, ((OrbitVMTask*)object)->stack);
-        DEALLOC(vm, ((OrbitVMTask*)object)->frames);
+        orbit_vmStackDeinit(vm, (OrbitVMTask*)object);
         break;
     }
-    DEALLOC(vm, object);
+    orbit_heapFree(&vm->heap, object);
 }
 
 // MARK: - Map functions implementations
@@ -219,12 +299,12 @@ static void orbit_gcMapGrow(OrbitVM* vm, OrbitGCMap* map) {
     uint32_t oldCapacity = map->capacity;
     OrbitGCMapEntry* oldData = map->data;
     
-    if(map->capacity == 0)
-        map->capacity = GCMAP_DEFAULT_CAPACITY;
-    else
-        map->capacity = map->capacity << 1;
-    
-    map->data = ALLOC_ARRAY(vm, OrbitGCMapEntry, map->capacity);
+    // The new entries are allocated first, since the map is still marked
+    // with its old ones if that triggers a collection.
+    uint32_t capacity = oldCapacity ? oldCapacity << 1 : GCMAP_DEFAULT_CAPACITY;
+    OrbitGCMapEntry* data = ALLOC_ARRAY(vm, OrbitGCMapEntry, capacity);
+    map->capacity = capacity;
+    map->data = data;
     map->size = 0;
     map->mask = map->capacity - 1;
     
@@ -243,16 +323,10 @@ static void orbit_gcMapGrow(OrbitVM* vm, OrbitGCMap* map) {
 // Custom equality check for map, we avoid unused cases (only number and string
 // comparisons)
 static inline bool orbit_gcMapComp(OrbitValue a, OrbitValue b) {
-    if(IS_NUM(a) && IS_NUM(b)) {
-        return AS_NUM(a) == AS_NUM(b);
+    if(IS_NUM(a) || IS_NUM(b)) {
+        return IS_NUM(a) && IS_NUM(b) && AS_NUM(a) == AS_NUM(b);
     }
-    OrbitGCString* stra = AS_STRING(a);
-    OrbitGCString* strb = AS_STRING(b);
-    // Check for pointer equality first.
-    return (stra == strb)
-        || (stra->length == strb->length
-            && stra->hash == strb->hash
-            && memcmp(stra->data, strb->data, stra->length) == 0); 
+    return orbit_gcStringEquals(AS_STRING(a), AS_STRING(b));
 }
 
 // Find the entry in [map] keyed by [key], or return a pointer to the entry
@@ -286,13 +360,17 @@ static OrbitGCMapEntry* orbit_gcMapFindSlot(OrbitGCMap* map, OrbitValue key) {
 OrbitGCMap* orbit_gcMapNew(OrbitVM* vm) {
     assert(vm != NULL && "Null instance error");
     
-    OrbitGCMap* map = ALLOC(vm, OrbitGCMap);
+    OrbitGCMap* map = ALLOC_OBJECT(vm, OrbitGCMap);
     orbit_objectInit(vm, (OrbitGCObject*)map, NULL/* TODO: replace with Map class*/);
     map->base.kind = ORBIT_OBJK_MAP;
     
     map->data = NULL;
     map->capacity = 0;
+    
+    // Growing the map could trigger a collection before anything points to it.
+    orbit_gcRetain(vm, (OrbitGCObject*)map);
     orbit_gcMapGrow(vm, map);
+    orbit_gcRelease(vm);
     
     return map;
 }
@@ -312,6 +390,8 @@ void orbit_gcMapAdd(OrbitVM* vm, OrbitGCMap* map, OrbitValue key, OrbitValue val
     }
     slot->key = key;
     slot->value = value;
+    orbit_gcWriteBarrier(vm, (OrbitGCObject*)map, key);
+    orbit_gcWriteBarrier(vm, (OrbitGCObject*)map, value);
 }
 
 bool orbit_gcMapGet(OrbitGCMap* map, OrbitValue key, OrbitValue* value) {
@@ -363,14 +443,17 @@ static void orbit_gcArrayGrow(OrbitVM* vm, OrbitGCArray* array) {
 OrbitGCArray* orbit_gcArrayNew(OrbitVM* vm) {
     assert(vm != NULL && "Null instance error");
     
-    OrbitGCArray* array = ALLOC(vm, OrbitGCArray);
+    OrbitGCArray* array = ALLOC_OBJECT(vm, OrbitGCArray);
     orbit_objectInit(vm, (OrbitGCObject*)array, NULL);
     array->base.kind = ORBIT_OBJK_ARRAY;
     
     array->data = NULL;
     array->capacity = 0;
     array->size = 0;
+    
+    orbit_gcRetain(vm, (OrbitGCObject*)array);
     orbit_gcArrayGrow(vm, array);
+    orbit_gcRelease(vm);
     
     return array;
 }
@@ -383,6 +466,7 @@ void orbit_gcArrayAdd(OrbitVM* vm, OrbitGCArray* array, OrbitValue value) {
         orbit_gcArrayGrow(vm, array);
     }
     array->data[array->size++] = value;
+    orbit_gcWriteBarrier(vm, (OrbitGCObject*)array, value);
 }
 
 bool orbit_gcArrayGet(OrbitGCArray* array, uint32_t index, OrbitValue* value) {
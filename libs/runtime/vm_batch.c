@@ -0,0 +1,269 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_batch.c - Running one function over many sets of arguments
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-15 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  A batch is run by a prepared call's task, in a single interpreter entry.
+//  When the task returns from its entry point, orbit_vmTaskFinished() hands it
+//  to orbit_vmBatchNext(), which stores the result, resets the task with the
+//  next arguments and puts it back in the run queue. The host side (guarded
+//  stack handler, string pool, caller task) is only set up once per batch,
+//  and the collector finds the arguments and results through the call.
+//
+//  Batches of isolated functions can also be split between VMs that each run
+//  on their own thread. VMs don't share anything but the module image they
+//  were loaded from, so the only requirement is that the function doesn't
+//  depend on state a VM accumulates: its module's globals, or the host's.
+//
+#include <assert.h>
+#include <string.h>
+#include <orbit/runtime/vm.h>
+#include <orbit/utils/memory.h>
+#include "vm_private.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+static void orbit_vmBatchLoad(OrbitVMCall* call) {
+    uint8_t arity = call->function->arity;
+    memcpy(call->task->stack, call->batchArgs + call->batchDone * arity, arity * sizeof(OrbitValue));
+}
+
+bool orbit_vmBatchNext(OrbitVM* vm, OrbitVMCall* call) {
+    assert(vm != NULL && "Null instance error");
+    assert(call != NULL && "Null instance error");
+
+    call->batchResults[call->batchDone++] = call->task->result;
+    if(call->batchDone == call->batchCount) { return false; }
+
+    orbit_vmTaskReset(vm, call->task, call->function);
+    orbit_vmBatchLoad(call);
+    return true;
+}
+
+bool orbit_vmCallBatch(OrbitVM* vm, OrbitVMCall* call,
+                       const OrbitValue* args, OrbitValue* results, uint32_t count) {
+    assert(vm != NULL && "Null instance error");
+    assert(call != NULL && "Null instance error");
+    assert(!call->running && "prepared call is already running");
+    assert(call->argCount == 0 && "arguments pushed before a batch");
+    if(count == 0) { return true; }
+    assert(args != NULL && results != NULL && "Null batch buffers");
+
+    call->batchArgs = args;
+    call->batchResults = results;
+    call->batchCount = count;
+    call->batchDone = 0;
+    orbit_vmBatchLoad(call);
+
+    // Foreign functions can run batches of their own.
+    OrbitVMCall* outer = vm->batch;
+    vm->batch = call;
+    call->running = true;
+    bool result = orbit_vmRunNested(vm, call->task);
+    call->running = false;
+    vm->batch = outer;
+
+    uint32_t done = call->batchDone;
+    for(uint32_t i = done; i < count; ++i) {
+        results[i] = VAL_NIL;
+    }
+    call->result = done ? results[done-1] : VAL_NIL;
+    call->batchArgs = NULL;
+    call->batchResults = NULL;
+    call->batchCount = call->batchDone = 0;
+    orbit_vmTaskReset(vm, call->task, call->function);
+    return result && done == count;
+}
+
+// Functions are looked at once each, and calls nested deeper than this are
+// assumed not to be isolated.
+#define ORBIT_ISOLATION_DEPTH 64
+
+typedef struct {
+    OrbitVMFunction*    seen[ORBIT_ISOLATION_DEPTH];
+    uint32_t            count;
+} OrbitIsolationCheck;
+
+static bool orbit_vmIsIsolated(OrbitVM* vm, OrbitVMFunction* function, OrbitIsolationCheck* check) {
+    if(function->kind != ORBIT_FK_NATIVE) { return false; }
+    for(uint32_t i = 0; i < check->count; ++i) {
+        if(check->seen[i] == function) { return true; }
+    }
+    if(check->count == ORBIT_ISOLATION_DEPTH) { return false; }
+    check->seen[check->count++] = function;
+
+    const uint8_t* code = function->native.byteCode;
+    OrbitValue* constants = function->module->constants;
+    for(uint32_t offset = 0; offset < function->native.byteCodeLength;) {
+        uint8_t op = code[offset];
+        uint32_t next = offset + 1 + orbit_vmOperandBytes[op];
+
+        switch(op) {
+        case CODE_load_global:
+        case CODE_store_global:
+            return false;
+
+        case CODE_invoke_sym:
+        case CODE_invoke:
+        case CODE_spawn_sym:
+        case CODE_spawn: {
+            // Call sites that haven't run yet still hold the symbol.
+            OrbitValue callee = constants[(code[offset+1] << 8) | code[offset+2]];
+            if(!IS_FUNCTION(callee) && !orbit_gcMapGet(vm->dispatchTable, callee, &callee)) {
+                return false;
+            }
+            if(!IS_FUNCTION(callee) || !orbit_vmIsIsolated(vm, AS_FUNCTION(callee), check)) {
+                return false;
+            }
+            break;
+        }
+
+        default:
+            break;
+        }
+        offset = next;
+    }
+    return true;
+}
+
+bool orbit_vmFunctionIsIsolated(OrbitVM* vm, OrbitVMFunction* function) {
+    assert(vm != NULL && "Null instance error");
+    assert(function != NULL && "Null instance error");
+    OrbitIsolationCheck check;
+    check.count = 0;
+    return orbit_vmIsIsolated(vm, function, &check);
+}
+
+#ifndef NDEBUG
+// Whether [a] and [b] have the same bytecode, ignoring quickened opcodes: each
+// VM rewrites its own copy of the code as it runs it.
+static bool orbit_vmSameCode(OrbitVMFunction* a, OrbitVMFunction* b) {
+    if(a->kind != ORBIT_FK_NATIVE || b->kind != ORBIT_FK_NATIVE) { return a == b; }
+    if(a->arity != b->arity || a->native.byteCodeLength != b->native.byteCodeLength) {
+        return false;
+    }
+    const uint8_t* codeA = a->native.byteCode;
+    const uint8_t* codeB = b->native.byteCode;
+    for(uint32_t offset = 0; offset < a->native.byteCodeLength;) {
+        uint8_t size = orbit_vmOperandBytes[codeA[offset]];
+        if(size != orbit_vmOperandBytes[codeB[offset]]) { return false; }
+        if(memcmp(codeA + offset + 1, codeB + offset + 1, size) != 0) { return false; }
+        offset += 1 + size;
+    }
+    return true;
+}
+#endif
+
+typedef struct {
+    OrbitVM*            vm;
+    OrbitVMCall*        call;
+    const OrbitValue*   args;
+    OrbitValue*         results;
+    uint32_t            count;
+    bool                result;
+} OrbitBatchSlice;
+
+#ifdef _WIN32
+typedef HANDLE OrbitThread;
+
+static DWORD WINAPI orbit_vmBatchWorker(LPVOID data) {
+    OrbitBatchSlice* slice = data;
+    slice->result = orbit_vmCallBatch(slice->vm, slice->call, slice->args, slice->results, slice->count);
+    return 0;
+}
+
+static bool orbit_vmThreadStart(OrbitThread* thread, OrbitBatchSlice* slice) {
+    *thread = CreateThread(NULL, 0, orbit_vmBatchWorker, slice, 0, NULL);
+    return *thread != NULL;
+}
+
+static void orbit_vmThreadJoin(OrbitThread thread) {
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+#else
+typedef pthread_t OrbitThread;
+
+static void* orbit_vmBatchWorker(void* data) {
+    OrbitBatchSlice* slice = data;
+    slice->result = orbit_vmCallBatch(slice->vm, slice->call, slice->args, slice->results, slice->count);
+    return NULL;
+}
+
+static bool orbit_vmThreadStart(OrbitThread* thread, OrbitBatchSlice* slice) {
+    return pthread_create(thread, NULL, orbit_vmBatchWorker, slice) == 0;
+}
+
+static void orbit_vmThreadJoin(OrbitThread thread) {
+    pthread_join(thread, NULL);
+}
+#endif
+
+bool orbit_vmCallBatchParallel(OrbitVM** vms, OrbitVMCall** calls, uint32_t workerCount,
+                               const OrbitValue* args, OrbitValue* results, uint32_t count) {
+    assert(vms != NULL && calls != NULL && "Null instance error");
+    assert(workerCount > 0 && "a batch needs at least one worker");
+
+    uint8_t arity = calls[0]->function->arity;
+    for(uint32_t i = 0; i < count * arity; ++i) {
+        assert(!IS_OBJECT(args[i]) && "objects can't be passed to other VMs");
+    }
+    // Each VM resolves calls through its own dispatch table.
+    bool isolated = true;
+    for(uint32_t i = 0; i < workerCount; ++i) {
+        assert(orbit_vmSameCode(calls[i]->function, calls[0]->function)
+               && "workers must run the same function");
+        isolated = isolated && orbit_vmFunctionIsIsolated(vms[i], calls[i]->function);
+    }
+    if(workerCount == 1 || count < workerCount || !isolated) {
+        return orbit_vmCallBatch(vms[0], calls[0], args, results, count);
+    }
+
+    OrbitBatchSlice* slices = ORBIT_ALLOC_ARRAY(OrbitBatchSlice, workerCount);
+    OrbitThread* threads = ORBIT_ALLOC_ARRAY(OrbitThread, workerCount);
+    bool* started = ORBIT_ALLOC_ARRAY(bool, workerCount);
+
+    uint32_t perWorker = (count + workerCount - 1) / workerCount;
+    for(uint32_t i = 0; i < workerCount; ++i) {
+        uint32_t start = i * perWorker;
+        uint32_t end = start + perWorker < count ? start + perWorker : count;
+
+        slices[i].vm = vms[i];
+        slices[i].call = calls[i];
+        slices[i].args = args + start * arity;
+        slices[i].results = results + start;
+        slices[i].count = start < end ? end - start : 0;
+        slices[i].result = false;
+    }
+
+    // The calling thread runs the first slice itself, and any slice no thread
+    // could be started for.
+    for(uint32_t i = 1; i < workerCount; ++i) {
+        started[i] = orbit_vmThreadStart(&threads[i], &slices[i]);
+    }
+    slices[0].result = orbit_vmCallBatch(vms[0], calls[0], slices[0].args,
+                                         slices[0].results, slices[0].count);
+
+    bool result = slices[0].result;
+    for(uint32_t i = 1; i < workerCount; ++i) {
+        if(started[i]) {
+            orbit_vmThreadJoin(threads[i]);
+        } else {
+            orbit_vmBatchWorker(&slices[i]);
+        }
+        result = result && slices[i].result;
+    }
+
+    orbit_dealloc(slices);
+    orbit_dealloc(threads);
+    orbit_dealloc(started);
+    return result;
+}
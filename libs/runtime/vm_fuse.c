@@ -0,0 +1,186 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_fuse.c - Load-time superinstruction fusing
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-11 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  A peephole pass that rewrites common opcode sequences into the
+//  superinstructions declared at the end of opcodes.h. The set was picked from
+//  opcode pair counts collected on the VM benchmarks and tests: by far the most
+//  frequent pairs are `load_local; load_const`, `test_lt; [r]jump_if` and
+//  `store_local; load_local`, which between them make up most of the
+//  dispatches of numeric loops and recursive calls.
+//
+//  Fused instructions are shorter than the sequences they replace, so the code
+//  is compacted and every jump offset is recomputed from a map of old to new
+//  instruction offsets. A sequence is only fused if none of its instructions
+//  but the first is the target of a jump, so every target still exists in the
+//  rewritten code.
+//
+#include <assert.h>
+#include <string.h>
+#include <orbit/runtime/vm.h>
+#include <orbit/utils/memory.h>
+#include <orbit/utils/platforms.h>
+#include "vm_private.h"
+
+typedef struct {
+    VMCode      fused;
+    uint8_t     count;
+    VMCode      codes[3];
+} OrbitFusion;
+
+// Tried in order, so longer sequences must come before their prefixes.
+static const OrbitFusion orbit_vmFusions[] = {
+    {CODE_add_ll,           3, {CODE_load_local, CODE_load_local, CODE_add}},
+    {CODE_load_local2,      2, {CODE_load_local, CODE_load_local}},
+    {CODE_load_local_const, 2, {CODE_load_local, CODE_load_const}},
+    {CODE_load_local_field, 2, {CODE_load_local, CODE_load_field}},
+    {CODE_store_load_local, 2, {CODE_store_local, CODE_load_local}},
+    {CODE_jump_if_lt,       2, {CODE_test_lt, CODE_jump_if}},
+    {CODE_rjump_if_lt,      2, {CODE_test_lt, CODE_rjump_if}},
+};
+
+#define FUSION_COUNT (sizeof(orbit_vmFusions) / sizeof(orbit_vmFusions[0]))
+
+// Returns 1 for forward jumps, -1 for backward ones and 0 for everything else.
+// The offset of every jump is the last two bytes of the instruction, counted
+// from the end of the instruction.
+static int orbit_vmJumpDirection(uint8_t code) {
+    switch(code) {
+    case CODE_jump:
+    case CODE_jump_if:
+    case CODE_jump_if_lt:
+        return 1;
+    case CODE_rjump:
+    case CODE_rjump_if:
+    case CODE_rjump_if_lt:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+static inline uint16_t orbit_vmJumpOffset(const uint8_t* code, uint32_t next) {
+    return (code[next-2] << 8) | code[next-1];
+}
+
+// Returns the fusion that matches the instructions starting at [at], or NULL.
+static const OrbitFusion* orbit_vmMatchFusion(const uint8_t* code, const uint16_t* starts,
+                                              const bool* targets, uint32_t at, uint32_t count) {
+    for(size_t i = 0; i < FUSION_COUNT; ++i) {
+        const OrbitFusion* fusion = &orbit_vmFusions[i];
+        if(at + fusion->count > count) { continue; }
+
+        bool match = true;
+        for(uint8_t j = 0; match && j < fusion->count; ++j) {
+            match = code[starts[at+j]] == fusion->codes[j]
+                 && (j == 0 || !targets[starts[at+j]]);
+        }
+        if(match) { return fusion; }
+    }
+    return NULL;
+}
+
+uint16_t orbit_vmFuseCode(uint8_t* code, uint16_t length) {
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_REGISTERS
+    // The register translator does its own fusing, and only reads the opcodes
+    // the compiler emits.
+    return length;
+#endif
+    if(length == 0) { return length; }
+
+    uint16_t* starts = ORBIT_ALLOC_ARRAY(uint16_t, length);
+    uint16_t* map = ORBIT_ALLOC_ARRAY(uint16_t, length + 1);
+    bool* targets = ORBIT_ALLOC_ARRAY(bool, length + 1);
+    uint8_t* fused = ORBIT_ALLOC_ARRAY(uint8_t, length);
+    uint16_t* oldEnds = ORBIT_ALLOC_ARRAY(uint16_t, length);
+    memset(targets, 0, (length + 1) * sizeof(bool));
+
+    // Find instructions and jump targets. Malformed code is left alone, and
+    // will fail wherever it would have failed before.
+    uint32_t count = 0;
+    bool ok = true;
+    for(uint32_t offset = 0; ok && offset < length;) {
+        uint8_t op = code[offset];
+        uint32_t next = offset + 1 + orbit_vmOperandBytes[op];
+        ok = next <= length;
+        if(ok && orbit_vmJumpDirection(op)) {
+            uint16_t distance = orbit_vmJumpOffset(code, next);
+            int64_t target = next + orbit_vmJumpDirection(op) * (int64_t)distance;
+            ok = target >= 0 && target <= length;
+            if(ok) { targets[target] = true; }
+        }
+        starts[count++] = offset;
+        offset = next;
+    }
+
+    // Copy instructions to [fused], remembering where each new instruction's
+    // last original instruction ended: that is where its jump offset counts
+    // from in the original code.
+    uint32_t newLength = 0;
+    for(uint32_t i = 0; ok && i < count;) {
+        const OrbitFusion* fusion = orbit_vmMatchFusion(code, starts, targets, i, count);
+        uint8_t instructions = fusion ? fusion->count : 1;
+        uint16_t newStart = newLength;
+
+        fused[newLength++] = fusion ? fusion->fused : code[starts[i]];
+        for(uint8_t j = 0; j < instructions; ++j, ++i) {
+            uint16_t start = starts[i];
+            uint8_t operands = orbit_vmOperandBytes[code[start]];
+            map[start] = newStart;
+            memcpy(fused + newLength, code + start + 1, operands);
+            newLength += operands;
+            oldEnds[newStart] = start + 1 + operands;
+        }
+    }
+    map[length] = newLength;
+
+    // Every jump's target is an instruction start, which [map] knows the new
+    // offset of.
+    for(uint32_t offset = 0; ok && offset < newLength;) {
+        uint8_t op = fused[offset];
+        uint32_t next = offset + 1 + orbit_vmOperandBytes[op];
+        int direction = orbit_vmJumpDirection(op);
+        if(direction) {
+            uint16_t oldNext = oldEnds[offset];
+            uint16_t distance = orbit_vmJumpOffset(code, oldNext);
+            uint16_t target = map[oldNext + direction * (int32_t)distance];
+            uint16_t newDistance = direction > 0 ? target - next : next - target;
+            fused[next-2] = (newDistance >> 8) & 0xff;
+            fused[next-1] = newDistance & 0xff;
+        }
+        offset = next;
+    }
+
+    if(ok && newLength < length) {
+        memcpy(code, fused, newLength);
+    } else {
+        newLength = length;
+    }
+
+    orbit_dealloc(starts);
+    orbit_dealloc(map);
+    orbit_dealloc(targets);
+    orbit_dealloc(fused);
+    orbit_dealloc(oldEnds);
+    return newLength;
+}
+
+void orbit_vmFuseFunction(OrbitVM* vm, OrbitVMFunction* function) {
+    assert(vm != NULL && "Null instance error");
+    assert(function != NULL && "Null instance error");
+    if(function->kind != ORBIT_FK_NATIVE) { return; }
+    // Offsets into the bytecode might already be recorded elsewhere, and
+    // shared code was fused when its image was loaded.
+    if(function->native.jit || function->native.loopCounts) { return; }
+    if(function->native.shared & ORBIT_SHARED_BYTECODE) { return; }
+
+    uint16_t length = orbit_vmFuseCode(function->native.byteCode, function->native.byteCodeLength);
+    if(length == function->native.byteCodeLength) { return; }
+    function->native.byteCodeLength = length;
+    if(function->native.threadedCode) { orbit_vmPrepareFunction(vm, function); }
+}
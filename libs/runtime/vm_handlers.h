@@ -0,0 +1,591 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_handlers.h - Opcode implementations shared by every dispatch engine
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-02 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  This file is not a normal header: it is included by vm_interpret.c once the
+//  dispatch engine's macros are defined, and expands to the body of every
+//  opcode listed in opcodes.h. Each engine turns HANDLER(code) { ... } into
+//  something it can dispatch to (a case label, a goto label or a function).
+//
+//  Handlers have access to the interpreter's registers (vm, task, frame, fn,
+//  ip, locals) and must only touch [ip] through the READ/PATCH/SAVE_IP/LOAD_IP
+//  macros, since its type depends on the engine.
+//
+//  Engine macros: HANDLER(code), NEXT(), READ8(), READ16(), PATCH(back, code),
+//  SAVE_IP(), LOAD_IP(), ENTER_FUNCTION().
+//
+
+// Verified functions never push past the room reserved when they are called
+// (see vm_verify.c). Other functions can, and unless the guard pages catch it,
+// each of their pushes checks for room and grows the stack if needed.
+#ifdef ORBIT_GUARDED_STACKS
+#define CHECK_STACK() ((void)0)
+#else
+#define CHECK_STACK()                                                               \
+    ((fn->native.verified || task->sp < task->stack + task->stackCapacity) ? (void)0 \
+        : (orbit_vmEnsureStack(vm, task, 1), (void)(locals = frame->stackBase)))
+#endif
+
+#define PUSH(value) (CHECK_STACK(), *(task->sp++) = (value))
+#define PEEK() (*(task->sp - 1))
+#define POP() (*(--task->sp))
+#define DROP() (--task->sp)
+
+// Operands of verified functions were checked when their module was loaded
+// (see vm_verify.c). Other functions check them as they run, and stop with a
+// runtime error instead of reading out of bounds.
+#define CHECK_OPERAND(cond) do { if(!fn->native.verified && !(cond)) return false; } while(0)
+
+// Hands control to [fn]'s machine code, if it has been compiled, until it
+// reaches an instruction only the interpreter can run. Used wherever the
+// interpreter starts running a function again: on entry, and after calls.
+#ifdef ORBIT_JIT_ENABLED
+#define JIT_RESUME()                                                                \
+    do {                                                                            \
+        if(fn->native.jit) {                                                        \
+            SAVE_IP();                                                              \
+            frame->ip = orbit_jitRun(task, frame);                                  \
+            LOAD_IP();                                                              \
+        }                                                                           \
+    } while(0)
+#define JIT_COUNT()                                                                 \
+    do {                                                                            \
+        if(++fn->native.callCount == ORBIT_JIT_THRESHOLD) orbit_jitCompile(vm, fn); \
+    } while(0)
+// Called after a backward jump of [distance] bytes was taken. Once the loop is
+// hot, the running frame is moved to compiled code at the loop's header (OSR).
+// The jump instruction itself starts 3 bytes before the end of the jump.
+#define JIT_LOOP(distance)                                                          \
+    do {                                                                            \
+        SAVE_IP();                                                                  \
+        uint16_t edge_ = (frame->ip - fn->native.byteCode) + (distance) - 3;        \
+        if(fn->native.jit || orbit_jitLoop(vm, fn, edge_)) {                        \
+            frame->ip = orbit_jitRun(task, frame);                                  \
+            LOAD_IP();                                                              \
+        }                                                                           \
+    } while(0)
+#else
+#define JIT_RESUME() do {} while(0)
+#define JIT_COUNT() do {} while(0)
+#define JIT_LOOP(distance) do {} while(0)
+#endif
+
+// Invocation is shared by `invoke` and `invoke_sym`. [callee] must be a value
+// that was just loaded from the constant pool.
+#define INVOKE(callee)                                                              \
+    do {                                                                            \
+        if(!IS_FUNCTION(callee)) return false;                                      \
+        OrbitVMFunction* callee_ = AS_FUNCTION(callee);                             \
+        /* First, we need to store the data brought up into locals back             \
+           into the task's frame stack. */                                          \
+        SAVE_IP();                                                                  \
+                                                                                    \
+        if(callee_->kind == ORBIT_FK_FOREIGN) {                                     \
+            /* Foreign functions without parameters return above the stack. */     \
+            CHECK_STACK();                                                          \
+            ORBIT_TRACE_CALL(vm, callee_, task);                                    \
+            if(callee_->foreign(vm, task->sp - callee_->arity)) {                   \
+                task->sp -= (callee_->arity - 1);                                   \
+            } else {                                                                \
+                task->sp -= callee_->arity;                                         \
+            }                                                                       \
+            ORBIT_TRACE_RETURN(vm, callee_, task);                                  \
+            JIT_RESUME();                                                           \
+            NEXT();                                                                 \
+        }                                                                           \
+        /* Get the pointer to the function object for convenience */               \
+        fn = callee_;                                                               \
+        JIT_COUNT();                                                                \
+        orbit_vmReserveCall(vm, task, fn->stackEffect);                             \
+                                                                                    \
+        /* setup a new frame on the task's call stack */                            \
+        frame = &task->frames[task->frameCount++];                                  \
+        frame->task = task;                                                         \
+        frame->function = fn;                                                       \
+        frame->ip = fn->native.byteCode;                                            \
+                                                                                    \
+        /* The stack base points to the first parameter */                          \
+        frame->stackBase = task->sp - fn->arity;                                    \
+        locals = frame->stackBase;                                                  \
+                                                                                    \
+        /* Move the stack pointer up so we have room reserved for                   \
+           local variables */                                                       \
+        task->sp += fn->localCount;                                                 \
+        ORBIT_TRACE_CALL(vm, fn, task);                                             \
+                                                                                    \
+        /* And now we bring up the new frame's IP into the local.                   \
+           NEXT() will start the new function. */                                   \
+        ENTER_FUNCTION();                                                           \
+        JIT_RESUME();                                                               \
+        NEXT();                                                                     \
+    } while(0)
+
+// Switches the interpreter to [next]: its registers are reloaded from the top
+// frame of its call stack, which is where it was suspended (or its entry point,
+// for a task that never ran).
+#define SWITCH_TASK(next)                                                           \
+    do {                                                                            \
+        task = (next);                                                              \
+        vm->task = task;                                                            \
+        frame = &task->frames[task->frameCount-1];                                  \
+        fn = frame->function;                                                       \
+        locals = frame->stackBase;                                                  \
+        ORBIT_TRACE_TASK(vm, task);                                                 \
+        LOAD_IP();                                                                  \
+        JIT_RESUME();                                                               \
+        NEXT();                                                                     \
+    } while(0)
+
+// When we reach `ret`, the function that has just finished its job might not
+// have left a clean stack. Functions in orbit consume their parameters: they
+// are considered off the stack once the function returns. To do that, we reset
+// the stack pointer to the start of the frame before RETURN(). For ret_val,
+// the return value is popped off the stack before reseting sp, and pushed
+// back on top after. Returning from a task's entry point finishes the task, and
+// the interpreter moves on to the next one that can run.
+#define RETURN()                                                                    \
+    do {                                                                            \
+        ORBIT_TRACE_RETURN(vm, fn, task);                                           \
+        if(--task->frameCount == 0) {                                               \
+            OrbitVMTask* next_ = orbit_vmTaskFinished(vm, task);                    \
+            if(!next_) return true;                                                 \
+            SWITCH_TASK(next_);                                                     \
+        }                                                                           \
+                                                                                    \
+        /* Now we can bring the old frame's pointers back up in the locals.         \
+           After this, the call to NEXT() will resume execution of the calling      \
+           function. */                                                             \
+        frame = &task->frames[task->frameCount-1];                                  \
+        fn = frame->function;                                                       \
+        locals = frame->stackBase;                                                  \
+        LOAD_IP();                                                                  \
+        JIT_RESUME();                                                               \
+        NEXT();                                                                     \
+    } while(0)
+
+HANDLER(halt) {
+    return true;
+}
+
+HANDLER(load_nil) {
+    PUSH(VAL_NIL);
+    NEXT();
+}
+
+HANDLER(load_true) {
+    PUSH(VAL_TRUE);
+    NEXT();
+}
+
+HANDLER(load_false) {
+    PUSH(VAL_FALSE);
+    NEXT();
+}
+
+HANDLER(load_const) {
+    PUSH(fn->module->constants[READ16()]);
+    NEXT();
+}
+
+HANDLER(load_local) {
+    PUSH(locals[READ8()]);
+    NEXT();
+}
+
+HANDLER(load_field) {
+    // TODO: replace POP() by PEEK() ?
+    OrbitGCInstance* obj = AS_INST(POP());
+    PUSH(obj->fields[READ16()]);
+    NEXT();
+}
+
+HANDLER(load_global) {
+    uint16_t idx = READ16();
+    CHECK_OPERAND(idx < fn->module->globalCount);
+    PUSH(fn->module->globals[idx].global);
+    NEXT();
+}
+
+HANDLER(store_local) {
+    locals[READ8()] = POP();
+    NEXT();
+}
+
+HANDLER(store_field) {
+    OrbitValue val = POP();
+    OrbitGCInstance* obj = AS_INST(POP());
+    obj->fields[READ16()] = val;
+    orbit_gcWriteBarrier(vm, (OrbitGCObject*)obj, val);
+    NEXT();
+}
+
+HANDLER(store_global) {
+    uint16_t idx = READ16();
+    CHECK_OPERAND(idx < fn->module->globalCount);
+    fn->module->globals[idx].global = POP();
+    NEXT();
+}
+
+// Arithmetic and comparison codes are quickened. The generic code checks the
+// kinds of its operands and, once it knows them, rewrites itself into the code
+// specialised for those kinds before doing the work. A specialised code only
+// checks that its operands are still of the kind it expects: if they aren't,
+// it rewrites itself back into the generic code and runs that one on the same
+// operands.
+#define QUICKEN(code) PATCH(1, code)
+#define DEQUICKEN(code) do { PATCH(1, code); ip -= 1; NEXT(); } while(0)
+
+#define NUM_BINARY(generic, quick, make, op)                                        \
+    HANDLER(generic) {                                                              \
+        OrbitValue b = task->sp[-1];                                                \
+        OrbitValue a = task->sp[-2];                                                \
+        if(!IS_NUM(a) || !IS_NUM(b)) return false;                                  \
+        QUICKEN(quick);                                                             \
+        DROP();                                                                     \
+        task->sp[-1] = make(AS_NUM(a) op AS_NUM(b));                                \
+        NEXT();                                                                     \
+    }                                                                               \
+                                                                                    \
+    HANDLER(quick) {                                                                \
+        OrbitValue b = task->sp[-1];                                                \
+        OrbitValue a = task->sp[-2];                                                \
+        if(!IS_NUM(a) || !IS_NUM(b)) DEQUICKEN(generic);                            \
+        DROP();                                                                     \
+        task->sp[-1] = make(AS_NUM(a) op AS_NUM(b));                                \
+        NEXT();                                                                     \
+    }
+
+NUM_BINARY(add, add_nn, MAKE_NUM, +)
+NUM_BINARY(sub, sub_nn, MAKE_NUM, -)
+NUM_BINARY(mul, mul_nn, MAKE_NUM, *)
+NUM_BINARY(div, div_nn, MAKE_NUM, /)
+NUM_BINARY(test_lt, test_lt_nn, MAKE_BOOL, <)
+NUM_BINARY(test_gt, test_gt_nn, MAKE_BOOL, >)
+
+// Equality is defined for every pair of values, so the generic code never
+// fails. Mixed kinds don't get quickened, since they are always unequal.
+HANDLER(test_eq) {
+    OrbitValue b = task->sp[-1];
+    OrbitValue a = task->sp[-2];
+    if(IS_NUM(a) && IS_NUM(b)) {
+        QUICKEN(test_eq_nn);
+    }
+    else if(IS_STRING(a) && IS_STRING(b)) {
+        QUICKEN(test_eq_ss);
+    }
+    DROP();
+    task->sp[-1] = MAKE_BOOL(orbit_valueEquals(a, b));
+    NEXT();
+}
+
+HANDLER(test_eq_nn) {
+    OrbitValue b = task->sp[-1];
+    OrbitValue a = task->sp[-2];
+    if(!IS_NUM(a) || !IS_NUM(b)) DEQUICKEN(test_eq);
+    DROP();
+    task->sp[-1] = MAKE_BOOL(AS_NUM(a) == AS_NUM(b));
+    NEXT();
+}
+
+HANDLER(test_eq_ss) {
+    OrbitValue b = task->sp[-1];
+    OrbitValue a = task->sp[-2];
+    if(!IS_STRING(a) || !IS_STRING(b)) DEQUICKEN(test_eq);
+    DROP();
+    task->sp[-1] = MAKE_BOOL(orbit_gcStringEquals(AS_STRING(a), AS_STRING(b)));
+    NEXT();
+}
+
+#undef NUM_BINARY
+
+// Superinstructions (see vm_fuse.c). Each does the work of the sequence it
+// replaces, without the dispatches in between. Operands are read into locals
+// first, since the order in which function arguments are evaluated isn't
+// defined.
+HANDLER(load_local2) {
+    uint8_t a = READ8();
+    uint8_t b = READ8();
+    PUSH(locals[a]);
+    PUSH(locals[b]);
+    NEXT();
+}
+
+HANDLER(load_local_const) {
+    uint8_t local = READ8();
+    uint16_t constant = READ16();
+    PUSH(locals[local]);
+    PUSH(fn->module->constants[constant]);
+    NEXT();
+}
+
+HANDLER(load_local_field) {
+    uint8_t local = READ8();
+    uint16_t field = READ16();
+    PUSH(AS_INST(locals[local])->fields[field]);
+    NEXT();
+}
+
+HANDLER(store_load_local) {
+    uint8_t store = READ8();
+    uint8_t load = READ8();
+    locals[store] = POP();
+    PUSH(locals[load]);
+    NEXT();
+}
+
+HANDLER(add_ll) {
+    OrbitValue a = locals[READ8()];
+    OrbitValue b = locals[READ8()];
+    if(!IS_NUM(a) || !IS_NUM(b)) return false;
+    PUSH(MAKE_NUM(AS_NUM(a) + AS_NUM(b)));
+    NEXT();
+}
+
+HANDLER(jump_if_lt) {
+    uint16_t offset = READ16();
+    OrbitValue b = POP();
+    OrbitValue a = POP();
+    if(!IS_NUM(a) || !IS_NUM(b)) return false;
+    if(AS_NUM(a) < AS_NUM(b)) {
+        ip += offset;
+    }
+    NEXT();
+}
+
+HANDLER(rjump_if_lt) {
+    uint16_t offset = READ16();
+    OrbitValue b = POP();
+    OrbitValue a = POP();
+    if(!IS_NUM(a) || !IS_NUM(b)) return false;
+    if(AS_NUM(a) < AS_NUM(b)) {
+        ip -= offset;
+        JIT_LOOP(offset);
+    }
+    NEXT();
+}
+
+HANDLER(and) {
+    // TODO: implementation
+    NEXT();
+}
+
+HANDLER(or) {
+    // TODO: implementation
+    NEXT();
+}
+
+HANDLER(jump_if) {
+    uint16_t offset = READ16();
+    OrbitValue condition = POP();
+    if(IS_TRUE(condition)) {
+        ip += offset;
+    }
+    NEXT();
+}
+
+HANDLER(jump) {
+    uint16_t offset = READ16();
+    ip += offset;
+    NEXT();
+}
+
+HANDLER(rjump_if) {
+    uint16_t offset = READ16();
+    OrbitValue condition = POP();
+    if(IS_TRUE(condition)) {
+        ip -= offset;
+        JIT_LOOP(offset);
+    }
+    NEXT();
+}
+
+HANDLER(rjump) {
+    uint16_t offset = READ16();
+    ip -= offset;
+    JIT_LOOP(offset);
+    NEXT();
+}
+
+HANDLER(pop) {
+    DROP();
+    NEXT();
+}
+
+HANDLER(swap) {
+    OrbitValue a = POP();
+    OrbitValue b = POP();
+    PUSH(a);
+    PUSH(b);
+    NEXT();
+}
+
+// invoke family of opcodes. When compiled, all invocations are done through
+// `invoke_sym`, and point to a symbolic reference (string in the function's
+// constant pool).
+//
+// The first time an invocation happens, the symbolic reference is resolved
+// (through the module's symbol table). The opcode is replaced with `invoke`
+// and the constant changed to point to the function object in memory. This
+// avoids the overhead of hashmap lookup with every single invocation, but does
+// not require the whole bytecode to be checked and doctored at load time.
+HANDLER(invoke_sym) {
+    uint16_t idx = READ16();
+    OrbitValue callee = fn->module->constants[idx];
+
+    // Several call sites can share the same symbol, in which case another one
+    // might have resolved it already.
+    if(!IS_FUNCTION(callee)) {
+        OrbitValue symbol = callee;
+        orbit_gcMapGet(vm->dispatchTable, symbol, &callee);
+        fn->module->constants[idx] = callee;
+    }
+
+    // replace the opcode in the bytecode stream so that future calls
+    // can use the direct reference.
+    PATCH(3, invoke);
+
+    // Start invocation.
+    INVOKE(callee);
+}
+
+HANDLER(invoke) {
+    // Invoke a function by direct reference: by then, the entry in the
+    // run-time constant pool points to a function object rather than
+    // a string, and we can just go along.
+    OrbitValue callee = fn->module->constants[READ16()];
+    INVOKE(callee);
+}
+
+HANDLER(ret_val) {
+    OrbitValue returnValue = POP();
+    task->sp = frame->stackBase;
+    PUSH(returnValue);
+    RETURN();
+}
+
+HANDLER(ret) {
+    // We reset the stack pointer first, before we loose track of the
+    // ending call frame.
+    task->sp = frame->stackBase;
+    RETURN();
+}
+
+HANDLER(init_sym) {
+    uint16_t idx = READ16();
+    OrbitValue class = fn->module->constants[idx];
+    if(!IS_CLASS(class)) {
+        OrbitValue symbol = class;
+        orbit_gcMapGet(vm->classes, symbol, &class);
+        if(!IS_CLASS(class)) return false;
+        fn->module->constants[idx] = class;
+    }
+
+    // replace the opcode in the bytecode stream so that future calls
+    // can use the direct reference.
+    PATCH(3, init);
+    PUSH(MAKE_OBJECT(orbit_gcInstanceNew(vm, AS_CLASS(class))));
+    NEXT();
+}
+
+HANDLER(init) {
+    OrbitValue class = fn->module->constants[READ16()];
+    if(!IS_CLASS(class)) return false;
+    PUSH(MAKE_OBJECT(orbit_gcInstanceNew(vm, AS_CLASS(class))));
+    NEXT();
+}
+
+HANDLER(debug_prt) {
+    OrbitValue tos = PEEK();
+    if(IS_NUM(tos)) {
+        fprintf(stderr, "TOS: %lf\n", AS_NUM(tos));
+    }
+    else if(IS_NIL(tos)) {
+        fprintf(stderr, "TOS: nil\n");
+    }
+    else if(IS_BOOL(tos)) {
+        fprintf(stderr, "TOS: %s\n",
+                IS_TRUE(tos) ? "true" : "false");
+    }
+    else if(IS_STRING(tos)) {
+        fprintf(stderr, "TOS: \"%.*s\"\n",
+                (int)AS_STRING(tos)->length,
+                AS_STRING(tos)->data);
+    }
+    else {
+        fprintf(stderr, "TOS: @%p\n", AS_OBJECT(tos));
+    }
+    NEXT();
+}
+
+// Spawning is shared by `spawn` and `spawn_sym`. The arguments are moved from
+// the current task's stack to the new task's, and replaced by the new task.
+#define SPAWN(callee)                                                               \
+    do {                                                                            \
+        if(!IS_FUNCTION(callee)) return false;                                      \
+        OrbitVMFunction* spawned_ = AS_FUNCTION(callee);                            \
+        if(spawned_->kind != ORBIT_FK_NATIVE) return false;                         \
+        OrbitVMTask* new_ = orbit_vmSpawn(vm, spawned_, task->sp - spawned_->arity);\
+        task->sp -= spawned_->arity;                                                \
+        PUSH(MAKE_OBJECT(new_));                                                    \
+        NEXT();                                                                     \
+    } while(0)
+
+HANDLER(spawn_sym) {
+    uint16_t idx = READ16();
+    OrbitValue callee = fn->module->constants[idx];
+    if(!IS_FUNCTION(callee)) {
+        OrbitValue symbol = callee;
+        orbit_gcMapGet(vm->dispatchTable, symbol, &callee);
+        fn->module->constants[idx] = callee;
+    }
+    PATCH(3, spawn);
+    SPAWN(callee);
+}
+
+HANDLER(spawn) {
+    OrbitValue callee = fn->module->constants[READ16()];
+    SPAWN(callee);
+}
+
+HANDLER(yield) {
+    if(!vm->runQueue) NEXT();
+    SAVE_IP();
+    SWITCH_TASK(orbit_vmTaskYield(vm, task));
+}
+
+// A task that joins one that isn't done yet is suspended on the `join` itself,
+// and runs it again once it is woken up.
+HANDLER(join) {
+    OrbitValue target = PEEK();
+    if(!IS_TASK(target)) return false;
+    if(AS_TASK(target)->state != ORBIT_TASK_DONE) {
+        ip -= 1;
+        SAVE_IP();
+        OrbitVMTask* next = orbit_vmTaskWait(vm, task, AS_TASK(target));
+        if(!next) return false;
+        SWITCH_TASK(next);
+    }
+    task->sp[-1] = AS_TASK(target)->result;
+    NEXT();
+}
+
+#undef CHECK_OPERAND
+#undef CHECK_STACK
+#undef QUICKEN
+#undef DEQUICKEN
+#undef INVOKE
+#undef SPAWN
+#undef SWITCH_TASK
+#undef JIT_RESUME
+#undef JIT_COUNT
+#undef JIT_LOOP
+#undef RETURN
+#undef PUSH
+#undef PEEK
+#undef POP
+#undef DROP
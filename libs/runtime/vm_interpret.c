@@ -0,0 +1,286 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_interpret.c - Orbit's bytecode interpreter engines
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-02 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#include <assert.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <orbit/runtime/vm.h>
+#include <orbit/runtime/gc.h>
+#include <orbit/runtime/rtutils.h>
+#include <orbit/utils/platforms.h>
+#include "jit_private.h"
+#include "vm_private.h"
+
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_DIRECT
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
+#if ORBIT_DISPATCH != ORBIT_DISPATCH_REGISTERS
+
+// The opcode bodies live in vm_handlers.h and are shared by every engine. Each
+// engine only defines how handlers are declared, how the next one is reached,
+// and how operands are read from the instruction stream.
+
+#define READ8() (*(ip++))
+#define READ16() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+// Code shared with other VMs (see image.h) is never written to: it is quickened
+// in the function's side table instead, which opcodes are then read from.
+#define FETCH()                                                                     \
+    (fn->native.quickened ? fn->native.quickened[ip++ - fn->native.byteCode] : *(ip++))
+#define PATCH(back, code)                                                           \
+    ((fn->native.shared & ORBIT_SHARED_BYTECODE)                                    \
+        ? orbit_vmQuickenShared(vm, fn, OFFSET() - (back), CODE_##code)             \
+        : (void)(ip[-(back)] = CODE_##code))
+#define SAVE_IP() (frame->ip = ip)
+#define LOAD_IP() (ip = frame->ip)
+#define OFFSET() ((uint32_t)(ip - fn->native.byteCode))
+#define ENTER_FUNCTION() (ip = frame->ip)
+
+#if ORBIT_DISPATCH != ORBIT_DISPATCH_DIRECT
+static void orbit_vmQuickenShared(OrbitVM* vm, OrbitVMFunction* fn, uint32_t offset, uint8_t code) {
+    GCNativeFn* native = &fn->native;
+    if(!native->quickened) {
+        // Only the opcodes are read from the side table, operands still come
+        // from the shared code.
+        native->quickened = ALLOC_ARRAY(vm, uint8_t, native->byteCodeLength);
+        memcpy(native->quickened, native->byteCode, native->byteCodeLength);
+    }
+    native->quickened[offset] = code;
+}
+#endif
+
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_TAILCALL
+
+// Tail-call dispatch: each opcode is a function taking the interpreter's
+// registers as parameters, and NEXT() is a tail call to the next handler.
+// Clang guarantees the call is a jump with `musttail`. GCC doesn't have the
+// attribute, but will turn sibling calls into jumps when optimising, which we
+// force on for the handlers so that debug builds don't overflow the C stack.
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define ORBIT_MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+
+#ifdef ORBIT_MUSTTAIL
+#define ORBIT_HANDLER_ATTR
+#else
+#define ORBIT_MUSTTAIL
+#define ORBIT_HANDLER_ATTR __attribute__((optimize("O2", "optimize-sibling-calls")))
+#endif
+
+#define VM_PARAMS   OrbitVM* vm, OrbitVMTask* task, OrbitVMFrame* frame, \
+                    OrbitVMFunction* fn, uint8_t* ip, OrbitValue* locals
+#define VM_ARGS     vm, task, frame, fn, ip, locals
+
+typedef bool (*OrbitVMHandler)(VM_PARAMS);
+
+#define OPCODE(code, _, __) static bool code_##code(VM_PARAMS);
+#include <orbit/runtime/opcodes.h>
+
+#define OPCODE(code, _, __) &code_##code,
+static const OrbitVMHandler dispatch[] = {
+#include <orbit/runtime/opcodes.h>
+};
+
+#define HANDLER(code) ORBIT_HANDLER_ATTR static bool code_##code(VM_PARAMS)
+#define NEXT()                                                                      \
+    do {                                                                            \
+        ORBIT_COUNT_OPCODE(vm, fn, OFFSET());                                       \
+        uint8_t code_ = FETCH();                                                    \
+        ORBIT_MUSTTAIL return dispatch[code_](VM_ARGS);                             \
+    } while(0)
+
+#include "vm_handlers.h"
+
+void orbit_vmPrepareFunction(OrbitVM* vm, OrbitVMFunction* function) {}
+
+bool orbit_vmRun(OrbitVM* vm, OrbitVMTask* task) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+    assert(task->frameCount > 0 && "task must have an entry point");
+
+    vm->task = task;
+    ORBIT_TRACE_TASK(vm, task);
+    OrbitVMFrame* frame = &task->frames[task->frameCount-1];
+    OrbitVMFunction* fn = frame->function;
+    uint8_t* ip = frame->ip;
+    OrbitValue* locals = frame->stackBase;
+
+    ORBIT_COUNT_OPCODE(vm, fn, OFFSET());
+    uint8_t code = FETCH();
+    return dispatch[code](VM_ARGS);
+}
+
+#else /* ORBIT_DISPATCH != ORBIT_DISPATCH_TAILCALL */
+
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_DIRECT
+
+// Direct-threaded dispatch: [ip] walks the function's threaded code, where the
+// word at each instruction's offset is the address of its handler and the
+// following ones hold pre-decoded operands. Since superinstructions mix 8 and
+// 16-bit operands, the word for each operand byte holds that byte and the next
+// one, which READ8() and READ16() pick from. The bytecode offsets are
+// preserved, so relative jumps work unchanged and converting from one to the
+// other is a matter of pointer arithmetic.
+#undef READ8
+#undef READ16
+#undef PATCH
+#undef SAVE_IP
+#undef LOAD_IP
+#undef OFFSET
+#undef ENTER_FUNCTION
+
+#define READ8() (ip += 1, (uint8_t)((uintptr_t)ip[-1] >> 8))
+#define READ16() (ip += 2, (uint16_t)(uintptr_t)ip[-2])
+// Threaded code belongs to each VM, so it is patched even if the bytecode it
+// was made from is shared.
+#define PATCH(back, code)                                                           \
+    ((fn->native.shared & ORBIT_SHARED_BYTECODE) ? (void)0                          \
+        : (void)(fn->native.byteCode[(ip - fn->native.threadedCode) - (back)] = CODE_##code), \
+     ip[-(back)] = orbit_vmDirectHandlers[CODE_##code])
+#define SAVE_IP() (frame->ip = fn->native.byteCode + (ip - fn->native.threadedCode))
+#define LOAD_IP() (ip = fn->native.threadedCode + (frame->ip - fn->native.byteCode))
+#define OFFSET() ((uint32_t)(ip - fn->native.threadedCode))
+#define ENTER_FUNCTION()                                                            \
+    (fn->native.threadedCode ? 0 : (orbit_vmPrepareFunction(vm, fn), 0),            \
+     ip = fn->native.threadedCode)
+
+typedef void** OrbitVMIP;
+
+// The handler labels only exist inside orbit_vmRun(), which publishes its label
+// table here when called with a NULL task, so that functions can be translated
+// when modules are loaded. That is done once per process, before any function
+// is translated, since VMs can be loaded and run on several threads at once.
+static void* const* orbit_vmDirectHandlers = NULL;
+
+static void orbit_vmPublishHandlers(void) {
+    orbit_vmRun(NULL, NULL);
+}
+
+#ifdef _WIN32
+static BOOL CALLBACK orbit_vmPublishHandlersOnce(PINIT_ONCE once, PVOID param, PVOID* context) {
+    orbit_vmPublishHandlers();
+    return TRUE;
+}
+#endif
+
+void orbit_vmPrepareFunction(OrbitVM* vm, OrbitVMFunction* function) {
+    assert(vm != NULL && "Null instance error");
+    assert(function != NULL && "Null instance error");
+    if(function->kind != ORBIT_FK_NATIVE) { return; }
+#ifdef _WIN32
+    static INIT_ONCE once = INIT_ONCE_STATIC_INIT;
+    InitOnceExecuteOnce(&once, orbit_vmPublishHandlersOnce, NULL, NULL);
+#else
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, orbit_vmPublishHandlers);
+#endif
+
+    uint16_t length = function->native.byteCodeLength;
+    uint8_t* code = function->native.byteCode;
+    void** threaded = function->native.threadedCode;
+    if(!threaded) {
+        threaded = ALLOC_ARRAY(vm, void*, length + 1);
+    }
+
+    for(uint16_t offset = 0; offset < length;) {
+        uint8_t op = code[offset];
+        uint8_t size = orbit_vmOperandBytes[op];
+        threaded[offset] = orbit_vmDirectHandlers[op];
+        for(uint8_t i = 1; i <= size && offset + i < length; ++i) {
+            uint8_t low = (i < size) ? code[offset+i+1] : 0;
+            threaded[offset+i] = (void*)(uintptr_t)((code[offset+i] << 8) | low);
+        }
+        offset += 1 + size;
+    }
+    // Falling off the end of a function halts the task, like the token engine
+    // reading past a function's bytecode would (hopefully) find a `halt`.
+    threaded[length] = orbit_vmDirectHandlers[CODE_halt];
+    function->native.threadedCode = threaded;
+}
+
+#else
+
+typedef uint8_t* OrbitVMIP;
+
+void orbit_vmPrepareFunction(OrbitVM* vm, OrbitVMFunction* function) {}
+
+#endif /* ORBIT_DISPATCH == ORBIT_DISPATCH_DIRECT */
+
+bool orbit_vmRun(OrbitVM* vm, OrbitVMTask* task) {
+#if ORBIT_DISPATCH != ORBIT_DISPATCH_SWITCH
+    #define OPCODE(code, _, __) &&code_##code,
+    static void* dispatch[] = {
+    #include <orbit/runtime/opcodes.h>
+    };
+#endif
+
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_DIRECT
+    if(task == NULL) {
+        orbit_vmDirectHandlers = dispatch;
+        return true;
+    }
+#endif
+
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+    assert(task->frameCount > 0 && "task must have an entry point");
+
+    vm->task = task;
+    ORBIT_TRACE_TASK(vm, task);
+
+    // pull stuff in locals so we don't have to follow 10 pointers every
+    // two line. This means invoke: and return: will have to update those
+    // so that we stay on the same page.
+
+    OrbitVMFrame* frame = &task->frames[task->frameCount-1];
+
+    register OrbitVMFunction* fn = frame->function;
+    register OrbitVMIP ip = NULL;
+    register OrbitValue* locals = frame->stackBase;
+
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_DIRECT
+    if(!fn->native.threadedCode) { orbit_vmPrepareFunction(vm, fn); }
+#endif
+    LOAD_IP();
+
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_SWITCH
+    register VMCode instruction = CODE_halt;
+    #define HANDLER(code) case CODE_##code:
+    #define NEXT() goto loop
+    #define START_LOOP() loop: ORBIT_COUNT_OPCODE(vm, fn, OFFSET()); switch(instruction = (VMCode)FETCH())
+#elif ORBIT_DISPATCH == ORBIT_DISPATCH_DIRECT
+    #define HANDLER(code) code_##code:
+    #define NEXT() do { ORBIT_COUNT_OPCODE(vm, fn, OFFSET()); goto **(ip++); } while(0)
+    #define START_LOOP() NEXT();
+#else
+    register VMCode instruction = CODE_halt;
+    #define HANDLER(code) code_##code:
+    #define NEXT() do { ORBIT_COUNT_OPCODE(vm, fn, OFFSET()); goto *dispatch[instruction = (VMCode)FETCH()]; } while(0)
+    #define START_LOOP() NEXT();
+#endif
+
+    // Main loop. Tonnes of opimisations to be done here (obviously)
+    START_LOOP()
+    {
+        #include "vm_handlers.h"
+    }
+
+    return false;
+}
+
+#endif /* ORBIT_DISPATCH == ORBIT_DISPATCH_TAILCALL */
+
+#endif /* ORBIT_DISPATCH != ORBIT_DISPATCH_REGISTERS */
@@ -0,0 +1,510 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_optimize.c - Load-time bytecode optimisation
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-17 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  A peephole optimiser for the compiler's bytecode. It runs on every function
+//  of a module image once the image has been verified, so it can rely on the
+//  code being well-formed, and before superinstructions are fused.
+//
+//  Code is decoded into a list of instructions in which jumps refer to the
+//  index of their target. Rewrites then only mark instructions as removed or
+//  change them in place, and are repeated until none applies:
+//
+//  - jumps to unconditional jumps go straight to the final target, and
+//    unconditional jumps to a return are replaced by the return.
+//  - arithmetic and comparisons on two known values are folded into a single
+//    load, and conditional jumps on a known value into a jump or nothing.
+//  - values that are loaded only to be popped aren't loaded at all.
+//  - `swap` is removed when its operands can be loaded in the other order,
+//    after another `swap`, or before a commutative code. `test_lt` and
+//    `test_gt` become each other.
+//  - jumps to the next instruction are removed, and so is any instruction
+//    that can't be reached from the start of the function.
+//
+//  Instructions other than the first of a rewritten sequence must not be the
+//  target of a jump. Jumps to a removed instruction go to the next one that is
+//  kept, which is always the correct target, since everything removed either
+//  can't be reached or has no effect. Code is then encoded again, choosing
+//  between forward and backward jumps from where their targets ended up.
+//
+//  Only numbers, `nil`, `true` and `false` are known values: call sites patch
+//  their constant in place, so a string constant might not hold a string by
+//  the time it is loaded.
+//
+#include <assert.h>
+#include <string.h>
+#include <orbit/runtime/image.h>
+#include <orbit/utils/memory.h>
+#include "vm_private.h"
+
+// Passes are cheap, but code written to defeat the optimiser could make every
+// pass enable exactly one rewrite.
+#define ORBIT_OPTIMIZE_PASSES 16
+
+typedef struct {
+    uint8_t     op;
+    uint8_t     operands[3];
+    int32_t     target;
+    // Folded loads only get a constant once the code is encoded, so the
+    // intermediate results of longer expressions aren't added to the image.
+    bool        folded;
+    double      number;
+    bool        removed;
+    bool        isTarget;
+    bool        reachable;
+} OrbitOptInstruction;
+
+typedef struct {
+    OrbitModuleImage*       image;
+    OrbitOptInstruction*    code;
+    uint32_t                count;
+    bool                    changed;
+} OrbitOptimizer;
+
+typedef enum {
+    ORBIT_KNOWN_NONE,
+    ORBIT_KNOWN_NIL,
+    ORBIT_KNOWN_BOOL,
+    ORBIT_KNOWN_NUM,
+} OrbitKnownKind;
+
+typedef struct {
+    OrbitKnownKind  kind;
+    double          number;
+} OrbitKnownValue;
+
+static inline uint16_t orbit_optOperand16(const OrbitOptInstruction* instruction) {
+    return (instruction->operands[0] << 8) | instruction->operands[1];
+}
+
+static bool orbit_optIsJump(uint8_t op) {
+    switch(op) {
+    case CODE_jump: case CODE_rjump:
+    case CODE_jump_if: case CODE_rjump_if:
+    case CODE_jump_if_lt: case CODE_rjump_if_lt:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool orbit_optIsBackward(uint8_t op) {
+    return op == CODE_rjump || op == CODE_rjump_if || op == CODE_rjump_if_lt;
+}
+
+// Returns the variant of the jump [op] that goes in the given direction.
+static uint8_t orbit_optJumpCode(uint8_t op, bool backward) {
+    switch(op) {
+    case CODE_jump: case CODE_rjump:
+        return backward ? CODE_rjump : CODE_jump;
+    case CODE_jump_if: case CODE_rjump_if:
+        return backward ? CODE_rjump_if : CODE_jump_if;
+    default:
+        return backward ? CODE_rjump_if_lt : CODE_jump_if_lt;
+    }
+}
+
+static bool orbit_optIsUnconditional(uint8_t op) {
+    return op == CODE_jump || op == CODE_rjump;
+}
+
+static bool orbit_optIsConditional(uint8_t op) {
+    return op == CODE_jump_if || op == CODE_rjump_if;
+}
+
+static bool orbit_optFallsThrough(uint8_t op) {
+    return op != CODE_halt && op != CODE_ret && op != CODE_ret_val && !orbit_optIsUnconditional(op);
+}
+
+// Codes that push one value and have no other effect.
+static bool orbit_optIsPureLoad(uint8_t op) {
+    switch(op) {
+    case CODE_load_nil: case CODE_load_true: case CODE_load_false:
+    case CODE_load_const: case CODE_load_local: case CODE_load_global:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static OrbitKnownValue orbit_optKnownValue(const OrbitOptimizer* opt, const OrbitOptInstruction* load) {
+    OrbitKnownValue value = {ORBIT_KNOWN_NONE, 0};
+    switch(load->op) {
+    case CODE_load_nil:
+        value.kind = ORBIT_KNOWN_NIL;
+        break;
+    case CODE_load_true:
+    case CODE_load_false:
+        value.kind = ORBIT_KNOWN_BOOL;
+        value.number = load->op == CODE_load_true;
+        break;
+    case CODE_load_const: {
+        if(load->folded) {
+            value.kind = ORBIT_KNOWN_NUM;
+            value.number = load->number;
+            break;
+        }
+        const OrbitImageConstant* constant = &opt->image->constants[orbit_optOperand16(load)];
+        if(constant->kind == OMF_NUM) {
+            value.kind = ORBIT_KNOWN_NUM;
+            value.number = constant->number;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return value;
+}
+
+// Same as IS_TRUE() in value.h.
+static bool orbit_optIsTrue(OrbitKnownValue value) {
+    return value.kind != ORBIT_KNOWN_NIL && value.number != 0.0;
+}
+
+// Returns the index of a number constant equal to [number], adding it to the
+// image if there isn't one. Returns -1 if the constant table is full.
+static int32_t orbit_optNumberConstant(OrbitModuleImage* image, double number) {
+    for(uint16_t i = 0; i < image->constantCount; ++i) {
+        const OrbitImageConstant* constant = &image->constants[i];
+        if(constant->kind == OMF_NUM && memcmp(&constant->number, &number, sizeof(double)) == 0) {
+            return i;
+        }
+    }
+    if(image->constantCount == UINT16_MAX) { return -1; }
+
+    uint16_t idx = image->constantCount;
+    image->constants = ORBIT_REALLOC_ARRAY(image->constants, OrbitImageConstant, idx + 1);
+    memset(&image->constants[idx], 0, sizeof(OrbitImageConstant));
+    image->constants[idx].kind = OMF_NUM;
+    image->constants[idx].number = number;
+    image->constantCount = idx + 1;
+    return idx;
+}
+
+// Rewrites [load] so it pushes the result of [op] on [a] and [b], the way the
+// interpreter would compute it. Returns false if the result isn't known.
+static bool orbit_optFoldBinary(OrbitOptInstruction* load, uint8_t op,
+                                OrbitKnownValue a, OrbitKnownValue b) {
+    bool numbers = a.kind == ORBIT_KNOWN_NUM && b.kind == ORBIT_KNOWN_NUM;
+    double number = 0;
+    int truth = -1;
+
+    switch(op) {
+    case CODE_add: case CODE_add_nn: if(!numbers) { return false; } number = a.number + b.number; break;
+    case CODE_sub: case CODE_sub_nn: if(!numbers) { return false; } number = a.number - b.number; break;
+    case CODE_mul: case CODE_mul_nn: if(!numbers) { return false; } number = a.number * b.number; break;
+    case CODE_div: case CODE_div_nn: if(!numbers) { return false; } number = a.number / b.number; break;
+    case CODE_test_lt: case CODE_test_lt_nn: if(!numbers) { return false; } truth = a.number < b.number; break;
+    case CODE_test_gt: case CODE_test_gt_nn: if(!numbers) { return false; } truth = a.number > b.number; break;
+    case CODE_test_eq: case CODE_test_eq_nn:
+        // Values of different kinds are never equal.
+        truth = a.kind == b.kind && (a.kind == ORBIT_KNOWN_NIL || a.number == b.number);
+        break;
+    default:
+        return false;
+    }
+
+    if(truth >= 0) {
+        load->op = truth ? CODE_load_true : CODE_load_false;
+        load->folded = false;
+    } else {
+        load->op = CODE_load_const;
+        load->folded = true;
+        load->number = number;
+    }
+    return true;
+}
+
+static int32_t orbit_optNextLive(const OrbitOptimizer* opt, int32_t i) {
+    for(i = i + 1; i < (int32_t)opt->count; ++i) {
+        if(!opt->code[i].removed) { return i; }
+    }
+    return -1;
+}
+
+// Instructions that follow [at] in a sequence can only be rewritten if nothing
+// jumps to them.
+static int32_t orbit_optNextInSequence(const OrbitOptimizer* opt, int32_t at) {
+    int32_t next = orbit_optNextLive(opt, at);
+    if(next < 0 || opt->code[next].isTarget) { return -1; }
+    return next;
+}
+
+static void orbit_optRemove(OrbitOptimizer* opt, int32_t i) {
+    opt->code[i].removed = true;
+    opt->changed = true;
+}
+
+static int32_t orbit_optResolve(const OrbitOptimizer* opt, int32_t target) {
+    return opt->code[target].removed ? orbit_optNextLive(opt, target) : target;
+}
+
+static void orbit_optFindTargets(OrbitOptimizer* opt) {
+    for(uint32_t i = 0; i < opt->count; ++i) {
+        opt->code[i].isTarget = false;
+    }
+    for(uint32_t i = 0; i < opt->count; ++i) {
+        OrbitOptInstruction* instruction = &opt->code[i];
+        if(instruction->removed || instruction->target < 0) { continue; }
+        instruction->target = orbit_optResolve(opt, instruction->target);
+        opt->code[instruction->target].isTarget = true;
+    }
+}
+
+static void orbit_optThreadJumps(OrbitOptimizer* opt) {
+    for(uint32_t i = 0; i < opt->count; ++i) {
+        OrbitOptInstruction* instruction = &opt->code[i];
+        if(instruction->removed || instruction->target < 0) { continue; }
+
+        // Bounded, since jumps can form a cycle.
+        instruction->target = orbit_optResolve(opt, instruction->target);
+        for(uint32_t hops = 0; hops < opt->count; ++hops) {
+            const OrbitOptInstruction* target = &opt->code[instruction->target];
+            if(!orbit_optIsUnconditional(target->op)) { break; }
+            int32_t final = orbit_optResolve(opt, target->target);
+            if(final == instruction->target) { break; }
+            instruction->target = final;
+            opt->changed = true;
+        }
+
+        uint8_t landing = opt->code[instruction->target].op;
+        if(orbit_optIsUnconditional(instruction->op)
+           && (landing == CODE_ret || landing == CODE_ret_val || landing == CODE_halt)) {
+            instruction->op = landing;
+            instruction->target = -1;
+            opt->changed = true;
+        }
+    }
+}
+
+// Applies the rewrite that starts at [i], if there is one.
+static void orbit_optPeephole(OrbitOptimizer* opt, int32_t i) {
+    OrbitOptInstruction* first = &opt->code[i];
+
+    // Jumps to the next instruction. Conditional ones still pop their operand.
+    if(first->target >= 0 && orbit_optResolve(opt, first->target) == orbit_optNextLive(opt, i)) {
+        if(orbit_optIsUnconditional(first->op)) {
+            orbit_optRemove(opt, i);
+            return;
+        }
+        if(orbit_optIsConditional(first->op)) {
+            first->op = CODE_pop;
+            first->target = -1;
+            opt->changed = true;
+            return;
+        }
+    }
+
+    int32_t j = orbit_optNextInSequence(opt, i);
+    if(j < 0) { return; }
+    OrbitOptInstruction* second = &opt->code[j];
+
+    if(orbit_optIsPureLoad(first->op) && second->op == CODE_pop) {
+        orbit_optRemove(opt, i);
+        orbit_optRemove(opt, j);
+        return;
+    }
+
+    OrbitKnownValue known = orbit_optKnownValue(opt, first);
+    if(known.kind != ORBIT_KNOWN_NONE && orbit_optIsConditional(second->op)) {
+        if(orbit_optIsTrue(known)) {
+            first->op = second->op == CODE_rjump_if ? CODE_rjump : CODE_jump;
+            first->target = second->target;
+            opt->changed = true;
+            orbit_optRemove(opt, j);
+        } else {
+            orbit_optRemove(opt, i);
+            orbit_optRemove(opt, j);
+        }
+        return;
+    }
+
+    if(first->op == CODE_swap) {
+        switch(second->op) {
+        case CODE_swap:
+            orbit_optRemove(opt, i);
+            orbit_optRemove(opt, j);
+            return;
+        case CODE_add: case CODE_add_nn:
+        case CODE_mul: case CODE_mul_nn:
+        case CODE_test_eq: case CODE_test_eq_nn: case CODE_test_eq_ss:
+            orbit_optRemove(opt, i);
+            return;
+        case CODE_test_lt: second->op = CODE_test_gt; orbit_optRemove(opt, i); return;
+        case CODE_test_gt: second->op = CODE_test_lt; orbit_optRemove(opt, i); return;
+        case CODE_test_lt_nn: second->op = CODE_test_gt_nn; orbit_optRemove(opt, i); return;
+        case CODE_test_gt_nn: second->op = CODE_test_lt_nn; orbit_optRemove(opt, i); return;
+        default:
+            return;
+        }
+    }
+
+    int32_t k = orbit_optNextInSequence(opt, j);
+    if(k < 0) { return; }
+    OrbitOptInstruction* third = &opt->code[k];
+
+    if(orbit_optIsPureLoad(first->op) && orbit_optIsPureLoad(second->op) && third->op == CODE_swap) {
+        // Jumps to the first load must still land on the first of the two.
+        OrbitOptInstruction load = *first;
+        *first = *second;
+        *second = load;
+        first->isTarget = second->isTarget;
+        second->isTarget = false;
+        orbit_optRemove(opt, k);
+        return;
+    }
+
+    OrbitKnownValue other = orbit_optKnownValue(opt, second);
+    if(known.kind != ORBIT_KNOWN_NONE && other.kind != ORBIT_KNOWN_NONE
+       && orbit_optFoldBinary(first, third->op, known, other)) {
+        opt->changed = true;
+        orbit_optRemove(opt, j);
+        orbit_optRemove(opt, k);
+    }
+}
+
+static void orbit_optRemoveUnreachable(OrbitOptimizer* opt) {
+    int32_t* work = ORBIT_ALLOC_ARRAY(int32_t, opt->count);
+    uint32_t workCount = 0;
+    for(uint32_t i = 0; i < opt->count; ++i) {
+        opt->code[i].reachable = false;
+    }
+
+    int32_t start = opt->code[0].removed ? orbit_optNextLive(opt, 0) : 0;
+    opt->code[start].reachable = true;
+    work[workCount++] = start;
+    while(workCount) {
+        int32_t at = work[--workCount];
+        const OrbitOptInstruction* instruction = &opt->code[at];
+        int32_t successors[2];
+        uint8_t successorCount = 0;
+        if(orbit_optFallsThrough(instruction->op) && orbit_optNextLive(opt, at) >= 0) {
+            successors[successorCount++] = orbit_optNextLive(opt, at);
+        }
+        if(instruction->target >= 0) {
+            successors[successorCount++] = orbit_optResolve(opt, instruction->target);
+        }
+        for(uint8_t i = 0; i < successorCount; ++i) {
+            if(opt->code[successors[i]].reachable) { continue; }
+            opt->code[successors[i]].reachable = true;
+            work[workCount++] = successors[i];
+        }
+    }
+    orbit_dealloc(work);
+
+    for(uint32_t i = 0; i < opt->count; ++i) {
+        if(!opt->code[i].removed && !opt->code[i].reachable) { orbit_optRemove(opt, i); }
+    }
+}
+
+static void orbit_optDecode(OrbitOptimizer* opt, const OrbitImageFunction* function) {
+    const uint8_t* code = function->byteCode;
+    uint32_t length = function->byteCodeLength;
+    int32_t* indices = ORBIT_ALLOC_ARRAY(int32_t, length);
+
+    for(uint32_t offset = 0; offset < length;) {
+        OrbitOptInstruction* instruction = &opt->code[opt->count];
+        uint8_t op = code[offset];
+        indices[offset] = opt->count++;
+        instruction->op = op;
+        instruction->target = -1;
+        memcpy(instruction->operands, code + offset + 1, orbit_vmOperandBytes[op]);
+        offset += 1 + orbit_vmOperandBytes[op];
+    }
+
+    // Jump offsets count from the end of the instruction.
+    for(uint32_t offset = 0, i = 0; offset < length; ++i) {
+        OrbitOptInstruction* instruction = &opt->code[i];
+        uint32_t next = offset + 1 + orbit_vmOperandBytes[instruction->op];
+        if(orbit_optIsJump(instruction->op)) {
+            uint16_t distance = orbit_optOperand16(instruction);
+            uint32_t target = orbit_optIsBackward(instruction->op) ? next - distance : next + distance;
+            instruction->target = indices[target];
+        }
+        offset = next;
+    }
+    orbit_dealloc(indices);
+}
+
+// Returns false if a folded value can't be added to the constant table, in
+// which case the code is left as it was.
+static bool orbit_optMaterialize(OrbitOptimizer* opt) {
+    for(uint32_t i = 0; i < opt->count; ++i) {
+        OrbitOptInstruction* instruction = &opt->code[i];
+        if(instruction->removed || !instruction->folded || instruction->op != CODE_load_const) { continue; }
+        int32_t idx = orbit_optNumberConstant(opt->image, instruction->number);
+        if(idx < 0) { return false; }
+        instruction->operands[0] = (idx >> 8) & 0xff;
+        instruction->operands[1] = idx & 0xff;
+    }
+    return true;
+}
+
+static uint16_t orbit_optEncode(OrbitOptimizer* opt, uint8_t* code) {
+    uint32_t* offsets = ORBIT_ALLOC_ARRAY(uint32_t, opt->count);
+    uint32_t length = 0;
+    for(uint32_t i = 0; i < opt->count; ++i) {
+        offsets[i] = length;
+        if(opt->code[i].removed) { continue; }
+        length += 1 + orbit_vmOperandBytes[opt->code[i].op];
+    }
+
+    for(uint32_t i = 0; i < opt->count; ++i) {
+        OrbitOptInstruction* instruction = &opt->code[i];
+        if(instruction->removed) { continue; }
+        uint32_t next = offsets[i] + 1 + orbit_vmOperandBytes[instruction->op];
+
+        if(instruction->target >= 0) {
+            uint32_t target = offsets[orbit_optResolve(opt, instruction->target)];
+            bool backward = target < next;
+            uint16_t distance = backward ? next - target : target - next;
+            instruction->op = orbit_optJumpCode(instruction->op, backward);
+            instruction->operands[0] = (distance >> 8) & 0xff;
+            instruction->operands[1] = distance & 0xff;
+        }
+        code[offsets[i]] = instruction->op;
+        memcpy(code + offsets[i] + 1, instruction->operands, orbit_vmOperandBytes[instruction->op]);
+    }
+    orbit_dealloc(offsets);
+    return length;
+}
+
+bool orbit_vmOptimizeFunction(OrbitModuleImage* image, OrbitImageFunction* function) {
+    assert(image != NULL && "Null instance error");
+    assert(function != NULL && "Null instance error");
+    if(function->byteCodeLength == 0) { return false; }
+
+    OrbitOptimizer opt;
+    opt.image = image;
+    opt.code = ORBIT_ALLOC_ARRAY(OrbitOptInstruction, function->byteCodeLength);
+    opt.count = 0;
+    orbit_optDecode(&opt, function);
+
+    bool changed = false;
+    for(int pass = 0; pass < ORBIT_OPTIMIZE_PASSES; ++pass) {
+        opt.changed = false;
+        orbit_optThreadJumps(&opt);
+        orbit_optRemoveUnreachable(&opt);
+        // Rewrites only make instructions after their own sequence targets, so
+        // finding targets once per pass is enough.
+        orbit_optFindTargets(&opt);
+        for(int32_t i = 0; i < (int32_t)opt.count; ++i) {
+            if(!opt.code[i].removed) { orbit_optPeephole(&opt, i); }
+        }
+        if(!opt.changed) { break; }
+        changed = true;
+    }
+
+    changed = changed && orbit_optMaterialize(&opt);
+    if(changed) {
+        function->byteCodeLength = orbit_optEncode(&opt, function->byteCode);
+    }
+    orbit_dealloc(opt.code);
+    return changed;
+}
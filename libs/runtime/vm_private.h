@@ -0,0 +1,339 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_private.h - Interface between the VM and its interpreter engines
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-02 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+#ifndef orbit_runtime_vm_private_h
+#define orbit_runtime_vm_private_h
+
+#include <assert.h>
+#include <stdbool.h>
+#include <orbit/runtime/image.h>
+#include <orbit/runtime/rtutils.h>
+#include <orbit/runtime/value.h>
+#include <orbit/runtime/vm.h>
+#include <orbit/utils/platforms.h>
+
+// Number of operand bytes following each opcode in the bytecode stream.
+#define OPCODE(code, idx, stack) idx,
+static const uint8_t orbit_vmOperandBytes[] = {
+#include <orbit/runtime/opcodes.h>
+};
+#undef OPCODE
+
+// Length in words of each register instruction (see regcodes.h).
+extern const uint8_t orbit_vmRegCodeLength[];
+
+#ifdef ORBIT_VM_STATS
+#define ORBIT_COUNT_DISPATCH(vm) ((vm)->dispatchCount++)
+#define ORBIT_COUNT_OPCODE(vm, fn, offset) orbit_vmCountOpcode((vm), (fn), (offset))
+
+// Gives [fn] a table of execution counts (see vm_stats.c).
+void orbit_vmStatsTrack(OrbitVMFunction* fn);
+
+// Counts the instruction at [offset] in [fn]'s bytecode as dispatched. The
+// opcode is read back from the bytecode, which quickening keeps up to date
+// unless it is shared with other VMs.
+static inline void orbit_vmCountOpcode(OrbitVM* vm, OrbitVMFunction* fn, uint32_t offset) {
+    uint8_t code = fn->native.byteCode[offset];
+    vm->dispatchCount++;
+    vm->opcodeCounts[code]++;
+    if(vm->lastOpcode < ORBIT_OPCODE_COUNT) { vm->pairCounts[vm->lastOpcode][code]++; }
+    vm->lastOpcode = code;
+    if(!fn->native.executionCounts) { orbit_vmStatsTrack(fn); }
+    fn->native.executionCounts[offset]++;
+}
+
+// Writes [vm]'s statistics where the ORBIT_VM_STATS environment variable says,
+// if it is set. Called when the VM is destroyed.
+void orbit_vmStatsDump(OrbitVM* vm);
+#else
+#define ORBIT_COUNT_DISPATCH(vm) ((void)0)
+#define ORBIT_COUNT_OPCODE(vm, fn, offset) ((void)0)
+#endif
+
+// A page of the heap. What its slots hold is kept on the side rather than in
+// the objects: [live] has a bit per slot that holds an object, and [marks] a
+// bit per object the collection in progress marked, so collecting never writes
+// to old objects (see heap.c).
+struct _OrbitGCPage {
+    OrbitGCPage*    next;
+    OrbitGCPage*    previous;
+    OrbitGCPage*    nextInClass;
+    OrbitGCPage*    previousInClass;
+    OrbitGCPage*    nextYoung;
+    uint8_t*        block;
+    uint8_t*        slots;
+    uint64_t*       marks;
+    uint32_t        slotSize;
+    uint32_t        slotCount;
+    uint32_t        freeCount;
+    // Dividing an offset by [slotSize] is a multiplication by this, and a
+    // shift, which is exact as long as the offset times [slotSize] stays
+    // under 2^32.
+    uint32_t        reciprocal;
+    uint32_t        epoch;
+    uint8_t         sizeClass;
+    bool            young;
+    uint64_t        live[];
+};
+
+// The first word of a page points to its descriptor.
+static inline OrbitGCPage* orbit_heapPageOf(const void* object) {
+    return *(OrbitGCPage**)((uintptr_t)object & ~(uintptr_t)(ORBIT_GC_PAGE_SIZE - 1));
+}
+
+static inline uint32_t orbit_heapIndexOf(const OrbitGCPage* page, const void* object) {
+    uint64_t offset = (const uint8_t*)object - page->slots;
+    return (uint32_t)((offset * page->reciprocal) >> 32);
+}
+
+static inline bool orbit_heapMarked(const OrbitGCObject* object) {
+    const OrbitGCPage* page = orbit_heapPageOf(object);
+    uint32_t index = orbit_heapIndexOf(page, object);
+    return page->marks[index / 64] & (1ull << (index % 64));
+}
+
+// Sets the mark bit of [object]. Returns false if it was already set.
+static inline bool orbit_heapMark(const OrbitGCObject* object) {
+    OrbitGCPage* page = orbit_heapPageOf(object);
+    uint32_t index = orbit_heapIndexOf(page, object);
+    uint64_t bit = 1ull << (index % 64);
+    if(page->marks[index / 64] & bit) { return false; }
+    page->marks[index / 64] |= bit;
+    return true;
+}
+
+// Same as orbit_heapMark(), when other threads can be marking objects of the
+// same page.
+static inline bool orbit_heapMarkAtomic(const OrbitGCObject* object) {
+    OrbitGCPage* page = orbit_heapPageOf(object);
+    uint32_t index = orbit_heapIndexOf(page, object);
+    uint64_t* word = &page->marks[index / 64];
+    uint64_t bit = 1ull << (index % 64);
+    if(__atomic_load_n(word, __ATOMIC_RELAXED) & bit) { return false; }
+    return !(__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+}
+
+// Sets up [heap] without any page (see heap.c).
+void orbit_heapInit(OrbitGCHeap* heap);
+
+// Frees every page of [vm]'s heap, and the objects still in them.
+void orbit_heapDeinit(OrbitVM* vm);
+
+// Returns a free slot of at least [size] bytes in [vm]'s heap. The collector
+// isn't run, but pages left to sweep can be swept.
+void* orbit_heapAllocate(OrbitVM* vm, size_t size);
+
+// Returns the slot of [object] to the page it is in.
+void orbit_heapFree(OrbitGCHeap* heap, OrbitGCObject* object);
+
+// Starts sweeping every page of [heap], once marking is done.
+void orbit_heapBeginSweep(OrbitGCHeap* heap);
+
+// Sweeps pages until [deadline] passes if it isn't 0, or [limit] pages were
+// swept. Returns true once every page was, and empty pages are released.
+bool orbit_heapSweep(OrbitVM* vm, uint64_t deadline, uint64_t limit);
+
+// Sweeps the young objects of the pages allocated from since the last
+// collection, after a minor collection marked them.
+void orbit_heapSweepYoung(OrbitVM* vm);
+
+typedef void (*OrbitGCVisitor)(OrbitGCObject* object, void* data);
+
+// Calls [visitor] with every object in [heap].
+void orbit_heapVisit(OrbitGCHeap* heap, OrbitGCVisitor visitor, void* data);
+
+// Runs [task] in [vm] until its call stack is empty, or an error occurs.
+bool orbit_vmRun(OrbitVM* vm, OrbitVMTask* task);
+
+// Prepares [function] to be run by the interpreter engine the VM was built
+// with. For direct-threaded dispatch, this translates the function's bytecode
+// into threaded code. For the other engines, this is a no-op.
+void orbit_vmPrepareFunction(OrbitVM* vm, OrbitVMFunction* function);
+
+// Translates [function]'s stack bytecode into register code, unless it already
+// has some. The functions it calls must be loaded already. Returns false if the
+// bytecode can't be translated (malformed code, inconsistent stack depths, or
+// more than 255 registers needed). Calls whose effect on the stack isn't known
+// yet are translated to `resolve`.
+bool orbit_vmTranslateRegisters(OrbitVM* vm, OrbitVMFunction* function);
+
+// Translates [function] again after one of its `resolve` instructions made a
+// call's effect known, keeping the old register code for the frames still
+// running it. Returns where the instruction at bytecode offset [resume] starts
+// in the new code, or UINT32_MAX if the function can't be translated.
+uint32_t orbit_vmRetranslateRegisters(OrbitVM* vm, OrbitVMFunction* function, uint16_t resume);
+
+// Empties [task]'s call stack and sets it up to run [function] from the start,
+// with nil parameters and locals.
+void orbit_vmTaskReset(OrbitVM* vm, OrbitVMTask* task, OrbitVMFunction* function);
+
+// Runs [task] as a nested call from the host or a foreign function: the current
+// task is kept alive and restored afterwards (see orbit_vmInvoke()).
+bool orbit_vmRunNested(OrbitVM* vm, OrbitVMTask* task);
+
+// Stores the result of the batch [call] just finished, and restarts its task
+// with the next arguments. Returns false if the batch is done.
+bool orbit_vmBatchNext(OrbitVM* vm, OrbitVMCall* call);
+
+// Appends [task] to the VM's run queue.
+void orbit_vmEnqueue(OrbitVM* vm, OrbitVMTask* task);
+
+// Removes the first task from the VM's run queue and returns it, or NULL if
+// the queue is empty.
+OrbitVMTask* orbit_vmDequeue(OrbitVM* vm);
+
+// Creates a task that runs [function] with the [function->arity] values at
+// [args] as parameters, and puts it in the run queue.
+OrbitVMTask* orbit_vmSpawn(OrbitVM* vm, OrbitVMFunction* function, OrbitValue* args);
+
+// Puts [task] back in the run queue and returns the task that should run next.
+OrbitVMTask* orbit_vmTaskYield(OrbitVM* vm, OrbitVMTask* task);
+
+// Stops [task] and the tasks waiting for it after a runtime error: they are
+// done, with empty call stacks, even if [task] overflowed its stack.
+void orbit_vmTaskAbort(OrbitVM* vm, OrbitVMTask* task);
+
+// Stops [vm]'s current task and every task in its run queue (see
+// orbit_vmTaskAbort()), so that a failed run leaves nothing to run later.
+void orbit_vmAbortTasks(OrbitVM* vm);
+
+// Makes [task] wait until [target] is done, and returns the task that should
+// run next. Returns NULL if nothing else can run, in which case [target] would
+// never finish.
+OrbitVMTask* orbit_vmTaskWait(OrbitVM* vm, OrbitVMTask* task, OrbitVMTask* target);
+
+// Records that [task] returned from its entry point, wakes the tasks waiting
+// for it and returns the task that should run next, or NULL if there is none.
+OrbitVMTask* orbit_vmTaskFinished(OrbitVM* vm, OrbitVMTask* task);
+
+// Checks [function]'s code (see vm_verify.c). Returns false if it is invalid.
+// Otherwise, [function->verified] is set if its stack use could be checked too,
+// in which case [function->stackEffect] is replaced by the exact requirement.
+// Unverified functions run with checked pushes.
+bool orbit_vmVerifyFunction(const OrbitModuleImage* image, OrbitImageFunction* function);
+
+// Optimises [function]'s code (see vm_optimize.c), which must have been
+// verified. Constants can be added to [image]. Returns true if the code changed.
+bool orbit_vmOptimizeFunction(OrbitModuleImage* image, OrbitImageFunction* function);
+
+// Rewrites the [length] bytes of bytecode at [code] to use superinstructions
+// (see vm_fuse.c), and returns the new length.
+uint16_t orbit_vmFuseCode(uint8_t* code, uint16_t length);
+
+// Stops profiling [vm] if it is, and frees its profile (see vm_profile.c).
+void orbit_vmProfilerFree(OrbitVM* vm);
+
+// Events recorded by the tracer (see vm_trace.c). Entering a function records
+// whether it is a foreign one, and collections the bytes allocated.
+typedef enum {
+    ORBIT_TRACE_ENTER,
+    ORBIT_TRACE_EXIT,
+    ORBIT_TRACE_GC_START,
+    ORBIT_TRACE_GC_END,
+} OrbitTraceKind;
+
+// Records an event in [vm]'s trace, which must exist.
+void orbit_vmTrace(OrbitVM* vm, OrbitTraceKind kind, const void* subject,
+                   const OrbitVMTask* task, uint64_t value);
+
+// Frees [vm]'s trace, if it has one.
+void orbit_vmTracerFree(OrbitVM* vm);
+
+// Returns the time in nanoseconds from a monotonic clock.
+uint64_t orbit_vmClock(void);
+
+// Hooks only cost a test of the VM's tracer when it isn't tracing.
+#define ORBIT_TRACE(vm, kind, subject, task, value)                                 \
+    ((vm)->tracer ? orbit_vmTrace((vm), (kind), (subject), (task), (value)) : (void)0)
+
+#define ORBIT_TRACE_CALL(vm, fn, task)                                              \
+    ORBIT_TRACE(vm, ORBIT_TRACE_ENTER, fn, task, (fn)->kind == ORBIT_FK_FOREIGN)
+#define ORBIT_TRACE_RETURN(vm, fn, task) ORBIT_TRACE(vm, ORBIT_TRACE_EXIT, fn, task, 0)
+
+// Tasks enter their entry point without a call, the first time they run.
+#define ORBIT_TRACE_TASK(vm, task)                                                  \
+    ((vm)->tracer && (task)->frameCount == 1                                        \
+        && (task)->frames[0].ip == (task)->frames[0].function->native.byteCode      \
+        ? orbit_vmTrace((vm), ORBIT_TRACE_ENTER, (task)->frames[0].function, (task), 0) \
+        : (void)0)
+
+// Allocates the value stack and call frames of [task] (see vm_stack.c).
+// Returns false if the memory couldn't be reserved.
+bool orbit_vmStackInit(OrbitVM* vm, OrbitVMTask* task);
+
+// Frees the value stack and call frames of [task].
+void orbit_vmStackDeinit(OrbitVM* vm, OrbitVMTask* task);
+
+// Runs [task] like orbit_vmRun(), but turns a stack overflow into a runtime
+// error instead of a crash.
+bool orbit_vmRunGuarded(OrbitVM* vm, OrbitVMTask* task);
+
+#ifdef ORBIT_GUARDED_STACKS
+
+// Guarded stacks never move or grow: overflows are caught by the guard pages.
+static inline void orbit_vmEnsureStack(OrbitVM* vm, OrbitVMTask* task, uint16_t req) {}
+static inline void orbit_vmEnsureFrames(OrbitVM* vm, OrbitVMTask* task) {}
+static inline void orbit_vmReserveCall(OrbitVM* vm, OrbitVMTask* task, uint16_t req) {}
+
+#else
+
+// Checks that [task]'s stack as at least [effect] more slots available. If it
+// doesn't grow the stack.
+static inline void orbit_vmEnsureStack(OrbitVM* vm, OrbitVMTask* task, uint16_t req) {
+    uint64_t stackSize = (task->sp - task->stack);
+    uint64_t required = stackSize + req;
+    if(required <= task->stackCapacity) { return; }
+
+    // First we reallocate the stack. The rest is not so trivial: the tasks
+    // keeps a bunch of pointers to different locations in the stack:
+    // - the most obvious one is the stack pointer
+    // - each frame's base pointer
+    // since REALLOC can move memory if it needs to, we need to calculate an
+    // offset and (if it's not zero) shift everything.
+
+    while(task->stackCapacity < required) {
+        task->stackCapacity *= 2;
+    }
+    OrbitValue* oldStack = task->stack;
+    task->stack = REALLOC_ARRAY(vm, task->stack, OrbitValue, task->stackCapacity);
+
+    int64_t stackOffset = task->stack - oldStack;
+    if(stackOffset == 0) { return; }
+
+    task->sp += stackOffset;
+    for(uint64_t i = 0; i < task->frameCount; ++i) {
+        task->frames[i].stackBase += stackOffset;
+    }
+}
+
+// checks that a task has enough frames left in the call stack for one more
+// to be pushed.
+static inline void orbit_vmEnsureFrames(OrbitVM* vm, OrbitVMTask* task) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+
+    if(task->frameCount + 1 < task->frameCapacity) return;
+    task->frameCapacity *= 2;
+    task->frames = REALLOC_ARRAY(vm, task->frames,
+                                 OrbitVMFrame, task->frameCapacity);
+}
+
+// Makes room for one more frame and [req] more slots on [task]'s stack, with a
+// single check when there is enough already. For verified functions, whose
+// stack effect is exact, this is all the checking a call needs.
+static inline void orbit_vmReserveCall(OrbitVM* vm, OrbitVMTask* task, uint16_t req) {
+    if(task->frameCount + 1 < task->frameCapacity
+       && task->sp + req <= task->stack + task->stackCapacity) { return; }
+    orbit_vmEnsureFrames(vm, task);
+    orbit_vmEnsureStack(vm, task, req);
+}
+
+#endif /* ORBIT_GUARDED_STACKS */
+
+#endif /* orbit_runtime_vm_private_h */
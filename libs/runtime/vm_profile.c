@@ -0,0 +1,470 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_profile.c - Sampling profiler
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-18 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  The profiler's timer sends SIGPROF to the thread running the profiled VM
+//  (a per-thread CPU-time timer on Linux, ITIMER_PROF elsewhere). The signal
+//  handler copies the function and saved instruction pointer of the current
+//  task's frames into the next slot of a ring buffer, and does nothing else:
+//  it can't allocate, take locks or look at objects, which might be halfway
+//  through being changed by the code it interrupted.
+//
+//  The ring buffer has a single producer, the handler, and a single consumer,
+//  orbit_profilerDrain(), which folds samples into a table of distinct stacks.
+//  Each side only writes its own index, and publishes it with release
+//  semantics once the slot it covers is done with.
+//
+//  Samples hold raw pointers, which are only resolved when the profile is
+//  written: a function is named by looking it up in the VM's dispatch table,
+//  so a pointer that no longer refers to a live function is never followed.
+//  Frames only save their instruction pointer when they call another function
+//  or yield, so outer frames are at the call they are waiting on, and the
+//  innermost one at its last call, or its start.
+//
+//  Frames must not move while the handler reads them, which only guarded
+//  stacks (see vm_stack.c) ensure.
+//
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <orbit/csupport/string.h>
+#include <orbit/mangling/mangle.h>
+#include <orbit/runtime/profiler.h>
+#include <orbit/runtime/vm.h>
+#include <orbit/utils/memory.h>
+#include <orbit/utils/platforms.h>
+#include "vm_private.h"
+
+// Deeper stacks keep their innermost frames, under a `[truncated]` root.
+#define ORBIT_PROFILE_DEPTH 32
+
+typedef struct {
+    uint32_t            depth;
+    bool                truncated;
+    OrbitVMFunction*    functions[ORBIT_PROFILE_DEPTH];
+    uint8_t*            ips[ORBIT_PROFILE_DEPTH];
+} OrbitProfileSample;
+
+typedef struct {
+    uint64_t            hash;
+    uint64_t            count;
+    OrbitProfileSample  sample;
+} OrbitProfileStack;
+
+struct _OrbitProfiler {
+    OrbitVM*            vm;
+    bool                running;
+
+    // Indices only ever grow: slot [i] is [ring[i & (capacity-1)]].
+    OrbitProfileSample* ring;
+    uint32_t            capacity;
+    uint32_t            head;
+    uint32_t            tail;
+    uint64_t            dropped;
+
+    // Open-addressed, with a power of two capacity.
+    OrbitProfileStack*  stacks;
+    uint32_t            stackCount;
+    uint32_t            stackCapacity;
+};
+
+static uint64_t orbit_profileHash(const OrbitProfileSample* sample) {
+    uint64_t hash = 14695981039346656037ULL ^ sample->truncated;
+    for(uint32_t i = 0; i < sample->depth; ++i) {
+        hash = (hash ^ (uintptr_t)sample->functions[i]) * 1099511628211ULL;
+        hash = (hash ^ (uintptr_t)sample->ips[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static bool orbit_profileSameStack(const OrbitProfileSample* a, const OrbitProfileSample* b) {
+    return a->depth == b->depth && a->truncated == b->truncated
+        && memcmp(a->functions, b->functions, a->depth * sizeof(a->functions[0])) == 0
+        && memcmp(a->ips, b->ips, a->depth * sizeof(a->ips[0])) == 0;
+}
+
+static void orbit_profileCount(OrbitProfiler* profiler, const OrbitProfileSample* sample,
+                               uint64_t hash, uint64_t count);
+
+static void orbit_profileGrow(OrbitProfiler* profiler) {
+    OrbitProfileStack* stacks = profiler->stacks;
+    uint32_t capacity = profiler->stackCapacity;
+
+    profiler->stackCapacity = capacity ? capacity * 2 : 64;
+    profiler->stacks = ORBIT_ALLOC_ARRAY(OrbitProfileStack, profiler->stackCapacity);
+    profiler->stackCount = 0;
+    for(uint32_t i = 0; i < capacity; ++i) {
+        if(!stacks[i].count) { continue; }
+        orbit_profileCount(profiler, &stacks[i].sample, stacks[i].hash, stacks[i].count);
+    }
+    orbit_dealloc(stacks);
+}
+
+static void orbit_profileCount(OrbitProfiler* profiler, const OrbitProfileSample* sample,
+                               uint64_t hash, uint64_t count) {
+    if((profiler->stackCount + 1) * 4 > profiler->stackCapacity * 3) {
+        orbit_profileGrow(profiler);
+    }
+
+    uint32_t mask = profiler->stackCapacity - 1;
+    for(uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        OrbitProfileStack* stack = &profiler->stacks[i];
+        if(!stack->count) {
+            stack->hash = hash;
+            stack->count = count;
+            stack->sample = *sample;
+            profiler->stackCount += 1;
+            return;
+        }
+        if(stack->hash == hash && orbit_profileSameStack(&stack->sample, sample)) {
+            stack->count += count;
+            return;
+        }
+    }
+}
+
+#ifdef ORBIT_GUARDED_STACKS
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+// Older C libraries only have the glibc-internal name for the thread to signal.
+#if defined(__linux__) && !defined(sigev_notify_thread_id)
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+static OrbitProfiler* orbit_profileActive = NULL;
+static pthread_t orbit_profileThread;
+#ifdef __linux__
+static timer_t orbit_profileTimer;
+#endif
+
+static void orbit_profileSample(OrbitProfiler* profiler) {
+    uint32_t head = __atomic_load_n(&profiler->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&profiler->tail, __ATOMIC_ACQUIRE);
+    if(head - tail == profiler->capacity) {
+        __atomic_add_fetch(&profiler->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    OrbitProfileSample* sample = &profiler->ring[head & (profiler->capacity - 1)];
+    OrbitVMTask* task = profiler->vm->task;
+    uint64_t first = 0, count = task ? task->frameCount : 0;
+    if(count > ORBIT_PROFILE_DEPTH) { first = count - ORBIT_PROFILE_DEPTH; }
+
+    sample->depth = count - first;
+    sample->truncated = first > 0;
+    for(uint64_t i = first; i < count; ++i) {
+        sample->functions[i - first] = task->frames[i].function;
+        sample->ips[i - first] = task->frames[i].ip;
+    }
+    __atomic_store_n(&profiler->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void orbit_profileSignal(int signal) {
+    (void)signal;
+    int error = errno;
+    OrbitProfiler* profiler = __atomic_load_n(&orbit_profileActive, __ATOMIC_ACQUIRE);
+    if(profiler && pthread_equal(pthread_self(), orbit_profileThread)) {
+        orbit_profileSample(profiler);
+    }
+    errno = error;
+}
+
+// The handler stays installed once profiling has started: a signal that was
+// already on its way when the timer was stopped must not kill the process.
+static void orbit_profileInstall(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = orbit_profileSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+}
+
+static bool orbit_profileArm(uint32_t frequency) {
+    long interval = 1000000000L / frequency;
+    if(interval < 1000) { interval = 1000; }
+#ifdef __linux__
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+    if(timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &orbit_profileTimer) != 0) { return false; }
+
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = interval / 1000000000L;
+    spec.it_interval.tv_nsec = interval % 1000000000L;
+    spec.it_value = spec.it_interval;
+    if(timer_settime(orbit_profileTimer, 0, &spec, NULL) != 0) {
+        timer_delete(orbit_profileTimer);
+        return false;
+    }
+    return true;
+#else
+    struct itimerval spec;
+    spec.it_interval.tv_sec = interval / 1000000000L;
+    spec.it_interval.tv_usec = (interval % 1000000000L) / 1000;
+    spec.it_value = spec.it_interval;
+    return setitimer(ITIMER_PROF, &spec, NULL) == 0;
+#endif
+}
+
+static void orbit_profileDisarm(void) {
+#ifdef __linux__
+    timer_delete(orbit_profileTimer);
+#else
+    struct itimerval spec;
+    memset(&spec, 0, sizeof(spec));
+    setitimer(ITIMER_PROF, &spec, NULL);
+#endif
+}
+
+bool orbit_profilerStart(OrbitVM* vm, uint32_t frequency, uint32_t capacity) {
+    assert(vm != NULL && "Null instance error");
+    assert(frequency > 0 && "profiling frequency must be positive");
+    assert(capacity > 0 && "profiler ring buffer can't be empty");
+    if(__atomic_load_n(&orbit_profileActive, __ATOMIC_ACQUIRE)) { return false; }
+
+    orbit_vmProfilerFree(vm);
+    OrbitProfiler* profiler = ORBIT_ALLOC_ARRAY(OrbitProfiler, 1);
+    profiler->vm = vm;
+    profiler->capacity = 1;
+    while(profiler->capacity < capacity) { profiler->capacity <<= 1; }
+    profiler->ring = ORBIT_ALLOC_ARRAY(OrbitProfileSample, profiler->capacity);
+    vm->profiler = profiler;
+
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, orbit_profileInstall);
+
+    // Claims the profiler for this VM, in case another thread got here first.
+    // The timer isn't armed yet, so the handler can't run before the thread is
+    // recorded.
+    OrbitProfiler* none = NULL;
+    if(!__atomic_compare_exchange_n(&orbit_profileActive, &none, profiler, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    orbit_profileThread = pthread_self();
+    if(!orbit_profileArm(frequency)) {
+        __atomic_store_n(&orbit_profileActive, NULL, __ATOMIC_RELEASE);
+        return false;
+    }
+    profiler->running = true;
+    return true;
+}
+
+void orbit_profilerStop(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    OrbitProfiler* profiler = vm->profiler;
+    if(!profiler || !profiler->running) { return; }
+
+    orbit_profileDisarm();
+    __atomic_store_n(&orbit_profileActive, NULL, __ATOMIC_RELEASE);
+    profiler->running = false;
+    orbit_profilerDrain(vm);
+}
+
+#else /* ORBIT_GUARDED_STACKS */
+
+bool orbit_profilerStart(OrbitVM* vm, uint32_t frequency, uint32_t capacity) {
+    assert(vm != NULL && "Null instance error");
+    (void)frequency;
+    (void)capacity;
+    return false;
+}
+
+void orbit_profilerStop(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+}
+
+#endif /* ORBIT_GUARDED_STACKS */
+
+uint32_t orbit_profilerDrain(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    OrbitProfiler* profiler = vm->profiler;
+    if(!profiler) { return 0; }
+
+    uint32_t tail = __atomic_load_n(&profiler->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&profiler->head, __ATOMIC_ACQUIRE);
+    for(uint32_t i = tail; i != head; ++i) {
+        const OrbitProfileSample* sample = &profiler->ring[i & (profiler->capacity - 1)];
+        orbit_profileCount(profiler, sample, orbit_profileHash(sample), 1);
+    }
+    __atomic_store_n(&profiler->tail, head, __ATOMIC_RELEASE);
+    return head - tail;
+}
+
+typedef struct {
+    OrbitVMFunction*    function;
+    OrbitGCString*      signature;
+} OrbitProfileName;
+
+typedef struct {
+    OCString*           text;
+    uint64_t            count;
+} OrbitProfileLine;
+
+static int orbit_profileCompareNames(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)((const OrbitProfileName*)a)->function;
+    uintptr_t y = (uintptr_t)((const OrbitProfileName*)b)->function;
+    return (x > y) - (x < y);
+}
+
+static int orbit_profileCompareLines(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)((const OrbitProfileLine*)a)->text;
+    uintptr_t y = (uintptr_t)((const OrbitProfileLine*)b)->text;
+    return (x > y) - (x < y);
+}
+
+static int orbit_profileCompareText(const void* a, const void* b) {
+    const OCString* x = ((const OrbitProfileLine*)a)->text;
+    const OCString* y = ((const OrbitProfileLine*)b)->text;
+    int order = memcmp(x->data, y->data, x->length < y->length ? x->length : y->length);
+    return order ? order : (x->length > y->length) - (x->length < y->length);
+}
+
+static void orbit_profileFrame(OCStringBuffer* line, const OrbitProfileName* names, uint64_t nameCount,
+                               OrbitVMFunction* function, uint8_t* ip, bool offsets) {
+    OrbitProfileName key = {function, NULL};
+    const OrbitProfileName* name = bsearch(&key, names, nameCount, sizeof(OrbitProfileName),
+                                           orbit_profileCompareNames);
+    if(!name) {
+        orbit_stringBufferAppendC(line, "[unknown]", 9);
+        return;
+    }
+
+    const OrbitGCString* signature = name->signature;
+    OCString* demangled = NULL;
+    if(signature->length > 2 && signature->data[0] == '_' && signature->data[1] == 'O') {
+        demangled = orbit_stringPoolGet(orbit_demangle(signature->data, signature->length));
+    }
+    if(demangled) {
+        orbit_stringBufferAppendC(line, demangled->data, demangled->length);
+    } else {
+        orbit_stringBufferAppendC(line, signature->data, signature->length);
+    }
+    if(!offsets || function->kind != ORBIT_FK_NATIVE) { return; }
+
+    const GCNativeFn* native = &function->native;
+    int64_t offset = -1;
+    if(ip >= native->byteCode && ip < native->byteCode + native->byteCodeLength) {
+        offset = ip - native->byteCode;
+    } else if(native->regCode && (uint32_t*)ip >= native->regCode
+              && (uint32_t*)ip < native->regCode + native->regCodeLength) {
+        offset = (uint32_t*)ip - native->regCode;
+    }
+    if(offset < 0) { return; }
+    char digits[16];
+    int length = snprintf(digits, sizeof(digits), "+%u", (unsigned)offset);
+    orbit_stringBufferAppendC(line, digits, length);
+}
+
+static void orbit_profileStack(OCStringBuffer* line, const OrbitProfileSample* sample,
+                               const OrbitProfileName* names, uint64_t nameCount, bool offsets) {
+    if(sample->depth == 0) { orbit_stringBufferAppendC(line, "[host]", 6); }
+    if(sample->truncated) { orbit_stringBufferAppendC(line, "[truncated]", 11); }
+    for(uint32_t i = 0; i < sample->depth; ++i) {
+        if(i || sample->truncated) { orbit_stringBufferAppendC(line, ";", 1); }
+        orbit_profileFrame(line, names, nameCount, sample->functions[i], sample->ips[i], offsets);
+    }
+}
+
+uint64_t orbit_profilerWrite(OrbitVM* vm, FILE* out, bool offsets) {
+    assert(vm != NULL && "Null instance error");
+    assert(out != NULL && "Null file passed");
+    OrbitProfiler* profiler = vm->profiler;
+    if(!profiler) { return 0; }
+    orbit_profilerDrain(vm);
+
+    // Every function that can be called is in the dispatch table.
+    OrbitGCMap* table = vm->dispatchTable;
+    OrbitProfileName* names = ORBIT_ALLOC_ARRAY(OrbitProfileName, table->size + 1);
+    uint64_t nameCount = 0;
+    for(uint64_t i = 0; i < table->capacity; ++i) {
+        const OrbitGCMapEntry* entry = &table->data[i];
+        if(!IS_STRING(entry->key) || !IS_FUNCTION(entry->value)) { continue; }
+        names[nameCount].function = AS_FUNCTION(entry->value);
+        names[nameCount].signature = AS_STRING(entry->key);
+        nameCount += 1;
+    }
+    qsort(names, nameCount, sizeof(OrbitProfileName), orbit_profileCompareNames);
+
+    // Stacks that only differ by instruction pointers have the same text when
+    // offsets aren't written. Lines are interned in a pool of their own, so
+    // equal lines can be found by address, and merged.
+    OCStringPool pool;
+    orbit_stringPoolInit(&pool, 64);
+    OCStringPool* strings = orbit_stringPoolSetCurrent(&pool);
+    OCStringBuffer buffer;
+    orbit_stringBufferInit(&buffer, 256);
+
+    OrbitProfileLine* lines = ORBIT_ALLOC_ARRAY(OrbitProfileLine, profiler->stackCount + 1);
+    uint32_t lineCount = 0;
+    for(uint32_t i = 0; i < profiler->stackCapacity; ++i) {
+        const OrbitProfileStack* stack = &profiler->stacks[i];
+        if(!stack->count) { continue; }
+        orbit_stringBufferReset(&buffer);
+        orbit_profileStack(&buffer, &stack->sample, names, nameCount, offsets);
+        lines[lineCount].text = orbit_stringPoolGet(orbit_stringPoolIntern(&pool, buffer.data, buffer.length));
+        lines[lineCount].count = stack->count;
+        lineCount += 1;
+    }
+
+    uint32_t merged = 0;
+    qsort(lines, lineCount, sizeof(OrbitProfileLine), orbit_profileCompareLines);
+    for(uint32_t i = 0; i < lineCount; ++i) {
+        if(merged && lines[merged-1].text == lines[i].text) {
+            lines[merged-1].count += lines[i].count;
+        } else {
+            lines[merged++] = lines[i];
+        }
+    }
+    qsort(lines, merged, sizeof(OrbitProfileLine), orbit_profileCompareText);
+
+    uint64_t written = 0;
+    for(uint32_t i = 0; i < merged; ++i) {
+        fprintf(out, "%.*s %llu\n", (int)lines[i].text->length, lines[i].text->data,
+                (unsigned long long)lines[i].count);
+        written += lines[i].count;
+    }
+    uint64_t dropped = __atomic_load_n(&profiler->dropped, __ATOMIC_RELAXED);
+    if(dropped) {
+        fprintf(out, "[dropped] %llu\n", (unsigned long long)dropped);
+    }
+
+    orbit_stringBufferDeinit(&buffer);
+    orbit_stringPoolSetCurrent(strings);
+    orbit_stringPoolDeinit(&pool);
+    orbit_dealloc(lines);
+    orbit_dealloc(names);
+    return written;
+}
+
+void orbit_vmProfilerFree(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    OrbitProfiler* profiler = vm->profiler;
+    if(!profiler) { return; }
+
+    orbit_profilerStop(vm);
+    orbit_dealloc(profiler->ring);
+    orbit_dealloc(profiler->stacks);
+    orbit_dealloc(profiler);
+    vm->profiler = NULL;
+}
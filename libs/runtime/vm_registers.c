@@ -0,0 +1,455 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_registers.c - Orbit's register-based interpreter
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-10 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  Runs register code (see regcodes.h) instead of stack bytecode. Functions
+//  that weren't loaded with register code are translated on their first call
+//  (see vm_regtranslate.c).
+//
+//  Register frames live in the task's stack, where the stack machine would
+//  keep its locals and operands, and frame->ip points into the register code.
+//  task->sp is only kept up to date where it matters: before calls and
+//  allocations, which can trigger a collection, it points just past the last
+//  live register.
+//
+#include <assert.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <orbit/runtime/vm.h>
+#include <orbit/runtime/gc.h>
+#include <orbit/utils/platforms.h>
+#include "vm_private.h"
+
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_REGISTERS
+
+void orbit_vmPrepareFunction(OrbitVM* vm, OrbitVMFunction* function) {
+    // Translation needs the functions called by [function] to be loaded, so it
+    // is left until [function] is first invoked.
+}
+
+static void orbit_vmDebugValue(OrbitValue value) {
+    if(IS_NUM(value)) {
+        fprintf(stderr, "REG: %lf\n", AS_NUM(value));
+    }
+    else if(IS_NIL(value)) {
+        fprintf(stderr, "REG: nil\n");
+    }
+    else if(IS_BOOL(value)) {
+        fprintf(stderr, "REG: %s\n", IS_TRUE(value) ? "true" : "false");
+    }
+    else if(IS_STRING(value)) {
+        fprintf(stderr, "REG: \"%.*s\"\n", (int)AS_STRING(value)->length, AS_STRING(value)->data);
+    }
+    else {
+        fprintf(stderr, "REG: @%p\n", AS_OBJECT(value));
+    }
+}
+
+// Sets up a new frame for [function], whose arguments are the values just
+// below [top]. Returns false if the function can't be run as register code.
+static bool orbit_vmPushFrame(OrbitVM* vm, OrbitVMTask* task, OrbitVMFunction* function, OrbitValue* top) {
+    if(!orbit_vmTranslateRegisters(vm, function)) {
+        fprintf(stderr, "error: cannot translate function to register code\n");
+        return false;
+    }
+    task->sp = top;
+    orbit_vmEnsureFrames(vm, task);
+    orbit_vmEnsureStack(vm, task, function->native.regCount);
+
+    OrbitVMFrame* frame = &task->frames[task->frameCount++];
+    frame->task = task;
+    frame->function = function;
+    frame->ip = (uint8_t*)function->native.regCode;
+    frame->stackBase = task->sp - function->arity;
+
+    uint16_t base = function->arity + function->localCount;
+    for(uint16_t i = function->arity; i < base; ++i) {
+        frame->stackBase[i] = VAL_NIL;
+    }
+    task->sp = frame->stackBase + base;
+    ORBIT_TRACE_CALL(vm, function, task);
+    return true;
+}
+
+// Does what the `resolve` for the call at bytecode [offset] of [fn] needs
+// before [fn] can be translated again: the callee must be loaded by now, and a
+// foreign function that never ran is called to find out if it returns a value.
+// The live registers are below task->sp. Returns where to carry on in the new
+// register code, or UINT32_MAX if the call can't be made.
+static uint32_t orbit_vmResolveCall(OrbitVM* vm, OrbitVMTask* task, OrbitVMFunction* fn, uint16_t offset) {
+    const uint8_t* code = fn->native.byteCode + offset;
+    uint16_t idx = (code[1] << 8) | code[2];
+    OrbitValue* constants = fn->module->constants;
+    OrbitValue callee = constants[idx];
+    if(!IS_FUNCTION(callee)) {
+        OrbitValue symbol = callee;
+        orbit_gcMapGet(vm->dispatchTable, symbol, &callee);
+        if(!IS_FUNCTION(callee)) { return UINT32_MAX; }
+        constants[idx] = callee;
+    }
+
+    OrbitVMFunction* callee_ = AS_FUNCTION(callee);
+    uint16_t resume = offset;
+    bool invoke = code[0] == CODE_invoke || code[0] == CODE_invoke_sym;
+    if(invoke && callee_->kind == ORBIT_FK_FOREIGN && callee_->foreignResults < 0) {
+        OrbitValue* args = task->sp - callee_->arity;
+        ORBIT_TRACE_CALL(vm, callee_, task);
+        bool result = callee_->foreign(vm, args);
+        if(!result) { *args = VAL_NIL; }
+        ORBIT_TRACE_RETURN(vm, callee_, task);
+        callee_->foreignResults = result ? 1 : 0;
+        resume = offset + 3;
+    }
+
+    uint32_t at = orbit_vmRetranslateRegisters(vm, fn, resume);
+    orbit_vmEnsureStack(vm, task, fn->native.regCount);
+    return at;
+}
+
+// Makes [task] the VM's current task. Tasks that never ran point at their entry
+// point's bytecode, which we swap for the function's register code.
+static bool orbit_vmEnterTask(OrbitVM* vm, OrbitVMTask* task) {
+    vm->task = task;
+    OrbitVMFrame* frame = &task->frames[task->frameCount-1];
+    OrbitVMFunction* fn = frame->function;
+    if(frame->ip != fn->native.byteCode) { return true; }
+    task->frameCount -= 1;
+    return orbit_vmPushFrame(vm, task, fn, frame->stackBase + fn->arity);
+}
+
+bool orbit_vmRun(OrbitVM* vm, OrbitVMTask* task) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+    assert(task->frameCount > 0 && "task must have an entry point");
+
+    if(!orbit_vmEnterTask(vm, task)) { return false; }
+    OrbitVMFrame* frame = &task->frames[task->frameCount-1];
+    OrbitVMFunction* fn = frame->function;
+
+    register const uint32_t* ip = (const uint32_t*)frame->ip;
+    register OrbitValue* regs = frame->stackBase;
+    OrbitValue* constants = fn->module->constants;
+    uint32_t word = 0;
+
+#define OP(w) ((w) & 0xff)
+#define A() ((word >> 8) & 0xff)
+#define B() ((word >> 16) & 0xff)
+#define C() ((word >> 24) & 0xff)
+#define Bx() ((uint16_t)(word >> 16))
+#define sJ() ((int32_t)word >> 8)
+#define EXT() ((int32_t)*(ip++))
+
+#ifdef _MSC_VER
+    #define HANDLER(code) case REG_##code:
+    #define NEXT() goto loop
+    #define START_LOOP() loop: ORBIT_COUNT_DISPATCH(vm); word = *(ip++); switch(OP(word))
+#else
+    #define REGCODE(code, _) &&reg_##code,
+    static void* dispatch[] = {
+    #include <orbit/runtime/regcodes.h>
+    };
+    #define HANDLER(code) reg_##code:
+    #define NEXT() do { ORBIT_COUNT_DISPATCH(vm); word = *(ip++); goto *dispatch[OP(word)]; } while(0)
+    #define START_LOOP() NEXT();
+#endif
+
+// Rewrites the current instruction. Register code always belongs to the
+// function, even when its bytecode is shared.
+#define PATCH(code) (((uint32_t*)ip)[-1] = (word & ~0xffu) | REG_##code)
+
+#define LOAD_FRAME()                                                                \
+    do {                                                                            \
+        frame = &task->frames[task->frameCount-1];                                  \
+        fn = frame->function;                                                       \
+        regs = frame->stackBase;                                                    \
+        constants = fn->module->constants;                                          \
+        ip = (const uint32_t*)frame->ip;                                            \
+    } while(0)
+
+#define CALL(callee)                                                                \
+    do {                                                                            \
+        if(!IS_FUNCTION(callee)) return false;                                      \
+        OrbitVMFunction* callee_ = AS_FUNCTION(callee);                             \
+        OrbitValue* top_ = regs + A();                                              \
+        frame->ip = (uint8_t*)ip;                                                   \
+        if(callee_->kind == ORBIT_FK_FOREIGN) {                                     \
+            task->sp = top_;                                                        \
+            OrbitValue* args_ = top_ - callee_->arity;                              \
+            ORBIT_TRACE_CALL(vm, callee_, task);                                    \
+            if(!callee_->foreign(vm, args_)) { *args_ = VAL_NIL; }                  \
+            ORBIT_TRACE_RETURN(vm, callee_, task);                                  \
+            NEXT();                                                                 \
+        }                                                                           \
+        if(!orbit_vmPushFrame(vm, task, callee_, top_)) return false;               \
+        LOAD_FRAME();                                                               \
+        NEXT();                                                                     \
+    } while(0)
+
+// Other tasks only run while this one is suspended, so task->sp must cover
+// every live register before switching.
+#define SWITCH_TASK(next)                                                           \
+    do {                                                                            \
+        task = (next);                                                              \
+        if(!orbit_vmEnterTask(vm, task)) return false;                              \
+        LOAD_FRAME();                                                               \
+        NEXT();                                                                     \
+    } while(0)
+
+#define RETURN()                                                                    \
+    do {                                                                            \
+        ORBIT_TRACE_RETURN(vm, fn, task);                                           \
+        if(--task->frameCount == 0) {                                               \
+            OrbitVMTask* next_ = orbit_vmTaskFinished(vm, task);                    \
+            if(!next_) return true;                                                 \
+            SWITCH_TASK(next_);                                                     \
+        }                                                                           \
+        LOAD_FRAME();                                                               \
+        NEXT();                                                                     \
+    } while(0)
+
+#define SPAWN(callee)                                                               \
+    do {                                                                            \
+        if(!IS_FUNCTION(callee)) return false;                                      \
+        OrbitVMFunction* spawned_ = AS_FUNCTION(callee);                            \
+        if(spawned_->kind != ORBIT_FK_NATIVE) return false;                         \
+        OrbitValue* args_ = regs + A() - spawned_->arity;                           \
+        task->sp = regs + A();                                                      \
+        *args_ = MAKE_OBJECT(orbit_vmSpawn(vm, spawned_, args_));                   \
+        NEXT();                                                                     \
+    } while(0)
+
+#define NUM_BINARY(code, make, op)                                                  \
+    HANDLER(code) {                                                                 \
+        OrbitValue b = regs[B()];                                                   \
+        OrbitValue c = regs[C()];                                                   \
+        if(!IS_NUM(b) || !IS_NUM(c)) return false;                                  \
+        regs[A()] = make(AS_NUM(b) op AS_NUM(c));                                   \
+        NEXT();                                                                     \
+    }
+
+#define NUM_BRANCH(code, op)                                                        \
+    HANDLER(code) {                                                                 \
+        OrbitValue a = regs[A()];                                                   \
+        OrbitValue b = regs[B()];                                                   \
+        int32_t offset = EXT();                                                     \
+        if(!IS_NUM(a) || !IS_NUM(b)) return false;                                  \
+        if(AS_NUM(a) op AS_NUM(b)) ip += offset;                                    \
+        NEXT();                                                                     \
+    }
+
+    START_LOOP()
+    {
+        HANDLER(halt) {
+            frame->ip = (uint8_t*)ip;
+            return true;
+        }
+
+        HANDLER(move) {
+            regs[A()] = regs[B()];
+            NEXT();
+        }
+
+        HANDLER(loadnil) {
+            regs[A()] = VAL_NIL;
+            NEXT();
+        }
+
+        HANDLER(loadtrue) {
+            regs[A()] = VAL_TRUE;
+            NEXT();
+        }
+
+        HANDLER(loadfalse) {
+            regs[A()] = VAL_FALSE;
+            NEXT();
+        }
+
+        HANDLER(loadk) {
+            regs[A()] = constants[Bx()];
+            NEXT();
+        }
+
+        HANDLER(getg) {
+            regs[A()] = fn->module->globals[Bx()].global;
+            NEXT();
+        }
+
+        HANDLER(setg) {
+            fn->module->globals[Bx()].global = regs[A()];
+            NEXT();
+        }
+
+        HANDLER(getfield) {
+            uint32_t field = EXT();
+            regs[A()] = AS_INST(regs[B()])->fields[field];
+            NEXT();
+        }
+
+        HANDLER(setfield) {
+            uint32_t field = EXT();
+            AS_INST(regs[A()])->fields[field] = regs[B()];
+            orbit_gcWriteBarrier(vm, AS_OBJECT(regs[A()]), regs[B()]);
+            NEXT();
+        }
+
+        NUM_BINARY(add, MAKE_NUM, +)
+        NUM_BINARY(sub, MAKE_NUM, -)
+        NUM_BINARY(mul, MAKE_NUM, *)
+        NUM_BINARY(div, MAKE_NUM, /)
+        NUM_BINARY(lt, MAKE_BOOL, <)
+        NUM_BINARY(gt, MAKE_BOOL, >)
+
+        HANDLER(eq) {
+            OrbitValue b = regs[B()];
+            OrbitValue c = regs[C()];
+            if(IS_NUM(b) && IS_NUM(c)) {
+                regs[A()] = MAKE_BOOL(AS_NUM(b) == AS_NUM(c));
+            } else {
+                regs[A()] = MAKE_BOOL(orbit_valueEquals(b, c));
+            }
+            NEXT();
+        }
+
+        HANDLER(jmp) {
+            ip += sJ();
+            NEXT();
+        }
+
+        HANDLER(jt) {
+            int32_t offset = EXT();
+            if(IS_TRUE(regs[A()])) ip += offset;
+            NEXT();
+        }
+
+        NUM_BRANCH(jlt, <)
+        NUM_BRANCH(jgt, >)
+
+        HANDLER(jeq) {
+            OrbitValue a = regs[A()];
+            OrbitValue b = regs[B()];
+            int32_t offset = EXT();
+            if(IS_NUM(a) && IS_NUM(b) ? AS_NUM(a) == AS_NUM(b) : orbit_valueEquals(a, b)) {
+                ip += offset;
+            }
+            NEXT();
+        }
+
+        // Like `invoke_sym`, resolves the symbol the first time and rewrites
+        // the instruction into a direct `call`.
+        HANDLER(callsym) {
+            uint16_t idx = Bx();
+            OrbitValue callee = constants[idx];
+            if(!IS_FUNCTION(callee)) {
+                OrbitValue symbol = callee;
+                orbit_gcMapGet(vm->dispatchTable, symbol, &callee);
+                constants[idx] = callee;
+            }
+            PATCH(call);
+            CALL(callee);
+        }
+
+        HANDLER(call) {
+            OrbitValue callee = constants[Bx()];
+            CALL(callee);
+        }
+
+        HANDLER(resolve) {
+            frame->ip = (uint8_t*)ip;
+            task->sp = regs + A();
+            uint32_t at = orbit_vmResolveCall(vm, task, fn, Bx());
+            if(at == UINT32_MAX) return false;
+            LOAD_FRAME();
+            ip = fn->native.regCode + at;
+            NEXT();
+        }
+
+        HANDLER(ret) {
+            task->sp = frame->stackBase;
+            RETURN();
+        }
+
+        HANDLER(retv) {
+            OrbitValue value = regs[A()];
+            task->sp = frame->stackBase;
+            *(task->sp++) = value;
+            RETURN();
+        }
+
+        HANDLER(newsym) {
+            uint16_t idx = Bx();
+            OrbitValue class = constants[idx];
+            if(!IS_CLASS(class)) {
+                OrbitValue symbol = class;
+                orbit_gcMapGet(vm->classes, symbol, &class);
+                if(!IS_CLASS(class)) return false;
+                constants[idx] = class;
+            }
+            PATCH(new);
+            task->sp = regs + A();
+            regs[A()] = MAKE_OBJECT(orbit_gcInstanceNew(vm, AS_CLASS(class)));
+            NEXT();
+        }
+
+        HANDLER(new) {
+            OrbitValue class = constants[Bx()];
+            if(!IS_CLASS(class)) return false;
+            task->sp = regs + A();
+            regs[A()] = MAKE_OBJECT(orbit_gcInstanceNew(vm, AS_CLASS(class)));
+            NEXT();
+        }
+
+        HANDLER(debug) {
+            orbit_vmDebugValue(regs[A()]);
+            NEXT();
+        }
+
+        HANDLER(spawnsym) {
+            uint16_t idx = Bx();
+            OrbitValue callee = constants[idx];
+            if(!IS_FUNCTION(callee)) {
+                OrbitValue symbol = callee;
+                orbit_gcMapGet(vm->dispatchTable, symbol, &callee);
+                constants[idx] = callee;
+            }
+            PATCH(spawn);
+            SPAWN(callee);
+        }
+
+        HANDLER(spawn) {
+            OrbitValue callee = constants[Bx()];
+            SPAWN(callee);
+        }
+
+        HANDLER(yield) {
+            if(!vm->runQueue) NEXT();
+            frame->ip = (uint8_t*)ip;
+            task->sp = regs + A();
+            SWITCH_TASK(orbit_vmTaskYield(vm, task));
+        }
+
+        // Like the stack machine, a task that has to wait runs the `join`
+        // again once it's woken up.
+        HANDLER(join) {
+            OrbitValue target = regs[A()-1];
+            if(!IS_TASK(target)) return false;
+            if(AS_TASK(target)->state != ORBIT_TASK_DONE) {
+                frame->ip = (uint8_t*)(ip - 1);
+                task->sp = regs + A();
+                OrbitVMTask* next = orbit_vmTaskWait(vm, task, AS_TASK(target));
+                if(!next) return false;
+                SWITCH_TASK(next);
+            }
+            regs[A()-1] = AS_TASK(target)->result;
+            NEXT();
+        }
+    }
+
+    return false;
+}
+
+#endif /* ORBIT_DISPATCH == ORBIT_DISPATCH_REGISTERS */
@@ -0,0 +1,742 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_regtranslate.c - Stack bytecode to register code translator
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-10 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  The translator maps each operand stack slot to a register of the frame:
+//  with [base] = arity + localCount, the value at depth `i` lives in register
+//  `base + i`. Since registers are frame slots, this is exactly where the stack
+//  machine would keep it, which means calls need no argument shuffling.
+//
+//  Most of the win comes from not materialising values that don't need to be.
+//  Each entry of the translator's virtual stack records which register holds
+//  its value: `load_local` pushes a reference to the local instead of copying
+//  it, and arithmetic reads its operands straight from wherever they are.
+//  When an instruction's result is immediately stored to a local, the
+//  instruction writes the local directly. Finally, comparisons followed by a
+//  conditional jump are fused into a single compare-and-branch.
+//
+//  Before any jump, call or allocation, every entry is copied to its own slot
+//  so that the frame looks exactly like the stack machine's would at that
+//  point, which keeps jump targets and GC marking simple.
+//
+#include <assert.h>
+#include <string.h>
+#include <orbit/runtime/gc.h>
+#include <orbit/runtime/vm.h>
+#include <orbit/utils/memory.h>
+#include "vm_private.h"
+
+#define REG_MAX 255
+#define NO_DEPTH (-1)
+
+#define REGCODE(code, length) length,
+const uint8_t orbit_vmRegCodeLength[] = {
+#include <orbit/runtime/regcodes.h>
+};
+#undef REGCODE
+
+#define RC_ABC(op, a, b, c) ((uint32_t)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 24))
+#define RC_ABx(op, a, bx)   ((uint32_t)(op) | ((uint32_t)(a) << 8) | ((uint32_t)(bx) << 16))
+#define RC_sJ(op, j)        ((uint32_t)(op) | ((uint32_t)(j) << 8))
+
+typedef enum { FIXUP_SJ, FIXUP_EXT } OrbitRTFixupKind;
+
+typedef struct {
+    OrbitRTFixupKind    kind;
+    uint32_t            word;
+    uint16_t            target;
+} OrbitRTFixup;
+
+typedef struct {
+    OrbitVM*            vm;
+    OrbitVMFunction*    fn;
+    uint16_t            length;
+    const uint8_t*      byteCode;
+
+    // Analysis results, indexed by bytecode offset.
+    int16_t*            depths;
+    bool*               targets;
+    int16_t             maxDepth;
+
+    // Output
+    uint32_t*           code;
+    uint32_t            codeLength;
+    uint32_t            codeCapacity;
+    uint32_t*           mapping;
+    OrbitRTFixup*       fixups;
+    uint32_t            fixupCount;
+    uint32_t            fixupCapacity;
+    int64_t             lastStart;
+
+    // Virtual operand stack: the register holding each entry's value.
+    uint8_t             base;
+    uint8_t             stack[REG_MAX+1];
+    int16_t             depth;
+} OrbitRT;
+
+// MARK: - Call effects
+
+// Returns whether [function] returns a value, looking for `ret_val`.
+static bool rt_returnsValue(OrbitVMFunction* function) {
+    const uint8_t* code = function->native.byteCode;
+    for(uint16_t offset = 0; offset < function->native.byteCodeLength;) {
+        if(code[offset] == CODE_ret_val) { return true; }
+        offset += 1 + orbit_vmOperandBytes[code[offset]];
+    }
+    return false;
+}
+
+// Returns the function in constant [idx], or NULL if it isn't loaded yet.
+static OrbitVMFunction* rt_callee(OrbitRT* rt, uint16_t idx) {
+    OrbitValue callee = rt->fn->module->constants[idx];
+    if(IS_STRING(callee)) {
+        if(!orbit_gcMapGet(rt->vm->dispatchTable, callee, &callee)) { return NULL; }
+    }
+    return IS_FUNCTION(callee) ? AS_FUNCTION(callee) : NULL;
+}
+
+// Finds how many values the call through constant [idx] pops and pushes.
+// Returns false if that isn't known yet: the callee isn't loaded, or is a
+// foreign function that never ran. Such calls end the translated path with a
+// `resolve`, and the function is translated again once they have run (see
+// orbit_vmRetranslateRegisters()).
+static bool rt_callEffect(OrbitRT* rt, uint16_t idx, uint8_t* arity, uint8_t* results) {
+    OrbitVMFunction* function = rt_callee(rt, idx);
+    if(!function) { return false; }
+    
+    *arity = function->arity;
+    if(function->kind == ORBIT_FK_NATIVE) {
+        *results = rt_returnsValue(function) ? 1 : 0;
+        return true;
+    }
+    if(function->foreignResults < 0) { return false; }
+    *results = function->foreignResults ? 1 : 0;
+    return true;
+}
+
+// Finds how many values spawning the function in constant [idx] pops. Spawning
+// always pushes the new task. Returns false if the function isn't loaded yet.
+static bool rt_spawnEffect(OrbitRT* rt, uint16_t idx, uint8_t* arity) {
+    OrbitVMFunction* function = rt_callee(rt, idx);
+    if(!function) { return false; }
+    *arity = function->arity;
+    return true;
+}
+
+// MARK: - Stack depth analysis
+
+static bool rt_visit(OrbitRT* rt, uint16_t* worklist, uint32_t* count, int32_t target, int16_t depth) {
+    if(target < 0 || target > rt->length) { return false; }
+    if(target == rt->length) { return true; }
+    if(rt->depths[target] == NO_DEPTH) {
+        rt->depths[target] = depth;
+        worklist[(*count)++] = target;
+        return true;
+    }
+    return rt->depths[target] == depth;
+}
+
+// Computes the operand stack depth before each reachable instruction, checking
+// operands as it goes. Fails if the stack would underflow, or if two paths
+// reach an instruction with different depths. Paths stop at calls whose effect
+// isn't known yet.
+static bool rt_analyse(OrbitRT* rt) {
+    uint16_t length = rt->length;
+    OrbitVMModule* module = rt->fn->module;
+    uint16_t* worklist = orbit_allocMulti(sizeof(uint16_t), length + 1);
+    uint32_t count = 0;
+    bool ok = true;
+
+    for(uint16_t i = 0; i < length; ++i) {
+        rt->depths[i] = NO_DEPTH;
+        rt->targets[i] = false;
+    }
+    rt->maxDepth = 0;
+    if(length) {
+        rt->depths[0] = 0;
+        worklist[count++] = 0;
+    }
+
+    while(ok && count) {
+        uint16_t offset = worklist[--count];
+        int16_t depth = rt->depths[offset];
+        uint8_t op = rt->byteCode[offset];
+        if(op >= sizeof(orbit_vmOperandBytes)) { ok = false; break; }
+
+        uint32_t next = offset + 1 + orbit_vmOperandBytes[op];
+        if(next > length) { ok = false; break; }
+        uint16_t operand = 0;
+        if(orbit_vmOperandBytes[op] == 1) {
+            operand = rt->byteCode[offset+1];
+        } else if(orbit_vmOperandBytes[op] == 2) {
+            operand = (rt->byteCode[offset+1] << 8) | rt->byteCode[offset+2];
+        }
+
+        int16_t pops = 0, pushes = 0;
+        int32_t jump = -1;
+        bool fallsThrough = true;
+        uint8_t arity = 0, results = 0;
+
+        switch(op) {
+        case CODE_load_nil: case CODE_load_true: case CODE_load_false:
+            pushes = 1;
+            break;
+        case CODE_load_const:
+            ok = operand < module->constantCount;
+            pushes = 1;
+            break;
+        case CODE_load_local:
+            ok = operand < rt->base;
+            pushes = 1;
+            break;
+        case CODE_store_local:
+            ok = operand < rt->base;
+            pops = 1;
+            break;
+        case CODE_load_global:
+            ok = operand < module->globalCount;
+            pushes = 1;
+            break;
+        case CODE_store_global:
+            ok = operand < module->globalCount;
+            pops = 1;
+            break;
+        case CODE_load_field:
+            pops = 1;
+            pushes = 1;
+            break;
+        case CODE_store_field:
+            pops = 2;
+            break;
+        case CODE_add: case CODE_add_nn:
+        case CODE_sub: case CODE_sub_nn:
+        case CODE_mul: case CODE_mul_nn:
+        case CODE_div: case CODE_div_nn:
+        case CODE_test_lt: case CODE_test_lt_nn:
+        case CODE_test_gt: case CODE_test_gt_nn:
+        case CODE_test_eq: case CODE_test_eq_nn: case CODE_test_eq_ss:
+            pops = 2;
+            pushes = 1;
+            break;
+        case CODE_and: case CODE_or:
+            break;
+        case CODE_jump_if:
+            pops = 1;
+            jump = next + operand;
+            break;
+        case CODE_jump:
+            jump = next + operand;
+            fallsThrough = false;
+            break;
+        case CODE_rjump_if:
+            pops = 1;
+            jump = (int32_t)next - operand;
+            break;
+        case CODE_rjump:
+            jump = (int32_t)next - operand;
+            fallsThrough = false;
+            break;
+        case CODE_pop:
+            pops = 1;
+            break;
+        case CODE_swap:
+            pops = 2;
+            pushes = 2;
+            break;
+        case CODE_invoke_sym: case CODE_invoke:
+            ok = operand < module->constantCount;
+            if(ok && rt_callEffect(rt, operand, &arity, &results)) {
+                pops = arity;
+                pushes = results;
+            } else {
+                fallsThrough = false;
+            }
+            break;
+        case CODE_init_sym: case CODE_init:
+            ok = operand < module->constantCount;
+            pushes = 1;
+            break;
+        case CODE_spawn_sym: case CODE_spawn:
+            ok = operand < module->constantCount;
+            if(ok && rt_spawnEffect(rt, operand, &arity)) {
+                pops = arity;
+                pushes = 1;
+            } else {
+                fallsThrough = false;
+            }
+            break;
+        case CODE_yield:
+            break;
+        case CODE_join:
+            pops = 1;
+            pushes = 1;
+            break;
+        case CODE_ret_val:
+            pops = 1;
+            fallsThrough = false;
+            break;
+        case CODE_ret: case CODE_halt:
+            fallsThrough = false;
+            break;
+        case CODE_debug_prt:
+            pops = 1;
+            pushes = 1;
+            break;
+        default:
+            ok = false;
+            break;
+        }
+        if(!ok) { break; }
+        if(depth < pops) { ok = false; break; }
+
+        int16_t after = depth - pops + pushes;
+        if(after > rt->maxDepth) { rt->maxDepth = after; }
+        if(rt->base + rt->maxDepth + 1 > REG_MAX) { ok = false; break; }
+
+        if(jump >= 0 || op == CODE_rjump || op == CODE_rjump_if) {
+            ok = rt_visit(rt, worklist, &count, jump, after);
+            if(ok && jump < length) { rt->targets[jump] = true; }
+        }
+        if(ok && fallsThrough) {
+            ok = rt_visit(rt, worklist, &count, next, after);
+        }
+    }
+    orbit_dealloc(worklist);
+    return ok;
+}
+
+// MARK: - Code emission
+
+static uint32_t rt_emit(OrbitRT* rt, uint32_t word) {
+    if(rt->codeLength + 1 > rt->codeCapacity) {
+        rt->codeCapacity = rt->codeCapacity ? rt->codeCapacity * 2 : 64;
+        rt->code = orbit_realloc(rt->code, rt->codeCapacity * sizeof(uint32_t));
+    }
+    rt->code[rt->codeLength] = word;
+    return rt->codeLength++;
+}
+
+// Starts a new instruction. Only the last instruction started can be retargeted
+// by rt_storeLocal().
+static uint32_t rt_op(OrbitRT* rt, uint32_t word) {
+    rt->lastStart = rt->codeLength;
+    return rt_emit(rt, word);
+}
+
+static void rt_fixup(OrbitRT* rt, OrbitRTFixupKind kind, uint32_t word, uint16_t target) {
+    if(rt->fixupCount + 1 > rt->fixupCapacity) {
+        rt->fixupCapacity = rt->fixupCapacity ? rt->fixupCapacity * 2 : 16;
+        rt->fixups = orbit_realloc(rt->fixups, rt->fixupCapacity * sizeof(OrbitRTFixup));
+    }
+    rt->fixups[rt->fixupCount++] = (OrbitRTFixup){kind, word, target};
+}
+
+static inline uint8_t rt_slot(OrbitRT* rt, int16_t depth) {
+    return rt->base + depth;
+}
+
+static inline uint8_t rt_pop(OrbitRT* rt) {
+    return rt->stack[--rt->depth];
+}
+
+static inline uint8_t rt_pushOwn(OrbitRT* rt) {
+    uint8_t slot = rt_slot(rt, rt->depth);
+    rt->stack[rt->depth++] = slot;
+    return slot;
+}
+
+// Copies the entry at [depth] to its own slot, if it isn't there already.
+static void rt_flushEntry(OrbitRT* rt, int16_t depth) {
+    uint8_t slot = rt_slot(rt, depth);
+    if(rt->stack[depth] == slot) { return; }
+    rt_op(rt, RC_ABC(REG_move, slot, rt->stack[depth], 0));
+    rt->stack[depth] = slot;
+}
+
+static void rt_flush(OrbitRT* rt) {
+    for(int16_t i = 0; i < rt->depth; ++i) { rt_flushEntry(rt, i); }
+}
+
+static bool rt_writesA(uint8_t op) {
+    switch(op) {
+    case REG_move: case REG_loadnil: case REG_loadtrue: case REG_loadfalse:
+    case REG_loadk: case REG_getg: case REG_getfield:
+    case REG_add: case REG_sub: case REG_mul: case REG_div:
+    case REG_lt: case REG_gt: case REG_eq:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void rt_storeLocal(OrbitRT* rt, uint8_t local) {
+    uint8_t value = rt_pop(rt);
+
+    // Entries that still refer to the local need their own copy of the old
+    // value before it gets overwritten.
+    for(int16_t i = 0; i < rt->depth; ++i) {
+        if(rt->stack[i] == local) { rt_flushEntry(rt, i); }
+    }
+
+    if(value == local) { return; }
+    if(value == rt_slot(rt, rt->depth) && rt->lastStart >= 0) {
+        uint32_t* last = &rt->code[rt->lastStart];
+        uint8_t op = *last & 0xff;
+        if(rt->lastStart + orbit_vmRegCodeLength[op] == rt->codeLength
+           && rt_writesA(op) && ((*last >> 8) & 0xff) == value) {
+            *last = (*last & ~0x0000ff00u) | ((uint32_t)local << 8);
+            return;
+        }
+    }
+    rt_op(rt, RC_ABC(REG_move, local, value, 0));
+}
+
+static uint8_t rt_binaryCode(uint8_t op) {
+    switch(op) {
+    case CODE_add: case CODE_add_nn: return REG_add;
+    case CODE_sub: case CODE_sub_nn: return REG_sub;
+    case CODE_mul: case CODE_mul_nn: return REG_mul;
+    case CODE_div: case CODE_div_nn: return REG_div;
+    case CODE_test_lt: case CODE_test_lt_nn: return REG_lt;
+    case CODE_test_gt: case CODE_test_gt_nn: return REG_gt;
+    default: return REG_eq;
+    }
+}
+
+static uint8_t rt_branchCode(uint8_t op) {
+    switch(op) {
+    case CODE_test_lt: case CODE_test_lt_nn: return REG_jlt;
+    case CODE_test_gt: case CODE_test_gt_nn: return REG_jgt;
+    default: return REG_jeq;
+    }
+}
+
+static bool rt_isCompare(uint8_t op) {
+    switch(op) {
+    case CODE_test_lt: case CODE_test_lt_nn:
+    case CODE_test_gt: case CODE_test_gt_nn:
+    case CODE_test_eq: case CODE_test_eq_nn: case CODE_test_eq_ss:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Translates the instruction at [offset]. Returns the offset of the next
+// instruction to translate, which skips over fused instructions.
+static uint32_t rt_instruction(OrbitRT* rt, uint16_t offset, bool* fallsThrough) {
+    const uint8_t* code = rt->byteCode;
+    uint8_t op = code[offset];
+    uint32_t next = offset + 1 + orbit_vmOperandBytes[op];
+    uint16_t operand = 0;
+    if(orbit_vmOperandBytes[op] == 1) {
+        operand = code[offset+1];
+    } else if(orbit_vmOperandBytes[op] == 2) {
+        operand = (code[offset+1] << 8) | code[offset+2];
+    }
+    *fallsThrough = true;
+
+    switch(op) {
+    case CODE_load_nil:
+        rt_op(rt, RC_ABC(REG_loadnil, rt_pushOwn(rt), 0, 0));
+        break;
+    case CODE_load_true:
+        rt_op(rt, RC_ABC(REG_loadtrue, rt_pushOwn(rt), 0, 0));
+        break;
+    case CODE_load_false:
+        rt_op(rt, RC_ABC(REG_loadfalse, rt_pushOwn(rt), 0, 0));
+        break;
+    case CODE_load_const:
+        rt_op(rt, RC_ABx(REG_loadk, rt_pushOwn(rt), operand));
+        break;
+    case CODE_load_local:
+        rt->stack[rt->depth++] = operand;
+        break;
+    case CODE_store_local:
+        rt_storeLocal(rt, operand);
+        break;
+    case CODE_load_global:
+        rt_op(rt, RC_ABx(REG_getg, rt_pushOwn(rt), operand));
+        break;
+    case CODE_store_global:
+        rt_op(rt, RC_ABx(REG_setg, rt_pop(rt), operand));
+        break;
+    case CODE_load_field: {
+        uint8_t object = rt_pop(rt);
+        rt_op(rt, RC_ABC(REG_getfield, rt_pushOwn(rt), object, 0));
+        rt_emit(rt, operand);
+        break;
+    }
+    case CODE_store_field: {
+        uint8_t value = rt_pop(rt);
+        uint8_t object = rt_pop(rt);
+        rt_op(rt, RC_ABC(REG_setfield, object, value, 0));
+        rt_emit(rt, operand);
+        break;
+    }
+    case CODE_add: case CODE_add_nn:
+    case CODE_sub: case CODE_sub_nn:
+    case CODE_mul: case CODE_mul_nn:
+    case CODE_div: case CODE_div_nn:
+    case CODE_test_lt: case CODE_test_lt_nn:
+    case CODE_test_gt: case CODE_test_gt_nn:
+    case CODE_test_eq: case CODE_test_eq_nn: case CODE_test_eq_ss: {
+        uint8_t b = rt_pop(rt);
+        uint8_t a = rt_pop(rt);
+
+        // Fuse with a conditional jump, unless something else jumps to it.
+        if(rt_isCompare(op) && next < rt->length && !rt->targets[next]
+           && (code[next] == CODE_jump_if || code[next] == CODE_rjump_if)) {
+            uint32_t after = next + 3;
+            uint16_t distance = (code[next+1] << 8) | code[next+2];
+            uint16_t target = code[next] == CODE_jump_if ? after + distance : after - distance;
+            rt_flush(rt);
+            rt_op(rt, RC_ABC(rt_branchCode(op), a, b, 0));
+            rt_fixup(rt, FIXUP_EXT, rt_emit(rt, 0), target);
+            return after;
+        }
+        rt_op(rt, RC_ABC(rt_binaryCode(op), rt_pushOwn(rt), a, b));
+        break;
+    }
+    case CODE_and: case CODE_or:
+        break;
+    case CODE_jump_if:
+    case CODE_rjump_if: {
+        uint8_t condition = rt_pop(rt);
+        rt_flush(rt);
+        rt_op(rt, RC_ABC(REG_jt, condition, 0, 0));
+        rt_fixup(rt, FIXUP_EXT, rt_emit(rt, 0), op == CODE_jump_if ? next + operand : next - operand);
+        break;
+    }
+    case CODE_jump:
+    case CODE_rjump:
+        rt_flush(rt);
+        rt_fixup(rt, FIXUP_SJ, rt_op(rt, RC_sJ(REG_jmp, 0)), op == CODE_jump ? next + operand : next - operand);
+        *fallsThrough = false;
+        break;
+    case CODE_pop:
+        rt->depth -= 1;
+        break;
+    case CODE_swap: {
+        int16_t d = rt->depth;
+        uint8_t a = rt->stack[d-2], b = rt->stack[d-1];
+        uint8_t slotA = rt_slot(rt, d-2), slotB = rt_slot(rt, d-1);
+        if(a == slotA && b == slotB) {
+            uint8_t scratch = rt_slot(rt, d);
+            rt_op(rt, RC_ABC(REG_move, scratch, slotA, 0));
+            rt_op(rt, RC_ABC(REG_move, slotA, slotB, 0));
+            rt_op(rt, RC_ABC(REG_move, slotB, scratch, 0));
+        } else if(a == slotA) {
+            rt_op(rt, RC_ABC(REG_move, slotB, slotA, 0));
+            rt->stack[d-2] = b;
+            rt->stack[d-1] = slotB;
+        } else if(b == slotB) {
+            rt_op(rt, RC_ABC(REG_move, slotA, slotB, 0));
+            rt->stack[d-2] = slotA;
+            rt->stack[d-1] = a;
+        } else {
+            rt->stack[d-2] = b;
+            rt->stack[d-1] = a;
+        }
+        break;
+    }
+    case CODE_invoke_sym:
+    case CODE_invoke: {
+        uint8_t arity = 0, results = 0;
+        rt_flush(rt);
+        if(!rt_callEffect(rt, operand, &arity, &results)) {
+            rt_op(rt, RC_ABx(REG_resolve, rt_slot(rt, rt->depth), offset));
+            *fallsThrough = false;
+            break;
+        }
+        rt_op(rt, RC_ABx(op == CODE_invoke ? REG_call : REG_callsym, rt_slot(rt, rt->depth), operand));
+        rt->depth -= arity;
+        if(results) { rt_pushOwn(rt); }
+        break;
+    }
+    case CODE_init_sym:
+    case CODE_init:
+        rt_flush(rt);
+        rt_op(rt, RC_ABx(op == CODE_init ? REG_new : REG_newsym, rt_pushOwn(rt), operand));
+        break;
+    case CODE_spawn_sym:
+    case CODE_spawn: {
+        uint8_t arity = 0;
+        rt_flush(rt);
+        if(!rt_spawnEffect(rt, operand, &arity)) {
+            rt_op(rt, RC_ABx(REG_resolve, rt_slot(rt, rt->depth), offset));
+            *fallsThrough = false;
+            break;
+        }
+        rt_op(rt, RC_ABx(op == CODE_spawn ? REG_spawn : REG_spawnsym, rt_slot(rt, rt->depth), operand));
+        rt->depth -= arity;
+        rt_pushOwn(rt);
+        break;
+    }
+    case CODE_yield:
+        rt_flush(rt);
+        rt_op(rt, RC_ABC(REG_yield, rt_slot(rt, rt->depth), 0, 0));
+        break;
+    case CODE_join:
+        rt_flush(rt);
+        rt_op(rt, RC_ABC(REG_join, rt_slot(rt, rt->depth), 0, 0));
+        break;
+    case CODE_ret_val:
+        rt_op(rt, RC_ABC(REG_retv, rt_pop(rt), 0, 0));
+        *fallsThrough = false;
+        break;
+    case CODE_ret:
+        rt_op(rt, RC_ABC(REG_ret, 0, 0, 0));
+        *fallsThrough = false;
+        break;
+    case CODE_halt:
+        rt_op(rt, RC_ABC(REG_halt, 0, 0, 0));
+        *fallsThrough = false;
+        break;
+    case CODE_debug_prt:
+        rt_op(rt, RC_ABC(REG_debug, rt->stack[rt->depth-1], 0, 0));
+        break;
+    default:
+        break;
+    }
+    return next;
+}
+
+static bool rt_translate(OrbitRT* rt) {
+    if(!rt_analyse(rt)) { return false; }
+
+    for(uint32_t i = 0; i <= rt->length; ++i) { rt->mapping[i] = UINT32_MAX; }
+    rt->lastStart = -1;
+    rt->depth = 0;
+
+    bool fallsThrough = false;
+    uint32_t offset = 0;
+    while(offset < rt->length) {
+        uint16_t at = offset;
+        if(rt->depths[at] == NO_DEPTH) {
+            offset += 1 + orbit_vmOperandBytes[rt->byteCode[at]];
+            fallsThrough = false;
+            continue;
+        }
+
+        // Every path into a jump target has its values in their own slots.
+        if(rt->targets[at] || !fallsThrough) {
+            if(fallsThrough) { rt_flush(rt); }
+            rt->depth = rt->depths[at];
+            for(int16_t i = 0; i < rt->depth; ++i) { rt->stack[i] = rt_slot(rt, i); }
+            rt->lastStart = -1;
+        }
+        rt->mapping[at] = rt->codeLength;
+        offset = rt_instruction(rt, at, &fallsThrough);
+    }
+
+    // Running off the end of the function stops the VM, like the direct
+    // threaded engine does.
+    rt->mapping[rt->length] = rt->codeLength;
+    rt_op(rt, RC_ABC(REG_halt, 0, 0, 0));
+
+    for(uint32_t i = 0; i < rt->fixupCount; ++i) {
+        OrbitRTFixup fixup = rt->fixups[i];
+        uint32_t target = rt->mapping[fixup.target];
+        if(target == UINT32_MAX) { return false; }
+        int32_t distance = (int32_t)target - (int32_t)(fixup.word + 1);
+        if(fixup.kind == FIXUP_EXT) {
+            rt->code[fixup.word] = (uint32_t)distance;
+        } else {
+            rt->code[fixup.word] = RC_sJ(REG_jmp, distance);
+        }
+    }
+    return rt->codeLength <= UINT16_MAX;
+}
+
+// Translates [function] into [rt]'s buffers, which rt_release() frees.
+static bool rt_run(OrbitRT* rt, OrbitVM* vm, OrbitVMFunction* function) {
+    memset(rt, 0, sizeof(*rt));
+    rt->vm = vm;
+    rt->fn = function;
+    rt->length = function->native.byteCodeLength;
+    rt->byteCode = function->native.byteCode;
+    rt->base = function->arity + function->localCount;
+    rt->depths = orbit_allocMulti(sizeof(int16_t), rt->length + 1);
+    rt->targets = orbit_allocMulti(sizeof(bool), rt->length + 1);
+    rt->mapping = orbit_allocMulti(sizeof(uint32_t), rt->length + 1);
+    return rt_translate(rt);
+}
+
+static void rt_release(OrbitRT* rt) {
+    orbit_dealloc(rt->depths);
+    orbit_dealloc(rt->targets);
+    orbit_dealloc(rt->mapping);
+    orbit_dealloc(rt->code);
+    orbit_dealloc(rt->fixups);
+}
+
+static void rt_install(OrbitRT* rt, OrbitVM* vm, OrbitVMFunction* function) {
+    function->native.regCode = ALLOC_ARRAY(vm, uint32_t, rt->codeLength);
+    memcpy(function->native.regCode, rt->code, rt->codeLength * sizeof(uint32_t));
+    function->native.regCodeLength = rt->codeLength;
+    function->native.regCount = rt->base + rt->maxDepth + 1;
+}
+
+bool orbit_vmTranslateRegisters(OrbitVM* vm, OrbitVMFunction* function) {
+    assert(vm != NULL && "Null instance error");
+    assert(function != NULL && "Null instance error");
+    if(function->kind != ORBIT_FK_NATIVE) { return false; }
+    if(function->native.regCode) { return true; }
+    if(!function->module || function->arity + function->localCount > REG_MAX) { return false; }
+
+    OrbitRT rt;
+    bool ok = rt_run(&rt, vm, function);
+    if(ok) { rt_install(&rt, vm, function); }
+    rt_release(&rt);
+    return ok;
+}
+
+// Returns whether register code [a] and [b] are the same, ignoring the calls
+// and allocations that rewrote themselves once their symbol was resolved.
+static bool rt_sameCode(const uint32_t* a, const uint32_t* b, uint32_t length) {
+    for(uint32_t i = 0; i < length;) {
+        uint8_t x = a[i] & 0xff, y = b[i] & 0xff;
+        uint32_t next = i + orbit_vmRegCodeLength[x];
+        if(x > y) { uint8_t t = x; x = y; y = t; }
+        if(x != y && !((x == REG_callsym && y == REG_call)
+                       || (x == REG_newsym && y == REG_new)
+                       || (x == REG_spawnsym && y == REG_spawn))) { return false; }
+        if((a[i] & ~0xffu) != (b[i] & ~0xffu)) { return false; }
+        for(uint32_t k = i + 1; k < next && k < length; ++k) {
+            if(a[k] != b[k]) { return false; }
+        }
+        i = next;
+    }
+    return true;
+}
+
+uint32_t orbit_vmRetranslateRegisters(OrbitVM* vm, OrbitVMFunction* function, uint16_t resume) {
+    assert(vm != NULL && "Null instance error");
+    assert(function != NULL && "Null instance error");
+    assert(function->native.regCode && "function must have been translated");
+    GCNativeFn* native = &function->native;
+
+    OrbitRT rt;
+    uint32_t at = UINT32_MAX;
+    if(rt_run(&rt, vm, function)) {
+        // Frames can still be running the old code (recursive calls, other
+        // tasks), so it is kept until the function is collected. When they
+        // reach the same call, nothing changed and they move to the new code.
+        if(rt.codeLength != native->regCodeLength
+           || !rt_sameCode(rt.code, native->regCode, rt.codeLength)) {
+            native->retiredRegCode = REALLOC_ARRAY(vm, native->retiredRegCode,
+                                                   uint32_t*, native->retiredCount + 1);
+            native->retiredRegCode[native->retiredCount++] = native->regCode;
+            rt_install(&rt, vm, function);
+        }
+        at = rt.mapping[resume];
+    }
+    rt_release(&rt);
+    return at;
+}
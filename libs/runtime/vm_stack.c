@@ -0,0 +1,187 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_stack.c - Task stack allocation and overflow detection
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-12 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  Where the platform has mmap() and signals (ORBIT_GUARDED_STACKS), each task
+//  reserves one region of address space for its call frames and its value
+//  stack, each followed by inaccessible guard pages:
+//
+//      [ frames | guard | values | guard ]
+//
+//  The kernel only commits the pages that are touched, so a task costs what
+//  it uses, and neither array ever moves: the interpreter doesn't need to
+//  check capacities when calling a function. Running off the end of either
+//  array faults in a guard page, which the signal handler below turns into a
+//  runtime error by jumping back to orbit_vmRunGuarded().
+//
+//  Elsewhere, tasks start with small heap arrays that the interpreter grows
+//  as needed (see orbit_vmEnsureStack()).
+//
+#include <assert.h>
+#include <stdio.h>
+#include <orbit/runtime/rtutils.h>
+#include <orbit/runtime/vm.h>
+#include <orbit/utils/platforms.h>
+#include "vm_private.h"
+
+#ifdef ORBIT_GUARDED_STACKS
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+static size_t orbit_vmPageRound(size_t size) {
+    // Cached, since this is also used by the signal handler.
+    static size_t page = 0;
+    if(!page) { page = (size_t)sysconf(_SC_PAGESIZE); }
+    return (size + page - 1) & ~(page - 1);
+}
+
+#define FRAMES_BYTES (orbit_vmPageRound(sizeof(OrbitVMFrame) * ORBIT_FRAMES_RESERVE))
+#define STACK_BYTES (orbit_vmPageRound(sizeof(OrbitValue) * ORBIT_STACK_RESERVE))
+#define GUARD_BYTES (orbit_vmPageRound(ORBIT_STACK_GUARD))
+#define REGION_BYTES (FRAMES_BYTES + STACK_BYTES + 2 * GUARD_BYTES)
+
+bool orbit_vmStackInit(OrbitVM* vm, OrbitVMTask* task) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+
+    uint8_t* region = mmap(NULL, REGION_BYTES, PROT_NONE,
+                           MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if(region == MAP_FAILED) { return false; }
+
+    uint8_t* values = region + FRAMES_BYTES + GUARD_BYTES;
+    if(mprotect(region, FRAMES_BYTES, PROT_READ | PROT_WRITE) != 0
+    || mprotect(values, STACK_BYTES, PROT_READ | PROT_WRITE) != 0) {
+        munmap(region, REGION_BYTES);
+        return false;
+    }
+
+    task->frames = (OrbitVMFrame*)region;
+    task->frameCapacity = FRAMES_BYTES / sizeof(OrbitVMFrame);
+    task->stack = (OrbitValue*)values;
+    task->stackCapacity = STACK_BYTES / sizeof(OrbitValue);
+    return true;
+}
+
+void orbit_vmStackDeinit(OrbitVM* vm, OrbitVMTask* task) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+    if(task->frames) { munmap(task->frames, REGION_BYTES); }
+    task->frames = NULL;
+    task->stack = NULL;
+}
+
+// The VM running on this thread, and where to go when one of its task's guard
+// pages is hit. Only the thread that faulted runs the handler, so neither
+// needs any synchronisation.
+static ORBIT_THREAD_LOCAL OrbitVM* orbit_vmGuardedVM = NULL;
+static ORBIT_THREAD_LOCAL sigjmp_buf* orbit_vmGuardJump = NULL;
+
+static struct sigaction orbit_vmOldSEGV;
+static struct sigaction orbit_vmOldBUS;
+
+static bool orbit_vmIsGuard(OrbitVMTask* task, uint8_t* address) {
+    if(!task || !task->frames) { return false; }
+    uint8_t* framesGuard = (uint8_t*)task->frames + FRAMES_BYTES;
+    uint8_t* stackGuard = (uint8_t*)task->stack + STACK_BYTES;
+    return (address >= framesGuard && address < framesGuard + GUARD_BYTES)
+        || (address >= stackGuard && address < stackGuard + GUARD_BYTES);
+}
+
+static void orbit_vmGuardHandler(int sig, siginfo_t* info, void* context) {
+    OrbitVM* vm = orbit_vmGuardedVM;
+    if(orbit_vmGuardJump && vm && orbit_vmIsGuard(vm->task, info->si_addr)) {
+        siglongjmp(*orbit_vmGuardJump, 1);
+    }
+    // Not ours: chain to whatever handler was there before. Ours stays
+    // installed, since it is only ever installed once.
+    const struct sigaction* old = sig == SIGBUS ? &orbit_vmOldBUS : &orbit_vmOldSEGV;
+    if(old->sa_flags & SA_SIGINFO) {
+        old->sa_sigaction(sig, info, context);
+    } else if(old->sa_handler == SIG_DFL) {
+        // The default action kills the process, so there is nothing left to
+        // keep our handler installed for.
+        signal(sig, SIG_DFL);
+        raise(sig);
+    } else if(old->sa_handler != SIG_IGN) {
+        old->sa_handler(sig);
+    }
+}
+
+static void orbit_vmInstallGuardHandlerOnce() {
+    struct sigaction action;
+    action.sa_sigaction = orbit_vmGuardHandler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &orbit_vmOldSEGV);
+    // Some systems report accesses to PROT_NONE pages as SIGBUS.
+    sigaction(SIGBUS, &action, &orbit_vmOldBUS);
+}
+
+static void orbit_vmInstallGuardHandler() {
+    // VMs can run on several threads at once (see vm_batch.c).
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, orbit_vmInstallGuardHandlerOnce);
+}
+
+bool orbit_vmRunGuarded(OrbitVM* vm, OrbitVMTask* task) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+    orbit_vmInstallGuardHandler();
+
+    // Foreign functions can invoke Orbit code, so this can be re-entered.
+    OrbitVM* oldVM = orbit_vmGuardedVM;
+    sigjmp_buf* oldJump = orbit_vmGuardJump;
+    sigjmp_buf jump;
+
+    bool result = false;
+    if(sigsetjmp(jump, 1) == 0) {
+        orbit_vmGuardedVM = vm;
+        orbit_vmGuardJump = &jump;
+        result = orbit_vmRun(vm, task);
+    } else {
+        fprintf(stderr, "error: stack overflow\n");
+        result = false;
+    }
+    orbit_vmGuardedVM = oldVM;
+    orbit_vmGuardJump = oldJump;
+    return result;
+}
+
+#else /* ORBIT_GUARDED_STACKS */
+
+bool orbit_vmStackInit(OrbitVM* vm, OrbitVMTask* task) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+    task->stack = ALLOC_ARRAY(vm, OrbitValue, 512);
+    task->stackCapacity = 512;
+    task->frames = ALLOC_ARRAY(vm, OrbitVMFrame, 32);
+    task->frameCapacity = 32;
+    return true;
+}
+
+void orbit_vmStackDeinit(OrbitVM* vm, OrbitVMTask* task) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+    DEALLOC(vm, task->stack);
+    DEALLOC(vm, task->frames);
+    task->frames = NULL;
+    task->stack = NULL;
+}
+
+bool orbit_vmRunGuarded(OrbitVM* vm, OrbitVMTask* task) {
+    return orbit_vmRun(vm, task);
+}
+
+#endif /* ORBIT_GUARDED_STACKS */
@@ -0,0 +1,328 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_stats.c - Interpreter execution counts and disassembly
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-19 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  The counts themselves are taken by orbit_vmCountOpcode() (vm_private.h),
+//  which each stack engine calls before dispatching an instruction. Functions
+//  only get a table of per-instruction counts when they first run, and lose it
+//  when they are collected, so a report only covers the functions still alive.
+//
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <orbit/csupport/string.h>
+#include <orbit/mangling/mangle.h>
+#include <orbit/runtime/stats.h>
+#include <orbit/utils/memory.h>
+#include "vm_private.h"
+
+#define OPCODE(code, idx, stack) #code,
+static const char* orbit_vmOpcodeNames[] = {
+#include <orbit/runtime/opcodes.h>
+};
+#undef OPCODE
+
+static inline uint16_t orbit_statsOperand16(const uint8_t* code) {
+    return (code[0] << 8) | code[1];
+}
+
+// Writes [signature], demangled if it is a mangled Orbit name.
+static void orbit_statsName(FILE* out, const OrbitGCString* signature) {
+    OCString* demangled = NULL;
+    if(signature->length > 2 && signature->data[0] == '_' && signature->data[1] == 'O') {
+        demangled = orbit_stringPoolGet(orbit_demangle(signature->data, signature->length));
+    }
+    if(demangled) {
+        fprintf(out, "%.*s", (int)demangled->length, demangled->data);
+    } else {
+        fprintf(out, "%.*s", (int)signature->length, signature->data);
+    }
+}
+
+// Writes the constant [idx] of [fn]'s module as a comment, if it is one we can
+// show on a single line.
+static void orbit_statsConstant(FILE* out, const OrbitVMFunction* fn, uint16_t idx) {
+    const OrbitVMModule* module = fn->module;
+    if(!module || idx >= module->constantCount) { return; }
+    OrbitValue constant = module->constants[idx];
+    if(IS_NUM(constant)) {
+        fprintf(out, "  ; %g", AS_NUM(constant));
+    } else if(IS_STRING(constant)) {
+        fprintf(out, "  ; \"%.*s\"", (int)AS_STRING(constant)->length, AS_STRING(constant)->data);
+    }
+}
+
+static void orbit_statsInstruction(FILE* out, const OrbitVMFunction* fn, uint32_t offset) {
+    const uint8_t* code = fn->native.byteCode;
+    uint8_t op = code[offset];
+    const uint8_t* operands = code + offset + 1;
+    uint32_t next = offset + 1 + orbit_vmOperandBytes[op];
+
+    fprintf(out, orbit_vmOperandBytes[op] ? "%-18s" : "%s", orbit_vmOpcodeNames[op]);
+    switch(op) {
+    case CODE_jump:
+    case CODE_jump_if:
+    case CODE_jump_if_lt:
+        fprintf(out, " +%u  -> %u", orbit_statsOperand16(operands), next + orbit_statsOperand16(operands));
+        break;
+    case CODE_rjump:
+    case CODE_rjump_if:
+    case CODE_rjump_if_lt:
+        fprintf(out, " -%u  -> %d", orbit_statsOperand16(operands),
+                (int)next - (int)orbit_statsOperand16(operands));
+        break;
+    case CODE_load_const:
+    case CODE_invoke_sym:
+    case CODE_spawn_sym:
+    case CODE_init_sym:
+        fprintf(out, " %u", orbit_statsOperand16(operands));
+        orbit_statsConstant(out, fn, orbit_statsOperand16(operands));
+        break;
+    case CODE_load_local2:
+    case CODE_store_load_local:
+    case CODE_add_ll:
+        fprintf(out, " %u %u", operands[0], operands[1]);
+        break;
+    case CODE_load_local_const:
+        fprintf(out, " %u %u", operands[0], orbit_statsOperand16(operands + 1));
+        orbit_statsConstant(out, fn, orbit_statsOperand16(operands + 1));
+        break;
+    case CODE_load_local_field:
+        fprintf(out, " %u %u", operands[0], orbit_statsOperand16(operands + 1));
+        break;
+    default:
+        if(orbit_vmOperandBytes[op] == 1) {
+            fprintf(out, " %u", operands[0]);
+        } else if(orbit_vmOperandBytes[op] == 2) {
+            fprintf(out, " %u", orbit_statsOperand16(operands));
+        }
+        break;
+    }
+    fprintf(out, "\n");
+}
+
+static void orbit_statsDisassemble(FILE* out, const OrbitVMFunction* fn) {
+    const GCNativeFn* native = &fn->native;
+    for(uint32_t offset = 0; offset < native->byteCodeLength;) {
+        // Shared code's quickened opcodes are only in its side table.
+        uint8_t op = native->quickened ? native->quickened[offset] : native->byteCode[offset];
+        if(op >= ORBIT_OPCODE_COUNT || offset + 1 + orbit_vmOperandBytes[op] > native->byteCodeLength) {
+            fprintf(out, "%14s  %5u  <invalid %u>\n", "", offset, op);
+            return;
+        }
+#ifdef ORBIT_VM_STATS
+        uint64_t count = native->executionCounts ? native->executionCounts[offset] : 0;
+        fprintf(out, "%14llu  %5u  ", (unsigned long long)count, offset);
+#else
+        fprintf(out, "%14s  %5u  ", "-", offset);
+#endif
+        orbit_statsInstruction(out, fn, offset);
+        offset += 1 + orbit_vmOperandBytes[op];
+    }
+}
+
+bool orbit_vmDisassemble(OrbitVM* vm, const char* signature, FILE* out) {
+    assert(vm != NULL && "Null instance error");
+    assert(signature != NULL && "Null string error");
+    assert(out != NULL && "Null file passed");
+
+    OrbitValue key = MAKE_OBJECT(orbit_gcStringNew(vm, signature));
+    OrbitValue fn = VAL_NIL;
+    if(!orbit_gcMapGet(vm->dispatchTable, key, &fn) || !IS_FUNCTION(fn)) { return false; }
+    if(AS_FUNCTION(fn)->kind != ORBIT_FK_NATIVE) { return false; }
+
+    OCStringPool* strings = orbit_stringPoolSetCurrent(&vm->strings);
+    orbit_statsName(out, AS_STRING(key));
+    fprintf(out, ":\n");
+    orbit_statsDisassemble(out, AS_FUNCTION(fn));
+    orbit_stringPoolSetCurrent(strings);
+    return true;
+}
+
+#ifdef ORBIT_VM_STATS
+
+typedef struct {
+    uint64_t            count;
+    uint16_t            first;
+    uint16_t            second;
+} OrbitStatsEntry;
+
+typedef struct {
+    uint64_t            count;
+    OrbitVMFunction*    function;
+    OrbitGCString*      signature;
+} OrbitStatsFunction;
+
+static int orbit_statsCompareEntries(const void* a, const void* b) {
+    uint64_t x = ((const OrbitStatsEntry*)a)->count;
+    uint64_t y = ((const OrbitStatsEntry*)b)->count;
+    return (x < y) - (x > y);
+}
+
+static int orbit_statsCompareFunctions(const void* a, const void* b) {
+    uint64_t x = ((const OrbitStatsFunction*)a)->count;
+    uint64_t y = ((const OrbitStatsFunction*)b)->count;
+    return (x < y) - (x > y);
+}
+
+static double orbit_statsPercent(uint64_t count, uint64_t total) {
+    return total ? 100.0 * (double)count / (double)total : 0.0;
+}
+
+void orbit_vmStatsTrack(OrbitVMFunction* fn) {
+    fn->native.executionCounts = ORBIT_ALLOC_ARRAY(uint64_t, fn->native.byteCodeLength + 1);
+}
+
+uint64_t orbit_vmStatsOpcode(const OrbitVM* vm, VMCode code) {
+    assert(vm != NULL && "Null instance error");
+    assert((unsigned)code < ORBIT_OPCODE_COUNT && "invalid opcode");
+    return vm->opcodeCounts[code];
+}
+
+uint64_t orbit_vmStatsPair(const OrbitVM* vm, VMCode first, VMCode second) {
+    assert(vm != NULL && "Null instance error");
+    assert((unsigned)first < ORBIT_OPCODE_COUNT && (unsigned)second < ORBIT_OPCODE_COUNT && "invalid opcode");
+    return vm->pairCounts[first][second];
+}
+
+static void orbit_statsForget(OrbitGCObject* object, void* data) {
+    if(object->kind != ORBIT_OBJK_FUNCTION) { return; }
+    OrbitVMFunction* fn = (OrbitVMFunction*)object;
+    if(fn->kind != ORBIT_FK_NATIVE) { return; }
+    orbit_dealloc(fn->native.executionCounts);
+    fn->native.executionCounts = NULL;
+}
+
+void orbit_vmStatsReset(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    vm->dispatchCount = 0;
+    vm->lastOpcode = ORBIT_OPCODE_COUNT;
+    memset(vm->opcodeCounts, 0, sizeof(vm->opcodeCounts));
+    memset(vm->pairCounts, 0, sizeof(vm->pairCounts));
+
+    orbit_heapVisit(&vm->heap, orbit_statsForget, NULL);
+}
+
+static void orbit_statsOpcodes(OrbitVM* vm, FILE* out, uint64_t total) {
+    OrbitStatsEntry entries[ORBIT_OPCODE_COUNT];
+    uint32_t count = 0;
+    for(uint16_t i = 0; i < ORBIT_OPCODE_COUNT; ++i) {
+        if(!vm->opcodeCounts[i]) { continue; }
+        entries[count++] = (OrbitStatsEntry){vm->opcodeCounts[i], i, i};
+    }
+    qsort(entries, count, sizeof(OrbitStatsEntry), orbit_statsCompareEntries);
+
+    fprintf(out, "opcodes (%llu dispatched):\n", (unsigned long long)total);
+    for(uint32_t i = 0; i < count; ++i) {
+        fprintf(out, "%14llu  %6.2f%%  %s\n", (unsigned long long)entries[i].count,
+                orbit_statsPercent(entries[i].count, total), orbit_vmOpcodeNames[entries[i].first]);
+    }
+}
+
+static void orbit_statsPairs(OrbitVM* vm, FILE* out, uint64_t total, uint32_t limit) {
+    OrbitStatsEntry* entries = ORBIT_ALLOC_ARRAY(OrbitStatsEntry, ORBIT_OPCODE_COUNT * ORBIT_OPCODE_COUNT);
+    uint32_t count = 0;
+    for(uint16_t i = 0; i < ORBIT_OPCODE_COUNT; ++i) {
+        for(uint16_t j = 0; j < ORBIT_OPCODE_COUNT; ++j) {
+            if(!vm->pairCounts[i][j]) { continue; }
+            entries[count++] = (OrbitStatsEntry){vm->pairCounts[i][j], i, j};
+        }
+    }
+    qsort(entries, count, sizeof(OrbitStatsEntry), orbit_statsCompareEntries);
+
+    fprintf(out, "\nopcode pairs (%u distinct):\n", count);
+    for(uint32_t i = 0; i < count && i < limit; ++i) {
+        fprintf(out, "%14llu  %6.2f%%  %s -> %s\n", (unsigned long long)entries[i].count,
+                orbit_statsPercent(entries[i].count, total),
+                orbit_vmOpcodeNames[entries[i].first], orbit_vmOpcodeNames[entries[i].second]);
+    }
+    orbit_dealloc(entries);
+}
+
+static void orbit_statsFunctions(OrbitVM* vm, FILE* out, uint64_t total, bool disassemble) {
+    // Only functions in the dispatch table have a name, so that's where the
+    // ones that ran are found.
+    OrbitGCMap* table = vm->dispatchTable;
+    OrbitStatsFunction* functions = ORBIT_ALLOC_ARRAY(OrbitStatsFunction, table->size + 1);
+    uint64_t count = 0;
+    for(uint64_t i = 0; i < table->capacity; ++i) {
+        const OrbitGCMapEntry* entry = &table->data[i];
+        if(!IS_STRING(entry->key) || !IS_FUNCTION(entry->value)) { continue; }
+        OrbitVMFunction* fn = AS_FUNCTION(entry->value);
+        if(fn->kind != ORBIT_FK_NATIVE || !fn->native.executionCounts) { continue; }
+
+        uint64_t executed = 0;
+        for(uint32_t offset = 0; offset < fn->native.byteCodeLength; ++offset) {
+            executed += fn->native.executionCounts[offset];
+        }
+        functions[count++] = (OrbitStatsFunction){executed, fn, AS_STRING(entry->key)};
+    }
+    qsort(functions, count, sizeof(OrbitStatsFunction), orbit_statsCompareFunctions);
+
+    fprintf(out, "\nfunctions:\n");
+    for(uint64_t i = 0; i < count; ++i) {
+        fprintf(out, "%14llu  %6.2f%%  ", (unsigned long long)functions[i].count,
+                orbit_statsPercent(functions[i].count, total));
+        orbit_statsName(out, functions[i].signature);
+        fprintf(out, "\n");
+    }
+
+    for(uint64_t i = 0; disassemble && i < count; ++i) {
+        fprintf(out, "\n");
+        orbit_statsName(out, functions[i].signature);
+        fprintf(out, ":\n");
+        orbit_statsDisassemble(out, functions[i].function);
+    }
+    orbit_dealloc(functions);
+}
+
+bool orbit_vmStatsWrite(OrbitVM* vm, FILE* out, uint32_t pairLimit, bool disassemble) {
+    assert(vm != NULL && "Null instance error");
+    assert(out != NULL && "Null file passed");
+
+    OCStringPool* strings = orbit_stringPoolSetCurrent(&vm->strings);
+    uint64_t total = 0;
+    for(uint16_t i = 0; i < ORBIT_OPCODE_COUNT; ++i) { total += vm->opcodeCounts[i]; }
+    orbit_statsOpcodes(vm, out, total);
+    orbit_statsPairs(vm, out, total, pairLimit);
+    if(vm->dispatchTable) { orbit_statsFunctions(vm, out, total, disassemble); }
+    orbit_stringPoolSetCurrent(strings);
+    return true;
+}
+
+void orbit_vmStatsDump(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    const char* path = getenv("ORBIT_VM_STATS");
+    if(!path || !*path || !vm->dispatchCount) { return; }
+
+    bool console = strcmp(path, "-") == 0;
+    FILE* out = console ? stderr : fopen(path, "a");
+    if(!out) { return; }
+    orbit_vmStatsWrite(vm, out, 32, true);
+    fprintf(out, "\n");
+    if(!console) { fclose(out); }
+}
+
+#else /* ORBIT_VM_STATS */
+
+uint64_t orbit_vmStatsOpcode(const OrbitVM* vm, VMCode code) {
+    return 0;
+}
+
+uint64_t orbit_vmStatsPair(const OrbitVM* vm, VMCode first, VMCode second) {
+    return 0;
+}
+
+void orbit_vmStatsReset(OrbitVM* vm) {}
+
+bool orbit_vmStatsWrite(OrbitVM* vm, FILE* out, uint32_t pairLimit, bool disassemble) {
+    return false;
+}
+
+#endif /* ORBIT_VM_STATS */
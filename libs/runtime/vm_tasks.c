@@ -0,0 +1,168 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_tasks.c - Cooperative task scheduling
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-13 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  Tasks are Orbit's green threads. Each one has its own value stack and call
+//  frames, so switching from one to another is only a matter of reloading the
+//  interpreter's registers (frame, ip, locals) from the other task's top frame.
+//  Nothing is preemptive: a task runs until it yields, joins a task that hasn't
+//  finished yet, or returns from its entry point.
+//
+//  Tasks that can run are kept in the VM's run queue, first in first out. A
+//  task waiting for another one is linked in that task's list of waiters
+//  instead, and they are all put back in the run queue when it finishes. The
+//  interpreter only returns once the task it was started with and every task
+//  in the run queue are done.
+//
+//  Batched calls (see vm_batch.c) reuse a single task for every set of
+//  arguments: when it finishes, it is reset and put back in the run queue.
+//
+#include <assert.h>
+#include <stdio.h>
+#include <orbit/runtime/gc.h>
+#include <orbit/runtime/vm.h>
+#include "vm_private.h"
+
+void orbit_vmTaskReset(OrbitVM* vm, OrbitVMTask* task, OrbitVMFunction* function) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+    assert(function != NULL && "Null instance error");
+    
+    // The entry point needs the same room on the stack as any other call.
+    task->frameCount = 0;
+    task->sp = task->stack + function->arity;
+    orbit_vmReserveCall(vm, task, function->stackEffect);
+    
+    task->frameCount = 1;
+    OrbitVMFrame* frame = &task->frames[0];
+    frame->task = task; // FIXME: not required? prob. not accesed
+    frame->function = function;
+    frame->ip = function->native.byteCode;
+    frame->stackBase = task->stack;
+    
+    // Put the stack pointer where it should be, after the entry point's
+    // parameters and locals table.
+    task->sp = frame->stackBase + function->arity + function->localCount;
+    for(OrbitValue* slot = frame->stackBase; slot < task->sp; ++slot) {
+        *slot = VAL_NIL;
+    }
+    task->state = ORBIT_TASK_READY;
+    task->result = VAL_NIL;
+    task->waiters = task->next = NULL;
+}
+
+void orbit_vmEnqueue(OrbitVM* vm, OrbitVMTask* task) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+    task->state = ORBIT_TASK_READY;
+    task->next = NULL;
+    if(vm->runQueueTail) {
+        vm->runQueueTail->next = task;
+    } else {
+        vm->runQueue = task;
+    }
+    vm->runQueueTail = task;
+}
+
+OrbitVMTask* orbit_vmDequeue(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    OrbitVMTask* task = vm->runQueue;
+    if(!task) { return NULL; }
+    vm->runQueue = task->next;
+    if(!vm->runQueue) { vm->runQueueTail = NULL; }
+    task->next = NULL;
+    return task;
+}
+
+OrbitVMTask* orbit_vmSpawn(OrbitVM* vm, OrbitVMFunction* function, OrbitValue* args) {
+    assert(vm != NULL && "Null instance error");
+    assert(function != NULL && "Null instance error");
+    assert(function->kind == ORBIT_FK_NATIVE && "only native functions can be spawned");
+
+    // [args] is on the current task's stack, so it is safe from the collection
+    // allocating the task could trigger.
+    OrbitVMTask* task = orbit_gcTaskNew(vm, function);
+    for(uint8_t i = 0; i < function->arity; ++i) {
+        task->stack[i] = args[i];
+    }
+    if(!function->native.threadedCode) { orbit_vmPrepareFunction(vm, function); }
+    orbit_vmEnqueue(vm, task);
+    return task;
+}
+
+OrbitVMTask* orbit_vmTaskYield(OrbitVM* vm, OrbitVMTask* task) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+    orbit_vmEnqueue(vm, task);
+    return orbit_vmDequeue(vm);
+}
+
+OrbitVMTask* orbit_vmTaskWait(OrbitVM* vm, OrbitVMTask* task, OrbitVMTask* target) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+    assert(target != NULL && "Null instance error");
+
+    // If nothing else can run, [target] can never finish.
+    if(target == task || !vm->runQueue) {
+        fprintf(stderr, "error: deadlock\n");
+        return NULL;
+    }
+    task->state = ORBIT_TASK_WAITING;
+    task->next = target->waiters;
+    target->waiters = task;
+    return orbit_vmDequeue(vm);
+}
+
+OrbitVMTask* orbit_vmTaskFinished(OrbitVM* vm, OrbitVMTask* task) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+    task->result = task->sp > task->stack ? task->stack[0] : VAL_NIL;
+    task->state = ORBIT_TASK_DONE;
+
+    OrbitVMTask* waiter = task->waiters;
+    task->waiters = NULL;
+    while(waiter) {
+        OrbitVMTask* next = waiter->next;
+        orbit_vmEnqueue(vm, waiter);
+        waiter = next;
+    }
+    
+    // A batched call starts over with its next arguments, after the tasks that
+    // are already waiting.
+    if(vm->batch && vm->batch->task == task && orbit_vmBatchNext(vm, vm->batch)) {
+        orbit_vmEnqueue(vm, task);
+    }
+    return orbit_vmDequeue(vm);
+}
+
+void orbit_vmTaskAbort(OrbitVM* vm, OrbitVMTask* task) {
+    assert(vm != NULL && "Null instance error");
+    assert(task != NULL && "Null instance error");
+    task->frameCount = 0;
+    task->sp = task->stack;
+    task->state = ORBIT_TASK_DONE;
+    task->result = VAL_NIL;
+    task->next = NULL;
+
+    OrbitVMTask* waiter = task->waiters;
+    task->waiters = NULL;
+    while(waiter) {
+        OrbitVMTask* next = waiter->next;
+        orbit_vmTaskAbort(vm, waiter);
+        waiter = next;
+    }
+}
+
+void orbit_vmAbortTasks(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    if(vm->task) { orbit_vmTaskAbort(vm, vm->task); }
+    OrbitVMTask* task = NULL;
+    while((task = orbit_vmDequeue(vm))) {
+        orbit_vmTaskAbort(vm, task);
+    }
+}
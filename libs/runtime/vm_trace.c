@@ -0,0 +1,247 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_trace.c - Call and collection tracing
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-20 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  The interpreters and the collector call orbit_vmTrace() through the
+//  ORBIT_TRACE() hooks in vm_private.h, which check whether the VM has a
+//  tracer and do nothing else when it doesn't. Recording an event reads the
+//  clock and fills the next slot of the buffer, and nothing else.
+//
+//  Like the profiler's samples, events hold raw pointers that are only
+//  resolved when the trace is written: functions through the dispatch table,
+//  so a function collected since is never followed, and tasks by their
+//  address, which is all a track needs.
+//
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <orbit/csupport/string.h>
+#include <orbit/mangling/mangle.h>
+#include <orbit/runtime/tracer.h>
+#include <orbit/runtime/vm.h>
+#include <orbit/utils/memory.h>
+#include "vm_private.h"
+
+typedef struct {
+    uint64_t            time;
+    const void*         subject;
+    const OrbitVMTask*  task;
+    uint64_t            value;
+    uint8_t             kind;
+} OrbitTraceEvent;
+
+struct _OrbitTracer {
+    bool                recording;
+    uint64_t            start;
+    OrbitTraceEvent*    events;
+    uint32_t            capacity;
+    uint32_t            count;
+    uint64_t            dropped;
+};
+
+uint64_t orbit_vmClock(void) {
+    struct timespec now;
+#ifdef _WIN32
+    timespec_get(&now, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+void orbit_vmTrace(OrbitVM* vm, OrbitTraceKind kind, const void* subject,
+                   const OrbitVMTask* task, uint64_t value) {
+    OrbitTracer* tracer = vm->tracer;
+    if(!tracer->recording) { return; }
+    if(tracer->count == tracer->capacity) {
+        tracer->dropped += 1;
+        return;
+    }
+    OrbitTraceEvent* event = &tracer->events[tracer->count++];
+    event->time = orbit_vmClock();
+    event->subject = subject;
+    event->task = task;
+    event->value = value;
+    event->kind = kind;
+}
+
+void orbit_tracerStart(OrbitVM* vm, uint32_t capacity) {
+    assert(vm != NULL && "Null instance error");
+    assert(capacity > 0 && "trace buffer can't be empty");
+
+    orbit_vmTracerFree(vm);
+    OrbitTracer* tracer = ORBIT_ALLOC_ARRAY(OrbitTracer, 1);
+    tracer->events = ORBIT_ALLOC_ARRAY(OrbitTraceEvent, capacity);
+    tracer->capacity = capacity;
+    tracer->start = orbit_vmClock();
+    tracer->recording = true;
+    vm->tracer = tracer;
+}
+
+void orbit_tracerStop(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    if(vm->tracer) { vm->tracer->recording = false; }
+}
+
+void orbit_vmTracerFree(OrbitVM* vm) {
+    assert(vm != NULL && "Null instance error");
+    OrbitTracer* tracer = vm->tracer;
+    if(!tracer) { return; }
+    orbit_dealloc(tracer->events);
+    orbit_dealloc(tracer);
+    vm->tracer = NULL;
+}
+
+typedef struct {
+    const void*         function;
+    OrbitGCString*      signature;
+} OrbitTraceName;
+
+typedef struct {
+    const OrbitVMTask*  task;
+    uint32_t            depth;
+} OrbitTraceTrack;
+
+static int orbit_traceComparePointers(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)*(const void* const*)a;
+    uintptr_t y = (uintptr_t)*(const void* const*)b;
+    return (x > y) - (x < y);
+}
+
+// Writes [length] bytes of [data] as the contents of a JSON string.
+static void orbit_traceString(FILE* out, const char* data, uint64_t length) {
+    for(uint64_t i = 0; i < length; ++i) {
+        unsigned char c = data[i];
+        if(c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if(c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+}
+
+static void orbit_traceName(FILE* out, const OrbitTraceName* names, uint64_t nameCount,
+                            const void* function) {
+    OrbitTraceName key = {function, NULL};
+    const OrbitTraceName* name = bsearch(&key, names, nameCount, sizeof(OrbitTraceName),
+                                         orbit_traceComparePointers);
+    if(!name) {
+        fprintf(out, "[unknown]");
+        return;
+    }
+
+    const OrbitGCString* signature = name->signature;
+    OCString* demangled = NULL;
+    if(signature->length > 2 && signature->data[0] == '_' && signature->data[1] == 'O') {
+        demangled = orbit_stringPoolGet(orbit_demangle(signature->data, signature->length));
+    }
+    if(demangled) {
+        orbit_traceString(out, demangled->data, demangled->length);
+    } else {
+        orbit_traceString(out, signature->data, signature->length);
+    }
+}
+
+// Tasks are numbered from 1 in the order they were first seen, which is also
+// the order their tracks are shown in.
+static uint32_t orbit_traceTrack(OrbitTraceTrack* tracks, uint32_t* trackCount, const OrbitVMTask* task) {
+    for(uint32_t i = *trackCount; i > 0; --i) {
+        if(tracks[i-1].task == task) { return i; }
+    }
+    tracks[*trackCount].task = task;
+    tracks[*trackCount].depth = 0;
+    return ++(*trackCount);
+}
+
+uint64_t orbit_tracerWrite(OrbitVM* vm, FILE* out) {
+    assert(vm != NULL && "Null instance error");
+    assert(out != NULL && "Null file passed");
+    OrbitTracer* tracer = vm->tracer;
+
+    OrbitGCMap* table = vm->dispatchTable;
+    OrbitTraceName* names = ORBIT_ALLOC_ARRAY(OrbitTraceName, table->size + 1);
+    uint64_t nameCount = 0;
+    for(uint64_t i = 0; i < table->capacity; ++i) {
+        const OrbitGCMapEntry* entry = &table->data[i];
+        if(!IS_STRING(entry->key) || !IS_FUNCTION(entry->value)) { continue; }
+        names[nameCount].function = AS_FUNCTION(entry->value);
+        names[nameCount].signature = AS_STRING(entry->key);
+        nameCount += 1;
+    }
+    qsort(names, nameCount, sizeof(OrbitTraceName), orbit_traceComparePointers);
+
+    uint32_t count = tracer ? tracer->count : 0;
+    OrbitTraceTrack* tracks = ORBIT_ALLOC_ARRAY(OrbitTraceTrack, count + 1);
+    uint32_t trackCount = 0;
+    uint64_t gcDepth = 0, gcBefore = 0, written = 0;
+    OCStringPool* strings = orbit_stringPoolSetCurrent(&vm->strings);
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"gc\"}}");
+    for(uint32_t i = 0; i < count; ++i) {
+        const OrbitTraceEvent* event = &tracer->events[i];
+        double ts = (double)(event->time - tracer->start) / 1000.0;
+
+        switch(event->kind) {
+        case ORBIT_TRACE_ENTER:
+        case ORBIT_TRACE_EXIT: {
+            uint32_t known = trackCount;
+            uint32_t tid = orbit_traceTrack(tracks, &trackCount, event->task);
+            if(tid > known) {
+                fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+                        "\"args\":{\"name\":\"task %u\"}}", tid, tid);
+            }
+            OrbitTraceTrack* track = &tracks[tid-1];
+
+            // Calls that started before tracing did have nothing to end.
+            if(event->kind == ORBIT_TRACE_EXIT) {
+                if(!track->depth) { continue; }
+                track->depth -= 1;
+                fprintf(out, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}", ts, tid);
+                break;
+            }
+            track->depth += 1;
+            fprintf(out, ",\n{\"name\":\"");
+            orbit_traceName(out, names, nameCount, event->subject);
+            fprintf(out, "\",\"cat\":\"%s\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":%u}",
+                    event->value ? "foreign" : "call", ts, tid);
+            break;
+        }
+
+        case ORBIT_TRACE_GC_START:
+            gcDepth += 1;
+            gcBefore = event->value;
+            fprintf(out, ",\n{\"name\":\"gc\",\"cat\":\"gc\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":0}", ts);
+            break;
+
+        case ORBIT_TRACE_GC_END:
+            if(!gcDepth) { continue; }
+            gcDepth -= 1;
+            fprintf(out, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":0,\"args\":"
+                    "{\"before\":%llu,\"after\":%llu,\"reclaimed\":%llu}}", ts,
+                    (unsigned long long)gcBefore, (unsigned long long)event->value,
+                    (unsigned long long)(gcBefore > event->value ? gcBefore - event->value : 0));
+            break;
+        }
+        written += 1;
+    }
+    fprintf(out, "\n],\"otherData\":{\"dropped\":\"%llu\"}}\n",
+            (unsigned long long)(tracer ? tracer->dropped : 0));
+
+    orbit_stringPoolSetCurrent(strings);
+    orbit_dealloc(tracks);
+    orbit_dealloc(names);
+    return written;
+}
@@ -0,0 +1,298 @@
+//===--------------------------------------------------------------------------------------------===
+// orbit/runtime/vm_verify.c - Load-time bytecode verification
+// This source is part of Orbit - Runtime
+//
+// Created on 2018-06-16 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  Every function in a module image is checked once, when the image is read,
+//  in two passes:
+//
+//  - the first walks instructions in order, and checks that each is a known
+//    opcode with all its operands in the code, that constant, local and global
+//    indices are in range, that jumps land on an instruction and that the
+//    code can't run off its end. Code that fails is rejected with its module.
+//  - the second follows every path through the function, tracking the operand
+//    stack's depth with the stack effect column of opcodes.h. Each instruction
+//    must find the operands it pops, and be reached with the same depth on
+//    every path. The deepest the stack gets, plus the function's locals, is
+//    the exact room a call needs, which replaces the module's `stackEffect`.
+//
+//  The effect of a call depends on its callee's arity, and whether it returns
+//  a value, so the second pass can only complete when every function called is
+//  in the same image. Functions that call anything else are left unverified:
+//  their stack effect is only a hint, and the interpreter checks their pushes
+//  (see vm_handlers.h). Functions that need more room than a frame can reserve
+//  are rejected.
+//
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <orbit/runtime/image.h>
+#include <orbit/utils/memory.h>
+#include "vm_private.h"
+
+#define OPCODE(code, idx, stack) stack,
+static const int8_t orbit_vmStackEffect[] = {
+#include <orbit/runtime/opcodes.h>
+};
+#undef OPCODE
+
+// Number of operands each instruction pops before pushing its results.
+static uint8_t orbit_vmStackInputs(uint8_t op) {
+    switch(op) {
+    case CODE_load_field:
+    case CODE_store_local:
+    case CODE_store_global:
+    case CODE_jump_if:
+    case CODE_rjump_if:
+    case CODE_pop:
+    case CODE_ret_val:
+    case CODE_debug_prt:
+    case CODE_join:
+    case CODE_store_load_local:
+        return 1;
+    case CODE_store_field:
+    case CODE_add: case CODE_sub: case CODE_mul: case CODE_div:
+    case CODE_add_nn: case CODE_sub_nn: case CODE_mul_nn: case CODE_div_nn:
+    case CODE_test_lt: case CODE_test_gt: case CODE_test_eq:
+    case CODE_test_lt_nn: case CODE_test_gt_nn: case CODE_test_eq_nn: case CODE_test_eq_ss:
+    case CODE_swap:
+    case CODE_jump_if_lt:
+    case CODE_rjump_if_lt:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+static inline uint16_t orbit_vmOperand16(const uint8_t* code, uint32_t at) {
+    return (code[at] << 8) | code[at+1];
+}
+
+// Finds where the instruction at [offset] jumps to. Returns false if it isn't
+// a jump.
+static bool orbit_vmJumpTarget(const uint8_t* code, uint32_t offset, int32_t* target) {
+    uint32_t next = offset + 1 + orbit_vmOperandBytes[code[offset]];
+    switch(code[offset]) {
+    case CODE_jump:
+    case CODE_jump_if:
+    case CODE_jump_if_lt:
+        *target = next + orbit_vmOperand16(code, next - 2);
+        return true;
+    case CODE_rjump:
+    case CODE_rjump_if:
+    case CODE_rjump_if_lt:
+        *target = next - orbit_vmOperand16(code, next - 2);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool orbit_vmFallsThrough(uint8_t op) {
+    return op != CODE_halt && op != CODE_ret && op != CODE_ret_val
+        && op != CODE_jump && op != CODE_rjump;
+}
+
+static bool orbit_vmIsSymbol(const OrbitModuleImage* image, uint16_t idx) {
+    return idx < image->constantCount && image->constants[idx].kind == OMF_STRING;
+}
+
+static const OrbitImageFunction* orbit_vmFindCallee(const OrbitModuleImage* image,
+                                                    const OrbitImageString* symbol) {
+    for(uint16_t i = 0; i < image->functionCount; ++i) {
+        const OrbitImageString* signature = &image->functions[i].signature;
+        if(signature->length == symbol->length
+           && memcmp(signature->data, symbol->data, symbol->length) == 0) {
+            return &image->functions[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns 1 if [function] always returns a value, 0 if it never does, and -1
+// if it can do both (or its code is malformed).
+static int orbit_vmReturnsValue(const OrbitImageFunction* function) {
+    bool value = false, none = false;
+    const uint8_t* code = function->byteCode;
+    for(uint32_t offset = 0; offset < function->byteCodeLength;) {
+        if(code[offset] >= ORBIT_OPCODE_COUNT) { return -1; }
+        value = value || code[offset] == CODE_ret_val;
+        none = none || code[offset] == CODE_ret;
+        offset += 1 + orbit_vmOperandBytes[code[offset]];
+    }
+    return value == none ? -1 : value;
+}
+
+// Checks operands and control flow. [starts] is set for every instruction.
+static bool orbit_vmCheckStructure(const OrbitModuleImage* image,
+                                   const OrbitImageFunction* function, bool* starts) {
+    const uint8_t* code = function->byteCode;
+    uint32_t length = function->byteCodeLength;
+    uint32_t locals = function->arity + function->localCount;
+
+    uint8_t last = CODE_halt;
+    for(uint32_t offset = 0; offset < length;) {
+        uint8_t op = code[offset];
+        if(op >= ORBIT_OPCODE_COUNT) { return false; }
+        uint32_t next = offset + 1 + orbit_vmOperandBytes[op];
+        if(next > length) { return false; }
+        starts[offset] = true;
+
+        const uint8_t* operands = code + offset + 1;
+        switch(op) {
+        case CODE_load_const:
+            if(orbit_vmOperand16(operands, 0) >= image->constantCount) { return false; }
+            break;
+        case CODE_load_global:
+        case CODE_store_global:
+            if(orbit_vmOperand16(operands, 0) >= image->globalCount) { return false; }
+            break;
+        case CODE_load_local:
+        case CODE_store_local:
+        case CODE_load_local_field:
+            if(operands[0] >= locals) { return false; }
+            break;
+        case CODE_load_local2:
+        case CODE_store_load_local:
+        case CODE_add_ll:
+            if(operands[0] >= locals || operands[1] >= locals) { return false; }
+            break;
+        case CODE_load_local_const:
+            if(operands[0] >= locals) { return false; }
+            if(orbit_vmOperand16(operands, 1) >= image->constantCount) { return false; }
+            break;
+        case CODE_invoke_sym:
+        case CODE_spawn_sym:
+        case CODE_init_sym:
+            if(!orbit_vmIsSymbol(image, orbit_vmOperand16(operands, 0))) { return false; }
+            break;
+        case CODE_invoke:
+        case CODE_spawn:
+        case CODE_init:
+            // Module files can only refer to functions and classes by name.
+            return false;
+        default:
+            break;
+        }
+        last = op;
+        offset = next;
+    }
+    if(length == 0 || orbit_vmFallsThrough(last)) { return false; }
+
+    for(uint32_t offset = 0; offset < length; offset += 1 + orbit_vmOperandBytes[code[offset]]) {
+        int32_t target = 0;
+        if(!orbit_vmJumpTarget(code, offset, &target)) { continue; }
+        if(target < 0 || target >= (int32_t)length || !starts[target]) { return false; }
+    }
+    return true;
+}
+
+typedef enum {
+    ORBIT_STACK_OK,
+    ORBIT_STACK_INVALID,
+    ORBIT_STACK_UNKNOWN,
+} OrbitStackCheck;
+
+// Finds how many operands the instruction at [offset] pops, and how many it
+// then pushes.
+static OrbitStackCheck orbit_vmStackUse(const OrbitModuleImage* image, const uint8_t* code,
+                                        uint32_t offset, int32_t* inputs, int32_t* outputs) {
+    uint8_t op = code[offset];
+    if(op != CODE_invoke_sym && op != CODE_spawn_sym) {
+        *inputs = orbit_vmStackInputs(op);
+        *outputs = *inputs + orbit_vmStackEffect[op];
+        return ORBIT_STACK_OK;
+    }
+    const OrbitImageConstant* symbol = &image->constants[orbit_vmOperand16(code, offset + 1)];
+    const OrbitImageFunction* callee = orbit_vmFindCallee(image, &symbol->string);
+    if(!callee) { return ORBIT_STACK_UNKNOWN; }
+
+    // Spawning always pushes the task.
+    int returns = op == CODE_spawn_sym ? 1 : orbit_vmReturnsValue(callee);
+    if(returns < 0) { return ORBIT_STACK_UNKNOWN; }
+    *inputs = callee->arity;
+    *outputs = returns;
+    return ORBIT_STACK_OK;
+}
+
+static OrbitStackCheck orbit_vmCheckStack(const OrbitModuleImage* image,
+                                          const OrbitImageFunction* function, int32_t* maxDepth) {
+    const uint8_t* code = function->byteCode;
+    uint32_t length = function->byteCodeLength;
+    int32_t* depths = ORBIT_ALLOC_ARRAY(int32_t, length);
+    uint32_t* work = ORBIT_ALLOC_ARRAY(uint32_t, length);
+    for(uint32_t i = 0; i < length; ++i) { depths[i] = -1; }
+
+    OrbitStackCheck result = ORBIT_STACK_OK;
+    uint32_t workCount = 0;
+    depths[0] = 0;
+    work[workCount++] = 0;
+    *maxDepth = 0;
+
+    while(workCount && result == ORBIT_STACK_OK) {
+        uint32_t offset = work[--workCount];
+        uint8_t op = code[offset];
+        int32_t depth = depths[offset];
+
+        int32_t inputs = 0, outputs = 0;
+        result = orbit_vmStackUse(image, code, offset, &inputs, &outputs);
+        if(result != ORBIT_STACK_OK) { break; }
+        if(depth < inputs) { result = ORBIT_STACK_INVALID; break; }
+        depth = depth - inputs + outputs;
+        if(depth > *maxDepth) { *maxDepth = depth; }
+
+        uint32_t successors[2];
+        uint8_t successorCount = 0;
+        if(orbit_vmFallsThrough(op)) {
+            successors[successorCount++] = offset + 1 + orbit_vmOperandBytes[op];
+        }
+        int32_t target = 0;
+        if(orbit_vmJumpTarget(code, offset, &target)) { successors[successorCount++] = target; }
+
+        for(uint8_t i = 0; i < successorCount; ++i) {
+            uint32_t successor = successors[i];
+            if(depths[successor] == -1) {
+                depths[successor] = depth;
+                work[workCount++] = successor;
+            } else if(depths[successor] != depth) {
+                result = ORBIT_STACK_INVALID;
+            }
+        }
+    }
+
+    orbit_dealloc(depths);
+    orbit_dealloc(work);
+    return result;
+}
+
+bool orbit_vmVerifyFunction(const OrbitModuleImage* image, OrbitImageFunction* function) {
+    assert(image != NULL && "Null instance error");
+    assert(function != NULL && "Null instance error");
+    function->verified = false;
+
+    bool* starts = ORBIT_ALLOC_ARRAY(bool, function->byteCodeLength + 1);
+    bool valid = orbit_vmCheckStructure(image, function, starts);
+    orbit_dealloc(starts);
+    if(!valid) { return false; }
+
+    int32_t maxDepth = 0;
+    switch(orbit_vmCheckStack(image, function, &maxDepth)) {
+    case ORBIT_STACK_INVALID:
+        return false;
+    case ORBIT_STACK_UNKNOWN:
+        // Still valid, but run with checked pushes.
+        return true;
+    case ORBIT_STACK_OK:
+        break;
+    }
+
+    int32_t required = function->localCount + maxDepth;
+    if(required > UINT16_MAX) { return false; }
+    function->stackEffect = required;
+    function->verified = true;
+    return true;
+}
@@ -125,6 +125,7 @@ void sema_doScopeAnalysis(OrbitASTContext* ctx, OrbitAST* func, void* data) {
 }
 
 void sema_runTypeAnalysis(OrbitASTContext* context) {
+    OCStringPool* strings = orbit_stringPoolSetCurrent(&context->strings);
     // Initialise a Sema object
     OCSema sema;
     sema_init(&sema);
@@ -160,4 +161,5 @@ void sema_runTypeAnalysis(OrbitASTContext* context) {
     
     
     sema_deinit(&sema);
+    orbit_stringPoolSetCurrent(strings);
 }
@@ -0,0 +1,219 @@
+//===--------------------------------------------------------------------------------------------===
+// bench/bench_vm.c - Micro-benchmarks for the Orbit interpreter
+// This source is part of Orbit - Tests
+//
+// Created on 2018-06-02 by Amy Parent <amy@amyparent.com>
+// Copyright (c) 2016-2018 Amy Parent <amy@amyparent.com>
+// Available under the MIT License
+// =^•.•^=
+//===--------------------------------------------------------------------------------------------===
+//  Each benchmark is a hand-assembled bytecode program loaded in a fresh VM
+//  (with superinstructions fused, as the module loader would do) and run
+//  through orbit_vmInvoke(). Results are stored in the module's first
+//  global so we can check that every engine computes the same thing.
+//
+//  Use tools/testing/bench-dispatch.sh to build and run this with every
+//  dispatch engine. When built with ORBIT_VM_STATS, the number of instructions
+//  dispatched is printed too.
+//
+//  `BenchVM <scale> profile` also times each benchmark with the sampling
+//  profiler running at 1 kHz, and prints how much slower that made it.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <orbit/orbit.h>
+#include <orbit/runtime/profiler.h>
+#include <orbit/runtime/rtutils.h>
+#include <orbit/runtime/value.h>
+#include <orbit/runtime/vm.h>
+
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_SWITCH
+#define ENGINE_NAME "switch"
+#elif ORBIT_DISPATCH == ORBIT_DISPATCH_TOKEN
+#define ENGINE_NAME "token"
+#elif ORBIT_DISPATCH == ORBIT_DISPATCH_DIRECT
+#define ENGINE_NAME "direct"
+#elif ORBIT_DISPATCH == ORBIT_DISPATCH_TAILCALL
+#define ENGINE_NAME "tailcall"
+#elif ORBIT_DISPATCH == ORBIT_DISPATCH_REGISTERS
+#define ENGINE_NAME "registers"
+#endif
+
+#define HI(x) (((x) >> 8) & 0xff)
+#define LO(x) ((x) & 0xff)
+
+#define BENCH_PROFILE_HZ        1000
+#define BENCH_PROFILE_ROUNDS    5
+
+static bool bench_profile = false;
+
+// Creates a module registered as `bench` in [vm], with [constantCount] nil
+// constants and [globalCount] nil globals.
+static OrbitVMModule* bench_module(OrbitVM* vm, uint16_t constantCount, uint16_t globalCount) {
+    OrbitVMModule* module = orbit_gcModuleNew(vm);
+    orbit_gcRetain(vm, (OrbitGCObject*)module);
+    orbit_gcMapAdd(vm, vm->modules, MAKE_OBJECT(orbit_gcStringNew(vm, "bench")), MAKE_OBJECT(module));
+    orbit_gcRelease(vm);
+
+    OrbitValue* constants = ALLOC_ARRAY(vm, OrbitValue, constantCount);
+    for(uint16_t i = 0; i < constantCount; ++i) { constants[i] = VAL_NIL; }
+    module->constants = constants;
+    module->constantCount = constantCount;
+
+    OrbitVMGlobal* globals = ALLOC_ARRAY(vm, OrbitVMGlobal, globalCount);
+    for(uint16_t i = 0; i < globalCount; ++i) {
+        globals[i].name = VAL_NIL;
+        globals[i].global = VAL_NIL;
+    }
+    module->globals = globals;
+    module->globalCount = globalCount;
+    return module;
+}
+
+// Creates a bytecode function in [module] and registers it as [signature].
+static void bench_function(OrbitVM* vm, OrbitVMModule* module, const char* signature,
+                           const uint8_t* code, uint16_t length,
+                           uint8_t arity, uint8_t localCount, uint8_t stackEffect) {
+    OrbitVMFunction* fn = orbit_gcFunctionNew(vm, length);
+    orbit_gcRetain(vm, (OrbitGCObject*)fn);
+    memcpy(fn->native.byteCode, code, length);
+    fn->module = module;
+    fn->arity = arity;
+    fn->localCount = localCount;
+    fn->stackEffect = stackEffect;
+    // Like the module loader would.
+    orbit_vmFuseFunction(vm, fn);
+    orbit_gcMapAdd(vm, vm->dispatchTable, MAKE_OBJECT(orbit_gcStringNew(vm, signature)), MAKE_OBJECT(fn));
+    orbit_gcRelease(vm);
+}
+
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double bench_time(OrbitVM* vm, const char* entry) {
+    double start = bench_now();
+    orbit_vmInvoke(vm, "bench", entry);
+    return bench_now() - start;
+}
+
+// Runs [entry] with and without the profiler, alternating so that both see the
+// same machine state, and compares the best time of each.
+static void bench_runProfiled(OrbitVM* vm, const char* name, const char* entry) {
+    double plain = 0, profiled = 0;
+    uint64_t samples = 0;
+    FILE* sink = fopen("/dev/null", "w");
+    for(int i = 0; i < BENCH_PROFILE_ROUNDS; ++i) {
+        double elapsed = bench_time(vm, entry);
+        if(i == 0 || elapsed < plain) { plain = elapsed; }
+
+        if(!orbit_profilerStart(vm, BENCH_PROFILE_HZ, 4096)) {
+            printf("%-10s %-12s profiling isn't supported here\n", ENGINE_NAME, name);
+            fclose(sink);
+            return;
+        }
+        elapsed = bench_time(vm, entry);
+        orbit_profilerStop(vm);
+        samples += orbit_profilerWrite(vm, sink, false);
+        if(i == 0 || elapsed < profiled) { profiled = elapsed; }
+    }
+    fclose(sink);
+    printf("%-10s %-12s %9.3f ms   profiled=%.3f ms (%+.2f%%, %llu samples)\n",
+           ENGINE_NAME, name, plain * 1000.0, profiled * 1000.0,
+           (profiled - plain) / plain * 100.0, (unsigned long long)samples);
+}
+
+static void bench_run(OrbitVM* vm, OrbitVMModule* module, const char* name, const char* entry) {
+    double start = bench_now();
+    bool ok = orbit_vmInvoke(vm, "bench", entry);
+    double elapsed = bench_now() - start;
+
+    OrbitValue result = module->globals[0].global;
+    printf("%-10s %-12s %9.3f ms   result=%.9g%s\n",
+           ENGINE_NAME, name, elapsed * 1000.0,
+           IS_NUM(result) ? AS_NUM(result) : 0.0, ok ? "" : " (FAILED)");
+#ifdef ORBIT_VM_STATS
+    printf("%-10s %-12s %12llu dispatches\n",
+           ENGINE_NAME, name, (unsigned long long)vm->dispatchCount);
+#endif
+    if(bench_profile) { bench_runProfiled(vm, name, entry); }
+}
+
+// Numeric loop: i = 0; while(i < N) { i = i + 1 }; result = i
+static void bench_loop(double iterations) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = bench_module(vm, 3, 1);
+    module->constants[0] = MAKE_NUM(0);
+    module->constants[1] = MAKE_NUM(1);
+    module->constants[2] = MAKE_NUM(iterations);
+
+    const uint8_t code[] = {
+        CODE_load_const, HI(0), LO(0),      //  0
+        CODE_store_local, 0,                //  3
+        CODE_load_local, 0,                 //  5: loop
+        CODE_load_const, HI(1), LO(1),      //  7
+        CODE_add,                           // 10
+        CODE_store_local, 0,                // 11
+        CODE_load_local, 0,                 // 13
+        CODE_load_const, HI(2), LO(2),      // 15
+        CODE_test_lt,                       // 18
+        CODE_rjump_if, HI(17), LO(17),      // 19 -> 5
+        CODE_load_local, 0,                 // 22
+        CODE_store_global, HI(0), LO(0),    // 24
+        CODE_ret,                           // 27
+    };
+    bench_function(vm, module, "loop", code, sizeof(code), 0, 1, 4);
+    bench_run(vm, module, "loop", "loop");
+    orbit_vmDealloc(vm);
+}
+
+// Call chain: fib(n) = n < 2 ? n : fib(n-1) + fib(n-2)
+static void bench_fib(double n) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = bench_module(vm, 4, 1);
+    module->constants[0] = MAKE_NUM(1);
+    module->constants[1] = MAKE_NUM(2);
+    module->constants[2] = MAKE_OBJECT(orbit_gcStringNew(vm, "fib"));
+    module->constants[3] = MAKE_NUM(n);
+
+    const uint8_t fib[] = {
+        CODE_load_local, 0,                 //  0
+        CODE_load_const, HI(1), LO(1),      //  2
+        CODE_test_lt,                       //  5
+        CODE_jump_if, HI(20), LO(20),       //  6 -> 29
+        CODE_load_local, 0,                 //  9
+        CODE_load_const, HI(0), LO(0),      // 11
+        CODE_sub,                           // 14
+        CODE_invoke_sym, HI(2), LO(2),      // 15
+        CODE_load_local, 0,                 // 18
+        CODE_load_const, HI(1), LO(1),      // 20
+        CODE_sub,                           // 23
+        CODE_invoke_sym, HI(2), LO(2),      // 24
+        CODE_add,                           // 27
+        CODE_ret_val,                       // 28
+        CODE_load_local, 0,                 // 29
+        CODE_ret_val,                       // 31
+    };
+    const uint8_t main[] = {
+        CODE_load_const, HI(3), LO(3),
+        CODE_invoke_sym, HI(2), LO(2),
+        CODE_store_global, HI(0), LO(0),
+        CODE_ret,
+    };
+    bench_function(vm, module, "fib", fib, sizeof(fib), 1, 0, 4);
+    bench_function(vm, module, "main", main, sizeof(main), 0, 0, 2);
+    bench_run(vm, module, "fib", "main");
+    orbit_vmDealloc(vm);
+}
+
+int main(int argc, const char** argv) {
+    double scale = argc > 1 ? atof(argv[1]) : 1.0;
+    bench_profile = argc > 2 && strcmp(argv[2], "profile") == 0;
+    bench_loop(10000000 * scale);
+    bench_fib(27);
+    return 0;
+}
@@ -10,10 +10,21 @@
 #include <orbit/runtime/value.h>
 #include <orbit/runtime/vm.h>
 #include <orbit/runtime/gc.h>
+#include <orbit/runtime/image.h>
+#include <orbit/runtime/objfile.h>
+#include <orbit/runtime/profiler.h>
+#include <orbit/runtime/stats.h>
+#include <orbit/runtime/tracer.h>
+#include <orbit/runtime/rtutils.h>
 #include <orbit/utils/pack.h>
 #include <orbit/utils/hashing.h>
+#include <orbit/csupport/string.h>
 #include "unity.h"
 
+#ifdef __unix__
+#include <pthread.h>
+#endif
+
 void pack_uint8(void) {
     FILE* f = fopen("/tmp/test", "w+");
     TEST_ASSERT_NOT_NULL(f);
@@ -146,6 +157,335 @@ void gc_savestack(void) {
     orbit_vmDealloc(vm);
 }
 
+static uint64_t test_heapObjects(OrbitVM* vm) {
+    uint64_t count = 0;
+    for(uint32_t i = 0; i <= ORBIT_GC_SIZE_CLASSES; ++i) {
+        OrbitGCSizeClassStats stats;
+        orbit_gcSizeClassStats(vm, i, &stats);
+        count += stats.used;
+    }
+    return count;
+}
+
+void gc_generational(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitGCMap* map = orbit_gcMapNew(vm);
+    orbit_gcRetain(vm, (OrbitGCObject*)map);
+    
+    orbit_gcRunMinor(vm);
+    TEST_ASSERT_TRUE(map->base.old);
+    TEST_ASSERT_NULL(vm->heap.young);
+    
+    // The old map is remembered, and keeps the young string alive.
+    OrbitGCString* string = orbit_gcStringNew(vm, "Hello, world");
+    orbit_gcMapAdd(vm, map, MAKE_NUM(1), MAKE_OBJECT(string));
+    TEST_ASSERT_TRUE(map->base.remembered);
+    
+    OrbitGCString* garbage = orbit_gcStringNew(vm, "garbage");
+    size_t before = vm->allocated;
+    size_t size = sizeof(OrbitGCString) + garbage->length + 1;
+    
+    orbit_gcRunMinor(vm);
+    TEST_ASSERT_EQUAL(before - size, vm->allocated);
+    TEST_ASSERT_TRUE(string->base.old);
+    TEST_ASSERT_FALSE(map->base.remembered);
+    TEST_ASSERT_NULL(vm->heap.young);
+    
+    OrbitValue value = VAL_NIL;
+    TEST_ASSERT_TRUE(orbit_gcMapGet(map, MAKE_NUM(1), &value));
+    TEST_ASSERT_EQUAL_STRING("Hello, world", AS_STRING(value)->data);
+    
+    orbit_gcRelease(vm);
+    orbit_vmDealloc(vm);
+}
+
+void gc_incremental(void) {
+    OrbitVM* vm = orbit_vmNew();
+    orbit_gcSetPauseBudget(vm, 1);
+    OrbitGCArray* array = orbit_gcArrayNew(vm);
+    orbit_gcRetain(vm, (OrbitGCObject*)array);
+    for(uint32_t i = 0; i < 20000; ++i) {
+        OrbitGCString* string = orbit_gcStringNew(vm, "live");
+        orbit_gcRetain(vm, (OrbitGCObject*)string);
+        orbit_gcArrayAdd(vm, array, MAKE_OBJECT(string));
+        orbit_gcRelease(vm);
+    }
+    OrbitGCString* stored = orbit_gcStringNew(vm, "stored");
+    orbit_gcRetain(vm, (OrbitGCObject*)stored);
+    orbit_gcRun(vm);
+    orbit_gcRelease(vm);
+    TEST_ASSERT_EQUAL(ORBIT_GC_IDLE, vm->gcPhase);
+    
+    orbit_gcStart(vm);
+    TEST_ASSERT_EQUAL(ORBIT_GC_MARK, vm->gcPhase);
+    
+    // Objects allocated or stored while marking are marked.
+    OrbitGCString* young = orbit_gcStringNew(vm, "young");
+    TEST_ASSERT_TRUE(orbit_gcIsMarked(&young->base));
+    orbit_gcArrayAdd(vm, array, MAKE_OBJECT(young));
+    TEST_ASSERT_FALSE(orbit_gcIsMarked(&stored->base));
+    orbit_gcArrayAdd(vm, array, MAKE_OBJECT(stored));
+    TEST_ASSERT_TRUE(orbit_gcIsMarked(&stored->base));
+    
+    uint32_t slices = 1;
+    while(vm->gcPhase != ORBIT_GC_IDLE) {
+        vm->gcNextStep = 0;
+        orbit_gcStep(vm);
+        slices += 1;
+    }
+    TEST_ASSERT_TRUE(slices > 2);
+    TEST_ASSERT_TRUE(young->base.old);
+    TEST_ASSERT_EQUAL_STRING("stored", stored->data);
+    TEST_ASSERT_EQUAL(20002, array->size);
+    
+    orbit_gcRelease(vm);
+    orbit_vmDealloc(vm);
+}
+
+void gc_lazySweep(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitGCString* live = orbit_gcStringNew(vm, "live");
+    orbit_gcRetain(vm, (OrbitGCObject*)live);
+    vm->nextGC = UINT64_MAX;
+    for(uint32_t i = 0; i < 1000; ++i) {
+        orbit_gcStringNew(vm, "garbage");
+    }
+    
+    // The mutator resumes as soon as marking is done.
+    orbit_gcStart(vm);
+    TEST_ASSERT_EQUAL(ORBIT_GC_SWEEP, vm->gcPhase);
+    TEST_ASSERT_TRUE(orbit_gcIsMarked(&live->base));
+    TEST_ASSERT_NOT_NULL(vm->heap.sweep);
+    
+    uint32_t allocations = 0;
+    while(vm->gcPhase != ORBIT_GC_IDLE) {
+        orbit_gcStringNew(vm, "young");
+        allocations += 1;
+    }
+    TEST_ASSERT_TRUE(allocations > 1);
+    TEST_ASSERT_TRUE(live->base.old);
+    TEST_ASSERT_FALSE(orbit_gcIsMarked(&live->base));
+    
+    orbit_gcRelease(vm);
+    orbit_vmDealloc(vm);
+}
+
+void gc_parallelMark(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitGCArray* root = orbit_gcArrayNew(vm);
+    orbit_gcRetain(vm, (OrbitGCObject*)root);
+    for(uint32_t i = 0; i < 64; ++i) {
+        OrbitGCMap* map = orbit_gcMapNew(vm);
+        orbit_gcRetain(vm, (OrbitGCObject*)map);
+        orbit_gcArrayAdd(vm, root, MAKE_OBJECT(map));
+        orbit_gcRelease(vm);
+        for(uint32_t j = 0; j < 256; ++j) {
+            char key[16];
+            snprintf(key, sizeof(key), "%u", j);
+            OrbitGCString* string = orbit_gcStringNew(vm, key);
+            orbit_gcRetain(vm, (OrbitGCObject*)string);
+            orbit_gcMapAdd(vm, map, MAKE_OBJECT(string), MAKE_NUM(j));
+            orbit_gcRelease(vm);
+        }
+    }
+    // A deep chain is marked without recursing.
+    OrbitGCArray* link = root;
+    for(uint32_t i = 0; i < 10000; ++i) {
+        OrbitGCArray* next = orbit_gcArrayNew(vm);
+        orbit_gcRetain(vm, (OrbitGCObject*)next);
+        orbit_gcArrayAdd(vm, link, MAKE_OBJECT(next));
+        orbit_gcRelease(vm);
+        link = next;
+    }
+    orbit_gcRun(vm);
+    uint64_t live = vm->allocated;
+    
+    orbit_gcSetMarkThreads(vm, 4);
+    for(uint32_t i = 0; i < 1000; ++i) {
+        orbit_gcStringNew(vm, "garbage");
+    }
+    orbit_gcRun(vm);
+    TEST_ASSERT_EQUAL(live, vm->allocated);
+    
+    uint64_t count = test_heapObjects(vm);
+    orbit_gcRun(vm);
+    TEST_ASSERT_EQUAL(live, vm->allocated);
+    TEST_ASSERT_EQUAL(count, test_heapObjects(vm));
+    
+    OrbitGCArray* chain = (OrbitGCArray*)AS_OBJECT(root->data[64]);
+    uint32_t depth = 1;
+    while(chain->size) {
+        chain = (OrbitGCArray*)AS_OBJECT(chain->data[0]);
+        depth += 1;
+    }
+    TEST_ASSERT_EQUAL(10000, depth);
+    TEST_ASSERT_EQUAL_PTR(link, chain);
+    
+    orbit_gcRelease(vm);
+    orbit_vmDealloc(vm);
+}
+
+void gc_sideMarks(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitGCArray* array = orbit_gcArrayNew(vm);
+    orbit_gcRetain(vm, (OrbitGCObject*)array);
+    for(uint32_t i = 0; i < 100; ++i) {
+        OrbitGCString* string = orbit_gcStringNew(vm, "shared");
+        orbit_gcRetain(vm, (OrbitGCObject*)string);
+        orbit_gcArrayAdd(vm, array, MAKE_OBJECT(string));
+        orbit_gcRelease(vm);
+    }
+    orbit_gcRun(vm);
+    
+    // Collections don't write to objects that were already old.
+    OrbitGCArray before = *array;
+    OrbitGCString strings[100];
+    for(uint32_t i = 0; i < 100; ++i) {
+        strings[i] = *AS_STRING(array->data[i]);
+    }
+    orbit_gcStart(vm);
+    TEST_ASSERT_TRUE(orbit_gcIsMarked((OrbitGCObject*)array));
+    orbit_gcRun(vm);
+    orbit_gcRunMinor(vm);
+    
+    TEST_ASSERT_EQUAL_MEMORY(&before, array, sizeof(OrbitGCArray));
+    for(uint32_t i = 0; i < 100; ++i) {
+        OrbitGCString* string = AS_STRING(array->data[i]);
+        TEST_ASSERT_EQUAL_MEMORY(&strings[i], string, sizeof(OrbitGCString));
+        TEST_ASSERT_FALSE(orbit_gcIsMarked(&string->base));
+    }
+    
+    orbit_gcRelease(vm);
+    orbit_vmDealloc(vm);
+}
+
+void gc_telemetry(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitGCStats before, after;
+    orbit_gcStats(vm, &before);
+    
+    OrbitGCString* name = orbit_gcStringNew(vm, "Point");
+    orbit_gcRetain(vm, (OrbitGCObject*)name);
+    OrbitGCClass* class = orbit_gcClassNew(vm, name, 2);
+    orbit_gcRelease(vm);
+    orbit_gcRetain(vm, (OrbitGCObject*)class);
+    OrbitGCArray* points = orbit_gcArrayNew(vm);
+    orbit_gcRetain(vm, (OrbitGCObject*)points);
+    for(uint32_t i = 0; i < 10; ++i) {
+        OrbitGCInstance* point = orbit_gcInstanceNew(vm, class);
+        orbit_gcRetain(vm, (OrbitGCObject*)point);
+        orbit_gcArrayAdd(vm, points, MAKE_OBJECT(point));
+        orbit_gcRelease(vm);
+    }
+    for(uint32_t i = 0; i < 100; ++i) {
+        orbit_gcStringNew(vm, "garbage");
+    }
+    orbit_gcRunMinor(vm);
+    orbit_gcRun(vm);
+    orbit_gcStats(vm, &after);
+    
+    uint64_t garbage = 100 * (sizeof(OrbitGCString) + 8);
+    uint64_t point = sizeof(OrbitGCInstance) + 2 * sizeof(OrbitValue);
+    TEST_ASSERT_EQUAL(before.collections + 1, after.collections);
+    TEST_ASSERT_EQUAL(before.minorCollections + 1, after.minorCollections);
+    TEST_ASSERT_TRUE(after.allocatedBytes - before.allocatedBytes >= garbage + 10 * point);
+    TEST_ASSERT_TRUE(after.freedBytes - before.freedBytes >= garbage);
+    TEST_ASSERT_TRUE(after.promotedBytes - before.promotedBytes >= 10 * point);
+    TEST_ASSERT_TRUE(after.peakHeap > vm->allocated);
+    
+    uint64_t pauses = 0;
+    for(uint32_t i = 0; i < ORBIT_GC_PAUSE_BUCKETS; ++i) {
+        pauses += after.pauses[i] - before.pauses[i];
+    }
+    TEST_ASSERT_EQUAL(2, pauses);
+    TEST_ASSERT_TRUE(after.pauseMax >= before.pauseMax);
+    
+    OrbitGCCensus census;
+    orbit_gcCensus(vm, &census);
+    TEST_ASSERT_EQUAL_STRING("instance", census.kinds[ORBIT_OBJK_INSTANCE].name);
+    TEST_ASSERT_EQUAL(10, census.kinds[ORBIT_OBJK_INSTANCE].objects);
+    TEST_ASSERT_EQUAL(10 * point, census.kinds[ORBIT_OBJK_INSTANCE].bytes);
+    TEST_ASSERT_EQUAL(1, census.classCount);
+    TEST_ASSERT_EQUAL_STRING("Point", census.classes[0].name);
+    TEST_ASSERT_EQUAL(10, census.classes[0].objects);
+    
+    // The census keeps its own copy of class names.
+    orbit_gcRelease(vm);
+    orbit_gcRelease(vm);
+    orbit_gcRun(vm);
+    TEST_ASSERT_EQUAL_STRING("Point", census.classes[0].name);
+    orbit_gcCensusDeinit(&census);
+    
+    // Garbage instances left for the lazy sweep are gone before the census
+    // looks at them, along with their class.
+    name = orbit_gcStringNew(vm, "Temp");
+    orbit_gcRetain(vm, (OrbitGCObject*)name);
+    class = orbit_gcClassNew(vm, name, 0);
+    orbit_gcRelease(vm);
+    orbit_gcRetain(vm, (OrbitGCObject*)class);
+    for(uint32_t i = 0; i < 10; ++i) {
+        orbit_gcInstanceNew(vm, class);
+    }
+    orbit_gcRelease(vm);
+    orbit_gcStart(vm);
+    TEST_ASSERT_EQUAL(ORBIT_GC_SWEEP, vm->gcPhase);
+    orbit_gcCensus(vm, &census);
+    TEST_ASSERT_EQUAL(ORBIT_GC_IDLE, vm->gcPhase);
+    TEST_ASSERT_EQUAL(0, census.kinds[ORBIT_OBJK_INSTANCE].objects);
+    TEST_ASSERT_EQUAL(0, census.classCount);
+    orbit_gcCensusDeinit(&census);
+    orbit_vmDealloc(vm);
+}
+
+void gc_sizeClasses(void) {
+    OrbitVM* vm = orbit_vmNew();
+    uint8_t sizeClass = vm->heap.classOf[(sizeof(OrbitGCString) + 6 + 15) / 16];
+    OrbitGCSizeClassStats stats;
+    orbit_gcRun(vm);
+    orbit_gcSizeClassStats(vm, sizeClass, &stats);
+    uint64_t used = stats.used;
+    
+    OrbitGCArray* kept = orbit_gcArrayNew(vm);
+    orbit_gcRetain(vm, (OrbitGCObject*)kept);
+    for(uint32_t i = 0; i < 1000; ++i) {
+        OrbitGCString* string = orbit_gcStringNew(vm, "pages");
+        orbit_gcRetain(vm, (OrbitGCObject*)string);
+        orbit_gcArrayAdd(vm, kept, MAKE_OBJECT(string));
+        orbit_gcRelease(vm);
+    }
+    OrbitGCString* large = orbit_gcStringReserve(vm, 4 * ORBIT_GC_LARGE_SIZE);
+    orbit_gcRetain(vm, (OrbitGCObject*)large);
+    for(uint32_t i = 1; i < 1000; i += 2) {
+        kept->data[i] = VAL_NIL;
+    }
+    orbit_gcRun(vm);
+    
+    // Strings that died leave holes in the pages the others still use.
+    orbit_gcSizeClassStats(vm, sizeClass, &stats);
+    TEST_ASSERT_TRUE(stats.objectSize >= sizeof(OrbitGCString) + 6);
+    TEST_ASSERT_TRUE(stats.used >= used + 500);
+    TEST_ASSERT_TRUE(stats.slots - stats.used >= 400);
+    TEST_ASSERT_EQUAL(stats.pages * ORBIT_GC_PAGE_SIZE, stats.bytes);
+    
+    orbit_gcSizeClassStats(vm, ORBIT_GC_SIZE_CLASSES, &stats);
+    TEST_ASSERT_EQUAL(0, stats.objectSize);
+    TEST_ASSERT_EQUAL(1, stats.pages);
+    TEST_ASSERT_EQUAL(1, stats.used);
+    TEST_ASSERT_TRUE(stats.bytes > 4 * ORBIT_GC_LARGE_SIZE);
+    
+    // Empty pages go back to the system.
+    orbit_gcRelease(vm);
+    orbit_gcRelease(vm);
+    orbit_gcRun(vm);
+    orbit_gcSizeClassStats(vm, ORBIT_GC_SIZE_CLASSES, &stats);
+    TEST_ASSERT_EQUAL(0, stats.pages);
+    orbit_gcSizeClassStats(vm, sizeClass, &stats);
+    TEST_ASSERT_EQUAL(used, stats.used);
+    TEST_ASSERT_TRUE(stats.pages <= 1);
+    
+    orbit_vmDealloc(vm);
+}
+
 void string_create(void) {
     OrbitVM* vm = orbit_vmNew();
     OrbitGCString* string = orbit_gcStringNew(vm, "Hello, world!");
@@ -189,12 +529,126 @@ void string_emptyHash(void) {
     orbit_vmDealloc(vm);
 }
 
+void stringpool_intern(void) {
+    OCStringPool a, b;
+    orbit_stringPoolInit(&a, 16);
+    orbit_stringPoolInit(&b, 16);
+    
+    OCStringID hello = orbit_stringPoolIntern(&a, "hello", 5);
+    TEST_ASSERT_EQUAL(hello, orbit_stringPoolIntern(&a, "hello", 5));
+    TEST_ASSERT_NOT_EQUAL(hello, orbit_stringPoolIntern(&a, "hell", 4));
+    TEST_ASSERT_NOT_EQUAL(hello, orbit_stringPoolIntern(&b, "hello", 5));
+    TEST_ASSERT_NULL(orbit_stringPoolLookup(&b, "hell", 4));
+    
+    // Growing the pool doesn't move strings.
+    char name[16];
+    for(int i = 0; i < 1000; ++i) {
+        int length = snprintf(name, sizeof(name), "sym%d", i);
+        orbit_stringPoolIntern(&a, name, length);
+    }
+    OCString* str = orbit_stringPoolGet(hello);
+    TEST_ASSERT_EQUAL(5, str->length);
+    TEST_ASSERT_EQUAL_STRING("hello", str->data);
+    TEST_ASSERT_EQUAL_PTR(str, orbit_stringPoolLookup(&a, "hello", 5));
+    
+    // The thread's current pool is the one used by orbit_stringIntern().
+    OCStringPool* previous = orbit_stringPoolSetCurrent(&b);
+    TEST_ASSERT_EQUAL_PTR(orbit_stringPoolLookup(&b, "hello", 5), orbit_stringPoolGet(orbit_stringIntern("hello", 5)));
+    orbit_stringPoolSetCurrent(previous);
+    
+    orbit_stringPoolDeinit(&a);
+    orbit_stringPoolDeinit(&b);
+}
+
+#ifdef __unix__
+#define POOL_THREADS 4
+#define POOL_STRINGS 2000
+
+static void* stringpool_worker(void* data) {
+    OCStringPool* pool = data;
+    OCStringID* ids = orbit_allocMulti(sizeof(OCStringID), POOL_STRINGS);
+    char name[16];
+    for(int i = 0; i < POOL_STRINGS; ++i) {
+        int length = snprintf(name, sizeof(name), "sym%d", i);
+        ids[i] = orbit_stringPoolIntern(pool, name, length);
+    }
+    return ids;
+}
+
+void stringpool_concurrent(void) {
+    OCStringPool pool;
+    orbit_stringPoolInitConcurrent(&pool, 1024);
+    
+    pthread_t threads[POOL_THREADS];
+    OCStringID* ids[POOL_THREADS];
+    for(int i = 0; i < POOL_THREADS; ++i) {
+        pthread_create(&threads[i], NULL, &stringpool_worker, &pool);
+    }
+    for(int i = 0; i < POOL_THREADS; ++i) {
+        pthread_join(threads[i], (void**)&ids[i]);
+    }
+    
+    // Every thread got the same string for the same name.
+    char name[16];
+    for(int i = 0; i < POOL_STRINGS; ++i) {
+        int length = snprintf(name, sizeof(name), "sym%d", i);
+        OCString* str = orbit_stringPoolGet(ids[0][i]);
+        TEST_ASSERT_EQUAL(length, str->length);
+        TEST_ASSERT_EQUAL(0, memcmp(name, str->data, length));
+        for(int j = 1; j < POOL_THREADS; ++j) {
+            TEST_ASSERT_EQUAL(ids[0][i], ids[j][i]);
+        }
+    }
+    for(int i = 0; i < POOL_THREADS; ++i) { orbit_dealloc(ids[i]); }
+    orbit_stringPoolDeinit(&pool);
+}
+#endif
+
 void double_hash(void) {
     TEST_ASSERT_EQUAL(orbit_hashDouble(12345.6789), orbit_hashDouble(12345.6789));
     TEST_ASSERT_NOT_EQUAL(orbit_hashDouble(-123.456), orbit_hashDouble(123.456));
     TEST_ASSERT_NOT_EQUAL(orbit_hashDouble(0.0), orbit_hashDouble(-0.0));
 }
 
+void value_tagging(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitGCString* string = orbit_gcStringNew(vm, "tagged");
+    
+    OrbitValue num = MAKE_NUM(-123.5);
+    OrbitValue nan = MAKE_NUM(0.0/0.0);
+    OrbitValue obj = MAKE_OBJECT(string);
+    
+    TEST_ASSERT_TRUE(IS_NUM(num));
+    TEST_ASSERT_EQUAL(-123.5, AS_NUM(num));
+    TEST_ASSERT_TRUE(IS_NUM(nan));
+    TEST_ASSERT_FALSE(IS_OBJECT(num));
+    
+    TEST_ASSERT_TRUE(IS_STRING(obj));
+    TEST_ASSERT_FALSE(IS_NUM(obj));
+    TEST_ASSERT_EQUAL_PTR(string, AS_STRING(obj));
+    
+    TEST_ASSERT_TRUE(IS_NIL(VAL_NIL));
+    TEST_ASSERT_FALSE(IS_BOOL(VAL_NIL));
+    TEST_ASSERT_TRUE(IS_BOOL(VAL_TRUE));
+    TEST_ASSERT_TRUE(IS_BOOL(VAL_FALSE));
+    TEST_ASSERT_TRUE(IS_TRUE(MAKE_BOOL(true)));
+    TEST_ASSERT_TRUE(IS_FALSE(MAKE_BOOL(false)));
+    TEST_ASSERT_TRUE(IS_FALSE(MAKE_NUM(0)));
+    TEST_ASSERT_FALSE(IS_NUM(VAL_TRUE));
+    
+#ifdef ORBIT_NAN_TAGGING
+    TEST_ASSERT_EQUAL(8, sizeof(OrbitValue));
+    
+    // A NaN with the bits of a tagged value is still a number.
+    OrbitValueBits forged = {.bits = ORBIT_SIGN_BIT | ORBIT_QNAN | (uint64_t)(uintptr_t)string};
+    OrbitValue host = MAKE_NUM(forged.number);
+    TEST_ASSERT_TRUE(IS_NUM(host));
+    TEST_ASSERT_FALSE(IS_OBJECT(host));
+    TEST_ASSERT_TRUE(AS_NUM(host) != AS_NUM(host));
+#endif
+    orbit_vmDealloc(vm);
+}
+
 void gcarray_new(void) {
     OrbitVM* vm = orbit_vmNew();
     
@@ -429,6 +883,1436 @@ void gcmap_grow(void) {
     orbit_vmDealloc(vm);
 }
 
+#define HI(x) (((x) >> 8) & 0xff)
+#define LO(x) ((x) & 0xff)
+
+// Creates a module registered as `test` in [vm], so that orbit_vmInvoke()
+// doesn't try to load it from disk.
+static OrbitVMModule* test_module(OrbitVM* vm, uint16_t constantCount, uint16_t globalCount) {
+    OrbitVMModule* module = orbit_gcModuleNew(vm);
+    orbit_gcRetain(vm, (OrbitGCObject*)module);
+    orbit_gcMapAdd(vm, vm->modules, MAKE_OBJECT(orbit_gcStringNew(vm, "test")), MAKE_OBJECT(module));
+    orbit_gcRelease(vm);
+    
+    OrbitValue* constants = ALLOC_ARRAY(vm, OrbitValue, constantCount);
+    for(uint16_t i = 0; i < constantCount; ++i) { constants[i] = VAL_NIL; }
+    module->constants = constants;
+    module->constantCount = constantCount;
+    
+    OrbitVMGlobal* globals = ALLOC_ARRAY(vm, OrbitVMGlobal, globalCount);
+    for(uint16_t i = 0; i < globalCount; ++i) {
+        globals[i].name = VAL_NIL;
+        globals[i].global = VAL_NIL;
+    }
+    module->globals = globals;
+    module->globalCount = globalCount;
+    return module;
+}
+
+// Creates a bytecode function in [module] and registers it as [signature].
+static OrbitVMFunction* test_function(OrbitVM* vm, OrbitVMModule* module, const char* signature,
+                                      const uint8_t* code, uint16_t length,
+                                      uint8_t arity, uint8_t localCount) {
+    OrbitVMFunction* fn = orbit_gcFunctionNew(vm, length);
+    orbit_gcRetain(vm, (OrbitGCObject*)fn);
+    memcpy(fn->native.byteCode, code, length);
+    fn->module = module;
+    fn->arity = arity;
+    fn->localCount = localCount;
+    fn->stackEffect = 8;
+    orbit_gcMapAdd(vm, vm->dispatchTable, MAKE_OBJECT(orbit_gcStringNew(vm, signature)), MAKE_OBJECT(fn));
+    orbit_gcRelease(vm);
+    return fn;
+}
+
+// Unverified functions can use more stack than they claim: here, a value is
+// left on the stack by every iteration.
+void vm_unverifiedStack(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 3, 1);
+    module->constants[0] = MAKE_NUM(0);
+    module->constants[1] = MAKE_NUM(1);
+    module->constants[2] = MAKE_NUM(5000);
+    
+    const uint8_t code[] = {
+        CODE_load_const, HI(0), LO(0),
+        CODE_store_local, 0,
+        CODE_load_nil,
+        CODE_load_local, 0,
+        CODE_load_const, HI(1), LO(1),
+        CODE_add,
+        CODE_store_local, 0,
+        CODE_load_local, 0,
+        CODE_load_const, HI(2), LO(2),
+        CODE_test_lt,
+        CODE_rjump_if, HI(18), LO(18),
+        CODE_load_local, 0,
+        CODE_store_global, HI(0), LO(0),
+        CODE_ret,
+    };
+    OrbitVMFunction* fn = test_function(vm, module, "main", code, sizeof(code), 0, 1);
+    fn->stackEffect = 2;
+    
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_REGISTERS
+    // Code whose stack depth isn't fixed can't be translated to registers.
+    TEST_ASSERT_FALSE(orbit_vmInvoke(vm, "test", "main"));
+#else
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_EQUAL(5000, AS_NUM(module->globals[0].global));
+#endif
+    orbit_vmDealloc(vm);
+}
+
+void vm_loop(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 3, 1);
+    module->constants[0] = MAKE_NUM(0);
+    module->constants[1] = MAKE_NUM(1);
+    module->constants[2] = MAKE_NUM(1000);
+    
+    const uint8_t code[] = {
+        CODE_load_const, HI(0), LO(0),
+        CODE_store_local, 0,
+        CODE_load_local, 0,
+        CODE_load_const, HI(1), LO(1),
+        CODE_add,
+        CODE_store_local, 0,
+        CODE_load_local, 0,
+        CODE_load_const, HI(2), LO(2),
+        CODE_test_lt,
+        CODE_rjump_if, HI(17), LO(17),
+        CODE_load_local, 0,
+        CODE_store_global, HI(0), LO(0),
+        CODE_ret,
+    };
+    OrbitVMFunction* fn = test_function(vm, module, "main", code, sizeof(code), 0, 1);
+    
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_TRUE(IS_NUM(module->globals[0].global));
+    TEST_ASSERT_EQUAL(1000, AS_NUM(module->globals[0].global));
+    
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_REGISTERS
+    // Local loads and stores fold into operands: the loop body is loadk, add,
+    // loadk, jlt instead of 8 stack instructions.
+    TEST_ASSERT_NOT_NULL(fn->native.regCode);
+    TEST_ASSERT_TRUE(fn->native.regCodeLength <= 10);
+#else
+    // The arithmetic and comparison should have been quickened.
+    TEST_ASSERT_EQUAL(CODE_add_nn, fn->native.byteCode[10]);
+    TEST_ASSERT_EQUAL(CODE_test_lt_nn, fn->native.byteCode[18]);
+#endif
+    orbit_vmDealloc(vm);
+}
+
+void vm_invoke(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 4, 1);
+    module->constants[0] = MAKE_NUM(1);
+    module->constants[1] = MAKE_NUM(2);
+    module->constants[2] = MAKE_OBJECT(orbit_gcStringNew(vm, "fib"));
+    module->constants[3] = MAKE_NUM(15);
+    
+    const uint8_t fib[] = {
+        CODE_load_local, 0,
+        CODE_load_const, HI(1), LO(1),
+        CODE_test_lt,
+        CODE_jump_if, HI(20), LO(20),
+        CODE_load_local, 0,
+        CODE_load_const, HI(0), LO(0),
+        CODE_sub,
+        CODE_invoke_sym, HI(2), LO(2),
+        CODE_load_local, 0,
+        CODE_load_const, HI(1), LO(1),
+        CODE_sub,
+        CODE_invoke_sym, HI(2), LO(2),
+        CODE_add,
+        CODE_ret_val,
+        CODE_load_local, 0,
+        CODE_ret_val,
+    };
+    const uint8_t main[] = {
+        CODE_load_const, HI(3), LO(3),
+        CODE_invoke_sym, HI(2), LO(2),
+        CODE_store_global, HI(0), LO(0),
+        CODE_ret,
+    };
+    test_function(vm, module, "fib", fib, sizeof(fib), 1, 0);
+    test_function(vm, module, "main", main, sizeof(main), 0, 0);
+    
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_EQUAL(610, AS_NUM(module->globals[0].global));
+    orbit_vmDealloc(vm);
+}
+
+void vm_quicken(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 4, 3);
+    module->constants[0] = MAKE_NUM(1);
+    module->constants[1] = MAKE_OBJECT(orbit_gcStringNew(vm, "orbit"));
+    module->constants[2] = MAKE_OBJECT(orbit_gcStringNew(vm, "orbit"));
+    module->constants[3] = MAKE_OBJECT(orbit_gcStringNew(vm, "equals"));
+    
+    const uint8_t equals[] = {
+        CODE_load_local, 0,
+        CODE_load_local, 1,
+        CODE_test_eq,
+        CODE_ret_val,
+    };
+    const uint8_t main[] = {
+        CODE_load_const, HI(0), LO(0),
+        CODE_load_const, HI(0), LO(0),
+        CODE_invoke_sym, HI(3), LO(3),
+        CODE_store_global, HI(0), LO(0),
+        CODE_load_const, HI(1), LO(1),
+        CODE_load_const, HI(2), LO(2),
+        CODE_invoke_sym, HI(3), LO(3),
+        CODE_store_global, HI(1), LO(1),
+        CODE_load_const, HI(0), LO(0),
+        CODE_load_const, HI(2), LO(2),
+        CODE_invoke_sym, HI(3), LO(3),
+        CODE_store_global, HI(2), LO(2),
+        CODE_ret,
+    };
+    OrbitVMFunction* fn = test_function(vm, module, "equals", equals, sizeof(equals), 2, 0);
+    test_function(vm, module, "main", main, sizeof(main), 0, 0);
+    
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_TRUE(IS_TRUE(module->globals[0].global));
+    TEST_ASSERT_TRUE(IS_TRUE(module->globals[1].global));
+    TEST_ASSERT_TRUE(IS_BOOL(module->globals[2].global));
+    TEST_ASSERT_TRUE(IS_FALSE(module->globals[2].global));
+    
+    // num/num quickens, str/str de-quickens and re-quickens, mixed kinds
+    // de-quicken and stay generic.
+    TEST_ASSERT_EQUAL(CODE_test_eq, fn->native.byteCode[4]);
+    orbit_vmDealloc(vm);
+}
+
+void vm_jit(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 6, 2);
+    module->constants[0] = MAKE_NUM(0);
+    module->constants[1] = MAKE_NUM(1);
+    module->constants[2] = MAKE_NUM(5);
+    module->constants[3] = MAKE_OBJECT(orbit_gcStringNew(vm, "kernel"));
+    module->constants[4] = MAKE_NUM(400);
+    module->constants[5] = MAKE_OBJECT(orbit_gcStringNew(vm, "orbit"));
+    
+    // kernel(n, b): counts up to n, then returns n == b
+    const uint8_t kernel[] = {
+        CODE_load_const, HI(0), LO(0),
+        CODE_store_local, 2,
+        CODE_load_local, 2,
+        CODE_load_const, HI(1), LO(1),
+        CODE_add,
+        CODE_store_local, 2,
+        CODE_load_local, 2,
+        CODE_load_local, 0,
+        CODE_test_lt,
+        CODE_rjump_if, HI(16), LO(16),
+        CODE_load_local, 2,
+        CODE_load_local, 1,
+        CODE_test_eq,
+        CODE_ret_val,
+    };
+    const uint8_t main[] = {
+        CODE_load_const, HI(0), LO(0),
+        CODE_store_local, 0,
+        CODE_load_const, HI(2), LO(2),
+        CODE_load_const, HI(2), LO(2),
+        CODE_invoke_sym, HI(3), LO(3),
+        CODE_store_global, HI(0), LO(0),
+        CODE_load_local, 0,
+        CODE_load_const, HI(1), LO(1),
+        CODE_add,
+        CODE_store_local, 0,
+        CODE_load_local, 0,
+        CODE_load_const, HI(4), LO(4),
+        CODE_test_lt,
+        CODE_rjump_if, HI(29), LO(29),
+        CODE_load_const, HI(2), LO(2),
+        CODE_load_const, HI(5), LO(5),
+        CODE_invoke_sym, HI(3), LO(3),
+        CODE_store_global, HI(1), LO(1),
+        CODE_ret,
+    };
+    OrbitVMFunction* fn = test_function(vm, module, "kernel", kernel, sizeof(kernel), 2, 1);
+    test_function(vm, module, "main", main, sizeof(main), 0, 1);
+    
+    // The last call fails the compiled code's number guard in test_eq and
+    // must finish in the interpreter.
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_TRUE(IS_TRUE(module->globals[0].global));
+    TEST_ASSERT_TRUE(IS_FALSE(module->globals[1].global));
+#if defined(ORBIT_JIT) && defined(__x86_64__) && defined(__linux__) \
+    && ORBIT_DISPATCH != ORBIT_DISPATCH_REGISTERS
+    TEST_ASSERT_NOT_NULL(fn->native.jit);
+#else
+    TEST_ASSERT_NULL(fn->native.jit);
+#endif
+    orbit_vmDealloc(vm);
+}
+
+void vm_osr(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 3, 1);
+    module->constants[0] = MAKE_NUM(0);
+    module->constants[1] = MAKE_NUM(1);
+    module->constants[2] = MAKE_NUM(10000);
+    
+    // main is only invoked once, so it can only be compiled while its loop
+    // is running: total = 0; i = 0; do { i = i + 1; total = total + i } while(i < N)
+    const uint8_t code[] = {
+        CODE_load_const, HI(0), LO(0),
+        CODE_store_global, HI(0), LO(0),
+        CODE_load_const, HI(0), LO(0),
+        CODE_store_local, 0,
+        CODE_load_local, 0,
+        CODE_load_const, HI(1), LO(1),
+        CODE_add,
+        CODE_store_local, 0,
+        CODE_load_global, HI(0), LO(0),
+        CODE_load_local, 0,
+        CODE_add,
+        CODE_store_global, HI(0), LO(0),
+        CODE_load_local, 0,
+        CODE_load_const, HI(2), LO(2),
+        CODE_test_lt,
+        CODE_rjump_if, HI(26), LO(26),
+        CODE_ret,
+    };
+    OrbitVMFunction* fn = test_function(vm, module, "main", code, sizeof(code), 0, 1);
+    
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_EQUAL(50005000, AS_NUM(module->globals[0].global));
+#if defined(ORBIT_JIT) && defined(__x86_64__) && defined(__linux__) \
+    && ORBIT_DISPATCH != ORBIT_DISPATCH_REGISTERS
+    TEST_ASSERT_NOT_NULL(fn->native.jit);
+#else
+    TEST_ASSERT_NULL(fn->native.jit);
+#endif
+    TEST_ASSERT_NULL(fn->native.loopCounts);
+    orbit_vmDealloc(vm);
+}
+
+void vm_registers(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 4, 1);
+    module->constants[0] = MAKE_NUM(7);
+    module->constants[1] = MAKE_NUM(3);
+    module->constants[2] = MAKE_OBJECT(orbit_gcStringNew(vm, "diff"));
+    module->constants[3] = MAKE_NUM(2);
+    
+    // diff(a, b): c = a - b; return (a + b) * c / 2
+    const uint8_t diff[] = {
+        CODE_load_local, 0,
+        CODE_load_local, 1,
+        CODE_sub,
+        CODE_store_local, 2,
+        CODE_load_local, 0,
+        CODE_load_local, 1,
+        CODE_add,
+        CODE_load_local, 2,
+        CODE_mul,
+        CODE_load_const, HI(3), LO(3),
+        CODE_div,
+        CODE_ret_val,
+    };
+    const uint8_t main[] = {
+        CODE_load_const, HI(0), LO(0),
+        CODE_load_const, HI(1), LO(1),
+        CODE_invoke_sym, HI(2), LO(2),
+        CODE_store_global, HI(0), LO(0),
+        CODE_ret,
+    };
+    OrbitVMFunction* fn = test_function(vm, module, "diff", diff, sizeof(diff), 2, 1);
+    test_function(vm, module, "main", main, sizeof(main), 0, 0);
+    
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_EQUAL(20, AS_NUM(module->globals[0].global));
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_REGISTERS
+    // Loads and stores of locals fold into the arithmetic's operands: 12
+    // stack instructions, 6 register instructions.
+    TEST_ASSERT_NOT_NULL(fn->native.regCode);
+    TEST_ASSERT_TRUE(fn->native.regCodeLength <= 7);
+#else
+    TEST_ASSERT_NULL(fn->native.regCode);
+#endif
+    orbit_vmDealloc(vm);
+}
+
+static double test_noted = 0;
+
+static bool test_note(OrbitVM* vm, OrbitValue* args) {
+    test_noted += AS_NUM(args[0]);
+    return false;
+}
+
+static bool test_twice(OrbitVM* vm, OrbitValue* args) {
+    args[0] = MAKE_NUM(AS_NUM(args[0]) * 2);
+    return true;
+}
+
+// Calls whose effect on the stack isn't known when a function is first run:
+// foreign functions that never ran, some returning a value and some not, and
+// functions that aren't loaded yet.
+void vm_registersResolve(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 8, 2);
+    module->constants[0] = MAKE_NUM(0);
+    module->constants[1] = MAKE_NUM(1);
+    module->constants[2] = MAKE_NUM(3);
+    module->constants[3] = MAKE_OBJECT(orbit_gcStringNew(vm, "note"));
+    module->constants[4] = MAKE_OBJECT(orbit_gcStringNew(vm, "twice"));
+    module->constants[5] = MAKE_OBJECT(orbit_gcStringNew(vm, "late"));
+    module->constants[6] = MAKE_OBJECT(orbit_gcStringNew(vm, "down"));
+    module->constants[7] = MAKE_OBJECT(orbit_gcStringNew(vm, "tally"));
+    
+    OrbitVMFunction* note = orbit_gcFunctionForeignNew(vm, &test_note, 1);
+    orbit_gcMapAdd(vm, vm->dispatchTable, module->constants[3], MAKE_OBJECT(note));
+    OrbitVMFunction* twice = orbit_gcFunctionForeignNew(vm, &test_twice, 1);
+    orbit_gcMapAdd(vm, vm->dispatchTable, module->constants[4], MAKE_OBJECT(twice));
+    
+    // for i in 0..<3 { note(i) }; g1 = twice(i); if g0 { g1 = late(1) }
+    const uint8_t main[] = {
+        CODE_load_const, HI(0), LO(0),      //  0
+        CODE_store_local, 0,                //  3
+        CODE_load_local, 0,                 //  5
+        CODE_invoke_sym, HI(3), LO(3),      //  7
+        CODE_load_local, 0,                 // 10
+        CODE_load_const, HI(1), LO(1),      // 12
+        CODE_add,                           // 15
+        CODE_store_local, 0,                // 16
+        CODE_load_local, 0,                 // 18
+        CODE_load_const, HI(2), LO(2),      // 20
+        CODE_test_lt,                       // 23
+        CODE_rjump_if, HI(22), LO(22),      // 24 -> 5
+        CODE_load_local, 0,                 // 27
+        CODE_invoke_sym, HI(4), LO(4),      // 29
+        CODE_store_global, HI(1), LO(1),    // 32
+        CODE_load_global, HI(0), LO(0),     // 35
+        CODE_jump_if, HI(1), LO(1),         // 38 -> 42
+        CODE_ret,                           // 41
+        CODE_load_const, HI(1), LO(1),      // 42
+        CODE_invoke_sym, HI(5), LO(5),      // 45
+        CODE_store_global, HI(1), LO(1),    // 48
+        CODE_ret,                           // 51
+    };
+    // late(n) = n + 3
+    const uint8_t late[] = {
+        CODE_load_local, 0,
+        CODE_load_const, HI(2), LO(2),
+        CODE_add,
+        CODE_ret_val,
+    };
+    // down(n): if n > 0 { down(n - 1); tally(n) }
+    const uint8_t down[] = {
+        CODE_load_local, 0,                 //  0
+        CODE_load_const, HI(0), LO(0),      //  2
+        CODE_test_gt,                       //  5
+        CODE_jump_if, HI(1), LO(1),         //  6 -> 10
+        CODE_ret,                           //  9
+        CODE_load_local, 0,                 // 10
+        CODE_load_const, HI(1), LO(1),      // 12
+        CODE_sub,                           // 15
+        CODE_invoke_sym, HI(6), LO(6),      // 16
+        CODE_load_local, 0,                 // 19
+        CODE_invoke_sym, HI(7), LO(7),      // 21
+        CODE_ret,                           // 24
+    };
+    const uint8_t countdown[] = {
+        CODE_load_const, HI(2), LO(2),
+        CODE_invoke_sym, HI(6), LO(6),
+        CODE_ret,
+    };
+    OrbitVMFunction* fn = test_function(vm, module, "main", main, sizeof(main), 0, 1);
+    
+    test_noted = 0;
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_EQUAL(3, test_noted);
+    TEST_ASSERT_EQUAL(6, AS_NUM(module->globals[1].global));
+    
+    test_function(vm, module, "late", late, sizeof(late), 1, 0);
+    module->globals[0].global = VAL_TRUE;
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_EQUAL(6, test_noted);
+    TEST_ASSERT_EQUAL(4, AS_NUM(module->globals[1].global));
+    
+    // The recursive calls are all running down's first translation when tally
+    // is first called, and move to the new one as they return.
+    OrbitVMFunction* tally = orbit_gcFunctionForeignNew(vm, &test_note, 1);
+    orbit_gcMapAdd(vm, vm->dispatchTable, module->constants[7], MAKE_OBJECT(tally));
+    OrbitVMFunction* downFn = test_function(vm, module, "down", down, sizeof(down), 1, 0);
+    test_function(vm, module, "countdown", countdown, sizeof(countdown), 0, 0);
+    
+    test_noted = 0;
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "countdown"));
+    TEST_ASSERT_EQUAL(6, test_noted);
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_REGISTERS
+    TEST_ASSERT_EQUAL(0, note->foreignResults);
+    TEST_ASSERT_EQUAL(1, twice->foreignResults);
+    TEST_ASSERT_EQUAL(3, fn->native.retiredCount);
+    TEST_ASSERT_EQUAL(1, downFn->native.retiredCount);
+#else
+    TEST_ASSERT_NULL(fn->native.regCode);
+    TEST_ASSERT_NULL(downFn->native.regCode);
+#endif
+    orbit_vmDealloc(vm);
+}
+
+void vm_superinstructions(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 4, 1);
+    module->constants[0] = MAKE_NUM(0);
+    module->constants[1] = MAKE_NUM(1);
+    module->constants[2] = MAKE_NUM(5000);
+    module->constants[3] = MAKE_OBJECT(orbit_gcStringNew(vm, "sum"));
+    
+    // sum(n): i = 0; t = 0; do { t = t + i; i = i + 1 } while(i < n); return t
+    const uint8_t sum[] = {
+        CODE_load_const, HI(0), LO(0),      //  0
+        CODE_store_local, 1,                //  3
+        CODE_load_const, HI(0), LO(0),      //  5
+        CODE_store_local, 2,                //  8
+        CODE_load_local, 2,                 // 10: loop
+        CODE_load_local, 1,                 // 12
+        CODE_add,                           // 14
+        CODE_store_local, 2,                // 15
+        CODE_load_local, 1,                 // 17
+        CODE_load_const, HI(1), LO(1),      // 19
+        CODE_add,                           // 22
+        CODE_store_local, 1,                // 23
+        CODE_load_local, 1,                 // 25
+        CODE_load_local, 0,                 // 27
+        CODE_test_lt,                       // 29
+        CODE_rjump_if, HI(23), LO(23),      // 30 -> 10
+        CODE_load_local, 2,                 // 33
+        CODE_ret_val,                       // 35
+    };
+    const uint8_t main[] = {
+        CODE_load_const, HI(2), LO(2),
+        CODE_invoke_sym, HI(3), LO(3),
+        CODE_store_global, HI(0), LO(0),
+        CODE_ret,
+    };
+    OrbitVMFunction* fn = test_function(vm, module, "sum", sum, sizeof(sum), 1, 2);
+    test_function(vm, module, "main", main, sizeof(main), 0, 0);
+    orbit_vmFuseFunction(vm, fn);
+    
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_REGISTERS
+    TEST_ASSERT_EQUAL(sizeof(sum), fn->native.byteCodeLength);
+#else
+    // The loop header is a jump target, so it can't be fused with the store
+    // before it. The backward jump now spans 18 bytes instead of 23.
+    TEST_ASSERT_EQUAL(31, fn->native.byteCodeLength);
+    TEST_ASSERT_EQUAL(CODE_store_local, fn->native.byteCode[8]);
+    TEST_ASSERT_EQUAL(CODE_add_ll, fn->native.byteCode[10]);
+    TEST_ASSERT_EQUAL(CODE_store_load_local, fn->native.byteCode[13]);
+    TEST_ASSERT_EQUAL(CODE_store_load_local, fn->native.byteCode[20]);
+    TEST_ASSERT_EQUAL(CODE_rjump_if_lt, fn->native.byteCode[25]);
+    TEST_ASSERT_EQUAL(18, fn->native.byteCode[27]);
+#endif
+    
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_EQUAL(12497500, AS_NUM(module->globals[0].global));
+#if defined(ORBIT_JIT) && defined(__x86_64__) && defined(__linux__) \
+    && ORBIT_DISPATCH != ORBIT_DISPATCH_REGISTERS
+    // The loop is hot enough to be compiled, superinstructions included.
+    TEST_ASSERT_NOT_NULL(fn->native.jit);
+#endif
+    orbit_vmDealloc(vm);
+}
+
+void vm_deepRecursion(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 4, 1);
+    module->constants[0] = MAKE_NUM(1);
+    module->constants[1] = MAKE_NUM(0);
+    module->constants[2] = MAKE_OBJECT(orbit_gcStringNew(vm, "depth"));
+    module->constants[3] = MAKE_NUM(50000);
+    
+    // depth(n) = n < 1 ? 0 : depth(n-1) + 1
+    const uint8_t depth[] = {
+        CODE_load_local, 0,                 //  0
+        CODE_load_const, HI(0), LO(0),      //  2
+        CODE_test_lt,                       //  5
+        CODE_jump_if, HI(14), LO(14),       //  6 -> 23
+        CODE_load_local, 0,                 //  9
+        CODE_load_const, HI(0), LO(0),      // 11
+        CODE_sub,                           // 14
+        CODE_invoke_sym, HI(2), LO(2),      // 15
+        CODE_load_const, HI(0), LO(0),      // 18
+        CODE_add,                           // 21
+        CODE_ret_val,                       // 22
+        CODE_load_const, HI(1), LO(1),      // 23
+        CODE_ret_val,                       // 26
+    };
+    const uint8_t main[] = {
+        CODE_load_const, HI(3), LO(3),
+        CODE_invoke_sym, HI(2), LO(2),
+        CODE_store_global, HI(0), LO(0),
+        CODE_ret,
+    };
+    test_function(vm, module, "depth", depth, sizeof(depth), 1, 0);
+    test_function(vm, module, "main", main, sizeof(main), 0, 0);
+    
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_EQUAL(50000, AS_NUM(module->globals[0].global));
+    
+#ifdef ORBIT_GUARDED_STACKS
+    // Running out of frames hits the guard page, and fails the invocation
+    // instead of crashing.
+    module->constants[3] = MAKE_NUM(ORBIT_FRAMES_RESERVE * 2);
+    TEST_ASSERT_FALSE(orbit_vmInvoke(vm, "test", "main"));
+    
+    // A spawned task that overflows is stopped along with the tasks still
+    // queued, so the collector can trace it and nothing is left to run.
+    const uint8_t spawner[] = {
+        CODE_load_const, HI(3), LO(3),
+        CODE_spawn_sym, HI(2), LO(2),
+        CODE_store_global, HI(0), LO(0),
+        CODE_yield,
+        CODE_ret,
+    };
+    test_function(vm, module, "spawner", spawner, sizeof(spawner), 0, 0);
+    TEST_ASSERT_FALSE(orbit_vmInvoke(vm, "test", "spawner"));
+    TEST_ASSERT_TRUE(IS_TASK(module->globals[0].global));
+    
+    OrbitVMTask* task = AS_TASK(module->globals[0].global);
+    TEST_ASSERT_EQUAL(ORBIT_TASK_DONE, task->state);
+    TEST_ASSERT_EQUAL(0, task->frameCount);
+    TEST_ASSERT_NULL(vm->runQueue);
+    orbit_gcRun(vm);
+#endif
+    orbit_vmDealloc(vm);
+}
+
+void vm_tasks(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 7, 2);
+    module->constants[0] = MAKE_NUM(0);
+    module->constants[1] = MAKE_NUM(1);
+    module->constants[2] = MAKE_NUM(2);
+    module->constants[3] = MAKE_NUM(3);
+    module->constants[4] = MAKE_NUM(10);
+    module->constants[5] = MAKE_NUM(100);
+    module->constants[6] = MAKE_OBJECT(orbit_gcStringNew(vm, "worker"));
+    module->globals[0].global = MAKE_NUM(0);
+    
+    // worker(id): 3 times, appends id to the digits of g0 and yields. Returns
+    // id * 100.
+    const uint8_t worker[] = {
+        CODE_load_const, HI(0), LO(0),      //  0
+        CODE_store_local, 1,                //  3
+        CODE_load_global, HI(0), LO(0),     //  5
+        CODE_load_const, HI(4), LO(4),      //  8
+        CODE_mul,                           // 11
+        CODE_load_local, 0,                 // 12
+        CODE_add,                           // 14
+        CODE_store_global, HI(0), LO(0),    // 15
+        CODE_yield,                         // 18
+        CODE_load_local, 1,                 // 19
+        CODE_load_const, HI(1), LO(1),      // 21
+        CODE_add,                           // 24
+        CODE_store_local, 1,                // 25
+        CODE_load_local, 1,                 // 27
+        CODE_load_const, HI(3), LO(3),      // 29
+        CODE_test_lt,                       // 32
+        CODE_rjump_if, HI(31), LO(31),      // 33 -> 5
+        CODE_load_local, 0,                 // 36
+        CODE_load_const, HI(5), LO(5),      // 38
+        CODE_mul,                           // 41
+        CODE_ret_val,                       // 42
+    };
+    const uint8_t main[] = {
+        CODE_load_const, HI(1), LO(1),
+        CODE_spawn_sym, HI(6), LO(6),
+        CODE_store_local, 0,
+        CODE_load_const, HI(2), LO(2),
+        CODE_spawn_sym, HI(6), LO(6),
+        CODE_store_local, 1,
+        CODE_load_local, 0,
+        CODE_join,
+        CODE_load_local, 1,
+        CODE_join,
+        CODE_add,
+        CODE_store_global, HI(1), LO(1),
+        CODE_ret,
+    };
+    test_function(vm, module, "worker", worker, sizeof(worker), 1, 1);
+    test_function(vm, module, "main", main, sizeof(main), 0, 2);
+    
+    // The workers take turns, and main is woken up when the first is done.
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_EQUAL(121212, AS_NUM(module->globals[0].global));
+    TEST_ASSERT_EQUAL(300, AS_NUM(module->globals[1].global));
+    TEST_ASSERT_NULL(vm->runQueue);
+    orbit_vmDealloc(vm);
+}
+
+static bool test_collect(OrbitVM* vm, OrbitValue* args) {
+    orbit_gcRun(vm);
+    args[0] = VAL_NIL;
+    return true;
+}
+
+void vm_taskCollect(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 4, 1);
+    module->constants[0] = MAKE_NUM(3);
+    module->constants[1] = MAKE_NUM(4);
+    module->constants[2] = MAKE_OBJECT(orbit_gcStringNew(vm, "add"));
+    module->constants[3] = MAKE_OBJECT(orbit_gcStringNew(vm, "collect"));
+    module->globals[0].global = MAKE_NUM(0);
+    
+    OrbitVMFunction* collect = orbit_gcFunctionForeignNew(vm, &test_collect, 0);
+    orbit_gcRetain(vm, (OrbitGCObject*)collect);
+    orbit_gcMapAdd(vm, vm->dispatchTable, MAKE_OBJECT(orbit_gcStringNew(vm, "collect")), MAKE_OBJECT(collect));
+    orbit_gcRelease(vm);
+    
+    const uint8_t add[] = {
+        CODE_load_global, HI(0), LO(0),
+        CODE_load_local, 0,
+        CODE_add,
+        CODE_store_global, HI(0), LO(0),
+        CODE_ret,
+    };
+    // The spawned tasks are only referenced by the run queue when the
+    // collection runs.
+    const uint8_t main[] = {
+        CODE_load_const, HI(0), LO(0),
+        CODE_spawn_sym, HI(2), LO(2),
+        CODE_pop,
+        CODE_load_const, HI(1), LO(1),
+        CODE_spawn_sym, HI(2), LO(2),
+        CODE_pop,
+        CODE_invoke_sym, HI(3), LO(3),
+        CODE_pop,
+        CODE_ret,
+    };
+    test_function(vm, module, "add", add, sizeof(add), 1, 0);
+    test_function(vm, module, "main", main, sizeof(main), 0, 0);
+    
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_EQUAL(7, AS_NUM(module->globals[0].global));
+    orbit_vmDealloc(vm);
+}
+
+static bool test_collectMinor(OrbitVM* vm, OrbitValue* args) {
+    orbit_gcRunMinor(vm);
+    args[0] = VAL_NIL;
+    return true;
+}
+
+void vm_incrementalCollect(void) {
+    OrbitVM* vm = orbit_vmNew();
+    orbit_gcSetPauseBudget(vm, 1);
+    OrbitVMModule* module = test_module(vm, 5, 1);
+    module->constants[0] = MAKE_NUM(0);
+    module->constants[1] = MAKE_NUM(1);
+    module->constants[2] = MAKE_NUM(20000);
+    OrbitGCClass* class = orbit_gcClassNew(vm, orbit_gcStringNew(vm, "Node"), 2);
+    module->constants[3] = MAKE_OBJECT(class);
+    module->constants[4] = MAKE_OBJECT(orbit_gcStringNew(vm, "minor"));
+    module->globals[0].global = MAKE_OBJECT(orbit_gcInstanceNew(vm, class));
+    
+    OrbitVMFunction* minor = orbit_gcFunctionForeignNew(vm, &test_collectMinor, 0);
+    orbit_gcRetain(vm, (OrbitGCObject*)minor);
+    orbit_gcMapAdd(vm, vm->dispatchTable, MAKE_OBJECT(orbit_gcStringNew(vm, "minor")), MAKE_OBJECT(minor));
+    orbit_gcRelease(vm);
+    
+    // Each node points to the previous one, which then points to a new
+    // instance, and a third instance is garbage right away. Minor collections
+    // run between full ones, and find the new instances through the barrier.
+    const uint8_t code[] = {
+        CODE_load_const, HI(0), LO(0),
+        CODE_store_local, 0,
+        CODE_load_global, HI(0), LO(0),
+        CODE_init, HI(3), LO(3),
+        CODE_store_field, HI(1), LO(1),
+        CODE_init, HI(3), LO(3),
+        CODE_store_local, 1,
+        CODE_load_local, 1,
+        CODE_load_global, HI(0), LO(0),
+        CODE_store_field, HI(0), LO(0),
+        CODE_load_local, 1,
+        CODE_store_global, HI(0), LO(0),
+        CODE_init, HI(3), LO(3),
+        CODE_pop,
+        CODE_invoke_sym, HI(4), LO(4),
+        CODE_pop,
+        CODE_load_local, 0,
+        CODE_load_const, HI(1), LO(1),
+        CODE_add,
+        CODE_store_local, 0,
+        CODE_load_local, 0,
+        CODE_load_const, HI(2), LO(2),
+        CODE_test_lt,
+        CODE_rjump_if, HI(52), LO(52),
+        CODE_ret,
+    };
+    test_function(vm, module, "main", code, sizeof(code), 0, 2);
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    
+    uint32_t count = 0;
+    OrbitValue node = module->globals[0].global;
+    while(IS_INSTANCE(node)) {
+        OrbitGCInstance* instance = AS_INST(node);
+        TEST_ASSERT_EQUAL_PTR(class, instance->base.class);
+        if(count > 0) {
+            TEST_ASSERT_TRUE(IS_INSTANCE(instance->fields[1]));
+            TEST_ASSERT_EQUAL_PTR(class, AS_INST(instance->fields[1])->base.class);
+        }
+        node = instance->fields[0];
+        count += 1;
+    }
+    TEST_ASSERT_EQUAL(20001, count);
+    orbit_vmDealloc(vm);
+}
+
+// fib(n), with constants 1, 2 and "fib".
+static const uint8_t test_fib[] = {
+    CODE_load_local, 0,
+    CODE_load_const, HI(1), LO(1),
+    CODE_test_lt,
+    CODE_jump_if, HI(20), LO(20),
+    CODE_load_local, 0,
+    CODE_load_const, HI(0), LO(0),
+    CODE_sub,
+    CODE_invoke_sym, HI(2), LO(2),
+    CODE_load_local, 0,
+    CODE_load_const, HI(1), LO(1),
+    CODE_sub,
+    CODE_invoke_sym, HI(2), LO(2),
+    CODE_add,
+    CODE_ret_val,
+    CODE_load_local, 0,
+    CODE_ret_val,
+};
+
+static void test_packString(FILE* f, const char* string) {
+    orbit_pack8(f, OMF_STRING);
+    orbit_pack16(f, strlen(string));
+    orbit_packBytes(f, (uint8_t*)string, strlen(string));
+}
+
+// Version 2 functions carry register code, which loading skips: this one's is a
+// lone `halt`.
+static void test_packFunction(FILE* f, uint16_t version, const char* signature,
+                              const uint8_t* code, uint16_t length, uint8_t arity) {
+    orbit_pack8(f, OMF_FUNCTION);
+    test_packString(f, signature);
+    orbit_pack8(f, arity);
+    orbit_pack8(f, 0);
+    orbit_pack8(f, 8);
+    orbit_pack16(f, length);
+    orbit_packBytes(f, (uint8_t*)code, length);
+    if(version < 0x02) { return; }
+    orbit_pack8(f, 1);
+    orbit_pack16(f, 1);
+    orbit_pack32(f, REG_halt);
+}
+
+static OrbitVMModule* test_findModule(OrbitVM* vm, const char* name) {
+    OrbitValue module = VAL_NIL;
+    orbit_gcMapGet(vm->modules, MAKE_OBJECT(orbit_gcStringNew(vm, name)), &module);
+    return IS_MODULE(module) ? (OrbitVMModule*)AS_OBJECT(module) : NULL;
+}
+
+static OrbitVMFunction* test_findFunction(OrbitVM* vm, const char* signature) {
+    OrbitValue fn = VAL_NIL;
+    orbit_gcMapGet(vm->dispatchTable, MAKE_OBJECT(orbit_gcStringNew(vm, signature)), &fn);
+    return IS_FUNCTION(fn) ? AS_FUNCTION(fn) : NULL;
+}
+
+// Writes a [version] module with constants 1, 2, "fib" and 15, a global,
+// test_fib and [main].
+static void test_writeImageVersion(const char* path, uint16_t version,
+                                   const uint8_t* main, uint16_t length) {
+    FILE* f = fopen(path, "w+");
+    TEST_ASSERT_NOT_NULL(f);
+    orbit_packBytes(f, (uint8_t*)"OMFF", 4);
+    orbit_pack16(f, version);
+    orbit_pack16(f, 4);
+    orbit_pack8(f, OMF_NUM);
+    orbit_packIEEE754(f, 1);
+    orbit_pack8(f, OMF_NUM);
+    orbit_packIEEE754(f, 2);
+    test_packString(f, "fib");
+    orbit_pack8(f, OMF_NUM);
+    orbit_packIEEE754(f, 15);
+    orbit_pack16(f, 1);
+    orbit_pack8(f, OMF_VARIABLE);
+    test_packString(f, "result");
+    orbit_pack16(f, 0);
+    orbit_pack16(f, 2);
+    test_packFunction(f, version, "fib", test_fib, sizeof(test_fib), 1);
+    test_packFunction(f, version, "main", main, length, 0);
+    fclose(f);
+}
+
+static void test_writeImage(const char* path, const uint8_t* main, uint16_t length) {
+    test_writeImageVersion(path, 0x01, main, length);
+}
+
+void vm_sharedImage(void) {
+    const uint8_t main[] = {
+        CODE_load_const, HI(3), LO(3),
+        CODE_invoke_sym, HI(2), LO(2),
+        CODE_store_global, HI(0), LO(0),
+        CODE_ret,
+    };
+    test_writeImage("/tmp/test_image.omf", main, sizeof(main));
+    
+    OrbitModuleImage* image = orbit_imageLoad("/tmp/test_image.omf");
+    TEST_ASSERT_NOT_NULL(image);
+    TEST_ASSERT_EQUAL(2, image->functionCount);
+    
+    uint16_t length = image->functions[0].byteCodeLength;
+    const uint8_t* shared = image->functions[0].byteCode;
+    uint8_t before[sizeof(test_fib)];
+    memcpy(before, shared, length);
+    
+    OrbitVM* vms[2] = {orbit_vmNew(), orbit_vmNew()};
+    for(int i = 0; i < 2; ++i) {
+        TEST_ASSERT_TRUE(orbit_vmLoadImage(vms[i], "test", image));
+    }
+    // The modules keep the image alive.
+    orbit_imageRelease(image);
+    
+    for(int i = 0; i < 2; ++i) {
+        TEST_ASSERT_TRUE(orbit_vmInvoke(vms[i], "test", "main"));
+        OrbitVMModule* module = test_findModule(vms[i], "test");
+        TEST_ASSERT_NOT_NULL(module);
+        TEST_ASSERT_EQUAL(610, AS_NUM(module->globals[0].global));
+    }
+    
+    // The image's code is never patched or copied: the VMs run it, and the
+    // engines that quicken bytecode do so in each function's side table.
+    OrbitVMFunction* fn0 = test_findFunction(vms[0], "fib");
+    OrbitVMFunction* fn1 = test_findFunction(vms[1], "fib");
+    TEST_ASSERT_NOT_NULL(fn0);
+    TEST_ASSERT_NOT_NULL(fn1);
+    TEST_ASSERT_TRUE(fn0 != fn1);
+    TEST_ASSERT_EQUAL_MEMORY(before, shared, length);
+    TEST_ASSERT_EQUAL_PTR(shared, fn0->native.byteCode);
+    TEST_ASSERT_EQUAL_PTR(shared, fn1->native.byteCode);
+#if ORBIT_DISPATCH == ORBIT_DISPATCH_DIRECT || ORBIT_DISPATCH == ORBIT_DISPATCH_REGISTERS
+    TEST_ASSERT_NULL(fn0->native.quickened);
+#else
+    TEST_ASSERT_NOT_NULL(fn0->native.quickened);
+    TEST_ASSERT_NOT_NULL(fn1->native.quickened);
+    TEST_ASSERT_TRUE(fn0->native.quickened != fn1->native.quickened);
+    TEST_ASSERT_TRUE(memcmp(before, fn0->native.quickened, length) != 0);
+#endif
+    
+    orbit_vmDealloc(vms[0]);
+    orbit_vmDealloc(vms[1]);
+}
+
+static OrbitVMModule* test_fibModule(OrbitVM* vm, uint16_t globalCount) {
+    OrbitVMModule* module = test_module(vm, 3, globalCount);
+    module->constants[0] = MAKE_NUM(1);
+    module->constants[1] = MAKE_NUM(2);
+    module->constants[2] = MAKE_OBJECT(orbit_gcStringNew(vm, "fib"));
+    test_function(vm, module, "fib", test_fib, sizeof(test_fib), 1, 0);
+    return module;
+}
+
+void vm_preparedCall(void) {
+    OrbitVM* vm = orbit_vmNew();
+    test_fibModule(vm, 0);
+    
+    TEST_ASSERT_NULL(orbit_vmPrepareCall(vm, "test", "nope"));
+    OrbitVMCall* call = orbit_vmPrepareCall(vm, "test", "fib");
+    TEST_ASSERT_NOT_NULL(call);
+    
+    orbit_vmCallPushNum(call, 10);
+    TEST_ASSERT_TRUE(orbit_vmCall(vm, call));
+    TEST_ASSERT_EQUAL(55, AS_NUM(orbit_vmCallResult(call)));
+    
+    // Once the call has run, running it again doesn't create any object.
+    uint64_t objects = test_heapObjects(vm);
+    const double expected[] = {0, 1, 1, 2, 3, 5, 8, 13, 21, 34, 55, 89, 144};
+    for(int i = 0; i < 1000; ++i) {
+        uint8_t n = i % 13;
+        orbit_vmCallPushNum(call, n);
+        TEST_ASSERT_TRUE(orbit_vmCall(vm, call));
+        TEST_ASSERT_EQUAL(expected[n], AS_NUM(orbit_vmCallResult(call)));
+    }
+    TEST_ASSERT_EQUAL(objects, test_heapObjects(vm));
+    
+    // Prepared calls survive collections.
+    orbit_gcRun(vm);
+    orbit_vmCallPushNum(call, 12);
+    TEST_ASSERT_TRUE(orbit_vmCall(vm, call));
+    TEST_ASSERT_EQUAL(144, AS_NUM(orbit_vmCallResult(call)));
+    
+    orbit_vmReleaseCall(vm, call);
+    TEST_ASSERT_NULL(vm->calls);
+    orbit_vmDealloc(vm);
+}
+
+void vm_batchCall(void) {
+    OrbitVM* vms[4];
+    OrbitVMCall* calls[4];
+    for(int i = 0; i < 4; ++i) {
+        vms[i] = orbit_vmNew();
+        OrbitVMModule* module = test_fibModule(vms[i], 1);
+        
+        // `counted` calls fib, and counts its calls in a global.
+        const uint8_t counted[] = {
+            CODE_load_global, HI(0), LO(0),
+            CODE_load_const, HI(0), LO(0),
+            CODE_add,
+            CODE_store_global, HI(0), LO(0),
+            CODE_load_local, 0,
+            CODE_invoke_sym, HI(2), LO(2),
+            CODE_ret_val,
+        };
+        module->globals[0].global = MAKE_NUM(0);
+        test_function(vms[i], module, "counted", counted, sizeof(counted), 1, 0);
+    }
+    
+    const double expected[] = {0, 1, 1, 2, 3, 5, 8, 13, 21, 34, 55, 89, 144};
+    OrbitValue args[1000];
+    OrbitValue results[1000];
+    for(int i = 0; i < 1000; ++i) {
+        args[i] = MAKE_NUM(i % 13);
+    }
+    
+    calls[0] = orbit_vmPrepareCall(vms[0], "test", "counted");
+    TEST_ASSERT_FALSE(orbit_vmFunctionIsIsolated(vms[0], calls[0]->function));
+    TEST_ASSERT_TRUE(orbit_vmCallBatch(vms[0], calls[0], args, results, 1000));
+    for(int i = 0; i < 1000; ++i) {
+        TEST_ASSERT_EQUAL(expected[i % 13], AS_NUM(results[i]));
+    }
+    OrbitVMModule* module = calls[0]->function->module;
+    TEST_ASSERT_EQUAL(1000, AS_NUM(module->globals[0].global));
+    
+    // The call can still be used on its own after a batch.
+    orbit_vmCallPushNum(calls[0], 7);
+    TEST_ASSERT_TRUE(orbit_vmCall(vms[0], calls[0]));
+    TEST_ASSERT_EQUAL(13, AS_NUM(orbit_vmCallResult(calls[0])));
+    orbit_vmReleaseCall(vms[0], calls[0]);
+    
+    for(int i = 0; i < 4; ++i) {
+        calls[i] = orbit_vmPrepareCall(vms[i], "test", "fib");
+        TEST_ASSERT_NOT_NULL(calls[i]);
+    }
+    TEST_ASSERT_TRUE(orbit_vmFunctionIsIsolated(vms[0], calls[0]->function));
+    memset(results, 0, sizeof(results));
+    TEST_ASSERT_TRUE(orbit_vmCallBatchParallel(vms, calls, 4, args, results, 1000));
+    for(int i = 0; i < 1000; ++i) {
+        TEST_ASSERT_EQUAL(expected[i % 13], AS_NUM(results[i]));
+    }
+    
+    for(int i = 0; i < 4; ++i) {
+        orbit_vmDealloc(vms[i]);
+    }
+}
+
+void vm_verifier(void) {
+    const uint8_t main[] = {
+        CODE_load_const, HI(3), LO(3),
+        CODE_invoke_sym, HI(2), LO(2),
+        CODE_store_global, HI(0), LO(0),
+        CODE_ret,
+    };
+    test_writeImage("/tmp/test_image.omf", main, sizeof(main));
+    OrbitModuleImage* image = orbit_imageLoad("/tmp/test_image.omf");
+    TEST_ASSERT_NOT_NULL(image);
+    
+    // The stack effect in the file is replaced by what the functions use.
+    TEST_ASSERT_TRUE(image->functions[0].verified);
+    TEST_ASSERT_EQUAL(3, image->functions[0].stackEffect);
+    TEST_ASSERT_TRUE(image->functions[1].verified);
+    TEST_ASSERT_EQUAL(1, image->functions[1].stackEffect);
+    orbit_imageRelease(image);
+    
+    // Frames can need more room than the file's stack effect can say.
+    uint8_t deep[301];
+    memset(deep, CODE_load_nil, 300);
+    deep[300] = CODE_ret;
+    test_writeImage("/tmp/test_image.omf", deep, sizeof(deep));
+    image = orbit_imageLoad("/tmp/test_image.omf");
+    TEST_ASSERT_NOT_NULL(image);
+    TEST_ASSERT_TRUE(image->functions[1].verified);
+    TEST_ASSERT_EQUAL(300, image->functions[1].stackEffect);
+    orbit_imageRelease(image);
+    
+    const uint8_t badConstant[] = {
+        CODE_load_const, HI(4), LO(4),
+        CODE_ret,
+    };
+    const uint8_t badGlobal[] = {
+        CODE_load_nil,
+        CODE_store_global, HI(1), LO(1),
+        CODE_ret,
+    };
+    const uint8_t badLocal[] = {
+        CODE_load_local, 0,
+        CODE_ret,
+    };
+    const uint8_t badJump[] = {
+        CODE_jump, HI(1), LO(1),
+        CODE_load_const, HI(0), LO(0),
+        CODE_ret,
+    };
+    const uint8_t fallsOff[] = {
+        CODE_load_nil,
+        CODE_pop,
+    };
+    const uint8_t underflow[] = {
+        CODE_load_nil,
+        CODE_add,
+        CODE_ret,
+    };
+    const uint8_t unbalanced[] = {
+        CODE_load_true,
+        CODE_jump_if, HI(1), LO(1),
+        CODE_load_nil,
+        CODE_ret,
+    };
+    const uint8_t* invalid[] = {badConstant, badGlobal, badLocal, badJump, fallsOff, underflow, unbalanced};
+    const uint16_t lengths[] = {
+        sizeof(badConstant), sizeof(badGlobal), sizeof(badLocal), sizeof(badJump),
+        sizeof(fallsOff), sizeof(underflow), sizeof(unbalanced)
+    };
+    for(int i = 0; i < 7; ++i) {
+        test_writeImage("/tmp/test_image.omf", invalid[i], lengths[i]);
+        TEST_ASSERT_NULL(orbit_imageLoad("/tmp/test_image.omf"));
+    }
+    
+    // Functions that weren't verified check their operands as they run.
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 0, 1);
+    test_function(vm, module, "main", badGlobal, sizeof(badGlobal), 0, 0);
+    TEST_ASSERT_FALSE(orbit_vmInvoke(vm, "test", "main"));
+    orbit_vmDealloc(vm);
+}
+
+void vm_optimizer(void) {
+    // result = (1 + 2) * 15 + (15 - 1), then subtract 2 while result > 15.
+    const uint8_t main[] = {
+        CODE_load_const, HI(0), LO(0),
+        CODE_load_const, HI(1), LO(1),
+        CODE_add,
+        CODE_load_const, HI(3), LO(3),
+        CODE_mul,
+        CODE_load_const, HI(0), LO(0),
+        CODE_load_const, HI(3), LO(3),
+        CODE_swap,
+        CODE_sub,
+        CODE_add,
+        CODE_load_true,
+        CODE_jump_if, HI(2), LO(2),
+        CODE_load_nil,
+        CODE_pop,
+        CODE_jump, HI(2), LO(2),
+        CODE_load_nil,
+        CODE_pop,
+        CODE_load_false,
+        CODE_pop,
+        CODE_store_global, HI(0), LO(0),
+        
+        CODE_load_global, HI(0), LO(0),
+        CODE_load_const, HI(1), LO(1),
+        CODE_sub,
+        CODE_store_global, HI(0), LO(0),
+        CODE_load_const, HI(3), LO(3),
+        CODE_load_global, HI(0), LO(0),
+        CODE_swap,
+        CODE_test_gt,
+        CODE_load_nil,
+        CODE_pop,
+        CODE_rjump_if, HI(23), LO(23),
+        CODE_ret,
+    };
+    test_writeImage("/tmp/test_image.omf", main, sizeof(main));
+    
+    FILE* in = fopen("/tmp/test_image.omf", "rb");
+    TEST_ASSERT_NOT_NULL(in);
+    OrbitModuleImage* image = orbit_readImage(in);
+    fclose(in);
+    TEST_ASSERT_NOT_NULL(image);
+    TEST_ASSERT_EQUAL(sizeof(main), image->functions[1].byteCodeLength);
+    
+    // Folding leaves `load_const 59; store_global` before the loop, which
+    // loses its `swap` and `load_nil; pop`. Only the final result is added to
+    // the constants, and fib has nothing to optimise.
+    orbit_imageOptimize(image);
+    TEST_ASSERT_EQUAL(sizeof(test_fib), image->functions[0].byteCodeLength);
+    TEST_ASSERT_EQUAL(27, image->functions[1].byteCodeLength);
+    TEST_ASSERT_EQUAL(5, image->constantCount);
+    TEST_ASSERT_TRUE(image->functions[1].verified);
+    TEST_ASSERT_EQUAL(2, image->functions[1].stackEffect);
+    
+    // Optimised images can be written back to a module file.
+    FILE* out = fopen("/tmp/test_image_opt.omf", "wb");
+    TEST_ASSERT_NOT_NULL(out);
+    TEST_ASSERT_TRUE(orbit_packImage(out, image));
+    fclose(out);
+    orbit_imageRelease(image);
+    
+    // Written as version 1, which every runtime can read.
+    uint8_t header[6];
+    in = fopen("/tmp/test_image_opt.omf", "rb");
+    TEST_ASSERT_NOT_NULL(in);
+    TEST_ASSERT_EQUAL(sizeof(header), fread(header, 1, sizeof(header), in));
+    fclose(in);
+    TEST_ASSERT_EQUAL_MEMORY("OMFF\x00\x01", header, sizeof(header));
+    
+    // Version 2 files are still read, without their register code.
+    test_writeImageVersion("/tmp/test_image_v2.omf", 0x02, main, sizeof(main));
+    
+    const char* paths[] = {"/tmp/test_image.omf", "/tmp/test_image_opt.omf", "/tmp/test_image_v2.omf"};
+    for(int i = 0; i < 3; ++i) {
+        OrbitVM* vm = orbit_vmNew();
+        image = orbit_imageLoad(paths[i]);
+        TEST_ASSERT_NOT_NULL(image);
+        TEST_ASSERT_TRUE(orbit_vmLoadImage(vm, "test", image));
+        orbit_imageRelease(image);
+        
+        TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+        OrbitVMModule* module = test_findModule(vm, "test");
+        TEST_ASSERT_EQUAL(15, AS_NUM(module->globals[0].global));
+        orbit_vmDealloc(vm);
+    }
+}
+
+void vm_profiler(void) {
+    // fib, under its mangled signature.
+    const char* signature = "_OF3fibpNdeNd";
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 3, 0);
+    module->constants[0] = MAKE_NUM(1);
+    module->constants[1] = MAKE_NUM(2);
+    module->constants[2] = MAKE_OBJECT(orbit_gcStringNew(vm, signature));
+    test_function(vm, module, signature, test_fib, sizeof(test_fib), 1, 0);
+    OrbitVMCall* call = orbit_vmPrepareCall(vm, "test", signature);
+    TEST_ASSERT_NOT_NULL(call);
+    
+    if(!orbit_profilerStart(vm, 5000, 256)) {
+        orbit_vmReleaseCall(vm, call);
+        orbit_vmDealloc(vm);
+        TEST_IGNORE_MESSAGE("profiling isn't supported here");
+    }
+    
+    // Only one VM can be profiled at a time.
+    OrbitVM* other = orbit_vmNew();
+    TEST_ASSERT_FALSE(orbit_profilerStart(other, 5000, 256));
+    orbit_vmDealloc(other);
+    
+    // The timer counts CPU time, so run until enough samples came in.
+    uint32_t samples = 0;
+    for(int i = 0; i < 2000 && samples < 50; ++i) {
+        orbit_vmCallPushNum(call, 18);
+        TEST_ASSERT_TRUE(orbit_vmCall(vm, call));
+        TEST_ASSERT_EQUAL(2584, AS_NUM(orbit_vmCallResult(call)));
+        samples += orbit_profilerDrain(vm);
+    }
+    orbit_profilerStop(vm);
+    TEST_ASSERT_TRUE(samples >= 50);
+    
+    FILE* out = tmpfile();
+    TEST_ASSERT_NOT_NULL(out);
+    uint64_t written = orbit_profilerWrite(vm, out, false);
+    TEST_ASSERT_TRUE(written >= samples);
+    rewind(out);
+    
+    // Every line is a stack of demangled functions, from the root, and a
+    // count. Samples taken in Orbit code all start in fib, the others while
+    // the host had control.
+    char line[4096];
+    uint64_t total = 0, inFib = 0;
+    while(fgets(line, sizeof(line), out)) {
+        char* count = strrchr(line, ' ');
+        TEST_ASSERT_NOT_NULL(count);
+        total += strtoull(count + 1, NULL, 10);
+        if(strncmp(line, "fib(Number) -> Number", 21) == 0 || strncmp(line, "[truncated]", 11) == 0) {
+            inFib += strtoull(count + 1, NULL, 10);
+        } else {
+            TEST_ASSERT_EQUAL_STRING_LEN("[host] ", line, 7);
+        }
+    }
+    fclose(out);
+    TEST_ASSERT_EQUAL(written, total);
+#ifndef __SANITIZE_THREAD__
+    // ThreadSanitizer holds signals back until the thread calls into the C
+    // library, which it only does from the host.
+    TEST_ASSERT_TRUE(inFib > 0);
+#endif
+    
+    orbit_vmReleaseCall(vm, call);
+    orbit_vmDealloc(vm);
+}
+
+void vm_stats(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 3, 1);
+    module->constants[0] = MAKE_NUM(0);
+    module->constants[1] = MAKE_NUM(1);
+    module->constants[2] = MAKE_NUM(1000);
+    
+    const uint8_t code[] = {
+        CODE_load_const, HI(0), LO(0),      //  0
+        CODE_store_local, 0,                //  3
+        CODE_load_local, 0,                 //  5: loop
+        CODE_load_const, HI(1), LO(1),      //  7
+        CODE_add,                           // 10
+        CODE_store_local, 0,                // 11
+        CODE_load_local, 0,                 // 13
+        CODE_load_const, HI(2), LO(2),      // 15
+        CODE_test_lt,                       // 18
+        CODE_rjump_if, HI(17), LO(17),      // 19 -> 5
+        CODE_load_local, 0,                 // 22
+        CODE_store_global, HI(0), LO(0),    // 24
+        CODE_ret,                           // 27
+    };
+    test_function(vm, module, "main", code, sizeof(code), 0, 1);
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_EQUAL(1000, AS_NUM(module->globals[0].global));
+    
+    FILE* out = tmpfile();
+    TEST_ASSERT_NOT_NULL(out);
+    TEST_ASSERT_FALSE(orbit_vmDisassemble(vm, "nope", out));
+    TEST_ASSERT_TRUE(orbit_vmDisassemble(vm, "main", out));
+    rewind(out);
+    
+    // One line per instruction after the name, each with its offset.
+    char line[256];
+    uint32_t lines = 0;
+    bool foundJump = false;
+    TEST_ASSERT_NOT_NULL(fgets(line, sizeof(line), out));
+    TEST_ASSERT_EQUAL_STRING("main:\n", line);
+    while(fgets(line, sizeof(line), out)) {
+        lines += 1;
+        foundJump = foundJump || (strstr(line, "rjump_if") && strstr(line, "-> 5"));
+    }
+    fclose(out);
+    TEST_ASSERT_EQUAL(13, lines);
+    TEST_ASSERT_TRUE(foundJump);
+    
+#if defined(ORBIT_VM_STATS) && !defined(ORBIT_JIT) && ORBIT_DISPATCH != ORBIT_DISPATCH_REGISTERS
+    // The first iteration runs the generic instructions, which are quickened
+    // for the other 999.
+    TEST_ASSERT_EQUAL(8005, vm->dispatchCount);
+    TEST_ASSERT_EQUAL(2001, orbit_vmStatsOpcode(vm, CODE_load_local));
+    TEST_ASSERT_EQUAL(1, orbit_vmStatsOpcode(vm, CODE_add));
+    TEST_ASSERT_EQUAL(999, orbit_vmStatsOpcode(vm, CODE_add_nn));
+    TEST_ASSERT_EQUAL(1000, orbit_vmStatsPair(vm, CODE_rjump_if, CODE_load_local));
+    TEST_ASSERT_EQUAL(999, orbit_vmStatsPair(vm, CODE_test_lt_nn, CODE_rjump_if));
+    TEST_ASSERT_EQUAL(0, orbit_vmStatsPair(vm, CODE_ret, CODE_load_const));
+    
+    OrbitVMFunction* fn = test_findFunction(vm, "main");
+    TEST_ASSERT_NOT_NULL(fn->native.executionCounts);
+    TEST_ASSERT_EQUAL(1, fn->native.executionCounts[0]);
+    TEST_ASSERT_EQUAL(1000, fn->native.executionCounts[5]);
+    TEST_ASSERT_EQUAL(1, fn->native.executionCounts[27]);
+    
+    out = tmpfile();
+    TEST_ASSERT_TRUE(orbit_vmStatsWrite(vm, out, 8, true));
+    rewind(out);
+    bool foundLoop = false;
+    while(fgets(line, sizeof(line), out)) {
+        foundLoop = foundLoop || strstr(line, " 1000      5  load_local");
+    }
+    fclose(out);
+    TEST_ASSERT_TRUE(foundLoop);
+    
+    orbit_vmStatsReset(vm);
+    TEST_ASSERT_EQUAL(0, orbit_vmStatsOpcode(vm, CODE_load_local));
+    TEST_ASSERT_NULL(fn->native.executionCounts);
+#elif !defined(ORBIT_VM_STATS)
+    TEST_ASSERT_FALSE(orbit_vmStatsWrite(vm, stderr, 8, true));
+#endif
+    orbit_vmDealloc(vm);
+}
+
+// Counts the occurrences of [needle] in what was written to [f].
+static uint32_t test_countInFile(FILE* f, const char* needle) {
+    char buffer[8192];
+    rewind(f);
+    size_t length = fread(buffer, 1, sizeof(buffer) - 1, f);
+    buffer[length] = '\0';
+    uint32_t count = 0;
+    for(const char* at = strstr(buffer, needle); at; at = strstr(at + 1, needle)) {
+        count += 1;
+    }
+    return count;
+}
+
+void vm_tracer(void) {
+    OrbitVM* vm = orbit_vmNew();
+    OrbitVMModule* module = test_module(vm, 4, 1);
+    module->constants[0] = MAKE_NUM(3);
+    module->constants[1] = MAKE_NUM(4);
+    module->constants[2] = MAKE_OBJECT(orbit_gcStringNew(vm, "add"));
+    module->constants[3] = MAKE_OBJECT(orbit_gcStringNew(vm, "collect"));
+    module->globals[0].global = MAKE_NUM(0);
+    
+    OrbitVMFunction* collect = orbit_gcFunctionForeignNew(vm, &test_collect, 0);
+    orbit_gcRetain(vm, (OrbitGCObject*)collect);
+    orbit_gcMapAdd(vm, vm->dispatchTable, MAKE_OBJECT(orbit_gcStringNew(vm, "collect")), MAKE_OBJECT(collect));
+    orbit_gcRelease(vm);
+    
+    const uint8_t add[] = {
+        CODE_load_global, HI(0), LO(0),
+        CODE_load_local, 0,
+        CODE_add,
+        CODE_store_global, HI(0), LO(0),
+        CODE_ret,
+    };
+    const uint8_t main[] = {
+        CODE_load_const, HI(0), LO(0),
+        CODE_spawn_sym, HI(2), LO(2),
+        CODE_pop,
+        CODE_load_const, HI(1), LO(1),
+        CODE_spawn_sym, HI(2), LO(2),
+        CODE_pop,
+        CODE_invoke_sym, HI(3), LO(3),
+        CODE_pop,
+        CODE_ret,
+    };
+    test_function(vm, module, "add", add, sizeof(add), 1, 0);
+    test_function(vm, module, "main", main, sizeof(main), 0, 0);
+    
+    // main, and the collection in the foreign function it calls, then the two
+    // tasks it spawned.
+    orbit_tracerStart(vm, 64);
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    TEST_ASSERT_EQUAL(7, AS_NUM(module->globals[0].global));
+    
+    FILE* out = tmpfile();
+    TEST_ASSERT_NOT_NULL(out);
+    TEST_ASSERT_EQUAL(10, orbit_tracerWrite(vm, out));
+    TEST_ASSERT_EQUAL(5, test_countInFile(out, "\"ph\":\"B\""));
+    TEST_ASSERT_EQUAL(5, test_countInFile(out, "\"ph\":\"E\""));
+    TEST_ASSERT_EQUAL(1, test_countInFile(out, "{\"name\":\"main\",\"cat\":\"call\""));
+    TEST_ASSERT_EQUAL(2, test_countInFile(out, "{\"name\":\"add\",\"cat\":\"call\""));
+    TEST_ASSERT_EQUAL(1, test_countInFile(out, "{\"name\":\"collect\",\"cat\":\"foreign\""));
+    TEST_ASSERT_EQUAL(1, test_countInFile(out, "\"reclaimed\":"));
+    TEST_ASSERT_EQUAL(1, test_countInFile(out, "\"name\":\"task 3\""));
+    TEST_ASSERT_EQUAL(1, test_countInFile(out, "\"dropped\":\"0\""));
+    fclose(out);
+    
+    // Once the buffer is full, events are dropped, and the trace is written
+    // with the calls that were still running left open.
+    orbit_tracerStart(vm, 4);
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    orbit_tracerStop(vm);
+    TEST_ASSERT_TRUE(orbit_vmInvoke(vm, "test", "main"));
+    
+    out = tmpfile();
+    TEST_ASSERT_EQUAL(4, orbit_tracerWrite(vm, out));
+    TEST_ASSERT_EQUAL(3, test_countInFile(out, "\"ph\":\"B\""));
+    TEST_ASSERT_EQUAL(1, test_countInFile(out, "\"ph\":\"E\""));
+    TEST_ASSERT_EQUAL(1, test_countInFile(out, "\"dropped\":\"6\""));
+    fclose(out);
+    orbit_vmDealloc(vm);
+}
+
 int main(void) {
     UNITY_BEGIN();
     RUN_TEST(pack_uint8);
@@ -440,10 +2324,22 @@ int main(void) {
     
     RUN_TEST(gc_collect);
     RUN_TEST(gc_savestack);
+    RUN_TEST(gc_generational);
+    RUN_TEST(gc_incremental);
+    RUN_TEST(gc_lazySweep);
+    RUN_TEST(gc_parallelMark);
+    RUN_TEST(gc_sideMarks);
+    RUN_TEST(gc_sizeClasses);
+    RUN_TEST(gc_telemetry);
     RUN_TEST(string_create);
     RUN_TEST(string_hash);
     RUN_TEST(string_emptyHash);
+    RUN_TEST(stringpool_intern);
+#ifdef __unix__
+    RUN_TEST(stringpool_concurrent);
+#endif
     RUN_TEST(double_hash);
+    RUN_TEST(value_tagging);
     
     RUN_TEST(gcarray_new);
     RUN_TEST(gcarray_add);
@@ -458,5 +2354,27 @@ int main(void) {
     RUN_TEST(gcmap_remove);
     RUN_TEST(gcmap_removeAdd);
     RUN_TEST(gcmap_grow);
+    
+    RUN_TEST(vm_loop);
+    RUN_TEST(vm_unverifiedStack);
+    RUN_TEST(vm_invoke);
+    RUN_TEST(vm_quicken);
+    RUN_TEST(vm_jit);
+    RUN_TEST(vm_osr);
+    RUN_TEST(vm_registers);
+    RUN_TEST(vm_registersResolve);
+    RUN_TEST(vm_superinstructions);
+    RUN_TEST(vm_deepRecursion);
+    RUN_TEST(vm_tasks);
+    RUN_TEST(vm_taskCollect);
+    RUN_TEST(vm_incrementalCollect);
+    RUN_TEST(vm_sharedImage);
+    RUN_TEST(vm_preparedCall);
+    RUN_TEST(vm_batchCall);
+    RUN_TEST(vm_verifier);
+    RUN_TEST(vm_optimizer);
+    RUN_TEST(vm_profiler);
+    RUN_TEST(vm_stats);
+    RUN_TEST(vm_tracer);
     return UNITY_END();
 }
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Builds the VM benchmarks with every interpreter dispatch engine and runs them
+# so they can be compared on the current machine.
+#
+# usage: bench-dispatch.sh <source dir> [scale] [stats]
+#
+# Passing `stats` as the third argument builds with ORBIT_VM_STATS, which also
+# prints how many instructions each engine dispatched.
+
+SOURCE_DIR=$1
+SCALE=${2:-1}
+STATS=OFF
+[ "$3" = "stats" ] && STATS=ON
+RESULT=0
+
+for ENGINE in switch token direct tailcall registers; do
+    BUILD_DIR="${SOURCE_DIR}/.build-bench-${ENGINE}.ignore"
+    mkdir -p $BUILD_DIR
+    cmake -S $SOURCE_DIR -B $BUILD_DIR -DCMAKE_BUILD_TYPE=Release \
+        -DORBIT_DISPATCH=$ENGINE -DORBIT_VM_STATS=$STATS > /dev/null || exit 1
+    cmake --build $BUILD_DIR --target BenchVM > /dev/null || exit 1
+    $BUILD_DIR/bin/BenchVM $SCALE
+    if [ $? != 0 ]; then
+        RESULT=1
+    fi
+done
+
+[ $RESULT -ne 0 ] && exit 1
+exit 0